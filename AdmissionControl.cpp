@@ -0,0 +1,144 @@
+#include "AdmissionControl.h"
+#include <stdio.h>
+#include <string.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+AdmissionControl::AdmissionControl(int maxSessions, int maxPerIp, int maxPerUser)
+{
+    m_maxSessions = maxSessions;
+    m_maxPerIp = maxPerIp;
+    m_maxPerUser = maxPerUser;
+    m_sessions = 0;
+    
+    m_accepted = 0;
+    m_rejectedGlobal = 0;
+    m_rejectedIp = 0;
+    m_rejectedUser = 0;
+    m_acceptErrors = 0;
+    m_listenerPauses = 0;
+    m_latencyTotal = 0;
+    m_latencyMax = 0;
+}
+
+bool AdmissionControl::admit(in_addr_t ip)
+{
+    if (m_maxSessions > 0 && m_sessions >= m_maxSessions)
+    {
+        m_rejectedGlobal++;
+        return false;
+    }
+    
+    if (m_maxPerIp > 0)
+    {
+        std::map<in_addr_t, int>::iterator it = m_ipSessions.find(ip);
+        if (it != m_ipSessions.end() && it->second >= m_maxPerIp)
+        {
+            m_rejectedIp++;
+            return false;
+        }
+    }
+    
+    return true;
+}
+
+void AdmissionControl::addSession(in_addr_t ip)
+{
+    m_sessions++;
+    m_accepted++;
+    m_ipSessions[ip]++;
+}
+
+void AdmissionControl::removeSession(in_addr_t ip)
+{
+    m_sessions--;
+    std::map<in_addr_t, int>::iterator it = m_ipSessions.find(ip);
+    if (it != m_ipSessions.end() && --it->second <= 0)
+        m_ipSessions.erase(it);
+}
+
+bool AdmissionControl::admitUser(const std::string& user)
+{
+    if (m_maxPerUser <= 0)
+        return true;
+    
+    std::map<std::string, int>::iterator it = m_userSessions.find(user);
+    if (it != m_userSessions.end() && it->second >= m_maxPerUser)
+    {
+        m_rejectedUser++;
+        return false;
+    }
+    
+    return true;
+}
+
+void AdmissionControl::addUser(const std::string& user)
+{
+    m_userSessions[user]++;
+}
+
+void AdmissionControl::removeUser(const std::string& user)
+{
+    std::map<std::string, int>::iterator it = m_userSessions.find(user);
+    if (it != m_userSessions.end() && --it->second <= 0)
+        m_userSessions.erase(it);
+}
+
+void AdmissionControl::recordAcceptLatency(uint64_t usec)
+{
+    m_latencyTotal += usec;
+    if (usec > m_latencyMax)
+        m_latencyMax = usec;
+}
+
+void AdmissionControl::recordAcceptError()
+{
+    m_acceptErrors++;
+}
+
+void AdmissionControl::recordListenerPause()
+{
+    m_listenerPauses++;
+}
+
+std::string AdmissionControl::formatStats(int listenFd)
+{
+    // 对监听套接字，tcpi_unacked是当前accept队列长度，tcpi_sacked是backlog上限
+    unsigned int queueDepth = 0;
+    unsigned int queueLimit = 0;
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+    memset(&info, 0, sizeof(info));
+    if (listenFd >= 0 && getsockopt(listenFd, IPPROTO_TCP, TCP_INFO, &info, &len) == 0)
+    {
+        queueDepth = info.tcpi_unacked;
+        queueLimit = info.tcpi_sacked;
+    }
+    
+    char buf[512];
+    sprintf(buf,
+            " accept.sessions %d\r\n"
+            " accept.queue_depth %u\r\n"
+            " accept.queue_limit %u\r\n"
+            " accept.accepted %llu\r\n"
+            " accept.rejected_global %llu\r\n"
+            " accept.rejected_ip %llu\r\n"
+            " accept.rejected_user %llu\r\n"
+            " accept.errors %llu\r\n"
+            " accept.listener_pauses %llu\r\n"
+            " accept.latency_avg_us %llu\r\n"
+            " accept.latency_max_us %llu\r\n",
+            m_sessions,
+            queueDepth,
+            queueLimit,
+            (unsigned long long)m_accepted,
+            (unsigned long long)m_rejectedGlobal,
+            (unsigned long long)m_rejectedIp,
+            (unsigned long long)m_rejectedUser,
+            (unsigned long long)m_acceptErrors,
+            (unsigned long long)m_listenerPauses,
+            (unsigned long long)(m_accepted == 0 ? 0 : m_latencyTotal / m_accepted),
+            (unsigned long long)m_latencyMax);
+    
+    return buf;
+}
@@ -0,0 +1,49 @@
+#ifndef ADMISSIONCONTROL_H
+#define ADMISSIONCONTROL_H
+
+#include <stdint.h>
+#include <netinet/in.h>
+#include <string>
+#include <map>
+
+// 连接准入控制：全局会话数、单个来源IP的会话数、单个用户的会话数上限，
+// 以及accept相关的统计
+class AdmissionControl
+{
+public:
+    AdmissionControl(int maxSessions, int maxPerIp, int maxPerUser);
+    
+    bool admit(in_addr_t ip);   // accept时检查，不通过则计入拒绝数
+    void addSession(in_addr_t ip);
+    void removeSession(in_addr_t ip);
+    
+    bool admitUser(const std::string& user);
+    void addUser(const std::string& user);
+    void removeUser(const std::string& user);
+    
+    void recordAcceptLatency(uint64_t usec);
+    void recordAcceptError();
+    void recordListenerPause();
+    
+    std::string formatStats(int listenFd);
+    
+protected:
+    int m_maxSessions;      // 0表示不限制，下同
+    int m_maxPerIp;
+    int m_maxPerUser;
+    
+    int m_sessions;
+    std::map<in_addr_t, int> m_ipSessions;
+    std::map<std::string, int> m_userSessions;
+    
+    uint64_t m_accepted;
+    uint64_t m_rejectedGlobal;
+    uint64_t m_rejectedIp;
+    uint64_t m_rejectedUser;
+    uint64_t m_acceptErrors;
+    uint64_t m_listenerPauses;
+    uint64_t m_latencyTotal;
+    uint64_t m_latencyMax;
+};
+
+#endif // ADMISSIONCONTROL_H
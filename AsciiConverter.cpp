@@ -0,0 +1,262 @@
+#include "AsciiConverter.h"
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define ASCII_SIMD 1
+#endif
+
+typedef size_t (*ConvertFunc)(const char* src, size_t length, char* dst, bool* state);
+
+static size_t toNetworkScalar(const char* src, size_t length, char* dst, bool* lastWasCr)
+{
+    char* out = dst;
+    bool cr = *lastWasCr;
+    for (size_t i = 0; i < length; i++)
+    {
+        char c = src[i];
+        if (c == '\n' && !cr)
+            *out++ = '\r';
+        *out++ = c;
+        cr = (c == '\r');
+    }
+
+    *lastWasCr = cr;
+    return out - dst;
+}
+
+// 进入时*pendingCr为false，src最后一个字节是'\r'时置为true且不输出它
+static size_t toLocalScalar(const char* src, size_t length, char* dst, bool* pendingCr)
+{
+    char* out = dst;
+    for (size_t i = 0; i < length; i++)
+    {
+        char c = src[i];
+        if (c == '\r')
+        {
+            if (i + 1 == length)
+            {
+                *pendingCr = true;
+                break;
+            }
+            if (src[i + 1] == '\n')
+                continue;
+        }
+        *out++ = c;
+    }
+
+    return out - dst;
+}
+
+#ifdef ASCII_SIMD
+
+// 处理一个含有'\n'的块，mask的每一位对应块内一个'\n'。两个换行之间的部分整段拷贝
+static inline char* networkBlock(const char* p, size_t width, uint32_t mask, char* out, bool cr)
+{
+    size_t start = 0;
+    while (mask != 0)
+    {
+        size_t bit = __builtin_ctz(mask);
+        memcpy(out, p + start, bit - start);
+        out += bit - start;
+        bool prevCr = (bit > 0) ? (p[bit - 1] == '\r') : cr;
+        if (!prevCr)
+            *out++ = '\r';
+        *out++ = '\n';
+        start = bit + 1;
+        mask &= mask - 1;
+    }
+
+    memcpy(out, p + start, width - start);
+    return out + (width - start);
+}
+
+// 处理一个含有'\r'的块，i为块在src中的起点。后面紧跟'\n'的'\r'丢掉，在src末尾的留给下一块
+static inline char* localBlock(const char* src, size_t length, size_t i, size_t width, uint32_t mask,
+                               char* out, bool* pendingCr)
+{
+    const char* p = src + i;
+    size_t start = 0;
+    while (mask != 0)
+    {
+        size_t bit = __builtin_ctz(mask);
+        memcpy(out, p + start, bit - start);
+        out += bit - start;
+        size_t next = i + bit + 1;
+        if (next == length)
+            *pendingCr = true;
+        else if (src[next] != '\n')
+            *out++ = '\r';
+        start = bit + 1;
+        mask &= mask - 1;
+    }
+
+    memcpy(out, p + start, width - start);
+    return out + (width - start);
+}
+
+__attribute__((target("sse2")))
+static size_t toNetworkSse2(const char* src, size_t length, char* dst, bool* lastWasCr)
+{
+    const __m128i lf = _mm_set1_epi8('\n');
+    char* out = dst;
+    bool cr = *lastWasCr;
+    size_t i = 0;
+    for (; i + 16 <= length; i += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i*)(src + i));
+        uint32_t mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, lf));
+        if (mask == 0)
+        {
+            _mm_storeu_si128((__m128i*)out, v);
+            out += 16;
+        }
+        else
+        {
+            out = networkBlock(src + i, 16, mask, out, cr);
+        }
+        cr = (src[i + 15] == '\r');
+    }
+
+    *lastWasCr = cr;
+    return (out - dst) + toNetworkScalar(src + i, length - i, out, lastWasCr);
+}
+
+__attribute__((target("sse2")))
+static size_t toLocalSse2(const char* src, size_t length, char* dst, bool* pendingCr)
+{
+    const __m128i cr = _mm_set1_epi8('\r');
+    char* out = dst;
+    size_t i = 0;
+    for (; i + 16 <= length; i += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i*)(src + i));
+        uint32_t mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, cr));
+        if (mask == 0)
+        {
+            _mm_storeu_si128((__m128i*)out, v);
+            out += 16;
+        }
+        else
+        {
+            out = localBlock(src, length, i, 16, mask, out, pendingCr);
+        }
+    }
+
+    return (out - dst) + toLocalScalar(src + i, length - i, out, pendingCr);
+}
+
+__attribute__((target("avx2")))
+static size_t toNetworkAvx2(const char* src, size_t length, char* dst, bool* lastWasCr)
+{
+    const __m256i lf = _mm256_set1_epi8('\n');
+    char* out = dst;
+    bool cr = *lastWasCr;
+    size_t i = 0;
+    for (; i + 32 <= length; i += 32)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(src + i));
+        uint32_t mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, lf));
+        if (mask == 0)
+        {
+            _mm256_storeu_si256((__m256i*)out, v);
+            out += 32;
+        }
+        else
+        {
+            out = networkBlock(src + i, 32, mask, out, cr);
+        }
+        cr = (src[i + 31] == '\r');
+    }
+
+    *lastWasCr = cr;
+    return (out - dst) + toNetworkSse2(src + i, length - i, out, lastWasCr);
+}
+
+__attribute__((target("avx2")))
+static size_t toLocalAvx2(const char* src, size_t length, char* dst, bool* pendingCr)
+{
+    const __m256i cr = _mm256_set1_epi8('\r');
+    char* out = dst;
+    size_t i = 0;
+    for (; i + 32 <= length; i += 32)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(src + i));
+        uint32_t mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, cr));
+        if (mask == 0)
+        {
+            _mm256_storeu_si256((__m256i*)out, v);
+            out += 32;
+        }
+        else
+        {
+            out = localBlock(src, length, i, 32, mask, out, pendingCr);
+        }
+    }
+
+    return (out - dst) + toLocalSse2(src + i, length - i, out, pendingCr);
+}
+
+#endif // ASCII_SIMD
+
+static ConvertFunc s_toNetwork = NULL;
+static ConvertFunc s_toLocal = NULL;
+static const char* s_kernelName = "scalar";
+
+// 第一次用到时按CPU选择实现，之后只在事件循环线程里调用
+static void selectKernels()
+{
+    s_toNetwork = toNetworkScalar;
+    s_toLocal = toLocalScalar;
+#ifdef ASCII_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+    {
+        s_toNetwork = toNetworkAvx2;
+        s_toLocal = toLocalAvx2;
+        s_kernelName = "avx2";
+    }
+    else if (__builtin_cpu_supports("sse2"))
+    {
+        s_toNetwork = toNetworkSse2;
+        s_toLocal = toLocalSse2;
+        s_kernelName = "sse2";
+    }
+#endif
+}
+
+/*static*/ size_t AsciiConverter::toNetwork(const char* src, size_t length, char* dst, bool* lastWasCr)
+{
+    if (s_toNetwork == NULL)
+        selectKernels();
+
+    return s_toNetwork(src, length, dst, lastWasCr);
+}
+
+/*static*/ size_t AsciiConverter::toLocal(const char* src, size_t length, char* dst, bool* pendingCr)
+{
+    if (length == 0)
+        return 0;
+    if (s_toLocal == NULL)
+        selectKernels();
+
+    // 上一块末尾的'\r'：这一块以'\n'开头时丢掉，否则原样补回
+    char* out = dst;
+    if (*pendingCr)
+    {
+        if (src[0] != '\n')
+            *out++ = '\r';
+        *pendingCr = false;
+    }
+
+    return (out - dst) + s_toLocal(src, length, out, pendingCr);
+}
+
+/*static*/ const char* AsciiConverter::kernelName()
+{
+    if (s_toNetwork == NULL)
+        selectKernels();
+
+    return s_kernelName;
+}
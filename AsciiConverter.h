@@ -0,0 +1,23 @@
+#ifndef ASCIICONVERTER_H
+#define ASCIICONVERTER_H
+
+#include <stddef.h>
+
+// TYPE A的换行转换，按块流式进行。跨块的状态由调用者为每次传输保存一个bool：
+// 下载时记上一块是否以'\r'结尾，避免把文件里已有的"\r\n"扩成"\r\r\n"；
+// 上传时记上一块末尾留下的'\r'，看到下一块的第一个字节后再决定丢掉还是补回。
+// x86上用SSE2/AVX2一次扫描16/32字节，没有换行的整段直接拷贝；其他平台用逐字节的实现
+class AsciiConverter
+{
+public:
+    // LF→CRLF，dst至少要有2*length字节，返回写入的长度
+    static size_t toNetwork(const char* src, size_t length, char* dst, bool* lastWasCr);
+
+    // CRLF→LF，dst至少要有length+1字节（补回上一块留下的'\r'），返回写入的长度。
+    // 传输结束时*pendingCr仍为true，说明文件以单独的'\r'结尾，调用者要把它写回去
+    static size_t toLocal(const char* src, size_t length, char* dst, bool* pendingCr);
+
+    static const char* kernelName();    // 当前使用的实现，供SITE STATS显示
+};
+
+#endif // ASCIICONVERTER_H
@@ -0,0 +1,78 @@
+#include "BlockMode.h"
+#include <stdio.h>
+#include <algorithm>
+
+const size_t BlockMode::HEADER;
+const size_t BlockMode::MAX_DATA;
+
+uint64_t BlockMode::s_sent = 0;
+uint64_t BlockMode::s_received = 0;
+uint64_t BlockMode::s_markers = 0;
+uint64_t BlockMode::s_transfers = 0;
+
+/*static*/ void BlockMode::putHeader(char* header, unsigned char descriptor, size_t length)
+{
+    header[0] = (char)descriptor;
+    header[1] = (char)(length >> 8);
+    header[2] = (char)(length & 0xff);
+}
+
+/*static*/ void BlockMode::add(evbuffer* output, unsigned char descriptor, const char* data, size_t length)
+{
+    // 空的EOF块也要发，它就是文件结束的标记
+    do
+    {
+        size_t count = std::min(length, MAX_DATA);
+        char header[HEADER];
+        putHeader(header, (count == length) ? descriptor : 0, count);
+        evbuffer_add(output, header, HEADER);
+        evbuffer_add(output, data, count);
+        data += count;
+        length -= count;
+        s_sent++;
+    } while (length > 0);
+}
+
+/*static*/ void BlockMode::addMarker(evbuffer* output, uint64_t offset)
+{
+    char marker[32];
+    int length = sprintf(marker, "%llu", (unsigned long long)offset);
+    add(output, Restart, marker, length);
+    s_markers++;
+}
+
+/*static*/ void BlockMode::resetReader(BlockReader* reader)
+{
+    reader->descriptor = 0;
+    reader->remaining = 0;
+    reader->marker.clear();
+}
+
+/*static*/ bool BlockMode::readHeader(evbuffer* input, BlockReader* reader)
+{
+    unsigned char header[HEADER];
+    if (evbuffer_get_length(input) < HEADER)
+        return false;
+
+    evbuffer_remove(input, header, HEADER);
+    reader->descriptor = header[0];
+    reader->remaining = ((size_t)header[1] << 8) | header[2];
+    reader->marker.clear();
+    s_received++;
+    return true;
+}
+
+/*static*/ std::string BlockMode::formatStats()
+{
+    char buf[256];
+    sprintf(buf,
+            " block.sent %llu\r\n"
+            " block.received %llu\r\n"
+            " block.markers %llu\r\n"
+            " block.transfers %llu\r\n",
+            (unsigned long long)s_sent,
+            (unsigned long long)s_received,
+            (unsigned long long)s_markers,
+            (unsigned long long)s_transfers);
+    return buf;
+}
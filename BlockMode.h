@@ -0,0 +1,54 @@
+#ifndef BLOCKMODE_H
+#define BLOCKMODE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include <event2/buffer.h>
+
+// 上传方向的解析状态，块头可能被拆在两次读事件里
+struct BlockReader
+{
+    unsigned char descriptor;
+    size_t remaining;       // 当前块还没收的数据长度
+    std::string marker;     // 正在收的重启标记
+};
+
+// RFC 959的块模式（MODE B）。每块前有3字节的头：1字节描述符，2字节大端的数据长度。
+// 文件以带EOF描述符的块结束，数据连接留着传下一个文件，省去每个文件的握手和慢启动。
+// 服务器发出的重启标记是十进制的文件偏移，断开后REST这个值即可续传
+class BlockMode
+{
+public:
+    enum Descriptor
+    {
+        Eor = 0x80,
+        Eof = 0x40,
+        Errors = 0x20,
+        Restart = 0x10
+    };
+
+    static const size_t HEADER = 3;
+    static const size_t MAX_DATA = 65535;
+
+    static void putHeader(char* header, unsigned char descriptor, size_t length);
+    // 超过MAX_DATA的数据拆成多块，描述符只加在最后一块上
+    static void add(evbuffer* output, unsigned char descriptor, const char* data, size_t length);
+    static void addMarker(evbuffer* output, uint64_t offset);
+
+    static void resetReader(BlockReader* reader);
+    static bool readHeader(evbuffer* input, BlockReader* reader);  // 输入里还不够一个块头时返回false
+
+    static void recordSent(size_t blocks) { s_sent += blocks; }
+    static void recordTransfer() { s_transfers++; }
+    static std::string formatStats();
+
+protected:
+    // 只在事件循环线程中修改
+    static uint64_t s_sent;
+    static uint64_t s_received;
+    static uint64_t s_markers;
+    static uint64_t s_transfers;    // 数据连接保持打开、成功完成的传输
+};
+
+#endif // BLOCKMODE_H
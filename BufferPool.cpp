@@ -0,0 +1,221 @@
+#include "BufferPool.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <algorithm>
+
+static const size_t PAGE = 4096;
+static const size_t SLAB_SIZE = 2 * 1024 * 1024;
+static const size_t MAX_SLABS = 1024;
+static const size_t LOCAL_MAX = 32;     // 线程空闲链表超过这么多时还一半给仓库
+static const size_t BATCH = 16;         // 和仓库之间每次交换的个数
+
+size_t BufferPool::s_bufferSize = 0;
+size_t BufferPool::s_maxBuffers = 0;
+bool BufferPool::s_hugePages = false;
+uint64_t BufferPool::s_acquires = 0;
+uint64_t BufferPool::s_misses = 0;
+uint64_t BufferPool::s_overflows = 0;
+uint64_t BufferPool::s_inUse = 0;
+uint64_t BufferPool::s_directReads = 0;
+uint64_t BufferPool::s_directWrites = 0;
+
+// 空闲缓冲的头几个字节存链表的下一个
+static __thread char* t_freeList = NULL;
+static __thread size_t t_freeCount = 0;
+
+static pthread_mutex_t s_depotLock = PTHREAD_MUTEX_INITIALIZER;
+static char* s_depot = NULL;
+static size_t s_depotCount = 0;
+
+// slab只增不减。归还时不加锁地按地址判断是否属于池，先写基址再发布个数
+static char* s_slabs[MAX_SLABS];
+static size_t s_slabCount = 0;
+static size_t s_slabBytes = 0;
+static bool s_slabHuge = false;     // 是否拿到了MAP_HUGETLB
+static char* s_carveNext = NULL;
+static char* s_carveEnd = NULL;
+static size_t s_carved = 0;
+
+static inline char*& nextOf(char* buffer)
+{
+    return *(char**)buffer;
+}
+
+/*static*/ void BufferPool::configure(size_t bufferSize, size_t maxBuffers, bool hugePages)
+{
+    s_bufferSize = (bufferSize + PAGE - 1) / PAGE * PAGE;
+    s_hugePages = hugePages;
+    s_slabBytes = (s_bufferSize + SLAB_SIZE - 1) / SLAB_SIZE * SLAB_SIZE;
+    size_t perSlab = s_slabBytes / s_bufferSize;
+    s_maxBuffers = std::min(maxBuffers, perSlab * MAX_SLABS);
+}
+
+/*static*/ char* BufferPool::carve()
+{
+    // 调用者持有s_depotLock
+    if (s_carveNext == NULL || s_carveNext + s_bufferSize > s_carveEnd)
+    {
+        if (s_slabCount >= MAX_SLABS)
+            return NULL;
+
+        void* slab = MAP_FAILED;
+        if (s_hugePages)
+        {
+            slab = mmap(NULL, s_slabBytes, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+            s_slabHuge = (slab != MAP_FAILED);
+        }
+        if (slab == MAP_FAILED)
+        {
+            slab = mmap(NULL, s_slabBytes, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+            if (slab == MAP_FAILED)
+                return NULL;
+            if (s_hugePages)
+                madvise(slab, s_slabBytes, MADV_HUGEPAGE);
+        }
+
+        s_slabs[s_slabCount] = (char*)slab;
+        __sync_synchronize();
+        s_slabCount++;
+        s_carveNext = (char*)slab;
+        s_carveEnd = s_carveNext + s_slabBytes;
+    }
+
+    char* buffer = s_carveNext;
+    s_carveNext += s_bufferSize;
+    s_carved++;
+    return buffer;
+}
+
+/*static*/ bool BufferPool::pooled(const char* buffer)
+{
+    size_t count = s_slabCount;
+    __sync_synchronize();
+    for (size_t i = 0; i < count; i++)
+    {
+        if (buffer >= s_slabs[i] && buffer < s_slabs[i] + s_slabBytes)
+            return true;
+    }
+    return false;
+}
+
+/*static*/ char* BufferPool::acquire()
+{
+    __sync_fetch_and_add(&s_acquires, 1);
+    __sync_fetch_and_add(&s_inUse, 1);
+    if (t_freeList != NULL)
+    {
+        char* buffer = t_freeList;
+        t_freeList = nextOf(buffer);
+        t_freeCount--;
+        return buffer;
+    }
+
+    // 本线程的链表空了，从仓库成批取一些；仓库也空时切一个新的
+    char* buffer = NULL;
+    pthread_mutex_lock(&s_depotLock);
+    for (size_t i = 0; i < BATCH && s_depot != NULL; i++)
+    {
+        char* taken = s_depot;
+        s_depot = nextOf(taken);
+        s_depotCount--;
+        if (buffer == NULL)
+        {
+            buffer = taken;
+            continue;
+        }
+        nextOf(taken) = t_freeList;
+        t_freeList = taken;
+        t_freeCount++;
+    }
+    if (buffer == NULL && s_carved < s_maxBuffers)
+    {
+        buffer = carve();
+        __sync_fetch_and_add(&s_misses, 1);
+    }
+    pthread_mutex_unlock(&s_depotLock);
+    if (buffer != NULL)
+        return buffer;
+
+    __sync_fetch_and_add(&s_misses, 1);
+    __sync_fetch_and_add(&s_overflows, 1);
+    void* temp = NULL;
+    if (posix_memalign(&temp, PAGE, s_bufferSize) != 0)
+    {
+        __sync_fetch_and_sub(&s_inUse, 1);
+        return NULL;
+    }
+    return (char*)temp;
+}
+
+/*static*/ void BufferPool::release(char* buffer)
+{
+    if (buffer == NULL)
+        return;
+
+    __sync_fetch_and_sub(&s_inUse, 1);
+    if (!pooled(buffer))
+    {
+        free(buffer);
+        return;
+    }
+
+    nextOf(buffer) = t_freeList;
+    t_freeList = buffer;
+    if (++t_freeCount <= LOCAL_MAX)
+        return;
+
+    // 攒得太多时还一批给仓库，别的线程可以用
+    pthread_mutex_lock(&s_depotLock);
+    for (size_t i = 0; i < BATCH; i++)
+    {
+        char* given = t_freeList;
+        t_freeList = nextOf(given);
+        t_freeCount--;
+        nextOf(given) = s_depot;
+        s_depot = given;
+        s_depotCount++;
+    }
+    pthread_mutex_unlock(&s_depotLock);
+}
+
+/*static*/ void BufferPool::releaseReference(const void* data, size_t length, void* extra)
+{
+    release((char*)data);
+}
+
+/*static*/ void BufferPool::recordDirect(bool write)
+{
+    __sync_fetch_and_add(write ? &s_directWrites : &s_directReads, 1);
+}
+
+/*static*/ std::string BufferPool::formatStats()
+{
+    if (!enabled())
+        return "";
+
+    char buf[512];
+    sprintf(buf,
+            " pool.buffer_size %llu\r\n"
+            " pool.buffers %llu of %llu\r\n"
+            " pool.in_use %llu\r\n"
+            " pool.acquires %llu\r\n"
+            " pool.misses %llu\r\n"
+            " pool.overflows %llu\r\n"
+            " pool.hugetlb %s\r\n"
+            " direct.reads %llu\r\n"
+            " direct.writes %llu\r\n",
+            (unsigned long long)s_bufferSize,
+            (unsigned long long)s_carved,
+            (unsigned long long)s_maxBuffers,
+            (unsigned long long)s_inUse,
+            (unsigned long long)s_acquires,
+            (unsigned long long)s_misses,
+            (unsigned long long)s_overflows,
+            s_slabHuge ? "yes" : "no",
+            (unsigned long long)s_directReads,
+            (unsigned long long)s_directWrites);
+    return buf;
+}
@@ -0,0 +1,45 @@
+#ifndef BUFFERPOOL_H
+#define BUFFERPOOL_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+
+// 传输缓冲池：大小固定、按页对齐的缓冲在传输之间重复使用，O_DIRECT读写可以直接用。
+// 缓冲从2MB的slab里切出来，配置了大页时slab用MAP_HUGETLB，失败则退回透明大页。
+// 每个线程有自己的空闲链表，取还都不加锁；链表空了或攒得太多时才和全局的仓库成批交换。
+// 池里的缓冲达到上限后再要的临时分配，归还时直接释放
+class BufferPool
+{
+public:
+    static void configure(size_t bufferSize, size_t maxBuffers, bool hugePages);
+    static bool enabled() { return s_bufferSize > 0; }
+    static size_t bufferSize() { return s_bufferSize; }
+
+    static char* acquire();
+    static void release(char* buffer);
+    // evbuffer_add_reference的清理回调，evbuffer发完这段数据后把缓冲还回池里
+    static void releaseReference(const void* data, size_t length, void* extra);
+
+    static void recordDirect(bool write);
+    static std::string formatStats();
+
+protected:
+    static bool pooled(const char* buffer);
+    static char* carve();
+
+protected:
+    static size_t s_bufferSize;     // 0表示不用缓冲池
+    static size_t s_maxBuffers;
+    static bool s_hugePages;
+
+    // 统计，可能在多个线程中修改
+    static uint64_t s_acquires;
+    static uint64_t s_misses;       // 空闲链表和仓库都空，新切或临时分配的次数
+    static uint64_t s_overflows;    // 池已满时的临时分配
+    static uint64_t s_inUse;
+    static uint64_t s_directReads;  // 用O_DIRECT的下载和上传
+    static uint64_t s_directWrites;
+};
+
+#endif // BUFFERPOOL_H
@@ -0,0 +1,158 @@
+#include "CachePolicy.h"
+#include <stdio.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+CachePolicy::CachePolicy(uint64_t streamThreshold, size_t readahead, bool dropUploads, const std::string& keepPaths)
+{
+    m_streamThreshold = streamThreshold;
+    m_readahead = (readahead == 0) ? 4*1024*1024 : readahead;
+    m_dropUploads = dropUploads;
+    
+    // 逗号分隔的路径前缀
+    size_t start = 0;
+    while (start < keepPaths.size())
+    {
+        size_t end = keepPaths.find(',', start);
+        if (end == std::string::npos)
+            end = keepPaths.size();
+        
+        std::string path = keepPaths.substr(start, end - start);
+        size_t first = path.find_first_not_of(" \t");
+        size_t last = path.find_last_not_of(" \t/");
+        if (first != std::string::npos && last != std::string::npos && last >= first)
+            m_keepPaths.push_back(path.substr(first, last - first + 1));
+        start = end + 1;
+    }
+    
+    m_streamReads = 0;
+    m_cachedReads = 0;
+    m_streamWrites = 0;
+    m_droppedBytes = 0;
+}
+
+bool CachePolicy::isKept(const std::string& hostPath)
+{
+    for (size_t i = 0; i < m_keepPaths.size(); i++)
+    {
+        const std::string& prefix = m_keepPaths[i];
+        if (hostPath.compare(0, prefix.size(), prefix) == 0 &&
+            (hostPath.size() == prefix.size() || hostPath[prefix.size()] == '/'))
+            return true;
+    }
+    
+    return false;
+}
+
+void CachePolicy::beginRead(int fd, const std::string& hostPath, uint64_t offset, CacheCursor* cursor)
+{
+    cursor->active = false;
+    if (fd < 0 || m_streamThreshold == 0)
+        return;
+    
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (uint64_t)st.st_size < m_streamThreshold || isKept(hostPath))
+    {
+        m_cachedReads++;
+        return;
+    }
+    
+    // 一次性的大文件：告诉内核顺序读，并提前发起第一个窗口的预读
+    cursor->active = true;
+    cursor->dropped = offset;
+    cursor->ahead = offset + m_readahead;
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    readahead(fd, offset, m_readahead);
+    m_streamReads++;
+}
+
+void CachePolicy::advanceRead(int fd, uint64_t position, CacheCursor* cursor)
+{
+    if (!cursor->active)
+        return;
+    
+    // 读游标离预读位置不到半个窗口时，再预读下一个窗口
+    if (cursor->ahead < position)
+        cursor->ahead = position;
+    if (cursor->ahead - position < m_readahead / 2)
+    {
+        readahead(fd, cursor->ahead, m_readahead);
+        cursor->ahead += m_readahead;
+    }
+    
+    // 读过的部分已经拷进输出缓冲，攒够一个窗口就从页缓存丢掉
+    if (position - cursor->dropped >= m_readahead)
+        drop(fd, position, cursor);
+}
+
+void CachePolicy::endRead(int fd, uint64_t position, CacheCursor* cursor)
+{
+    if (cursor->active && position > cursor->dropped)
+        drop(fd, position, cursor);
+    cursor->active = false;
+}
+
+void CachePolicy::beginWrite(int fd, const std::string& hostPath, uint64_t offset, CacheCursor* cursor)
+{
+    cursor->active = (m_dropUploads && m_streamThreshold > 0 && fd >= 0 && !isKept(hostPath));
+    cursor->dropped = offset;
+    cursor->ahead = offset;
+}
+
+void CachePolicy::advanceWrite(int fd, uint64_t position, CacheCursor* cursor)
+{
+    // 上传长度事先不知道，超过阈值后才开始处理，小文件留在缓存里
+    if (!cursor->active || position < m_streamThreshold || position - cursor->ahead < m_readahead)
+        return;
+    
+    // 上一批在上一个窗口时已经开始回写，此时多半已落盘，丢弃不会阻塞；
+    // 还是脏页的部分内核会跳过
+    if (cursor->ahead > cursor->dropped)
+    {
+        posix_fadvise(fd, cursor->dropped, cursor->ahead - cursor->dropped, POSIX_FADV_DONTNEED);
+        m_droppedBytes += cursor->ahead - cursor->dropped;
+        cursor->dropped = cursor->ahead;
+    }
+    
+    sync_file_range(fd, cursor->ahead, position - cursor->ahead, SYNC_FILE_RANGE_WRITE);
+    cursor->ahead = position;
+}
+
+void CachePolicy::endWrite(int fd, uint64_t position, CacheCursor* cursor)
+{
+    if (!cursor->active || position < m_streamThreshold)
+    {
+        cursor->active = false;
+        return;
+    }
+    
+    // 剩余部分发起回写后丢弃，仍在回写中的页留给内核按需回收
+    sync_file_range(fd, cursor->ahead, 0, SYNC_FILE_RANGE_WRITE);
+    posix_fadvise(fd, cursor->dropped, 0, POSIX_FADV_DONTNEED);
+    if (position > cursor->dropped)
+        m_droppedBytes += position - cursor->dropped;
+    m_streamWrites++;
+    cursor->active = false;
+}
+
+void CachePolicy::drop(int fd, uint64_t position, CacheCursor* cursor)
+{
+    posix_fadvise(fd, cursor->dropped, position - cursor->dropped, POSIX_FADV_DONTNEED);
+    m_droppedBytes += position - cursor->dropped;
+    cursor->dropped = position;
+}
+
+std::string CachePolicy::formatStats()
+{
+    char buf[256];
+    sprintf(buf,
+            " cache.stream_reads %llu\r\n"
+            " cache.cached_reads %llu\r\n"
+            " cache.stream_writes %llu\r\n"
+            " cache.dropped_bytes %llu\r\n",
+            (unsigned long long)m_streamReads,
+            (unsigned long long)m_cachedReads,
+            (unsigned long long)m_streamWrites,
+            (unsigned long long)m_droppedBytes);
+    return buf;
+}
@@ -0,0 +1,50 @@
+#ifndef CACHEPOLICY_H
+#define CACHEPOLICY_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+// 单次传输的页缓存游标，只有大文件的流式读写才会激活
+struct CacheCursor
+{
+    bool active;
+    uint64_t dropped;   // 此前的部分已经从页缓存中丢弃（或已要求回写）
+    uint64_t ahead;     // 已经发起预读到的位置
+};
+
+// 传输的页缓存策略：大文件顺序下载提示SEQUENTIAL并按窗口预读，读过的部分随即DONTNEED；
+// 上传完的大文件可选地回写后丢弃。小文件和白名单目录下的文件不做任何提示，留在缓存里
+class CachePolicy
+{
+public:
+    CachePolicy(uint64_t streamThreshold, size_t readahead, bool dropUploads, const std::string& keepPaths);
+    
+    void beginRead(int fd, const std::string& hostPath, uint64_t offset, CacheCursor* cursor);
+    void advanceRead(int fd, uint64_t position, CacheCursor* cursor);
+    void endRead(int fd, uint64_t position, CacheCursor* cursor);
+    
+    void beginWrite(int fd, const std::string& hostPath, uint64_t offset, CacheCursor* cursor);
+    void advanceWrite(int fd, uint64_t position, CacheCursor* cursor);
+    void endWrite(int fd, uint64_t position, CacheCursor* cursor);
+    
+    std::string formatStats();
+
+protected:
+    bool isKept(const std::string& hostPath);
+    void drop(int fd, uint64_t position, CacheCursor* cursor);
+
+protected:
+    uint64_t m_streamThreshold;     // 不小于该长度的文件按流式处理，0表示关闭
+    size_t m_readahead;             // 预读窗口，同时也是丢弃和回写的批量
+    bool m_dropUploads;
+    std::vector<std::string> m_keepPaths;  // 本地路径前缀，其下文件始终保留在缓存中
+    
+    // 统计
+    uint64_t m_streamReads;
+    uint64_t m_cachedReads;
+    uint64_t m_streamWrites;
+    uint64_t m_droppedBytes;
+};
+
+#endif // CACHEPOLICY_H
@@ -0,0 +1,94 @@
+#include "Config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+Config::Config()
+{
+}
+
+bool Config::load(const std::string& filename)
+{
+    FILE* file = fopen(filename.c_str(), "r");
+    if (file == NULL)
+        return false;
+    
+    char line[1024];
+    while (fgets(line, sizeof(line), file) != NULL)
+    {
+        std::string str = trim(line);
+        if (str.empty() || str[0] == '#')
+            continue;
+        
+        size_t equal = str.find('=');
+        if (equal == std::string::npos)
+            continue;
+        
+        set(trim(str.substr(0, equal)), trim(str.substr(equal+1)));
+    }
+    
+    fclose(file);
+    return true;
+}
+
+bool Config::has(const std::string& key) const
+{
+    return (m_values.find(key) != m_values.end());
+}
+
+std::string Config::getString(const std::string& key, const std::string& def /*= ""*/) const
+{
+    std::map<std::string, std::string>::const_iterator it = m_values.find(key);
+    if (it == m_values.end())
+        return def;
+    
+    return it->second;
+}
+
+long long Config::getInt(const std::string& key, long long def) const
+{
+    std::map<std::string, std::string>::const_iterator it = m_values.find(key);
+    if (it == m_values.end() || it->second.empty())
+        return def;
+    
+    // 支持 K/M/G 后缀，方便配置大小类参数
+    char* end = NULL;
+    long long value = strtoll(it->second.c_str(), &end, 0);
+    switch (*end)
+    {
+    case 'k': case 'K': value <<= 10; break;
+    case 'm': case 'M': value <<= 20; break;
+    case 'g': case 'G': value <<= 30; break;
+    default: break;
+    }
+    
+    return value;
+}
+
+bool Config::getBool(const std::string& key, bool def) const
+{
+    std::map<std::string, std::string>::const_iterator it = m_values.find(key);
+    if (it == m_values.end())
+        return def;
+    
+    const char* value = it->second.c_str();
+    return (strcasecmp(value, "yes") == 0 || strcasecmp(value, "true") == 0 ||
+            strcasecmp(value, "on") == 0 || strcmp(value, "1") == 0);
+}
+
+void Config::set(const std::string& key, const std::string& value)
+{
+    m_values[key] = value;
+}
+
+/*static*/ std::string Config::trim(const std::string& str)
+{
+    static const char* blanks = " \t\r\n";
+    size_t begin = str.find_first_not_of(blanks);
+    if (begin == std::string::npos)
+        return "";
+    
+    size_t end = str.find_last_not_of(blanks);
+    return str.substr(begin, end-begin+1);
+}
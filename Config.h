@@ -0,0 +1,28 @@
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#include <string>
+#include <map>
+
+// 简单的 key = value 配置文件，'#' 开头为注释
+class Config
+{
+public:
+    Config();
+    
+    bool load(const std::string& filename);
+    
+    bool has(const std::string& key) const;
+    std::string getString(const std::string& key, const std::string& def = "") const;
+    long long getInt(const std::string& key, long long def) const;
+    bool getBool(const std::string& key, bool def) const;
+    void set(const std::string& key, const std::string& value);
+    
+protected:
+    static std::string trim(const std::string& str);
+    
+protected:
+    std::map<std::string, std::string> m_values;
+};
+
+#endif // CONFIG_H
@@ -0,0 +1,295 @@
+#include "ContentStore.h"
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include "LocalFile.h"
+
+ContentStore::ContentStore(const std::string& storeDir)
+{
+    m_storeDir = storeDir;
+    m_tempSeq = 0;
+    
+    m_uploads = 0;
+    m_dupUploads = 0;
+    m_logicalBytes = 0;
+    m_physicalBytes = 0;
+    m_reflinks = 0;
+    m_hardlinks = 0;
+    m_copies = 0;
+}
+
+bool ContentStore::init()
+{
+    std::string dirs[] = { m_storeDir, m_storeDir + "/objects", m_storeDir + "/tmp" };
+    for (size_t i = 0; i < sizeof(dirs)/sizeof(dirs[0]); i++)
+    {
+        if (!LocalFile::exist(dirs[i]) && !LocalFile::mkDir(dirs[i]))
+            return false;
+    }
+    
+    return true;
+}
+
+std::string ContentStore::createTempPath()
+{
+    char buf[32];
+    sprintf(buf, "/tmp/%d-%u", (int)getpid(), __sync_fetch_and_add(&m_tempSeq, 1));
+    return m_storeDir + buf;
+}
+
+std::string ContentStore::blobPath(const std::string& digest)
+{
+    // 按摘要前两位分目录，避免单个目录过大
+    return m_storeDir + "/objects/" + digest.substr(0, 2) + "/" + digest;
+}
+
+bool ContentStore::commit(const std::string& tempFile, const std::string& digest,
+                          int dirFd, const std::string& name, uint64_t size)
+{
+    std::string blob = blobPath(digest);
+    std::string blobDir = LocalFile::getUpDir(blob);
+    if (!LocalFile::exist(blobDir) && !LocalFile::mkDir(blobDir) && errno != EEXIST)
+    {
+        discard(tempFile);
+        return false;
+    }
+    
+    if (LocalFile::exist(blob))
+    {
+        // 重复内容，临时文件直接丢弃，只花了网络时间
+        discard(tempFile);
+        __sync_fetch_and_add(&m_dupUploads, 1);
+    }
+    else
+    {
+        if (!LocalFile::rename(tempFile, blob))
+        {
+            discard(tempFile);
+            return false;
+        }
+        __sync_fetch_and_add(&m_physicalBytes, size);
+    }
+    
+    __sync_fetch_and_add(&m_uploads, 1);
+    __sync_fetch_and_add(&m_logicalBytes, size);
+    return linkInto(blob, dirFd, name);
+}
+
+void ContentStore::discard(const std::string& tempFile)
+{
+    LocalFile::rmFile(tempFile);
+}
+
+bool ContentStore::linkInto(const std::string& blob, int dirFd, const std::string& name)
+{
+    // 先在目标目录生成临时链接再rename，替换旧文件时读者不会看到中间状态。
+    // 用户一侧只经由解析好的父目录描述符操作，路径里的符号链接带不出根目录
+    char suffix[32];
+    sprintf(suffix, ".dedup-%d-%u", (int)getpid(), __sync_fetch_and_add(&m_tempSeq, 1));
+    std::string staging = "." + name + suffix;
+    
+    // reflink是写时复制的，优先使用；其次硬链接；跨文件系统时只能复制
+    if (cloneFile(blob, dirFd, staging))
+    {
+        __sync_fetch_and_add(&m_reflinks, 1);
+    }
+    else if (linkat(AT_FDCWD, blob.c_str(), dirFd, staging.c_str(), 0) == 0)
+    {
+        __sync_fetch_and_add(&m_hardlinks, 1);
+    }
+    else
+    {
+        int src = open(blob.c_str(), O_RDONLY|O_CLOEXEC);
+        bool copied = (src != -1 && copyFile(src, dirFd, staging));
+        if (src != -1)
+            close(src);
+        if (!copied)
+            return false;
+        __sync_fetch_and_add(&m_copies, 1);
+    }
+    
+    // 目标已经是同一个块的硬链接时rename什么都不做，临时链接会留下，统一删一次
+    bool ret = (renameat(dirFd, staging.c_str(), dirFd, name.c_str()) == 0);
+    unlinkat(dirFd, staging.c_str(), 0);
+    return ret;
+}
+
+bool ContentStore::isLinked(int dirFd, const std::string& name)
+{
+    // 去重只产生硬链接，不产生符号链接，最后一级不跟随
+    struct stat st;
+    return (fstatat(dirFd, name.c_str(), &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISREG(st.st_mode) && st.st_nlink > 1);
+}
+
+bool ContentStore::breakLink(int dirFd, const std::string& name)
+{
+    // 硬链接与存储中的块共享inode，追加写之前必须先拆开，否则会改坏其他用户的文件
+    if (!isLinked(dirFd, name))
+        return true;
+    
+    int src = openat(dirFd, name.c_str(), O_RDONLY|O_NOFOLLOW|O_CLOEXEC);
+    if (src == -1)
+        return false;
+    
+    std::string staging = name + ".unlink";
+    bool ret = copyFile(src, dirFd, staging);
+    close(src);
+    if (!ret)
+        return false;
+    
+    if (renameat(dirFd, staging.c_str(), dirFd, name.c_str()) != 0)
+    {
+        unlinkat(dirFd, staging.c_str(), 0);
+        return false;
+    }
+    
+    return true;
+}
+
+/*static*/ bool ContentStore::cloneFile(const std::string& from, int dirFd, const std::string& name)
+{
+    int src = open(from.c_str(), O_RDONLY|O_CLOEXEC);
+    if (src == -1)
+        return false;
+    
+    int dst = openat(dirFd, name.c_str(), O_WRONLY|O_CREAT|O_EXCL|O_NOFOLLOW|O_CLOEXEC, 0644);
+    if (dst == -1)
+    {
+        close(src);
+        return false;
+    }
+    
+    bool ret = (ioctl(dst, FICLONE, src) == 0);
+    close(src);
+    close(dst);
+    if (!ret)
+        unlinkat(dirFd, name.c_str(), 0);
+    
+    return ret;
+}
+
+/*static*/ bool ContentStore::copyFile(int src, int dirFd, const std::string& name)
+{
+    int dst = openat(dirFd, name.c_str(), O_WRONLY|O_CREAT|O_TRUNC|O_NOFOLLOW|O_CLOEXEC, 0644);
+    if (dst == -1)
+        return false;
+    
+    static const int BUF_SIZE = 64*1024;
+    char buf[BUF_SIZE];
+    bool ret = true;
+    for (;;)
+    {
+        ssize_t count = read(src, buf, BUF_SIZE);
+        if (count == 0)
+            break;
+        if (count < 0 || write(dst, buf, count) != count)
+        {
+            ret = false;
+            break;
+        }
+    }
+    
+    close(dst);
+    if (!ret)
+        unlinkat(dirFd, name.c_str(), 0);
+    
+    return ret;
+}
+
+int ContentStore::collectGarbage(uint64_t* freedBytes)
+{
+    // 离线执行：服务未运行时，链接数为1的块只被存储本身引用，即已无用户文件指向它。
+    // reflink出去的文件不共享inode，其对应的块也会被回收，但用户文件本身不受影响
+    int removed = 0;
+    uint64_t freed = 0;
+    
+    std::string objects = m_storeDir + "/objects";
+    DIR* top = opendir(objects.c_str());
+    if (top != NULL)
+    {
+        for (dirent* sub = readdir(top); sub != NULL; sub = readdir(top))
+        {
+            if (sub->d_name[0] == '.')
+                continue;
+            
+            std::string subDir = objects + "/" + sub->d_name;
+            DIR* d = opendir(subDir.c_str());
+            if (d == NULL)
+                continue;
+            
+            for (dirent* entry = readdir(d); entry != NULL; entry = readdir(d))
+            {
+                if (entry->d_name[0] == '.')
+                    continue;
+                
+                std::string blob = subDir + "/" + entry->d_name;
+                struct stat st;
+                if (lstat(blob.c_str(), &st) == 0 && S_ISREG(st.st_mode) &&
+                    st.st_nlink == 1 && unlink(blob.c_str()) == 0)
+                {
+                    removed++;
+                    freed += st.st_size;
+                }
+            }
+            
+            closedir(d);
+            rmdir(subDir.c_str());  // 空目录顺便删掉，非空时失败无妨
+        }
+        
+        closedir(top);
+    }
+    
+    // 上次运行中断的上传残留
+    std::string tmp = m_storeDir + "/tmp";
+    DIR* d = opendir(tmp.c_str());
+    if (d != NULL)
+    {
+        for (dirent* entry = readdir(d); entry != NULL; entry = readdir(d))
+        {
+            if (entry->d_name[0] == '.')
+                continue;
+            
+            std::string file = tmp + "/" + entry->d_name;
+            struct stat st;
+            if (lstat(file.c_str(), &st) == 0 && unlink(file.c_str()) == 0)
+                freed += st.st_size;
+        }
+        
+        closedir(d);
+    }
+    
+    if (freedBytes != NULL)
+        *freedBytes = freed;
+    
+    return removed;
+}
+
+std::string ContentStore::formatStats()
+{
+    double ratio = (m_physicalBytes == 0) ? 1.0 : (double)m_logicalBytes / m_physicalBytes;
+    char buf[512];
+    sprintf(buf,
+            " dedup.uploads %llu\r\n"
+            " dedup.duplicate_uploads %llu\r\n"
+            " dedup.logical_bytes %llu\r\n"
+            " dedup.physical_bytes %llu\r\n"
+            " dedup.ratio %.2f\r\n"
+            " dedup.reflinks %llu\r\n"
+            " dedup.hardlinks %llu\r\n"
+            " dedup.copies %llu\r\n",
+            (unsigned long long)m_uploads,
+            (unsigned long long)m_dupUploads,
+            (unsigned long long)m_logicalBytes,
+            (unsigned long long)m_physicalBytes,
+            ratio,
+            (unsigned long long)m_reflinks,
+            (unsigned long long)m_hardlinks,
+            (unsigned long long)m_copies);
+    
+    return buf;
+}
@@ -0,0 +1,47 @@
+#ifndef CONTENTSTORE_H
+#define CONTENTSTORE_H
+
+#include <stdint.h>
+#include <string>
+
+// 内容寻址存储：上传的文件按SHA-256落到 objects/ 下，再用reflink或硬链接挂到用户目录，
+// 相同内容只占一份磁盘空间。commit和breakLink可能要复制整个文件，在工作线程中调用，统计用原子操作累加
+class ContentStore
+{
+public:
+    ContentStore(const std::string& storeDir);
+    
+    bool init();
+    
+    std::string createTempPath();
+    // 目标由父目录描述符（Vfs::openParent）和最后一级名字给出，不经过主机路径
+    bool commit(const std::string& tempFile, const std::string& digest,
+                int dirFd, const std::string& name, uint64_t size);
+    void discard(const std::string& tempFile);
+    bool isLinked(int dirFd, const std::string& name);     // 与存储共享inode，写之前要breakLink
+    bool breakLink(int dirFd, const std::string& name);
+    
+    int collectGarbage(uint64_t* freedBytes);
+    std::string formatStats();
+    
+protected:
+    std::string blobPath(const std::string& digest);
+    bool linkInto(const std::string& blob, int dirFd, const std::string& name);
+    static bool copyFile(int src, int dirFd, const std::string& name);
+    static bool cloneFile(const std::string& from, int dirFd, const std::string& name);
+    
+protected:
+    std::string m_storeDir;
+    unsigned int m_tempSeq;
+    
+    // 统计
+    uint64_t m_uploads;
+    uint64_t m_dupUploads;
+    uint64_t m_logicalBytes;    // 用户上传的总字节数
+    uint64_t m_physicalBytes;   // 实际新写入存储的字节数
+    uint64_t m_reflinks;
+    uint64_t m_hardlinks;
+    uint64_t m_copies;
+};
+
+#endif // CONTENTSTORE_H
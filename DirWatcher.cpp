@@ -0,0 +1,288 @@
+#include "DirWatcher.h"
+#include "UploadJournal.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <algorithm>
+
+static const uint32_t WATCH_MASK = IN_CREATE|IN_CLOSE_WRITE|IN_MOVED_FROM|IN_MOVED_TO|
+                                   IN_DELETE_SELF|IN_MOVE_SELF|IN_ONLYDIR;
+
+static std::string formatMask(uint32_t mask)
+{
+    std::string events;
+    if (mask & IN_CREATE)
+        events += ",CREATE";
+    if (mask & IN_CLOSE_WRITE)
+        events += ",CLOSE_WRITE";
+    if (mask & IN_MOVED_FROM)
+        events += ",MOVED_FROM";
+    if (mask & IN_MOVED_TO)
+        events += ",MOVED_TO";
+    if (mask & IN_ISDIR)
+        events += ",ISDIR";
+    return events.substr(1);
+}
+
+DirWatcher::DirWatcher(size_t queueMax, int coalesceMs)
+{
+    m_queueMax = (queueMax > 0) ? queueMax : 1;
+    m_coalesceMs = coalesceMs;
+    m_inotifyFd = -1;
+    m_readEvent = NULL;
+    m_flushTimer = NULL;
+    m_events = 0;
+    m_coalesced = 0;
+    m_notifications = 0;
+    m_overflows = 0;
+    m_sessions = 0;
+}
+
+DirWatcher::~DirWatcher()
+{
+    std::map<int, DirWatch*>::iterator it;
+    for (it = m_watches.begin(); it != m_watches.end(); it++)
+    {
+        std::list<WatchSubscription*>::iterator sub;
+        for (sub = it->second->subs.begin(); sub != it->second->subs.end(); sub++)
+            delete *sub;
+        delete it->second;
+    }
+
+    if (m_readEvent != NULL)
+        event_free(m_readEvent);
+    if (m_flushTimer != NULL)
+        event_free(m_flushTimer);
+    if (m_inotifyFd >= 0)
+        close(m_inotifyFd);
+}
+
+bool DirWatcher::start(event_base* base)
+{
+    m_inotifyFd = inotify_init1(IN_NONBLOCK|IN_CLOEXEC);
+    if (m_inotifyFd < 0)
+        return false;
+
+    m_readEvent = event_new(base, m_inotifyFd, EV_READ|EV_PERSIST, DirWatcher::readCallback, this);
+    m_flushTimer = evtimer_new(base, DirWatcher::flushCallback, this);
+    event_add(m_readEvent, NULL);
+    return true;
+}
+
+WatchSubscription* DirWatcher::subscribe(int dirFd, WatchCallback callback, void* arg)
+{
+    // 经由/proc/self/fd按已打开的目录加watch，路径解析沿用Vfs的检查，不会被符号链接带出根目录。
+    // 同一个inode再加一次时内核返回已有的wd，会话之间自然共用
+    char path[64];
+    sprintf(path, "/proc/self/fd/%d", dirFd);
+    int wd = inotify_add_watch(m_inotifyFd, path, WATCH_MASK);
+    if (wd < 0)
+        return NULL;
+
+    DirWatch* watch;
+    std::map<int, DirWatch*>::iterator it = m_watches.find(wd);
+    if (it != m_watches.end())
+    {
+        watch = it->second;
+    }
+    else
+    {
+        watch = new DirWatch;
+        watch->wd = wd;
+        m_watches[wd] = watch;
+    }
+
+    WatchSubscription* sub = new WatchSubscription;
+    sub->watch = watch;
+    sub->callback = callback;
+    sub->arg = arg;
+    sub->overflow = false;
+    watch->subs.push_back(sub);
+    m_sessions++;
+    return sub;
+}
+
+void DirWatcher::unsubscribe(WatchSubscription* sub)
+{
+    DirWatch* watch = sub->watch;
+    watch->subs.remove(sub);
+    delete sub;
+    m_sessions--;
+    if (!watch->subs.empty())
+        return;
+
+    // 最后一个会话离开时才撤掉watch；目录已经没了的watch内核已撤销
+    if (watch->wd >= 0)
+    {
+        inotify_rm_watch(m_inotifyFd, watch->wd);
+        m_watches.erase(watch->wd);
+    }
+    delete watch;
+}
+
+/*static*/ void DirWatcher::readCallback(evutil_socket_t fd, short event, void* arg)
+{
+    ((DirWatcher*)arg)->readEvents();
+}
+
+void DirWatcher::readEvents()
+{
+    char buf[64 * 1024] __attribute__((aligned(__alignof__(inotify_event))));
+    ssize_t length;
+    std::vector<DirWatch*> removed;
+    while ((length = read(m_inotifyFd, buf, sizeof(buf))) > 0)
+    {
+        for (char* p = buf; p < buf + length; p += sizeof(inotify_event) + ((inotify_event*)p)->len)
+        {
+            const inotify_event* ev = (const inotify_event*)p;
+            m_events++;
+
+            // 内核的事件队列满了，所有订阅都可能漏了事件
+            if (ev->mask & IN_Q_OVERFLOW)
+            {
+                std::map<int, DirWatch*>::iterator it;
+                std::list<WatchSubscription*>::iterator sub;
+                for (it = m_watches.begin(); it != m_watches.end(); it++)
+                {
+                    for (sub = it->second->subs.begin(); sub != it->second->subs.end(); sub++)
+                        (*sub)->overflow = true;
+                }
+                continue;
+            }
+
+            std::map<int, DirWatch*>::iterator it = m_watches.find(ev->wd);
+            if (it == m_watches.end())
+                continue;
+
+            if (ev->mask & (IN_DELETE_SELF|IN_MOVE_SELF|IN_IGNORED))
+            {
+                if (std::find(removed.begin(), removed.end(), it->second) == removed.end())
+                    removed.push_back(it->second);
+                continue;
+            }
+
+            std::string name = (ev->len > 0) ? ev->name : "";
+            if (!name.empty() && !UploadJournal::isTempName(name))
+                queueEvent(it->second, ev->mask, name);
+        }
+    }
+
+    for (size_t i = 0; i < removed.size(); i++)
+        removeWatch(removed[i]);
+
+    if (m_coalesceMs <= 0)
+    {
+        flush();
+    }
+    else if (!evtimer_pending(m_flushTimer, NULL))
+    {
+        timeval delay = { m_coalesceMs / 1000, (m_coalesceMs % 1000) * 1000 };
+        evtimer_add(m_flushTimer, &delay);
+    }
+}
+
+void DirWatcher::queueEvent(DirWatch* watch, uint32_t mask, const std::string& name)
+{
+    mask &= (IN_CREATE|IN_CLOSE_WRITE|IN_MOVED_FROM|IN_MOVED_TO|IN_ISDIR);
+    std::list<WatchSubscription*>::iterator it;
+    for (it = watch->subs.begin(); it != watch->subs.end(); it++)
+    {
+        WatchSubscription* sub = *it;
+        if (sub->overflow)
+            continue;
+
+        std::map<std::string, uint32_t>::iterator entry = sub->pending.find(name);
+        if (entry != sub->pending.end())
+        {
+            entry->second |= mask;
+            m_coalesced++;
+        }
+        else if (sub->order.size() >= m_queueMax)
+        {
+            // 客户端跟不上时不再攒，让它重新LIST
+            sub->overflow = true;
+            sub->order.clear();
+            sub->pending.clear();
+        }
+        else
+        {
+            sub->pending[name] = mask;
+            sub->order.push_back(name);
+        }
+    }
+}
+
+void DirWatcher::removeWatch(DirWatch* watch)
+{
+    // 内核随后会发IN_IGNORED，wd可能被新的watch重用，这里先从表里摘掉
+    inotify_rm_watch(m_inotifyFd, watch->wd);
+    m_watches.erase(watch->wd);
+    watch->wd = -1;
+
+    // 回调里调用者会退订，watch在最后一个订阅离开时释放
+    std::vector<WatchSubscription*> subs(watch->subs.begin(), watch->subs.end());
+    for (size_t i = 0; i < subs.size(); i++)
+        deliver(subs[i], true);
+}
+
+/*static*/ void DirWatcher::flushCallback(evutil_socket_t fd, short event, void* arg)
+{
+    ((DirWatcher*)arg)->flush();
+}
+
+void DirWatcher::flush()
+{
+    std::vector<WatchSubscription*> ready;
+    std::map<int, DirWatch*>::iterator it;
+    std::list<WatchSubscription*>::iterator sub;
+    for (it = m_watches.begin(); it != m_watches.end(); it++)
+    {
+        for (sub = it->second->subs.begin(); sub != it->second->subs.end(); sub++)
+        {
+            if (!(*sub)->order.empty() || (*sub)->overflow)
+                ready.push_back(*sub);
+        }
+    }
+
+    // 回调只会退订自己，其余的指针仍然有效
+    for (size_t i = 0; i < ready.size(); i++)
+        deliver(ready[i], false);
+}
+
+void DirWatcher::deliver(WatchSubscription* sub, bool removed)
+{
+    std::vector<std::string> lines;
+    for (size_t i = 0; i < sub->order.size(); i++)
+        lines.push_back(formatMask(sub->pending[sub->order[i]]) + " " + sub->order[i]);
+    sub->order.clear();
+    sub->pending.clear();
+
+    bool overflow = sub->overflow;
+    sub->overflow = false;
+    m_notifications += lines.size();
+    if (overflow)
+        m_overflows++;
+    sub->callback(lines, overflow, removed, sub->arg);
+}
+
+std::string DirWatcher::formatStats()
+{
+    char buf[256];
+    sprintf(buf,
+            " watch.dirs %llu\r\n"
+            " watch.sessions %llu\r\n"
+            " watch.events %llu\r\n"
+            " watch.coalesced %llu\r\n"
+            " watch.notifications %llu\r\n"
+            " watch.overflows %llu\r\n",
+            (unsigned long long)m_watches.size(),
+            (unsigned long long)m_sessions,
+            (unsigned long long)m_events,
+            (unsigned long long)m_coalesced,
+            (unsigned long long)m_notifications,
+            (unsigned long long)m_overflows);
+    return buf;
+}
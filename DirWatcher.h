@@ -0,0 +1,75 @@
+#ifndef DIRWATCHER_H
+#define DIRWATCHER_H
+
+#include <stdint.h>
+#include <string>
+#include <map>
+#include <list>
+#include <vector>
+#include <event2/event.h>
+
+struct DirWatch;
+
+// 一个会话对一个目录的订阅。lines为合并后的通知，每个名字一行："<事件,...> <名字>"；
+// overflow表示队列超限、中间的事件已丢弃；removed表示目录被删除或移走，订阅不会再有通知
+typedef void (*WatchCallback)(const std::vector<std::string>& lines, bool overflow, bool removed, void* arg);
+
+struct WatchSubscription
+{
+    DirWatch* watch;
+    WatchCallback callback;
+    void* arg;
+    std::vector<std::string> order;             // 待发的名字，按第一次出现的顺序
+    std::map<std::string, uint32_t> pending;    // 名字 -> 合并后的inotify事件
+    bool overflow;
+};
+
+struct DirWatch
+{
+    int wd;                 // 目录被删除后为-1
+    std::list<WatchSubscription*> subs;
+};
+
+// SITE WATCH的目录变化通知。所有会话共用一个inotify实例，同一个目录（按inode）只有一个watch，
+// 订阅它的会话各自排队。事件先攒coalesceMs毫秒再发，同一个名字的多次事件合并成一行；
+// 一个会话攒下的名字超过queueMax时丢掉并标记溢出，由调用者让客户端重新LIST。
+// 原子上传的临时文件不通知，发布时的改名以MOVED_TO出现。只在事件循环线程中使用
+class DirWatcher
+{
+public:
+    DirWatcher(size_t queueMax, int coalesceMs);
+    ~DirWatcher();
+
+    bool start(event_base* base);
+    // dirFd为已打开的目录，调用者随后可以关闭。失败时返回NULL并设置errno
+    WatchSubscription* subscribe(int dirFd, WatchCallback callback, void* arg);
+    void unsubscribe(WatchSubscription* sub);
+
+    std::string formatStats();
+
+protected:
+    static void readCallback(evutil_socket_t fd, short event, void* arg);
+    static void flushCallback(evutil_socket_t fd, short event, void* arg);
+    void readEvents();
+    void queueEvent(DirWatch* watch, uint32_t mask, const std::string& name);
+    void removeWatch(DirWatch* watch);
+    void flush();
+    void deliver(WatchSubscription* sub, bool removed);
+
+protected:
+    size_t m_queueMax;
+    int m_coalesceMs;
+    int m_inotifyFd;
+    event* m_readEvent;
+    event* m_flushTimer;
+    std::map<int, DirWatch*> m_watches;     // wd -> watch
+
+    // 统计
+    uint64_t m_events;          // 收到的inotify事件
+    uint64_t m_coalesced;       // 合并进已有行的事件
+    uint64_t m_notifications;   // 发出的通知行
+    uint64_t m_overflows;
+    uint64_t m_sessions;        // 当前的订阅数
+};
+
+#endif // DIRWATCHER_H
@@ -4,7 +4,179 @@
 #include <algorithm>
 #include <unistd.h>
 #include <ifaddrs.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <sched.h>
 #include "LocalFile.h"
+#include "MemoryVfs.h"
+#include "PathResolver.h"
+#include "AsciiConverter.h"
+#include "GlobMatcher.h"
+
+static uint64_t nowUsec()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// 原子上传的发布请求，落盘和改名完成后回到事件循环线程回复客户端
+class PublishRequest : public SyncRequest
+{
+public:
+    PublishRequest(FtpServer* server, FtpClient* client, uint64_t oldSize)
+        : m_server(server), m_socket(client->cmdSocket), m_sessionId(client->sessionId),
+          m_quota(client->quota), m_oldSize(oldSize), m_storSize(client->storSize), m_bytes(client->storBytes)
+    {
+    }
+
+    virtual void done()
+    {
+        m_server->finishPublish(m_socket, m_sessionId, ok, m_bytes, m_quota, ok ? m_oldSize : m_storSize);
+    }
+
+protected:
+    FtpServer* m_server;
+    evutil_socket_t m_socket;
+    uint64_t m_sessionId;
+    QuotaAccount* m_quota;
+    uint64_t m_oldSize;     // 被替换的旧文件长度，发布成功后释放
+    uint64_t m_storSize;    // 临时文件计入的用量，发布失败时退回
+    uint64_t m_bytes;
+};
+
+// 上传前拆开与去重存储共享的硬链接。大文件要整个复制，放到工作线程里，完成后重新执行原命令
+class LinkBreakTask : public ThreadTask
+{
+public:
+    LinkBreakTask(FtpServer* server, ContentStore* store, FtpClient* client, const ClientCommand& cmd,
+                  int dirFd, const std::string& name, uint64_t offset, uint64_t allocSize)
+        : m_server(server), m_store(store), m_socket(client->cmdSocket), m_sessionId(client->sessionId),
+          m_cmd(cmd), m_dirFd(dirFd), m_name(name), m_offset(offset), m_allocSize(allocSize), m_ok(false)
+    {
+    }
+    
+    ~LinkBreakTask()
+    {
+        close(m_dirFd);
+    }
+    
+    virtual void run()
+    {
+        m_ok = m_store->breakLink(m_dirFd, m_name);
+    }
+    
+    virtual void done()
+    {
+        m_server->finishLinkBreak(m_socket, m_sessionId, m_ok, m_cmd, m_offset, m_allocSize);
+    }
+    
+protected:
+    FtpServer* m_server;
+    ContentStore* m_store;
+    evutil_socket_t m_socket;
+    uint64_t m_sessionId;
+    ClientCommand m_cmd;
+    int m_dirFd;
+    std::string m_name;
+    uint64_t m_offset;      // 原命令前的REST和ALLO，重新执行时恢复
+    uint64_t m_allocSize;
+    bool m_ok;
+};
+
+// 去重上传收完后的提交：改名进存储，再链接到目标位置，跨文件系统时要复制，
+// 放到工作线程里，完成后与原子上传一样在finishPublish里回复
+class StoreCommitTask : public ThreadTask
+{
+public:
+    StoreCommitTask(FtpServer* server, ContentStore* store, FtpClient* client, const std::string& digest,
+                    int dirFd, const std::string& name, uint64_t oldSize)
+        : m_server(server), m_store(store), m_socket(client->cmdSocket), m_sessionId(client->sessionId),
+          m_tempFile(client->storTempFile), m_digest(digest), m_dirFd(dirFd), m_name(name),
+          m_quota(client->quota), m_oldSize(oldSize), m_storSize(client->storSize), m_bytes(client->storBytes),
+          m_ran(false), m_ok(false)
+    {
+    }
+
+    ~StoreCommitTask()
+    {
+        // 停服时还排着没执行的，临时文件不再有人认领
+        if (!m_ran)
+            m_store->discard(m_tempFile);
+        close(m_dirFd);
+    }
+
+    virtual void run()
+    {
+        m_ran = true;
+        m_ok = m_store->commit(m_tempFile, m_digest, m_dirFd, m_name, m_bytes);
+    }
+    
+    virtual void done()
+    {
+        m_server->finishPublish(m_socket, m_sessionId, m_ok, m_bytes, m_quota, m_ok ? m_oldSize : m_storSize);
+    }
+    
+protected:
+    FtpServer* m_server;
+    ContentStore* m_store;
+    evutil_socket_t m_socket;
+    uint64_t m_sessionId;
+    std::string m_tempFile;
+    std::string m_digest;
+    int m_dirFd;
+    std::string m_name;
+    QuotaAccount* m_quota;
+    uint64_t m_oldSize;
+    uint64_t m_storSize;
+    uint64_t m_bytes;
+    bool m_ran;
+    bool m_ok;
+};
+
+// 在工作线程中校验密码散列，结果回到事件循环线程处理
+class AuthTask : public ThreadTask
+{
+public:
+    AuthTask(FtpServer* server, FtpClient* client, const std::string& password,
+             const std::string& hash, const std::string& rootPath, const std::string& cacheKey)
+        : m_server(server), m_socket(client->cmdSocket), m_sessionId(client->sessionId),
+          m_authSeq(client->authSeq), m_password(password), m_hash(hash),
+          m_rootPath(rootPath), m_cacheKey(cacheKey), m_ok(false)
+    {
+    }
+    
+    virtual void run()
+    {
+        m_ok = UserDatabase::verifyPassword(m_password, m_hash);
+    }
+    
+    virtual void done()
+    {
+        m_server->finishPass(m_socket, m_sessionId, m_authSeq, m_ok, m_rootPath, m_cacheKey);
+    }
+    
+protected:
+    FtpServer* m_server;
+    evutil_socket_t m_socket;
+    uint64_t m_sessionId;
+    unsigned int m_authSeq;
+    std::string m_password;
+    std::string m_hash;
+    std::string m_rootPath;
+    std::string m_cacheKey;
+    bool m_ok;
+};
+
+// 命令通道输入队列的上限，超过后暂停从套接字读取
+#define CMD_INPUT_HIGH_WATER (64*1024)
+
+// SITE WATCH的会话命令通道积压超过这么多时按溢出处理
+#define WATCH_OUTPUT_LIMIT (64*1024)
+
+// 数据通道上传每次取出的字节数
+#define DATA_READ_SIZE (8*1024)
 
 // 若未登录，大部分命令请求要回显登录提示
 #define ENSURE_USER_LOGIN(client) \
@@ -27,12 +199,134 @@
         } \
     } while (0);
 
+#define ENSURE_SITE_ADMIN(client) \
+    do \
+    { \
+        if (m_siteAdmins.find(client->user) == m_siteAdmins.end()) \
+        { \
+            echo(client->cmdBev, "550 Permission denied."); \
+            return; \
+        } \
+    } while (0);
+
 
-FtpServer::FtpServer()
+FtpServer::FtpServer(const Config& config)
 {
-    m_cmdPort = 5021;
-    m_cmdTimeout = 60;
+    m_cmdPort = config.getInt("port", 5021);
+    m_cmdTimeout = config.getInt("cmd_timeout", 60);
 	m_logger = new Logger;
+    
+    m_contentStore = NULL;
+    if (config.getBool("dedup", false))
+        m_contentStore = new ContentStore(config.getString("dedup_store", "/var/lib/ftp_server/store"));
+    
+    m_usersFile = config.getString("users_file");
+    m_authThreads = config.getInt("auth_threads", 4);
+    m_authQueue = config.getInt("auth_queue", 1024);
+    m_authCacheSize = config.getInt("auth_cache_size", 10000);
+    m_authPool = NULL;
+    m_reloadEvent = NULL;
+    m_nextSessionId = 1;
+    
+    m_admission = new AdmissionControl(config.getInt("max_sessions", 0),
+                                       config.getInt("max_sessions_per_ip", 0),
+                                       config.getInt("max_sessions_per_user", 0));
+    m_acceptResumeTimer = NULL;
+    m_commitRetryTimer = NULL;
+    m_acceptBackoffMs = 0;
+    
+    m_transferChunkSize = config.getInt("transfer_chunk_size", 256*1024);
+    m_transferLowWatermark = config.getInt("transfer_low_watermark", m_transferChunkSize / 2);
+    m_asciiBuffer.resize(m_transferChunkSize);
+    MemoryTree::setDefaultLimit(config.getInt("mem_fs_limit", 256*1024*1024));
+    PathResolver::setCacheSize(config.getInt("path_cache_size", 16));
+
+    m_uploads = new UploadTracker;
+    m_cachePolicy = new CachePolicy(config.getInt("cache_stream_threshold", 64*1024*1024),
+                                    config.getInt("cache_readahead", 4*1024*1024),
+                                    config.getBool("cache_drop_uploads", false),
+                                    config.getString("cache_keep_paths"));
+    m_quota = new QuotaManager(config.getInt("quota_default", 0), config.getString("quota_file"),
+                               config.getString("quota_state"));
+    m_quotaTimer = NULL;
+    m_quotaSaveInterval = config.getInt("quota_save_interval", 60);
+    m_memory = new MemoryBudget(config.getInt("mem_global_limit", 512*1024*1024),
+                                config.getInt("mem_session_limit", 16*1024*1024),
+                                config.getInt("mem_defer_percent", 90));
+    m_memoryWakeup = NULL;
+    m_trace = new TransferTrace(config.getInt("trace_ring_size", 4096));
+    m_traceFile = config.getString("trace_file");
+    
+    // 逗号分隔的用户名
+    std::string admins = config.getString("site_admins");
+    size_t start = 0;
+    while (start < admins.size())
+    {
+        size_t end = admins.find(',', start);
+        if (end == std::string::npos)
+            end = admins.size();
+        
+        std::string name = admins.substr(start, end - start);
+        size_t first = name.find_first_not_of(" \t");
+        size_t last = name.find_last_not_of(" \t");
+        if (first != std::string::npos)
+            m_siteAdmins.insert(name.substr(first, last - first + 1));
+        start = end + 1;
+    }
+    m_walkPool = NULL;
+    m_walkThreads = config.getInt("walk_threads", 4);
+    m_walkQueue = config.getInt("walk_queue", 1024);
+    m_treeMaxDepth = config.getInt("tree_max_depth", 64);
+    m_treeMaxEntries = config.getInt("tree_max_entries", 2000000);
+    m_tarSendfileMin = config.getInt("tar_sendfile_min", 64*1024);
+    m_tarGzipLevel = config.getInt("tar_gzip_level", 1);
+    m_controlProfile = SocketTuning::load(config, "control_", true);
+    m_dataProfile = SocketTuning::load(config, "data_", false);
+    m_journal = NULL;
+    if (config.getBool("atomic_uploads", true))
+        m_journal = new UploadJournal(config.getString("upload_journal"), config.getBool("upload_fsync", true),
+                                      config.getInt("upload_resume_ttl", 86400), config.getInt("upload_syncfs_min", 8));
+    m_checkpointBytes = config.getInt("upload_checkpoint", 8*1024*1024);
+    m_hotManifest = NULL;
+    if (!config.getString("hot_manifest").empty())
+        m_hotManifest = new HotManifest(config.getString("hot_manifest"), config.getInt("hot_manifest_size", 1000),
+                                        config.getInt("warm_rate", 64*1024*1024), config.getInt("warm_file_max", 8*1024*1024));
+    m_manifestTimer = NULL;
+    m_manifestInterval = config.getInt("hot_manifest_interval", 300);
+    m_blockMarkerInterval = config.getInt("block_marker_interval", 0);
+    m_dirWatcher = new DirWatcher(config.getInt("watch_queue", 1000), config.getInt("watch_coalesce_ms", 100));
+    m_watchTimeout = config.getInt("watch_timeout", 300);
+    m_eventPriorities = config.getBool("event_priorities", true);
+    m_loopMaxCallbacks = config.getInt("loop_max_callbacks", 64);
+    m_dataReadBudget = config.getInt("data_read_budget", 0);
+    m_dataWriteBudget = config.getInt("data_write_budget", 0);
+    if (config.getBool("transfer_buffer_pool", true))
+        BufferPool::configure(m_transferChunkSize, config.getInt("transfer_pool_max", 256),
+                              config.getBool("transfer_buffer_hugepages", false));
+    m_directIoMin = BufferPool::enabled() ? config.getInt("direct_io_min", 0) : 0;
+    m_lowLatency = config.getBool("low_latency", false);
+    m_loopCpu = config.getInt("loop_cpu", -1);
+    m_spinMaxUsec = config.getInt("spin_usec", 200);
+    if (m_spinMaxUsec < 16)
+        m_spinMaxUsec = 16;
+    m_spinUsec = m_spinMaxUsec;
+    m_loopActivity = 0;
+    m_spinHits = 0;
+    m_spinMisses = 0;
+    m_loopBlocks = 0;
+    
+    m_recorder = NULL;
+    if (!config.getString("capture_file").empty())
+        m_recorder = new SessionRecorder(config.getString("capture_file"), config.getBool("capture_passwords", false));
+    
+    m_upgradePath = config.getString("upgrade_socket");
+    m_takeover = false;
+    m_upgradeListenFd = -1;
+    m_upgradeListenEvent = NULL;
+    m_handoffFd = -1;
+    m_draining = false;
+    m_takeoverFd = -1;
+    m_takeoverEvent = NULL;
 
     initUserConfigs();
     initCmdMaps();
@@ -41,6 +335,14 @@ FtpServer::FtpServer()
 FtpServer::~FtpServer()
 {
     delete m_logger;
+    delete m_contentStore;
+    delete m_uploads;
+    delete m_cachePolicy;
+    delete m_quota;
+    delete m_memory;
+    delete m_trace;
+    delete m_admission;
+    delete m_recorder;
     clearUserConfigs();
 }
 
@@ -61,6 +363,7 @@ void FtpServer::initCmdMaps()
     INSERT_CMD_MAPS("CDUP", CDUP,   &FtpServer::processCdup)
     INSERT_CMD_MAPS("PWD",  PWD,    &FtpServer::processPwd)
     INSERT_CMD_MAPS("PASV", PASV,   &FtpServer::processPasv)
+    INSERT_CMD_MAPS("MODE", MODE,   &FtpServer::processMode)
     INSERT_CMD_MAPS("LIST", LIST,   &FtpServer::processList)
     INSERT_CMD_MAPS("NLST", NLST,   &FtpServer::processNlst)
     INSERT_CMD_MAPS("RETR", RETR,   &FtpServer::processRetr)
@@ -71,9 +374,19 @@ void FtpServer::initCmdMaps()
     INSERT_CMD_MAPS("DELE", DELE,   &FtpServer::processDele)
     INSERT_CMD_MAPS("RNFR", RNFR,   &FtpServer::processRnfr)
     INSERT_CMD_MAPS("RNTO", RNTO,   &FtpServer::processRnto)
+    INSERT_CMD_MAPS("REST", REST,   &FtpServer::processRest)
+    INSERT_CMD_MAPS("ALLO", ALLO,   &FtpServer::processAllo)
     INSERT_CMD_MAPS("ABOR", ABOR,   &FtpServer::processAbor)
     INSERT_CMD_MAPS("NOOP", NOOP,   &FtpServer::processNoop)
+    INSERT_CMD_MAPS("SITE", SITE,   &FtpServer::processSite)
     INSERT_CMD_MAPS("QUIT", QUIT,   &FtpServer::processQuit)
+    
+    m_siteFuncMap.insert(std::make_pair("STATS", &FtpServer::processSiteStats));
+    m_siteFuncMap.insert(std::make_pair("TREE", &FtpServer::processSiteTree));
+    m_siteFuncMap.insert(std::make_pair("QUOTA", &FtpServer::processSiteQuota));
+    m_siteFuncMap.insert(std::make_pair("MEM", &FtpServer::processSiteMem));
+    m_siteFuncMap.insert(std::make_pair("TRACE", &FtpServer::processSiteTrace));
+    m_siteFuncMap.insert(std::make_pair("WATCH", &FtpServer::processSiteWatch));
 }
 
 ClientOperation FtpServer::matchCmdOp(std::string cmd)
@@ -95,72 +408,288 @@ ProcessFunc FtpServer::matchProcessFunc(ClientOperation op)
     return it->second;
 }
 
-UserConfig* FtpServer::findUserConfig(const std::string& user)
+const UserConfig* FtpServer::findUserConfig(const std::string& user)
 {
-    std::map<std::string, UserConfig*>::iterator it = m_userConfigMap.find(user);
-    if (it == m_userConfigMap.end())
-        return NULL;
-    
-    return it->second;
+    return m_userDb->find(user);
 }
 
 void FtpServer::initUserConfigs()
 {
-    UserConfig* cfg = new UserConfig;
-    cfg->password = "test";
-    cfg->rootPath = "/home";
-    m_userConfigMap.insert(std::make_pair("test", cfg));
+    m_userDb = new UserDatabase;
+    if (!m_usersFile.empty())
+    {
+        if (!m_userDb->load(m_usersFile))
+        {
+            std::string msg = "cannot load user file " + m_usersFile;
+            log(msg);
+        }
+        return;
+    }
+    
+    // 未配置用户文件时保留内置的测试用户
+    UserConfig cfg;
+    cfg.password = "test";
+    cfg.rootPath = "/home";
+    m_userDb->addUser("test", cfg);
 }
 
 void FtpServer::clearUserConfigs()
 {
-    std::map<std::string, UserConfig*>::iterator it = m_userConfigMap.begin();
-    for (; it != m_userConfigMap.end(); it++)
-        delete it->second;
-    
-    m_userConfigMap.clear();
+    delete m_userDb;
+    m_userDb = NULL;
 }
 
 int FtpServer::start()
 {
-    m_eventBase = event_base_new();
+    if (m_contentStore != NULL && !m_contentStore->init())
+        return -1;
+    
+    if (m_recorder != NULL && !m_recorder->open())
+        return -1;
+    
+    // 数据回调每处理m_loopMaxCallbacks个就回头取一次新事件，到了的命令在下一轮先处理，
+    // 不必排在成千上万个数据回调后面
+    event_config* eventConfig = event_config_new();
+    if (m_eventPriorities && m_loopMaxCallbacks > 0)
+        event_config_set_max_dispatch_interval(eventConfig, NULL, m_loopMaxCallbacks, PriorityData);
+    m_eventBase = event_base_new_with_config(eventConfig);
+    event_config_free(eventConfig);
     if (m_eventBase == NULL)
         return -1;
+    if (m_eventPriorities)
+        event_base_priority_init(m_eventBase, PriorityCount);
+    m_memoryWakeup = event_new(m_eventBase, -1, 0, FtpServer::memoryWakeupCallback, this);
 
-    sockaddr_in addr;
-    memset(&addr, 0, sizeof(addr));
-	addr.sin_family = AF_INET;
-    addr.sin_addr.s_addr = htonl(INADDR_ANY);
-	addr.sin_port = htons(m_cmdPort);
-    
-    m_cmdListener = evconnlistener_new_bind(m_eventBase, FtpServer::listenCallback, 
-        this, LEV_OPT_REUSEABLE|LEV_OPT_CLOSE_ON_FREE, -1,
-	    (struct sockaddr*)&addr, sizeof(addr));
+    if (m_takeover)
+    {
+        // 从旧进程接收监听套接字，会话随后陆续交接过来
+        if (!takeOver())
+            return -1;
+    }
+    else
+    {
+        sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_ANY);
+        addr.sin_port = htons(m_cmdPort);
+        
+        m_cmdListener = evconnlistener_new_bind(m_eventBase, FtpServer::listenCallback, 
+            this, LEV_OPT_REUSEABLE|LEV_OPT_CLOSE_ON_FREE, -1,
+            (struct sockaddr*)&addr, sizeof(addr));
+    }
     if (m_cmdListener == NULL)
         return -1;
+    SocketTuning::applyListener(evconnlistener_get_fd(m_cmdListener), m_controlProfile);
+    evconnlistener_set_error_cb(m_cmdListener, FtpServer::acceptErrorCallback);
+    m_acceptResumeTimer = evtimer_new(m_eventBase, FtpServer::acceptResumeCallback, this);
+    m_commitRetryTimer = evtimer_new(m_eventBase, FtpServer::commitRetryCallback, this);
+    
+    m_authPool = new ThreadPool(m_authThreads, m_authQueue);
+    if (!m_authPool->start(m_eventBase))
+        return -1;
+
+    m_walkPool = new ThreadPool(m_walkThreads, m_walkQueue);
+    if (!m_walkPool->start(m_eventBase))
+        return -1;
+
+    if (m_journal != NULL && !m_journal->open(m_eventBase))
+    {
+        std::string msg = "cannot open upload journal";
+        log(msg);
+        return -1;
+    }
+
+    if (!m_quota->load())
+    {
+        std::string msg = "cannot load quota file";
+        log(msg);
+        return -1;
+    }
+    m_quotaTimer = event_new(m_eventBase, -1, EV_PERSIST, FtpServer::quotaTimerCallback, this);
+    timeval saveInterval = { m_quotaSaveInterval, 0 };
+    event_add(m_quotaTimer, &saveInterval);
+    
+    m_reloadEvent = evsignal_new(m_eventBase, SIGHUP, FtpServer::reloadSignalCallback, this);
+    event_add(m_reloadEvent, NULL);
+
+    if (!m_dirWatcher->start(m_eventBase))
+    {
+        std::string msg = "cannot initialize inotify, SITE WATCH disabled";
+        log(msg);
+        delete m_dirWatcher;
+        m_dirWatcher = NULL;
+    }
+
+    // 预热在后台按时间片进行，监听已经就绪，新连接不用等它
+    if (m_hotManifest != NULL)
+    {
+        if (!m_hotManifest->load())
+        {
+            std::string msg = "cannot load hot manifest";
+            log(msg);
+        }
+        m_hotManifest->startWarming(m_eventBase, m_walkPool);
+        m_manifestTimer = event_new(m_eventBase, -1, EV_PERSIST, FtpServer::manifestTimerCallback, this);
+        timeval manifestInterval = { m_manifestInterval, 0 };
+        event_add(m_manifestTimer, &manifestInterval);
+    }
+    
+    if (!m_upgradePath.empty() && !startUpgradeListener())
+    {
+        std::string msg = "cannot listen on upgrade socket " + m_upgradePath;
+        log(msg);
+    }
 
-    event_base_dispatch(m_eventBase);
+    runLoop();
+    
+    event_free(m_reloadEvent);
+    m_reloadEvent = NULL;
+    event_free(m_quotaTimer);
+    m_quotaTimer = NULL;
+    m_quota->save();
+    if (m_manifestTimer != NULL)
+    {
+        event_free(m_manifestTimer);
+        m_manifestTimer = NULL;
+    }
+    if (m_hotManifest != NULL)
+        m_hotManifest->save();
+    event_free(m_memoryWakeup);
+    m_memoryWakeup = NULL;
+    event_free(m_acceptResumeTimer);
+    m_acceptResumeTimer = NULL;
+    event_free(m_commitRetryTimer);
+    m_commitRetryTimer = NULL;
+    while (!m_commitBacklog.empty())
+    {
+        delete m_commitBacklog.front();
+        m_commitBacklog.pop_front();
+    }
+    if (m_upgradeListenEvent != NULL)
+    {
+        event_free(m_upgradeListenEvent);
+        close(m_upgradeListenFd);
+    }
+    if (m_takeoverEvent != NULL)
+    {
+        event_free(m_takeoverEvent);
+        close(m_takeoverFd);
+    }
+    delete m_authPool;
+    m_authPool = NULL;
+    delete m_walkPool;
+    m_walkPool = NULL;
+    delete m_journal;
+    m_journal = NULL;
+    delete m_hotManifest;
+    m_hotManifest = NULL;
+    delete m_dirWatcher;
+    m_dirWatcher = NULL;
     evconnlistener_free(m_cmdListener);
 	event_base_free(m_eventBase);
     
     return 0;
 }
 
+void FtpServer::runLoop()
+{
+    if (!m_lowLatency)
+    {
+        event_base_dispatch(m_eventBase);
+        return;
+    }
+
+    // 只绑事件循环线程，线程池在这之前已经创建，不受影响
+    if (m_loopCpu >= 0)
+    {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(m_loopCpu, &set);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+        {
+            std::string msg = "cannot pin event loop to cpu";
+            log(msg);
+        }
+    }
+
+    // 每次被唤醒后先非阻塞地轮询，空转窗口内命令通道又有数据就顺延，整个窗口都没有才回到
+    // epoll_wait睡眠，省掉一问一答之间的唤醒延迟。等到过命令的窗口加倍，白转的减半
+    for (;;)
+    {
+        uint64_t activity = m_loopActivity;
+        uint64_t deadline = nowUsec() + m_spinUsec;
+        bool caught = false;
+        while (nowUsec() < deadline)
+        {
+            if (event_base_loop(m_eventBase, EVLOOP_NONBLOCK) != 0 ||
+                event_base_got_exit(m_eventBase) || event_base_got_break(m_eventBase))
+                return;
+            if (m_loopActivity != activity)
+            {
+                activity = m_loopActivity;
+                caught = true;
+                deadline = nowUsec() + m_spinUsec;
+            }
+        }
+
+        if (caught)
+        {
+            m_spinHits++;
+            m_spinUsec = std::min(m_spinUsec * 2, m_spinMaxUsec);
+        }
+        else
+        {
+            m_spinMisses++;
+            m_spinUsec = std::max(m_spinUsec / 2, m_spinMaxUsec / 16);
+        }
+
+        m_loopBlocks++;
+        if (event_base_loop(m_eventBase, EVLOOP_ONCE) != 0 ||
+            event_base_got_exit(m_eventBase) || event_base_got_break(m_eventBase))
+            return;
+    }
+}
+
 /*static*/ void FtpServer::listenCallback(evconnlistener* listener, evutil_socket_t fd,
         sockaddr* address, int socklen, void* arg)
 
 {
     FtpServer* thisPtr = (FtpServer*)arg;
-    event_base* base = (event_base*)thisPtr->m_eventBase;
-    bufferevent* bev = bufferevent_socket_new(base, fd, BEV_OPT_CLOSE_ON_FREE);
+    uint64_t acceptTime = nowUsec();
+    thisPtr->m_acceptBackoffMs = 0;
+    
+    // 超出上限时直接回静态的421并关闭，不创建bufferevent和会话
+    in_addr_t ip = ((sockaddr_in*)address)->sin_addr.s_addr;
+    if (!thisPtr->m_admission->admit(ip))
+    {
+        static const char reject[] = "421 Too many connections, try again later.\r\n";
+        send(fd, reject, sizeof(reject)-1, MSG_DONTWAIT|MSG_NOSIGNAL);
+        evutil_closesocket(fd);
+        return;
+    }
     
-    FtpClient* client = thisPtr->addClient(fd);
-    client->serverPtr = thisPtr;
+    FtpClient* client = thisPtr->createSession(fd, *((sockaddr_in*)address));
+    thisPtr->echo(client->cmdBev, "220 Hello.");
+    thisPtr->m_admission->recordAcceptLatency(nowUsec() - acceptTime);
+}
+
+FtpClient* FtpServer::createSession(evutil_socket_t fd, const sockaddr_in& addr)
+{
+    SocketTuning::applyAccepted(fd, m_controlProfile);
+    bufferevent* bev = bufferevent_socket_new(m_eventBase, fd, BEV_OPT_CLOSE_ON_FREE);
+    if (m_eventPriorities)
+        bufferevent_priority_set(bev, PriorityControl);
+    
+    FtpClient* client = addClient(fd);
+    client->serverPtr = this;
     client->cmdBev = bev;
-    client->addr = *((sockaddr_in*)address);
+    client->addr = addr;
     
     // 命令通道超时检测
-    client->cmdTimer = event_new(base, -1, EV_PERSIST, FtpServer::cmdTimerCallback, client);
+    client->cmdTimer = event_new(m_eventBase, -1, EV_PERSIST, FtpServer::cmdTimerCallback, client);
+    if (m_eventPriorities)
+        event_priority_set(client->cmdTimer, PriorityControl);
     struct timeval tv;
     evutil_timerclear(&tv);
 	tv.tv_sec = 1;
@@ -169,7 +698,47 @@ int FtpServer::start()
     bufferevent_setcb(bev, FtpServer::readCallback, NULL, FtpServer::eventCallback, client);
     bufferevent_enable(bev, EV_READ|EV_WRITE|EV_PERSIST);
 
-    thisPtr->echo(client->cmdBev, "220 Hello.");
+    // 命令每次只取一段，输入队列用高水位封顶而不计入会话，否则暂停读取后它永远降不下来
+    bufferevent_setwatermark(bev, EV_READ, 0, CMD_INPUT_HIGH_WATER);
+    attachBuffers(client, bev, false);
+    
+    m_admission->addSession(addr.sin_addr.s_addr);
+    if (m_recorder != NULL)
+        m_recorder->recordOpen(client->sessionId);
+    
+    return client;
+}
+
+/*static*/ void FtpServer::acceptErrorCallback(evconnlistener* listener, void* arg)
+{
+    FtpServer* thisPtr = (FtpServer*)arg;
+    int err = EVUTIL_SOCKET_ERROR();
+    thisPtr->m_admission->recordAcceptError();
+    
+    if (err != EMFILE && err != ENFILE && err != ENOBUFS && err != ENOMEM)
+        return;
+    
+    // 文件描述符或内存耗尽：暂停监听，否则监听套接字会一直可读而空转。退避时间逐次翻倍
+    evconnlistener_disable(listener);
+    thisPtr->m_admission->recordListenerPause();
+    if (thisPtr->m_acceptBackoffMs == 0)
+        thisPtr->m_acceptBackoffMs = 10;
+    else if (thisPtr->m_acceptBackoffMs < 1000)
+        thisPtr->m_acceptBackoffMs *= 2;
+    
+    struct timeval tv;
+    tv.tv_sec = thisPtr->m_acceptBackoffMs / 1000;
+    tv.tv_usec = (thisPtr->m_acceptBackoffMs % 1000) * 1000;
+    evtimer_add(thisPtr->m_acceptResumeTimer, &tv);
+    
+    std::string msg = "accept failed: " + std::string(evutil_socket_error_to_string(err)) + ", listener paused";
+    thisPtr->log(msg);
+}
+
+/*static*/ void FtpServer::acceptResumeCallback(evutil_socket_t fd, short event, void* arg)
+{
+    FtpServer* thisPtr = (FtpServer*)arg;
+    evconnlistener_enable(thisPtr->m_cmdListener);
 }
 
 /*static*/ void FtpServer::readCallback(bufferevent* bev, void* arg)
@@ -186,11 +755,18 @@ int FtpServer::start()
     {
         // 计时归零
         client->cmdTickCount = 0;
+        serverPtr->m_loopActivity++;
         std::string request(buf, count);
 
         if (isCompleteCommand(request))
         {
             ClientCommand cmd = serverPtr->parseClientCommand(request);
+            if (serverPtr->m_recorder != NULL)
+                serverPtr->m_recorder->recordCommand(client->sessionId, request);
+
+            // 任何命令都结束正在进行的SITE WATCH，回复不会与通知交错
+            if (client->watch != NULL)
+                serverPtr->endWatch(client, "226 Watch ended.");
             ProcessFunc func = serverPtr->matchProcessFunc(cmd.op);
             (serverPtr->*func)(client, cmd);
         }
@@ -246,11 +822,45 @@ FtpClient* FtpServer::addClient(evutil_socket_t socket)
 {
     FtpClient* client = new FtpClient;
     client->cmdSocket = socket;
+    client->sessionId = m_nextSessionId++;
+    client->authPending = false;
+    client->authSeq = 0;
     client->pasvListener = NULL;
     client->pasvsBev = NULL;
     client->hasPendingCmd = false;
     client->login = false;
+    client->vfs = NULL;
     client->type = TypeI;
+    client->blockMode = false;
+    BlockMode::resetReader(&client->blockReader);
+    client->nextMarker = 0;
+    client->storFile = NULL;
+    client->storHash = NULL;
+    client->journal = NULL;
+    client->checkpointAt = 0;
+    client->storPublishing = false;
+    client->storPreparing = false;
+    client->watch = NULL;
+    client->watchTicks = 0;
+    client->storBytes = 0;
+    client->asciiCr = false;
+    client->retrFile = NULL;
+    client->sentBytes = 0;
+    client->restOffset = 0;
+    client->alloSize = 0;
+    client->transferOffset = 0;
+    client->upload = NULL;
+    client->retrCache.active = false;
+    client->storCache.active = false;
+    client->quota = NULL;
+    client->storSize = 0;
+    m_memory->init(&client->mem);
+    TransferTrace::reset(&client->trace);
+    client->transferState = TransferIdle;
+    client->listMode = ListPlain;
+    client->walker = NULL;
+    client->archive = ArchiveNone;
+    client->tar = NULL;
     
     m_clients.insert(std::make_pair(socket, client));
     return client;
@@ -264,31 +874,57 @@ void FtpServer::removeClient(FtpClient* client)
     
     if (client->cmdBev != NULL)
     {
+        detachBuffers(client, client->cmdBev);
         bufferevent_free(client->cmdBev);
         client->cmdBev = NULL;
     }
+
+    closeDataConnection(client);
+    m_deferred.remove(client);
+    m_stalled.remove(client);
     
-    if (client->pasvListener != NULL)
+    if (client->cmdTimer != NULL)
     {
-        evconnlistener_free(client->pasvListener);
-        client->pasvListener = NULL;
+        evtimer_del(client->cmdTimer);
+        event_free(client->cmdTimer);
+        client->cmdTimer = NULL;
     }
     
-    if (client->pasvsBev != NULL)
+    if (client->storFile != NULL)
+        abortStor(client);
+    
+    if (client->retrFile != NULL)
+        closeRetrFile(client);
+
+    if (client->watch != NULL)
     {
-        bufferevent_free(client->pasvsBev);
-        client->pasvsBev = NULL;
+        m_dirWatcher->unsubscribe(client->watch);
+        client->watch = NULL;
     }
-    
-    if (client->cmdTimer != NULL)
+
+    if (client->walker != NULL)
     {
-        evtimer_del(client->cmdTimer);
-        event_free(client->cmdTimer);
-        client->cmdTimer = NULL;
+        client->walker->cancel();
+        client->walker = NULL;
     }
+
+    delete client->tar;
+    client->tar = NULL;
+
+    if (m_recorder != NULL)
+        m_recorder->recordClose(client->sessionId);
+
+    delete client->vfs;
+    client->vfs = NULL;
+    
+    m_admission->removeSession(client->addr.sin_addr.s_addr);
+    if (client->login)
+        m_admission->removeUser(client->user);
     
     delete it->second;
     m_clients.erase(it);
+    
+    checkDrained();
 }
 
 void FtpServer::processUnknown(FtpClient* client, ClientCommand cmd)
@@ -303,7 +939,12 @@ void FtpServer::processAuth(FtpClient* client, ClientCommand cmd)
 
 void FtpServer::processUser(FtpClient* client, ClientCommand cmd)
 {
+    if (client->login)
+        m_admission->removeUser(client->user);
+    
     client->login = false;
+    client->authPending = false;
+    client->authSeq++;
     client->user = cmd.data;
     echo(client->cmdBev, "331 Password required for " + client->user + ".");
 }
@@ -316,30 +957,122 @@ void FtpServer::processPass(FtpClient* client, ClientCommand cmd)
         return;
     }
     
+    // 重复登录会再占一个会话名额，而断开时只退还一个
+    if (client->login)
+    {
+        echo(client->cmdBev, "503 Already logged in.");
+        return;
+    }
+    
     if (cmd.data.empty())
     {
         echo(client->cmdBev, "530 User cannot log in.");
         return;
     }
     
-    UserConfig* cfg = findUserConfig(client->user);
+    if (client->authPending)
+    {
+        echo(client->cmdBev, "503 Login in progress.");
+        return;
+    }
+    
+    const UserConfig* cfg = findUserConfig(client->user);
     if (cfg == NULL)
     {
         echo(client->cmdBev, "530 User cannot log in.");
         return;
     }
     
-    if (cmd.data == cfg->password)
+    // 该用户会话数已满就不必再花时间算散列
+    if (!m_admission->admitUser(client->user))
     {
-        echo(client->cmdBev, "230 User logged in.");
-        client->login = true;
-        client->rootPath = cfg->rootPath;
-        client->curRelativePath = "/";
+        echo(client->cmdBev, "421 Too many sessions for this user.", true);
+        removeClient(client);
+        return;
     }
-    else
+    
+    // 明文密码（内置用户）直接比较
+    if (cfg->password.empty() || cfg->password[0] != '$')
+    {
+        if (UserDatabase::verifyPassword(cmd.data, cfg->password))
+            loginSucceeded(client, cfg->rootPath);
+        else
+            echo(client->cmdBev, "530 User cannot log in.");
+        return;
+    }
+    
+    // 缓存里只存摘要，不保存明文密码；散列变了键自然失效
+    std::string material = client->user + '\0' + cmd.data + '\0' + cfg->password;
+    std::string cacheKey = Sha256::hex(material.c_str(), material.size());
+    if (m_authCache.find(cacheKey) != m_authCache.end())
+    {
+        loginSucceeded(client, cfg->rootPath);
+        return;
+    }
+    
+    client->authSeq++;
+    AuthTask* task = new AuthTask(this, client, cmd.data, cfg->password, cfg->rootPath, cacheKey);
+    if (!m_authPool->submit(task))
+    {
+        delete task;
+        echo(client->cmdBev, "421 Too many pending logins, try again later.", true);
+        removeClient(client);
+        return;
+    }
+    
+    client->authPending = true;
+}
+
+void FtpServer::finishPass(evutil_socket_t socket, uint64_t sessionId, unsigned int authSeq,
+                           bool ok, const std::string& rootPath, const std::string& cacheKey)
+{
+    std::map<evutil_socket_t, FtpClient*>::iterator it = m_clients.find(socket);
+    if (it == m_clients.end())
+        return;
+    
+    // 会话已经断开或重新发了USER，结果作废
+    FtpClient* client = it->second;
+    if (client->sessionId != sessionId || client->authSeq != authSeq || !client->authPending)
+        return;
+    
+    client->authPending = false;
+    if (!ok)
     {
         echo(client->cmdBev, "530 User cannot log in.");
+        return;
+    }
+    
+    if (m_authCacheSize > 0 && m_authCache.insert(cacheKey).second)
+    {
+        m_authCacheOrder.push_back(cacheKey);
+        if (m_authCacheOrder.size() > m_authCacheSize)
+        {
+            m_authCache.erase(m_authCacheOrder.front());
+            m_authCacheOrder.pop_front();
+        }
     }
+    
+    loginSucceeded(client, rootPath);
+}
+
+void FtpServer::loginSucceeded(FtpClient* client, const std::string& rootPath)
+{
+    // 异步校验期间同一用户可能已有其他会话登录，再检查一次
+    if (!m_admission->admitUser(client->user))
+    {
+        echo(client->cmdBev, "421 Too many sessions for this user.", true);
+        removeClient(client);
+        return;
+    }
+    
+    m_admission->addUser(client->user);
+    echo(client->cmdBev, "230 User logged in.");
+    client->login = true;
+    client->rootPath = rootPath;
+    client->curRelativePath = "/";
+    delete client->vfs;
+    client->vfs = Vfs::create(rootPath);
+    client->quota = client->vfs->hostPath("/").empty() ? NULL : m_quota->account(rootPath, m_walkPool);
 }
 
 void FtpServer::processSyst(FtpClient* client, ClientCommand cmd)
@@ -349,26 +1082,15 @@ void FtpServer::processSyst(FtpClient* client, ClientCommand cmd)
 
 void FtpServer::processFeat(FtpClient* client, ClientCommand cmd)
 {
-    echo(client->cmdBev, "211-Extended features supported:\r\n UTF8\r\n211 END");
+    echo(client->cmdBev, "211-Extended features supported:\r\n UTF8\r\n REST STREAM\r\n211 END");
 }
 
 void FtpServer::processCwd(FtpClient* client, ClientCommand cmd)
 {
     ENSURE_USER_LOGIN(client)
 
-    std::string newRelPath;
-    if (cmd.data.size() > 0 && cmd.data[0] == '/')  // 切换到绝对路径
-        newRelPath = cmd.data;
-    else    // 相对路径
-    {
-        if (client->curRelativePath == "/")
-            newRelPath = client->curRelativePath + cmd.data;
-        else
-            newRelPath = client->curRelativePath + "/" + cmd.data;
-    }
-    
-    std::string newDir = client->rootPath + newRelPath;
-    if (LocalFile::exist(newDir))
+    std::string newRelPath = generateAbsoluteTarget(client, cmd.data);
+    if (client->vfs->changeDir(newRelPath))
     {
         client->curRelativePath = newRelPath;
         echo(client->cmdBev, "250 CWD command successful.");
@@ -384,6 +1106,7 @@ void FtpServer::processCdup(FtpClient* client, ClientCommand cmd)
     ENSURE_USER_LOGIN(client)
     
     client->curRelativePath = LocalFile::getUpDir(client->curRelativePath);
+    client->vfs->changeDir(client->curRelativePath);
     echo(client->cmdBev, "250 CDUP command successful.");
 }
 
@@ -415,12 +1138,53 @@ void FtpServer::processType(FtpClient* client, ClientCommand cmd)
     }
 }
 
-void FtpServer::processPasv(FtpClient* client, ClientCommand cmd)
+void FtpServer::processMode(FtpClient* client, ClientCommand cmd)
 {
     ENSURE_USER_LOGIN(client)
+    ENSURE_PARAMETERS(cmd)
     
-    evconnlistener* pasvListener = createListenerForPasv(FtpServer::pasvListenCallback, client);
-    client->pasvListener = pasvListener;
+    if (client->transferState != TransferIdle || client->storFile != NULL)
+    {
+        echo(client->cmdBev, "503 Bad sequence of commands.");
+        return;
+    }
+    
+    if (cmd.data == "s" || cmd.data == "S")
+    {
+        // 流模式靠关闭连接表示文件结束，块模式留下的连接不能再用
+        if (client->blockMode)
+            closeDataConnection(client);
+        client->blockMode = false;
+        echo(client->cmdBev, "200 Mode set to S.");
+    }
+    else if (cmd.data == "b" || cmd.data == "B")
+    {
+        client->blockMode = true;
+        echo(client->cmdBev, "200 Mode set to B.");
+    }
+    else if (cmd.data == "c" || cmd.data == "C")
+    {
+        echo(client->cmdBev, "504 Command not implemented for that parameter.");
+    }
+    else
+    {
+        echo(client->cmdBev, "501 Parameter error.");
+    }
+}
+
+void FtpServer::processPasv(FtpClient* client, ClientCommand cmd)
+{
+    ENSURE_USER_LOGIN(client)
+    
+    // 块模式留下的数据连接，或上一个PASV还没连上的监听，换成新的
+    if (client->transferState == TransferIdle && client->storFile == NULL)
+        closeDataConnection(client);
+
+    TransferTrace::reset(&client->trace);
+    TransferTrace::mark(&client->trace, MarkPasv);
+    evconnlistener* pasvListener = createListenerForPasv(FtpServer::pasvListenCallback, client);
+    client->pasvListener = pasvListener;
+    TransferTrace::mark(&client->trace, MarkPasvReady);
 
     // 回显服务端IP地址和可用端口
     std::string address = formatPasvAddress(pasvListener);
@@ -489,7 +1253,10 @@ evconnlistener* FtpServer::createListenerForPasv(evconnlistener_cb callback, Ftp
             client, LEV_OPT_REUSEABLE|LEV_OPT_CLOSE_ON_FREE, -1,
             (struct sockaddr*)&addr, sizeof(addr));
         if (pasvListener != NULL)
+        {
+            SocketTuning::applyListener(evconnlistener_get_fd(pasvListener), m_dataProfile);
             return pasvListener;
+        }
     }
     
     return NULL;
@@ -499,323 +1266,2070 @@ void FtpServer::processList(FtpClient* client, ClientCommand cmd)
 {
     ENSURE_USER_LOGIN(client)
     
-    echo(client->cmdBev, "150 Opening BINARY mode data connection.");
-    
-    std::string target = generateAbsoluteTarget(client, cmd.data);
-    if (client->pasvsBev != NULL)
-    {
-        // 客户端先连上了PASV数据通道，直接回写目录
-        echoList(client, target);
-    }
-    else
+    TransferTrace::begin(&client->trace, "LIST");
+
+    // 跳过ls风格的选项，只认-R
+    client->listMode = ListPlain;
+    std::string arg = cmd.data;
+    while (!arg.empty() && arg[0] == '-')
     {
-        // 客户端还没有连上PASV数据通道，先记录，一旦连上即回显
-        client->hasPendingCmd = true;
-        client->pendingCmd = cmd;
-        client->pendingAccessFile = target;
+        size_t end = arg.find(' ');
+        if (arg.substr(0, end).find('R') != std::string::npos)
+            client->listMode = ListRecursive;
+        size_t next = (end == std::string::npos) ? end : arg.find_first_not_of(' ', end);
+        arg = (next == std::string::npos) ? "" : arg.substr(next);
     }
-}
-
-void FtpServer::echoList(FtpClient* client, const std::string& dir)
-{
-    std::string dirRes = LocalFile::getDirList(dir);
-    echo(client->pasvsBev, dirRes, true);   // 立即发送，不通过libevent的缓存队列
-    echo(client->cmdBev, "226 Transfer complete.");
     
-    bufferevent_free(client->pasvsBev);
-    client->pasvsBev = NULL;
-    evconnlistener_free(client->pasvListener);
-    client->pasvListener = NULL;
-}
-
-void FtpServer::processNlst(FtpClient* client, ClientCommand cmd)
-{
-    ENSURE_USER_LOGIN(client)
+    echo(client->cmdBev, "150 Opening BINARY mode data connection.");
+    
+    // 客户端先连上了PASV数据通道则直接回写目录，否则先记录，一旦连上即回显
+    client->hasPendingCmd = true;
+    client->pendingCmd = cmd;
+    setListTarget(client, arg);
+    if (client->pasvsBev != NULL)
+        startTransfer(client);
 }
 
-void FtpServer::processRetr(FtpClient* client, ClientCommand cmd)
+void FtpServer::setListTarget(FtpClient* client, const std::string& arg)
 {
-    ENSURE_USER_LOGIN(client)
-    ENSURE_PARAMETERS(cmd)
-    
-    echo(client->cmdBev, "150 Opening BINARY mode data connection.");
+    // 最后一级含通配符时拆成目录和模式，由服务器端过滤；"*/"只列目录。
+    // 前面几级的通配符不展开，按普通路径处理
+    std::string path = arg;
+    std::string suffix;
+    if (path.size() > 1 && path[path.size() - 1] == '/')
+    {
+        path.erase(path.size() - 1);
+        suffix = "/";
+    }
     
-    std::string target = generateAbsoluteTarget(client, cmd.data);
-    if (client->pasvsBev != NULL)
+    size_t slash = path.rfind('/');
+    std::string last = (slash == std::string::npos) ? path : path.substr(slash + 1);
+    client->listPattern.clear();
+    if (GlobMatcher::isPattern(last))
     {
-        echoFile(client, target);
+        client->listPattern = last + suffix;
+        path = (slash == std::string::npos) ? "" : path.substr(0, slash + 1);
     }
     else
     {
-        client->hasPendingCmd = true;
-        client->pendingCmd = cmd;
-        client->pendingAccessFile = target;
+        path = arg;
     }
-}
-
-void FtpServer::echoFile(FtpClient* client, const std::string& filename)
-{
-    LocalFile file;
-    file.open(filename, LocalFile::Read);
-    std::string content = file.readAll();
-    file.close();
-    
-    echo(client->pasvsBev, content, true);
-    echo(client->cmdBev, "226 Transfer complete.");
     
-    bufferevent_free(client->pasvsBev);
-    client->pasvsBev = NULL;
-    evconnlistener_free(client->pasvListener);
-    client->pasvListener = NULL;
-    client->hasPendingCmd = false;
+    client->pendingAccessFile = generateAbsoluteTarget(client, path);
 }
 
-void FtpServer::processStor(FtpClient* client, ClientCommand cmd)
+void FtpServer::startTransfer(FtpClient* client)
 {
-    ENSURE_USER_LOGIN(client)
-    ENSURE_PARAMETERS(cmd)
-    
-    client->storFile = new LocalFile;
-    std::string target = generateAbsoluteTarget(client, cmd.data);
-    bool ret = client->storFile->open(target, LocalFile::Write|LocalFile::Truncate);
-    
-    if (ret)
+    ClientOperation op = client->pendingCmd.op;
+    if (client->transferState == TransferDeferred || (op != LIST && op != NLST && op != SITE && op != RETR))
+        return;
+
+    // 全局缓冲内存接近上限时先不产生新的输出，等别的传输释放后按顺序开始
+    if (m_memory->globalTight())
     {
-        client->hasPendingCmd = true;
-        client->pendingCmd = cmd;
-        client->pendingAccessFile = target;
-        
-        echo(client->cmdBev, "125 Data connection already open; Transfer starting.");
+        m_memory->recordDeferred();
+        client->transferState = TransferDeferred;
+        m_deferred.push_back(client);
+        return;
     }
+
+    // 开了cork时整个下载期间都塞住，startFlushing或finishTransfer时放开。
+    // 块模式的数据连接跨多次传输保持打开，每次传输开始时重新塞住
+    if (client->pasvsBev != NULL)
+        SocketTuning::setCork(bufferevent_getfd(client->pasvsBev), m_dataProfile, true);
+
+    if (op == RETR && client->archive != ArchiveNone)
+        echoArchive(client, client->pendingAccessFile);
+    else if (op == RETR)
+        echoFile(client, client->pendingAccessFile);
     else
-    {
-        echo(client->cmdBev, "550 File open failed.");
-        delete client->storFile;
-        client->storFile = NULL;
-    }
+        echoList(client, client->pendingAccessFile);
 }
 
-void FtpServer::processAppe(FtpClient* client, ClientCommand cmd)
+void FtpServer::echoList(FtpClient* client, const std::string& dir)
 {
-    ENSURE_USER_LOGIN(client)
-    ENSURE_PARAMETERS(cmd)
-            
-    client->storFile = new LocalFile;
-    std::string target = generateAbsoluteTarget(client, cmd.data);
-    bool ret = client->storFile->open(target, LocalFile::Write);
-    
-    if (ret)
+    client->hasPendingCmd = false;
+
+    // 递归列目录只支持本地磁盘，其他后端退回只列一层；带通配符时也只列一层
+    std::string hostDir = client->vfs->hostPath(dir);
+    if (m_hotManifest != NULL && !hostDir.empty())
+        m_hotManifest->touchDir(hostDir);
+    if (client->listMode == ListPlain || client->listMode == ListNames ||
+        !client->listPattern.empty() || hostDir.empty())
     {
-        client->hasPendingCmd = true;
-        client->pendingCmd = cmd;
-        client->pendingAccessFile = target;
-        
-        echo(client->cmdBev, "125 Data connection already open; Transfer starting.");
+        // 模式对每次列目录只编译一次
+        GlobMatcher matcher(client->listPattern);
+        const GlobMatcher* filter = client->listPattern.empty() ? NULL : &matcher;
+        std::string dirRes = (client->listMode == ListNames) ? client->vfs->getNameList(dir, filter)
+                                                             : client->vfs->getDirList(dir, filter);
+        TransferTrace::mark(&client->trace, MarkOpen);
+        if (client->blockMode)
+            BlockMode::add(bufferevent_get_output(client->pasvsBev), BlockMode::Eof, dirRes.c_str(), dirRes.size());
+        else
+            bufferevent_write(client->pasvsBev, dirRes.c_str(), dirRes.size());
+        TransferTrace::mark(&client->trace, MarkFirstByte);
+        client->sentBytes = dirRes.size();
+        startFlushing(client);
+        return;
     }
-    else
+
+    // 递归列目录由工作线程直接写进输出缓冲，没有分块，块模式下不支持
+    if (client->blockMode)
     {
-        echo(client->cmdBev, "550 File open failed.");
-        delete client->storFile;
-        client->storFile = NULL;
+        finishTransfer(client, "504 Command not implemented for that parameter in MODE B.");
+        return;
     }
-}
 
-void FtpServer::processMkd(FtpClient* client, ClientCommand cmd)
-{
-    ENSURE_USER_LOGIN(client)
-    ENSURE_PARAMETERS(cmd)
-    
-    std::string absoluteDir = generateAbsoluteTarget(client, cmd.data);
-    if (LocalFile::exist(absoluteDir))
+    TreeWalker* walker = new TreeWalker(m_walkPool, m_walkThreads, m_treeMaxDepth, m_treeMaxEntries);
+    TreeWalker::Format format = (client->listMode == ListTree) ? TreeWalker::FormatTree : TreeWalker::FormatList;
+    if (!walker->start(client->vfs->openDir(dir), dir, format, bufferevent_get_output(client->pasvsBev),
+                       m_transferLowWatermark + m_transferChunkSize, FtpServer::walkDoneCallback, client))
     {
-        echo(client->cmdBev, "550 Cannot create a directory when the directory already exists.");
+        delete walker;
+        finishTransfer(client, "550 The directory cannot be found.");
         return;
     }
-    
-    bool ret = LocalFile::mkDir(absoluteDir);
-    if (ret)
-        echo(client->cmdBev, "257 \"" + cmd.data + "\" directory created.");
-    else
-        echo(client->cmdBev, "550 Directory create failed.");
+
+    TransferTrace::mark(&client->trace, MarkOpen);
+    client->walker = walker;
+    client->sentBytes = 0;
+    client->transferState = TransferWalking;
+    bufferevent_setwatermark(client->pasvsBev, EV_WRITE, m_transferLowWatermark, 0);
+    walker->pump();
 }
 
-void FtpServer::processRmd(FtpClient* client, ClientCommand cmd)
+/*static*/ void FtpServer::walkDoneCallback(TreeWalker* walker, void* arg)
 {
-    ENSURE_USER_LOGIN(client)
-    ENSURE_PARAMETERS(cmd)
-    
-    std::string absoluteDir = generateAbsoluteTarget(client, cmd.data);
-    if (!LocalFile::exist(absoluteDir))
+    FtpClient* client = (FtpClient*)arg;
+    FtpServer* serverPtr = client->serverPtr;
+
+    client->sentBytes = walker->bytes();
+    std::string response = "226 Transfer complete.";
+    if (walker->failed())
     {
-        echo(client->cmdBev, "550 The direcotory cannot be found.");
-        return;
+        response = "451 Server busy, listing aborted.";
     }
-    
-    bool ret = LocalFile::rmDir(absoluteDir);
-    if (ret)
-        echo(client->cmdBev, "RMD command successful.");
-    else
-        echo(client->cmdBev, "RMD command failed.");
+    else if (walker->truncated())
+    {
+        char buf[96];
+        sprintf(buf, "226 Transfer complete; listing truncated after %llu entries.",
+                (unsigned long long)walker->entries());
+        response = buf;
+    }
+
+    delete walker;
+    client->walker = NULL;
+    serverPtr->startFlushing(client, response);
 }
 
-void FtpServer::processDele(FtpClient* client, ClientCommand cmd)
+void FtpServer::processNlst(FtpClient* client, ClientCommand cmd)
 {
     ENSURE_USER_LOGIN(client)
-    ENSURE_PARAMETERS(cmd)
     
-    std::string absoluteFile = generateAbsoluteTarget(client, cmd.data);
-    if (!LocalFile::exist(absoluteFile))
-    {
-        echo(client->cmdBev, "550 The file cannot be found.");
-        return;
-    }
+    TransferTrace::begin(&client->trace, "NLST");
+    echo(client->cmdBev, "150 Opening BINARY mode data connection.");
     
-    bool ret = LocalFile::rmFile(absoluteFile);
-    if (ret)
-        echo(client->cmdBev, "250 DELE command successful.");
-    else
-        echo(client->cmdBev, "550 DELE command failed.");
+    client->listMode = ListNames;
+    client->hasPendingCmd = true;
+    client->pendingCmd = cmd;
+    setListTarget(client, cmd.data);
+    if (client->pasvsBev != NULL)
+        startTransfer(client);
 }
 
-void FtpServer::processRnfr(FtpClient* client, ClientCommand cmd)
+void FtpServer::processRetr(FtpClient* client, ClientCommand cmd)
 {
     ENSURE_USER_LOGIN(client)
     ENSURE_PARAMETERS(cmd)
+    
+    TransferTrace::begin(&client->trace, "RETR");
+    client->transferOffset = client->restOffset;
+    client->restOffset = 0;
 
+    // 没有这个文件，但去掉.tar等后缀是一个目录时打包下载
     std::string target = generateAbsoluteTarget(client, cmd.data);
-    if (!LocalFile::exist(target))
+    std::string dir;
+    bool gzip = false;
+    client->archive = ArchiveNone;
+    if (!client->vfs->exist(target) && TarStreamer::archiveName(target, &dir, &gzip) &&
+        dir.rfind('/') + 1 < dir.size() && client->vfs->exist(dir))
+    {
+        client->archive = gzip ? ArchiveTarGz : ArchiveTar;
+        target = dir;
+    }
+    else if (!client->vfs->exist(target))
     {
         echo(client->cmdBev, "550 The system cannot find the file specified.");
         return;
     }
     
+    echo(client->cmdBev, "150 Opening BINARY mode data connection.");
+
     client->hasPendingCmd = true;
     client->pendingCmd = cmd;
     client->pendingAccessFile = target;
-    
-    echo(client->cmdBev, "350 Requested file action pending further information.");    
+    if (client->pasvsBev != NULL)
+        startTransfer(client);
 }
 
-void FtpServer::processRnto(FtpClient* client, ClientCommand cmd)
+void FtpServer::echoFile(FtpClient* client, const std::string& filename)
 {
-    ENSURE_USER_LOGIN(client)
-    ENSURE_PARAMETERS(cmd)
-            
-    if (client->hasPendingCmd && client->pendingCmd.op == RNFR)
+    client->hasPendingCmd = false;
+    
+    VfsFile* file = client->vfs->open(filename, LocalFile::Read);
+    if (file == NULL)
     {
-        std::string newTarget = generateAbsoluteTarget(client, cmd.data);
-        bool ret = LocalFile::rename(client->pendingAccessFile, newTarget);
-        if (ret)
-            echo(client->cmdBev, "250 RNTO command successful.");
-        else
-            echo(client->cmdBev, "550 RNTO command failed.");
-        
-        client->hasPendingCmd = false;
+        finishTransfer(client, "550 File open failed.");
+        return;
     }
-    else
+    
+    if (client->transferOffset > 0 && !file->seek(client->transferOffset))
     {
-        echo(client->cmdBev, "503 Bad sequence of commands.");
+        file->close();
+        delete file;
+        finishTransfer(client, "554 Requested action not taken: invalid REST parameter.");
+        return;
     }
-}
 
-void FtpServer::processAbor(FtpClient* client, ClientCommand cmd)
-{
-    ENSURE_USER_LOGIN(client)
+    std::string hostPath = client->vfs->hostPath(filename);
+    if (m_hotManifest != NULL && !hostPath.empty())
+        m_hotManifest->touchFile(hostPath);
+    TransferTrace::mark(&client->trace, MarkOpen);
+
+    // 大文件的二进制流模式下载绕过页缓存，读进池里对齐的缓冲；偏移和每次读的长度都要按页对齐。
+    // 绕过时不再预读和丢弃页缓存，否则同一段会从磁盘读两次
+    bool direct = (m_directIoMin > 0 && client->type != TypeA && !client->blockMode &&
+                   client->transferOffset % 4096 == 0 && m_transferChunkSize % 4096 == 0 &&
+                   client->vfs->fileSize(filename) >= m_directIoMin && file->setDirect());
+    if (direct)
+        client->retrCache.active = false;
+    else
+        m_cachePolicy->beginRead(file->fd(), hostPath, client->transferOffset, &client->retrCache);
+    
+    // 不一次读入整个文件：输出缓冲降到低水位以下时由写回调补充，内存占用有上限
+    client->retrFile = file;
+    client->sentBytes = 0;
+    client->asciiCr = false;
+    client->nextMarker = client->transferOffset + m_blockMarkerInterval;
+    client->transferState = TransferSending;
+    bufferevent_setwatermark(client->pasvsBev, EV_WRITE, m_transferLowWatermark, 0);
+    fillTransfer(client);
 }
 
-void FtpServer::processNoop(FtpClient* client, ClientCommand cmd)
+void FtpServer::fillTransfer(FtpClient* client)
 {
-    echo(client->cmdBev, "200 NOOP command successful.");
-}
+    evbuffer* output = bufferevent_get_output(client->pasvsBev);
+    while (evbuffer_get_length(output) < m_transferLowWatermark + m_transferChunkSize)
+    {
+        // 会话占用超限时停止补充，回落后由resumeTransfers继续
+        if (client->mem.paused)
+        {
+            m_stalled.remove(client);
+            m_stalled.push_back(client);
+            return;
+        }
+        
+        // 直接读进evbuffer预留的空间，省去一次拷贝。TYPE A先读到暂存区，
+        // 转换时写进预留空间，每个换行最多多出一个'\r'。sentBytes始终按文件字节计。
+        // 二进制流模式读进池里的缓冲，以引用挂到evbuffer上，发完由清理回调归还
+        size_t count;
+        if (client->blockMode)
+        {
+            if (!fillBlocks(client, output, &count))
+                break;
+        }
+        else if (client->type != TypeA && BufferPool::enabled())
+        {
+            // 缓冲拿不到或挂不上时没有数据排进输出，也就不会再有写回调，只能中止；
+            // 用O_DIRECT打开的文件也不能退回读进预留空间
+            char* buffer = BufferPool::acquire();
+            count = (buffer != NULL) ? client->retrFile->read(buffer, m_transferChunkSize) : 0;
+            if (buffer == NULL ||
+                (count > 0 && evbuffer_add_reference(output, buffer, count, BufferPool::releaseReference, NULL) != 0))
+            {
+                BufferPool::release(buffer);
+                finishTransfer(client, "451 Requested action aborted: local error in processing.");
+                return;
+            }
+            if (count == 0)
+                BufferPool::release(buffer);
+        }
+        else
+        {
+            bool ascii = (client->type == TypeA);
+            evbuffer_iovec vec;
+            if (evbuffer_reserve_space(output, ascii ? m_transferChunkSize * 2 : m_transferChunkSize, &vec, 1) < 1)
+                break;
 
-void FtpServer::processQuit(FtpClient* client, ClientCommand cmd)
-{
-    echo(client->cmdBev, "221 Bye.", true);
-    removeClient(client);
-}
+            if (ascii)
+            {
+                count = client->retrFile->read(&m_asciiBuffer[0], m_transferChunkSize);
+                vec.iov_len = AsciiConverter::toNetwork(&m_asciiBuffer[0], count, (char*)vec.iov_base, &client->asciiCr);
+            }
+            else
+            {
+                count = client->retrFile->read((char*)vec.iov_base, m_transferChunkSize);
+                vec.iov_len = count;
+            }
+            evbuffer_commit_space(output, &vec, 1);
+        }
+        client->sentBytes += count;
+        if (count > 0)
+            TransferTrace::markOnce(&client->trace, MarkFirstByte);
 
-/*static*/ void FtpServer::pasvListenCallback(evconnlistener* listener, evutil_socket_t fd,
-    sockaddr* address, int socklen, void* arg)
-{
-    FtpClient* client = (FtpClient*)arg;
-    
-    bufferevent* pasvBev = bufferevent_socket_new(bufferevent_get_base(client->cmdBev), fd, BEV_OPT_CLOSE_ON_FREE);
-    bufferevent_setcb(pasvBev, FtpServer::pasvReadCallback, NULL, FtpServer::pasvEventCallback, arg);
-    bufferevent_enable(pasvBev, EV_READ|EV_WRITE|EV_PERSIST);
-    client->pasvsBev = pasvBev;
-    
-    // 处理之前待处理的命令
-    if (client->hasPendingCmd)
-    {
-        if (client->pendingCmd.op == LIST)
+        if (count < m_transferChunkSize)
         {
-            client->serverPtr->echoList(client, client->pendingAccessFile);
-            client->hasPendingCmd = false;
+            closeRetrFile(client);
+            startFlushing(client);
+            return;
         }
-        else if (client->pendingCmd.op == RETR)
+
+        // 重启标记只落在块之间，值是已经排进输出的文件偏移
+        uint64_t offset = client->transferOffset + client->sentBytes;
+        if (client->blockMode && m_blockMarkerInterval > 0 && offset >= client->nextMarker)
         {
-            client->serverPtr->echoFile(client, client->pendingAccessFile);
-            client->hasPendingCmd = false;
+            BlockMode::addMarker(output, offset);
+            client->nextMarker = offset + m_blockMarkerInterval;
         }
+
+        m_cachePolicy->advanceRead(client->retrFile->fd(), client->transferOffset + client->sentBytes, &client->retrCache);
     }
 }
 
-/*static*/ void FtpServer::pasvReadCallback(bufferevent* bev, void* arg)
+bool FtpServer::fillBlocks(FtpClient* client, evbuffer* output, size_t* count)
 {
-    FtpClient* client = (FtpClient*)arg;
-    FtpServer* serverPtr = client->serverPtr;
-    
-    static const int BUF_SIZE = 8*1024;
-    static char buf[BUF_SIZE];
-    size_t length;
+    // 块头写在预留空间里每段数据的前面，文件内容仍然直接读进evbuffer。
+    // TYPE A每段最多取半块，转换后不会超过一块的长度
+    bool ascii = (client->type == TypeA);
+    size_t pieceMax = ascii ? BlockMode::MAX_DATA / 2 : BlockMode::MAX_DATA;
+    size_t blocks = (m_transferChunkSize + pieceMax - 1) / pieceMax + 1;
+    evbuffer_iovec vec;
+    if (evbuffer_reserve_space(output, (ascii ? m_transferChunkSize * 2 : m_transferChunkSize) +
+                               blocks * BlockMode::HEADER, &vec, 1) < 1)
+        return false;
 
-    length = bufferevent_read(bev, buf, BUF_SIZE);
-    
-    // 处理客户端上传的文件
-    if (client->hasPendingCmd &&
-        (client->pendingCmd.op == STOR || client->pendingCmd.op == APPE))
+    char* out = (char*)vec.iov_base;
+    char* last = NULL;
+    size_t done = 0;
+    size_t sent = 0;
+    if (ascii)
     {
-        client->storFile->write(buf, length);
+        size_t length = client->retrFile->read(&m_asciiBuffer[0], m_transferChunkSize);
+        for (done = 0; done < length; done += pieceMax)
+        {
+            size_t piece = std::min(pieceMax, length - done);
+            size_t n = AsciiConverter::toNetwork(&m_asciiBuffer[done], piece, out + BlockMode::HEADER, &client->asciiCr);
+            BlockMode::putHeader(out, 0, n);
+            last = out;
+            out += BlockMode::HEADER + n;
+            sent++;
+        }
+        done = length;
     }
-}
+    else
+    {
+        while (done < m_transferChunkSize)
+        {
+            size_t want = std::min(pieceMax, m_transferChunkSize - done);
+            size_t n = client->retrFile->read(out + BlockMode::HEADER, want);
+            if (n == 0)
+                break;
+            BlockMode::putHeader(out, 0, n);
+            last = out;
+            out += BlockMode::HEADER + n;
+            done += n;
+            sent++;
+            if (n < want)
+                break;
+        }
+    }
+
+    // 读到文件末尾时把最后一块标成EOF；正好读完一整片时补一个空的EOF块
+    if (done < m_transferChunkSize)
+    {
+        if (last == NULL)
+        {
+            last = out;
+            BlockMode::putHeader(out, 0, 0);
+            out += BlockMode::HEADER;
+            sent++;
+        }
+        last[0] = (char)BlockMode::Eof;
+    }
+
+    vec.iov_len = out - (char*)vec.iov_base;
+    evbuffer_commit_space(output, &vec, 1);
+    BlockMode::recordSent(sent);
+    *count = done;
+    return true;
+}
+
+void FtpServer::echoArchive(FtpClient* client, const std::string& dir)
+{
+    client->hasPendingCmd = false;
+    bool gzip = (client->archive == ArchiveTarGz);
+    client->archive = ArchiveNone;
+    
+    // 打包输出由TarStreamer直接写进输出缓冲，没有分块，块模式下不支持
+    if (client->blockMode)
+    {
+        finishTransfer(client, "504 Command not implemented for that parameter in MODE B.");
+        return;
+    }
+    
+    // 归档是现生成的，不支持断点续传
+    if (client->transferOffset > 0)
+    {
+        finishTransfer(client, "554 Requested action not taken: invalid REST parameter.");
+        return;
+    }
+    
+    int fd = client->vfs->openDir(dir);
+    if (fd < 0)
+    {
+        finishTransfer(client, "550 Directory cannot be archived.");
+        return;
+    }
+    
+    TarStreamer* tar = new TarStreamer(m_treeMaxDepth, m_transferChunkSize, m_tarSendfileMin, gzip ? m_tarGzipLevel : -1);
+    if (!tar->start(fd, dir.substr(dir.rfind('/') + 1), bufferevent_get_output(client->pasvsBev),
+                    m_transferLowWatermark + m_transferChunkSize))
+    {
+        delete tar;
+        finishTransfer(client, "550 Directory cannot be archived.");
+        return;
+    }
+    
+    TransferTrace::mark(&client->trace, MarkOpen);
+    client->tar = tar;
+    client->sentBytes = 0;
+    client->transferState = TransferArchiving;
+    bufferevent_setwatermark(client->pasvsBev, EV_WRITE, m_transferLowWatermark, 0);
+    pumpArchive(client);
+}
+
+void FtpServer::pumpArchive(FtpClient* client)
+{
+    // 与fillTransfer一样，会话占用超限时停下，回落后由resumeTransfers继续
+    if (client->mem.paused)
+    {
+        m_stalled.remove(client);
+        m_stalled.push_back(client);
+        return;
+    }
+    
+    bool done = client->tar->pump();
+    client->sentBytes = client->tar->bytes();
+    if (client->sentBytes > 0)
+        TransferTrace::markOnce(&client->trace, MarkFirstByte);
+    if (!done)
+        return;
+    
+    std::string response = client->tar->failed() ? "451 Requested action aborted: local error in processing."
+                                                  : "226 Transfer complete.";
+    delete client->tar;
+    client->tar = NULL;
+    startFlushing(client, response);
+}
+
+void FtpServer::closeRetrFile(FtpClient* client)
+{
+    m_cachePolicy->endRead(client->retrFile->fd(), client->transferOffset + client->sentBytes, &client->retrCache);
+    client->retrFile->close();
+    delete client->retrFile;
+    client->retrFile = NULL;
+}
+
+void FtpServer::startFlushing(FtpClient* client, const std::string& response)
+{
+    // 低水位置0，输出缓冲完全发空时才触发写回调
+    TransferTrace::mark(&client->trace, MarkLastByte);
+    SocketTuning::setCork(bufferevent_getfd(client->pasvsBev), m_dataProfile, false);
+    client->transferState = TransferFlushing;
+    client->transferResponse = response;
+    bufferevent_setwatermark(client->pasvsBev, EV_WRITE, 0, 0);
+    bufferevent_setcb(client->pasvsBev, FtpServer::pasvReadCallback, FtpServer::pasvWriteCallback,
+                      FtpServer::pasvEventCallback, client);
+    
+    if (evbuffer_get_length(bufferevent_get_output(client->pasvsBev)) == 0)
+        finishTransfer(client, response);
+}
+
+void FtpServer::finishTransfer(FtpClient* client, const std::string& response)
+{
+    if (client->retrFile != NULL)
+        closeRetrFile(client);
+
+    if (client->walker != NULL)
+    {
+        client->walker->cancel();
+        client->walker = NULL;
+    }
+    
+    delete client->tar;
+    client->tar = NULL;
+    
+    // 出错中止时没有经过startFlushing，这里放开，块模式下连接还要留给下一次传输
+    if (client->pasvsBev != NULL)
+        SocketTuning::setCork(bufferevent_getfd(client->pasvsBev), m_dataProfile, false);
+    
+    client->transferState = TransferIdle;
+    std::string reply = completionReply(client, response);
+    echo(client->cmdBev, reply);
+    traceDone(client, client->sentBytes, reply);
+    
+    // 块模式下文件以EOF块结束，数据连接留给下一次传输
+    if (!client->blockMode)
+        closeDataConnection(client);
+    
+    if (m_recorder != NULL)
+        m_recorder->recordData(client->sessionId, TraceDataOut, client->sentBytes);
+}
+
+std::string FtpServer::completionReply(FtpClient* client, const std::string& response)
+{
+    // 226表示数据连接已关闭，块模式下连接还开着，成功时改回250
+    if (!client->blockMode || response.compare(0, 3, "226") != 0)
+        return response;
+
+    BlockMode::recordTransfer();
+    return "250" + response.substr(3);
+}
+
+void FtpServer::closeDataConnection(FtpClient* client)
+{
+    if (client->pasvsBev != NULL)
+    {
+        detachBuffers(client, client->pasvsBev);
+        bufferevent_free(client->pasvsBev);
+        client->pasvsBev = NULL;
+    }
+    
+    if (client->pasvListener != NULL)
+    {
+        evconnlistener_free(client->pasvListener);
+        client->pasvListener = NULL;
+    }
+}
+
+void FtpServer::setDataPriority(bufferevent* bev)
+{
+    if (m_eventPriorities)
+        bufferevent_priority_set(bev, PriorityData);
+
+    // 每次回调读写的字节数封顶，一个高速连接不会独占一轮循环
+    if (m_dataReadBudget > 0)
+        bufferevent_set_max_single_read(bev, m_dataReadBudget);
+    if (m_dataWriteBudget > 0)
+        bufferevent_set_max_single_write(bev, m_dataWriteBudget);
+}
+
+void FtpServer::processStor(FtpClient* client, ClientCommand cmd)
+{
+    ENSURE_USER_LOGIN(client)
+    ENSURE_PARAMETERS(cmd)
+    
+    if (client->storPreparing)
+    {
+        echo(client->cmdBev, "450 Requested file action not taken. Upload in progress.");
+        return;
+    }
+    
+    TransferTrace::begin(&client->trace, "STOR");
+
+    // REST和ALLO只作用于紧接着的这一次上传
+    uint64_t offset = client->restOffset;
+    uint64_t allocSize = client->alloSize;
+    client->restOffset = 0;
+    client->alloSize = 0;
+
+    client->storBytes = 0;
+    client->asciiCr = false;
+    client->transferOffset = offset;
+    std::string target = generateAbsoluteTarget(client, cmd.data);
+    std::string hostTarget = client->vfs->hostPath(target);
+    uint64_t oldSize = (client->quota != NULL) ? client->vfs->fileSize(target) : 0;
+
+    // 内存文件关闭时整体替换内容，并行的分段会互相覆盖，不支持从偏移处写
+    if ((offset > 0 || allocSize > 0) && hostTarget.empty())
+    {
+        echo(client->cmdBev, "504 REST and ALLO uploads are not supported on this mount.");
+        return;
+    }
+
+    // 同一个目标只能有一个原子上传在写；落盘中的检查点回来前也不能重新开始
+    JournalEntry* entry = (m_journal != NULL && !hostTarget.empty()) ? m_journal->find(hostTarget) : NULL;
+    if (entry != NULL && (entry->active || entry->syncing))
+    {
+        echo(client->cmdBev, "450 Requested file action not taken. Upload in progress.");
+        return;
+    }
+    if (entry != NULL && offset > entry->durable && allocSize == 0)
+    {
+        char buf[128];
+        sprintf(buf, "554 Requested action not taken: invalid REST parameter (durable %llu bytes).",
+                (unsigned long long)entry->durable);
+        echo(client->cmdBev, buf);
+        return;
+    }
+
+    // 已经用满，或ALLO声明的长度放不下时，不等数据传过来就拒绝
+    uint64_t need = (allocSize > oldSize) ? allocSize - oldSize : 1;
+    if (client->quota != NULL && !m_quota->canGrow(client->quota, need))
+    {
+        m_quota->recordRejected();
+        echo(client->cmdBev, "552 Requested file action aborted. Exceeded storage allocation.");
+        return;
+    }
+
+    bool ret;
+    if (entry != NULL && allocSize == 0)
+    {
+        // 断开过的原子上传：REST到已落盘范围内续传，不带REST则从头重来
+        ret = beginAtomicStor(client, target, hostTarget, offset);
+    }
+    else if (offset > 0 || allocSize > 0)
+    {
+        // 分段上传或续传：不截断，从偏移处pwrite。可能与去重存储共享块，先在工作线程里拆开
+        if (deferLinkBreak(client, cmd, target, offset, allocSize))
+            return;
+        client->storFile = client->vfs->open(target, LocalFile::Write);
+        ret = (client->storFile != NULL && client->storFile->seek(offset));
+
+        // 带ALLO的上传按文件登记，第一个到的连接负责预分配
+        if (ret && allocSize > 0 && !hostTarget.empty())
+        {
+            bool created;
+            client->upload = m_uploads->attach(hostTarget, allocSize, &created);
+            if (client->upload == NULL)
+            {
+                echo(client->cmdBev, "501 ALLO size does not match the upload in progress.");
+                delete client->storFile;
+                client->storFile = NULL;
+                return;
+            }
+            if (created)
+                client->storFile->allocate(allocSize);
+        }
+
+        // 预分配出来的长度算作已用
+        client->storSize = oldSize;
+        if (ret && client->quota != NULL)
+        {
+            client->storSize = client->vfs->fileSize(target);
+            if (client->storSize > oldSize)
+                m_quota->grow(client->quota, client->storSize - oldSize);
+        }
+    }
+    else if (m_contentStore != NULL && !hostTarget.empty())
+    {
+        // 去重模式：先写到存储的临时文件，收完按摘要落盘后再链接到目标位置
+        LocalFile* tempFile = new LocalFile;
+        client->storFile = tempFile;
+        std::string name;
+        int dirFd = client->vfs->openParent(target, &name);
+        ret = (dirFd >= 0);
+        if (ret)
+            close(dirFd);
+        if (ret)
+        {
+            client->storTempFile = m_contentStore->createTempPath();
+            ret = tempFile->open(client->storTempFile, LocalFile::Write|LocalFile::Truncate);
+        }
+        if (ret)
+            client->storHash = new Sha256;
+
+        // 目标文件在提交时才被替换，旧长度到那时再释放
+        client->storSize = 0;
+    }
+    else if (m_journal != NULL && !hostTarget.empty())
+    {
+        ret = beginAtomicStor(client, target, hostTarget, 0);
+    }
+    else
+    {
+        client->storFile = client->vfs->open(target, LocalFile::Write|LocalFile::Truncate);
+        ret = (client->storFile != NULL);
+        client->storSize = 0;
+        if (ret && client->quota != NULL)
+            m_quota->shrink(client->quota, oldSize);
+    }
+    
+    if (ret)
+    {
+        client->hasPendingCmd = true;
+        client->pendingCmd = cmd;
+        client->pendingAccessFile = target;
+        client->storFile->stageWrites(m_directIoMin);
+        m_cachePolicy->beginWrite(client->storFile->fd(), hostTarget, offset, &client->storCache);
+        TransferTrace::mark(&client->trace, MarkOpen);
+
+        echo(client->cmdBev, "125 Data connection already open; Transfer starting.");
+
+        // 块模式下数据可能在STOR之前就已经到了输入缓冲
+        BlockMode::resetReader(&client->blockReader);
+        if (client->blockMode && client->pasvsBev != NULL)
+            readBlocks(client);
+    }
+    else
+    {
+        echo(client->cmdBev, "550 File open failed.");
+        delete client->storFile;
+        client->storFile = NULL;
+    }
+}
+
+bool FtpServer::beginAtomicStor(FtpClient* client, const std::string& target, const std::string& hostTarget, uint64_t offset)
+{
+    // 写到目标同目录下的隐藏临时文件，收完落盘后再改名发布，目标位置上不会出现写了一半的文件
+    size_t slash = target.find_last_of('/');
+    std::string temp = target.substr(0, slash + 1) + UploadJournal::tempName(target.substr(slash + 1));
+    uint64_t tempSize = (client->quota != NULL) ? client->vfs->fileSize(temp) : 0;
+    client->storFile = client->vfs->open(temp, (offset > 0) ? LocalFile::Write : LocalFile::Write|LocalFile::Truncate);
+    if (client->storFile == NULL)
+        return false;
+    if (offset > 0 && (ftruncate(client->storFile->fd(), offset) != 0 || !client->storFile->seek(offset)))
+        return false;
+
+    // 临时文件里截掉的部分退回用量，被替换的目标文件到发布时再释放
+    client->storSize = offset;
+    if (client->quota != NULL && tempSize > offset)
+        m_quota->shrink(client->quota, tempSize - offset);
+
+    client->journal = m_journal->begin(hostTarget, offset);
+    client->checkpointAt = offset;
+    return true;
+}
+
+void FtpServer::finishPublish(evutil_socket_t socket, uint64_t sessionId, bool ok, uint64_t bytes,
+                              QuotaAccount* quota, uint64_t release)
+{
+    // 成功时释放被替换的旧文件，失败时临时文件已删除，退回它占的用量
+    if (quota != NULL)
+        m_quota->shrink(quota, release);
+
+    // 会话已经断开时文件照样发布，只是没人收回复
+    std::map<evutil_socket_t, FtpClient*>::iterator it = m_clients.find(socket);
+    if (it == m_clients.end() || it->second->sessionId != sessionId)
+        return;
+
+    FtpClient* client = it->second;
+    client->storPublishing = false;
+    std::string response = ok ? "226 Transfer complete." : "451 Requested action aborted: local error in processing.";
+    response = completionReply(client, response);
+    echo(client->cmdBev, response);
+    traceDone(client, bytes, response);
+}
+
+void FtpServer::processAppe(FtpClient* client, ClientCommand cmd)
+{
+    ENSURE_USER_LOGIN(client)
+    ENSURE_PARAMETERS(cmd)
+            
+    if (client->storPreparing)
+    {
+        echo(client->cmdBev, "450 Requested file action not taken. Upload in progress.");
+        return;
+    }
+    
+    TransferTrace::begin(&client->trace, "APPE");
+    client->restOffset = 0;
+    client->alloSize = 0;
+    client->storBytes = 0;
+    client->asciiCr = false;
+    std::string target = generateAbsoluteTarget(client, cmd.data);
+    std::string hostTarget = client->vfs->hostPath(target);
+
+    // 追加从文件末尾开始，记下起点以便按增长计入用量
+    client->storSize = client->vfs->fileSize(target);
+    client->transferOffset = client->storSize;
+    if (client->quota != NULL && !m_quota->canGrow(client->quota, 1))
+    {
+        m_quota->recordRejected();
+        echo(client->cmdBev, "552 Requested file action aborted. Exceeded storage allocation.");
+        return;
+    }
+    
+    // 去重存储的文件可能与其他文件共享同一个块，追加前先拆开
+    if (deferLinkBreak(client, cmd, target, 0, 0))
+        return;
+    
+    client->storFile = client->vfs->open(target, LocalFile::Write|LocalFile::Append);
+    bool ret = (client->storFile != NULL);
+
+    if (ret)
+    {
+        client->hasPendingCmd = true;
+        client->pendingCmd = cmd;
+        client->pendingAccessFile = target;
+        client->storFile->stageWrites(m_directIoMin);
+        m_cachePolicy->beginWrite(client->storFile->fd(), hostTarget, client->transferOffset, &client->storCache);
+        TransferTrace::mark(&client->trace, MarkOpen);
+
+        echo(client->cmdBev, "125 Data connection already open; Transfer starting.");
+
+        BlockMode::resetReader(&client->blockReader);
+        if (client->blockMode && client->pasvsBev != NULL)
+            readBlocks(client);
+    }
+    else
+    {
+        echo(client->cmdBev, "550 File open failed.");
+        delete client->storFile;
+        client->storFile = NULL;
+    }
+}
+
+void FtpServer::processMkd(FtpClient* client, ClientCommand cmd)
+{
+    ENSURE_USER_LOGIN(client)
+    ENSURE_PARAMETERS(cmd)
+    
+    std::string absoluteDir = generateAbsoluteTarget(client, cmd.data);
+    if (client->vfs->exist(absoluteDir))
+    {
+        echo(client->cmdBev, "550 Cannot create a directory when the directory already exists.");
+        return;
+    }
+    
+    bool ret = client->vfs->mkDir(absoluteDir);
+    if (ret)
+        echo(client->cmdBev, "257 \"" + cmd.data + "\" directory created.");
+    else
+        echo(client->cmdBev, "550 Directory create failed.");
+}
+
+void FtpServer::processRmd(FtpClient* client, ClientCommand cmd)
+{
+    ENSURE_USER_LOGIN(client)
+    ENSURE_PARAMETERS(cmd)
+    
+    std::string absoluteDir = generateAbsoluteTarget(client, cmd.data);
+    if (!client->vfs->exist(absoluteDir))
+    {
+        echo(client->cmdBev, "550 The direcotory cannot be found.");
+        return;
+    }
+    
+    bool ret = client->vfs->rmDir(absoluteDir);
+    if (ret)
+        echo(client->cmdBev, "250 RMD command successful.");
+    else
+        echo(client->cmdBev, "RMD command failed.");
+}
+
+void FtpServer::processDele(FtpClient* client, ClientCommand cmd)
+{
+    ENSURE_USER_LOGIN(client)
+    ENSURE_PARAMETERS(cmd)
+    
+    std::string absoluteFile = generateAbsoluteTarget(client, cmd.data);
+    if (!client->vfs->exist(absoluteFile))
+    {
+        echo(client->cmdBev, "550 The file cannot be found.");
+        return;
+    }
+    
+    uint64_t size = (client->quota != NULL) ? client->vfs->fileSize(absoluteFile) : 0;
+    bool ret = client->vfs->rmFile(absoluteFile);
+    if (ret && client->quota != NULL)
+        m_quota->shrink(client->quota, size);
+
+    if (ret)
+        echo(client->cmdBev, "250 DELE command successful.");
+    else
+        echo(client->cmdBev, "550 DELE command failed.");
+}
+
+void FtpServer::processRnfr(FtpClient* client, ClientCommand cmd)
+{
+    ENSURE_USER_LOGIN(client)
+    ENSURE_PARAMETERS(cmd)
+
+    std::string target = generateAbsoluteTarget(client, cmd.data);
+    if (!client->vfs->exist(target))
+    {
+        echo(client->cmdBev, "550 The system cannot find the file specified.");
+        return;
+    }
+    
+    client->hasPendingCmd = true;
+    client->pendingCmd = cmd;
+    client->pendingAccessFile = target;
+    
+    echo(client->cmdBev, "350 Requested file action pending further information.");    
+}
+
+void FtpServer::processRest(FtpClient* client, ClientCommand cmd)
+{
+    ENSURE_USER_LOGIN(client)
+    ENSURE_PARAMETERS(cmd)
+
+    char* end = NULL;
+    unsigned long long offset = strtoull(cmd.data.c_str(), &end, 10);
+    if (!isdigit((unsigned char)cmd.data[0]) || *end != '\0')
+    {
+        echo(client->cmdBev, "501 Invalid REST parameter.");
+        return;
+    }
+
+    client->restOffset = offset;
+    char buf[96];
+    sprintf(buf, "350 Restarting at %llu. Send STORE or RETRIEVE to initiate transfer.", offset);
+    echo(client->cmdBev, buf);
+}
+
+void FtpServer::processAllo(FtpClient* client, ClientCommand cmd)
+{
+    ENSURE_USER_LOGIN(client)
+    ENSURE_PARAMETERS(cmd)
+
+    // ALLO <长度> [R <记录长度>]，记录长度忽略
+    char* end = NULL;
+    unsigned long long size = strtoull(cmd.data.c_str(), &end, 10);
+    if (!isdigit((unsigned char)cmd.data[0]) || (*end != '\0' && *end != ' '))
+    {
+        echo(client->cmdBev, "501 Invalid ALLO parameter.");
+        return;
+    }
+
+    client->alloSize = size;
+    if (size == 0)
+        echo(client->cmdBev, "202 No storage allocation necessary.");
+    else
+        echo(client->cmdBev, "200 ALLO command successful.");
+}
+
+void FtpServer::processRnto(FtpClient* client, ClientCommand cmd)
+{
+    ENSURE_USER_LOGIN(client)
+    ENSURE_PARAMETERS(cmd)
+            
+    if (client->hasPendingCmd && client->pendingCmd.op == RNFR)
+    {
+        std::string newTarget = generateAbsoluteTarget(client, cmd.data);
+        // 改名覆盖已有文件时，被覆盖的文件不再占用空间
+        uint64_t replaced = 0;
+        if (client->quota != NULL && client->vfs->exist(newTarget))
+            replaced = client->vfs->fileSize(newTarget);
+
+        bool ret = client->vfs->rename(client->pendingAccessFile, newTarget);
+        if (ret && replaced > 0)
+            m_quota->shrink(client->quota, replaced);
+        if (ret)
+            echo(client->cmdBev, "250 RNTO command successful.");
+        else
+            echo(client->cmdBev, "550 RNTO command failed.");
+        
+        client->hasPendingCmd = false;
+    }
+    else
+    {
+        echo(client->cmdBev, "503 Bad sequence of commands.");
+    }
+}
+
+void FtpServer::processAbor(FtpClient* client, ClientCommand cmd)
+{
+    ENSURE_USER_LOGIN(client)
+}
+
+void FtpServer::processNoop(FtpClient* client, ClientCommand cmd)
+{
+    echo(client->cmdBev, "200 NOOP command successful.");
+}
+
+void FtpServer::processQuit(FtpClient* client, ClientCommand cmd)
+{
+    echo(client->cmdBev, "221 Bye.", true);
+    removeClient(client);
+}
+
+void FtpServer::processSite(FtpClient* client, ClientCommand cmd)
+{
+    ENSURE_USER_LOGIN(client)
+    ENSURE_PARAMETERS(cmd)
+    
+    // SITE <子命令> [参数]
+    ClientCommand subCmd;
+    subCmd.op = SITE;
+    std::string name;
+    size_t space = cmd.data.find(' ');
+    if (space == std::string::npos)
+    {
+        name = cmd.data;
+    }
+    else
+    {
+        name = cmd.data.substr(0, space);
+        size_t noSpace = cmd.data.find_first_not_of(' ', space+1);
+        if (noSpace != std::string::npos)
+            subCmd.data = cmd.data.substr(noSpace);
+    }
+    std::transform(name.begin(), name.end(), name.begin(), ::toupper);
+    
+    std::map<std::string, ProcessFunc>::iterator it = m_siteFuncMap.find(name);
+    if (it == m_siteFuncMap.end())
+    {
+        echo(client->cmdBev, "501 Unknown SITE command.");
+        return;
+    }
+    
+    (this->*(it->second))(client, subCmd);
+}
+
+void FtpServer::processSiteStats(FtpClient* client, ClientCommand cmd)
+{
+    ENSURE_SITE_ADMIN(client)
+    
+    std::string response = "211-Server statistics:\r\n";
+    response += m_admission->formatStats(evconnlistener_get_fd(m_cmdListener));
+    if (m_contentStore != NULL)
+        response += m_contentStore->formatStats();
+    response += TreeWalker::formatStats();
+    response += TarStreamer::formatStats();
+    response += SocketTuning::formatStats();
+    response += PathResolver::formatStats();
+    response += m_uploads->formatStats();
+    response += m_cachePolicy->formatStats();
+    response += m_quota->formatStats();
+    response += m_memory->formatStats();
+    response += m_trace->formatStats();
+    response += BlockMode::formatStats();
+    response += BufferPool::formatStats();
+    if (m_dirWatcher != NULL)
+        response += m_dirWatcher->formatStats();
+    if (m_journal != NULL)
+        response += m_journal->formatStats();
+    if (m_hotManifest != NULL)
+        response += m_hotManifest->formatStats();
+    if (m_lowLatency)
+    {
+        char buf[256];
+        sprintf(buf,
+                " loop.spin_usec %llu\r\n"
+                " loop.spin_hits %llu\r\n"
+                " loop.spin_misses %llu\r\n"
+                " loop.blocks %llu\r\n",
+                (unsigned long long)m_spinUsec, (unsigned long long)m_spinHits,
+                (unsigned long long)m_spinMisses, (unsigned long long)m_loopBlocks);
+        response += buf;
+    }
+    response += std::string(" ascii.kernel ") + AsciiConverter::kernelName() + "\r\n";
+    response += "211 End";
+    
+    echo(client->cmdBev, response);
+}
+
+void FtpServer::processSiteQuota(FtpClient* client, ClientCommand cmd)
+{
+    QuotaAccount* quota = client->quota;
+    if (quota == NULL)
+    {
+        echo(client->cmdBev, "211 No quota.");
+        return;
+    }
+
+    char buf[160];
+    sprintf(buf, "211 Quota: %llu of %llu bytes used%s.",
+            (unsigned long long)(quota->used < 0 ? 0 : quota->used), (unsigned long long)quota->limit,
+            quota->ready ? "" : " (initial scan in progress)");
+    echo(client->cmdBev, buf);
+}
+
+void FtpServer::processSiteMem(FtpClient* client, ClientCommand cmd)
+{
+    ENSURE_SITE_ADMIN(client)
+    
+    char buf[160];
+    sprintf(buf, "211-Buffer memory: %llu of %llu bytes used.\r\n",
+            (unsigned long long)m_memory->used(), (unsigned long long)m_memory->globalLimit());
+    std::string response = buf;
+
+    // 每个会话一行：会话号 用户 当前占用 峰值 状态
+    std::map<evutil_socket_t, FtpClient*>::iterator it;
+    for (it = m_clients.begin(); it != m_clients.end(); it++)
+    {
+        FtpClient* other = it->second;
+        snprintf(buf, sizeof(buf), " %llu %s %llu peak %llu%s%s\r\n",
+                (unsigned long long)other->sessionId, other->login ? other->user.c_str() : "-",
+                (unsigned long long)other->mem.bytes, (unsigned long long)other->mem.peak,
+                other->mem.paused ? " paused" : "",
+                other->transferState == TransferDeferred ? " deferred" : "");
+        response += buf;
+    }
+    response += "211 End";
+
+    echo(client->cmdBev, response);
+}
+
+void FtpServer::processSiteTrace(FtpClient* client, ClientCommand cmd)
+{
+    ENSURE_SITE_ADMIN(client)
+    
+    // SITE TRACE [DUMP|RESET]
+    std::string arg = cmd.data;
+    std::transform(arg.begin(), arg.end(), arg.begin(), ::toupper);
+    if (arg == "DUMP")
+    {
+        if (m_traceFile.empty())
+            echo(client->cmdBev, "550 trace_file is not configured.");
+        else if (m_trace->dumpChrome(m_traceFile))
+            echo(client->cmdBev, "200 Trace written to " + m_traceFile + ".");
+        else
+            echo(client->cmdBev, "550 Cannot write trace file.");
+    }
+    else if (arg == "RESET")
+    {
+        m_trace->clear();
+        echo(client->cmdBev, "200 Trace cleared.");
+    }
+    else if (arg.empty())
+    {
+        std::string response = "211-Transfer phase latencies:\r\n";
+        response += m_trace->formatHistograms();
+        response += "211 End";
+        echo(client->cmdBev, response);
+    }
+    else
+    {
+        echo(client->cmdBev, "501 Usage: SITE TRACE [DUMP|RESET]");
+    }
+}
+
+void FtpServer::traceDone(FtpClient* client, uint64_t bytes, const std::string& response)
+{
+    TransferTrace::mark(&client->trace, MarkDone);
+    m_trace->record(client->sessionId, bytes, response, &client->trace);
+    TransferTrace::reset(&client->trace);
+}
+
+void FtpServer::processSiteTree(FtpClient* client, ClientCommand cmd)
+{
+    std::string target = generateAbsoluteTarget(client, cmd.data);
+    if (client->vfs->hostPath(target).empty())
+    {
+        echo(client->cmdBev, "504 SITE TREE is not supported on this mount.");
+        return;
+    }
+
+    echo(client->cmdBev, "150 Opening BINARY mode data connection.");
+
+    TransferTrace::begin(&client->trace, "TREE");
+    client->listMode = ListTree;
+    client->listPattern.clear();
+    client->hasPendingCmd = true;
+    client->pendingCmd = cmd;
+    client->pendingAccessFile = target;
+    if (client->pasvsBev != NULL)
+        startTransfer(client);
+}
+
+void FtpServer::processSiteWatch(FtpClient* client, ClientCommand cmd)
+{
+    std::string target = generateAbsoluteTarget(client, cmd.data);
+    if (m_dirWatcher == NULL || client->vfs->hostPath(target).empty())
+    {
+        echo(client->cmdBev, "504 SITE WATCH is not supported on this mount.");
+        return;
+    }
+
+    int fd = client->vfs->openDir(target);
+    WatchSubscription* sub = (fd >= 0) ? m_dirWatcher->subscribe(fd, FtpServer::watchCallback, client) : NULL;
+    int error = errno;
+    if (fd >= 0)
+        close(fd);
+    if (sub == NULL)
+    {
+        // ENOSPC是fs.inotify.max_user_watches用完了
+        echo(client->cmdBev, (fd < 0 || error == ENOTDIR) ? "550 The directory cannot be found."
+                                                         : "451 Requested action aborted: cannot watch directory.");
+        return;
+    }
+
+    // 通知以151中间回复发出，直到客户端发下一个命令
+    client->watch = sub;
+    client->watchTicks = 0;
+    echo(client->cmdBev, "150 Watching " + target + "; send any command to stop.");
+}
+
+/*static*/ void FtpServer::watchCallback(const std::vector<std::string>& lines, bool overflow, bool removed, void* arg)
+{
+    FtpClient* client = (FtpClient*)arg;
+    FtpServer* serverPtr = client->serverPtr;
+
+    // 名字里的CR/LF会在命令通道上伪造出一行应答，这样的名字不发，按溢出让客户端重新LIST
+    for (size_t i = 0; i < lines.size(); i++)
+    {
+        if (lines[i].find_first_of("\r\n") != std::string::npos)
+            overflow = true;
+        else
+            serverPtr->echo(client->cmdBev, "151 " + lines[i]);
+    }
+
+    // 客户端不读命令通道时通知会越积越多，同样按溢出结束
+    if (evbuffer_get_length(bufferevent_get_output(client->cmdBev)) > WATCH_OUTPUT_LIMIT)
+        overflow = true;
+
+    if (overflow)
+        serverPtr->endWatch(client, "226 Watch ended; events were dropped, LIST to resync.");
+    else if (removed)
+        serverPtr->endWatch(client, "226 Watch ended; directory removed.");
+}
+
+void FtpServer::endWatch(FtpClient* client, const std::string& response)
+{
+    m_dirWatcher->unsubscribe(client->watch);
+    client->watch = NULL;
+    echo(client->cmdBev, response);
+}
+
+/*static*/ void FtpServer::pasvListenCallback(evconnlistener* listener, evutil_socket_t fd,
+    sockaddr* address, int socklen, void* arg)
+{
+    FtpClient* client = (FtpClient*)arg;
+    
+    SocketTuning::applyAccepted(fd, client->serverPtr->m_dataProfile);
+    bufferevent* pasvBev = bufferevent_socket_new(bufferevent_get_base(client->cmdBev), fd, BEV_OPT_CLOSE_ON_FREE);
+    client->serverPtr->setDataPriority(pasvBev);
+    bufferevent_setcb(pasvBev, FtpServer::pasvReadCallback, FtpServer::pasvWriteCallback,
+                      FtpServer::pasvEventCallback, arg);
+    bufferevent_enable(pasvBev, EV_READ|EV_WRITE|EV_PERSIST);
+    if (client->mem.paused)
+        bufferevent_disable(pasvBev, EV_READ);
+    client->pasvsBev = pasvBev;
+    client->serverPtr->attachBuffers(client, pasvBev, true);
+    TransferTrace::mark(&client->trace, MarkAccept);
+
+    // 处理之前待处理的命令
+    if (client->hasPendingCmd)
+        client->serverPtr->startTransfer(client);
+}
+
+/*static*/ void FtpServer::pasvReadCallback(bufferevent* bev, void* arg)
+{
+    FtpClient* client = (FtpClient*)arg;
+    FtpServer* serverPtr = client->serverPtr;
+    
+    // 上传还在等拆链接，先不读，数据留在套接字里
+    if (client->storPreparing)
+    {
+        bufferevent_disable(bev, EV_READ);
+        return;
+    }
+    
+    if (client->blockMode)
+    {
+        serverPtr->readBlocks(client);
+        return;
+    }
+    
+    static char buf[DATA_READ_SIZE];
+    size_t length;
+
+    // 一次读事件可能收到不止一个缓冲的数据，全部取完，输入队列不会越积越多
+    while ((length = bufferevent_read(bev, buf, DATA_READ_SIZE)) > 0)
+    {
+        // 处理客户端上传的文件
+        if (client->hasPendingCmd &&
+            (client->pendingCmd.op == STOR || client->pendingCmd.op == APPE) &&
+            !serverPtr->storeData(client, buf, length))
+            return;
+    }
+}
+
+bool FtpServer::storeData(FtpClient* client, const char* buf, size_t length)
+{
+    static char asciiBuf[DATA_READ_SIZE + 1];
+
+    // TYPE A把CRLF还原成LF，之后的配额、写入和散列都按转换后的字节
+    const char* data = buf;
+    if (client->type == TypeA)
+    {
+        length = AsciiConverter::toLocal(buf, length, asciiBuf, &client->asciiCr);
+        data = asciiBuf;
+    }
+
+    // 写入会越过配额时立即中止，不等整个文件传完
+    if (client->quota != NULL && !chargeQuota(client, length))
+    {
+        rejectStor(client);
+        return false;
+    }
+
+    TransferTrace::markOnce(&client->trace, MarkFirstByte);
+    client->storFile->write(data, length);
+    client->storBytes += length;
+    m_cachePolicy->advanceWrite(client->storFile->fd(), client->transferOffset + client->storBytes, &client->storCache);
+    if (client->storHash != NULL)
+        client->storHash->update(data, length);
+
+    // 原子上传定期落盘并记下偏移，断开或崩溃后可以从这里续传
+    uint64_t end = client->transferOffset + client->storBytes;
+    if (client->journal != NULL && !client->journal->syncing && end - client->checkpointAt >= m_checkpointBytes)
+    {
+        client->checkpointAt = end;
+        client->storFile->flush();
+        m_journal->checkpoint(client->journal, dup(client->storFile->fd()), end);
+    }
+    return true;
+}
+
+void FtpServer::readBlocks(FtpClient* client)
+{
+    static char buf[DATA_READ_SIZE];
+    evbuffer* input = bufferevent_get_input(client->pasvsBev);
+    BlockReader* reader = &client->blockReader;
+
+    // 没有待处理的上传时数据留在输入缓冲里，等STOR来了再解析
+    while (client->hasPendingCmd && (client->pendingCmd.op == STOR || client->pendingCmd.op == APPE))
+    {
+        if (reader->remaining == 0 && !BlockMode::readHeader(input, reader))
+            return;
+
+        int length = 0;
+        if (reader->remaining > 0)
+        {
+            length = evbuffer_remove(input, buf, std::min(reader->remaining, sizeof(buf)));
+            if (length <= 0)
+                return;
+            reader->remaining -= length;
+        }
+
+        // 客户端的重启标记：回复110，带上对应的文件偏移，断开后REST这个偏移即可续传
+        if (reader->descriptor & BlockMode::Restart)
+        {
+            for (int i = 0; i < length && reader->marker.size() < 64; i++)
+            {
+                if (buf[i] > ' ' && buf[i] < 0x7f)
+                    reader->marker += buf[i];
+            }
+            if (reader->remaining == 0)
+            {
+                char reply[160];
+                sprintf(reply, "110 MARK %s = %llu", reader->marker.c_str(),
+                        (unsigned long long)(client->transferOffset + client->storBytes));
+                echo(client->cmdBev, reply);
+            }
+            continue;
+        }
+
+        if (length > 0 && !storeData(client, buf, length))
+            return;
+
+        // EOF块收完即文件结束，连接留着传下一个文件
+        if (reader->remaining == 0 && (reader->descriptor & BlockMode::Eof))
+        {
+            TransferTrace::mark(&client->trace, MarkLastByte);
+            BlockMode::resetReader(reader);
+            finishStor(client);
+            client->hasPendingCmd = false;
+            return;
+        }
+    }
+}
+
+/*static*/ void FtpServer::pasvWriteCallback(bufferevent* bev, void* arg)
+{
+    FtpClient* client = (FtpClient*)arg;
+    FtpServer* serverPtr = client->serverPtr;
+    
+    if (client->transferState == TransferSending)
+    {
+        serverPtr->fillTransfer(client);
+    }
+    else if (client->transferState == TransferWalking)
+    {
+        client->walker->pump();
+    }
+    else if (client->transferState == TransferArchiving)
+    {
+        serverPtr->pumpArchive(client);
+    }
+    else if (client->transferState == TransferFlushing &&
+             evbuffer_get_length(bufferevent_get_output(bev)) == 0)
+    {
+        // 最后一个字节已写入套接字
+        serverPtr->finishTransfer(client, client->transferResponse);
+    }
+}
 
 /*static*/ void FtpServer::pasvEventCallback(bufferevent* bev, short event, void* arg)
 {
     FtpClient* client = (FtpClient*)arg;
     FtpServer* serverPtr = client->serverPtr;
     
+    // 下载或列目录过程中客户端断开了数据通道
+    if ((event & (BEV_EVENT_EOF|BEV_EVENT_ERROR)) && client->transferState != TransferIdle)
+    {
+        serverPtr->finishTransfer(client, "426 Connection closed; transfer aborted.");
+        serverPtr->closeDataConnection(client);
+        return;
+    }
+    
+    if ((event & (BEV_EVENT_EOF|BEV_EVENT_ERROR)) && client->blockMode)
+    {
+        // 块模式以EOF块结束文件，没收到它连接就断了说明文件不完整
+        if (client->hasPendingCmd &&
+            (client->pendingCmd.op == STOR || client->pendingCmd.op == APPE))
+        {
+            serverPtr->abortStor(client);
+            client->hasPendingCmd = false;
+            serverPtr->echo(client->cmdBev, "426 Connection closed; transfer aborted.");
+            serverPtr->traceDone(client, client->storBytes, "426");
+        }
+        serverPtr->closeDataConnection(client);
+        return;
+    }
+    
     if (event & BEV_EVENT_EOF)
     {
         // 客户端在数据通道主动关闭，表示文件上传完成
         if (client->hasPendingCmd && 
             (client->pendingCmd.op == STOR || client->pendingCmd.op == APPE))
         {
-            serverPtr->echo(client->cmdBev, "226 Transfer complete.");
-            
-            client->storFile->close();
-            delete client->storFile;
-            client->storFile = NULL;
-            
-            bufferevent_free(client->pasvsBev);
-            client->pasvsBev = NULL;
-            evconnlistener_free(client->pasvListener);
-            client->pasvListener = NULL;
+            TransferTrace::mark(&client->trace, MarkLastByte);
+            serverPtr->finishStor(client);
+            serverPtr->closeDataConnection(client);
             client->hasPendingCmd = false;
         }
     }
 }
 
+void FtpServer::finishStor(FtpClient* client)
+{
+    // TYPE A上传以单独的'\r'结尾时，它还留在转换状态里
+    if (client->asciiCr)
+    {
+        client->asciiCr = false;
+        if (client->quota == NULL || chargeQuota(client, 1))
+        {
+            client->storFile->write("\r", 1);
+            client->storBytes++;
+            if (client->storHash != NULL)
+                client->storHash->update("\r", 1);
+        }
+    }
+    
+    client->storFile->flush();
+    m_cachePolicy->endWrite(client->storFile->fd(), client->transferOffset + client->storBytes, &client->storCache);
+    int syncFd = (client->journal != NULL) ? dup(client->storFile->fd()) : -1;
+    bool ret = client->storFile->close();
+    delete client->storFile;
+    client->storFile = NULL;
+    
+    if (m_recorder != NULL)
+        m_recorder->recordData(client->sessionId, TraceDataIn, client->storBytes);
+
+    if (client->journal != NULL)
+    {
+        JournalEntry* entry = client->journal;
+        client->journal = NULL;
+        uint64_t oldSize = (client->quota != NULL) ? client->vfs->fileSize(client->pendingAccessFile) : 0;
+        PublishRequest* request = new PublishRequest(this, client, oldSize);
+        request->fd = syncFd;
+        std::string name;
+        if (ret && syncFd >= 0)
+            request->dirFd = client->vfs->openParent(client->pendingAccessFile, &name);
+
+        // 落盘和改名交给组提交，完成后在finishPublish里回复
+        if (request->dirFd >= 0)
+        {
+            client->storPublishing = true;
+            m_journal->publish(entry, name, request);
+            return;
+        }
+
+        if (syncFd >= 0)
+            close(syncFd);
+        delete request;
+        m_journal->discard(entry);
+        if (client->quota != NULL)
+            m_quota->shrink(client->quota, client->storSize);
+        ret = false;
+    }
+    
+    if (client->storHash != NULL)
+    {
+        std::string digest = client->storHash->finalHex();
+        delete client->storHash;
+        client->storHash = NULL;
+        uint64_t oldSize = (client->quota != NULL) ? client->vfs->fileSize(client->pendingAccessFile) : 0;
+        std::string name;
+        int dirFd = ret ? client->vfs->openParent(client->pendingAccessFile, &name) : -1;
+        if (dirFd >= 0)
+        {
+            // 线程池排满时数据已经收完了，不能丢，排队后由定时器重新提交
+            StoreCommitTask* task = new StoreCommitTask(this, m_contentStore, client, digest, dirFd, name, oldSize);
+            client->storPublishing = true;
+            if (!m_commitBacklog.empty() || !m_walkPool->submit(task))
+            {
+                m_commitBacklog.push_back(task);
+                scheduleCommitRetry();
+            }
+            return;
+        }
+
+        // 临时文件已删除，退回它占的用量
+        m_contentStore->discard(client->storTempFile);
+        ret = false;
+        if (client->quota != NULL)
+            m_quota->shrink(client->quota, client->storSize);
+    }
+    
+    std::string response = "226 Transfer complete.";
+    if (client->upload != NULL)
+    {
+        // 写失败的区段不算收到，客户端需要重传
+        UploadSession* upload = client->upload;
+        client->upload = NULL;
+        uint64_t begin = client->transferOffset;
+        uint64_t end = ret ? begin + client->storBytes : begin;
+        if (m_uploads->detach(upload, begin, end))
+        {
+            response = "226 Transfer complete; all segments received.";
+        }
+        else
+        {
+            char buf[128];
+            sprintf(buf, "226 Segment stored; %llu of %llu bytes received.",
+                    (unsigned long long)upload->received, (unsigned long long)upload->size);
+            response = buf;
+        }
+    }
+
+    if (!ret)
+        response = "451 Requested action aborted: local error in processing.";
+    response = completionReply(client, response);
+    echo(client->cmdBev, response);
+    traceDone(client, client->storBytes, response);
+}
+
+void FtpServer::scheduleCommitRetry()
+{
+    if (evtimer_pending(m_commitRetryTimer, NULL))
+        return;
+
+    struct timeval tv = {0, 10*1000};
+    evtimer_add(m_commitRetryTimer, &tv);
+}
+
+/*static*/ void FtpServer::commitRetryCallback(evutil_socket_t fd, short event, void* arg)
+{
+    FtpServer* serverPtr = (FtpServer*)arg;
+
+    // 按收完的顺序提交，队列又满了就等下一轮
+    std::list<StoreCommitTask*>& backlog = serverPtr->m_commitBacklog;
+    while (!backlog.empty() && serverPtr->m_walkPool->submit(backlog.front()))
+        backlog.pop_front();
+
+    if (!backlog.empty())
+        serverPtr->scheduleCommitRetry();
+}
+
+bool FtpServer::deferLinkBreak(FtpClient* client, const ClientCommand& cmd, const std::string& target,
+                               uint64_t offset, uint64_t allocSize)
+{
+    if (m_contentStore == NULL)
+        return false;
+    
+    // 父目录不存在时由随后的打开报错；不在本地磁盘上的后端没有去重
+    std::string name;
+    int dirFd = client->vfs->openParent(target, &name);
+    if (dirFd < 0)
+        return false;
+    if (!m_contentStore->isLinked(dirFd, name))
+    {
+        close(dirFd);
+        return false;
+    }
+    
+    LinkBreakTask* task = new LinkBreakTask(this, m_contentStore, client, cmd, dirFd, name, offset, allocSize);
+    if (!m_walkPool->submit(task))
+    {
+        delete task;
+        echo(client->cmdBev, "450 Requested file action not taken. Server busy, try again later.");
+        return true;
+    }
+    
+    client->storPreparing = true;
+    return true;
+}
+
+void FtpServer::finishLinkBreak(evutil_socket_t socket, uint64_t sessionId, bool ok, const ClientCommand& cmd,
+                                uint64_t offset, uint64_t allocSize)
+{
+    std::map<evutil_socket_t, FtpClient*>::iterator it = m_clients.find(socket);
+    if (it == m_clients.end() || it->second->sessionId != sessionId)
+        return;
+    
+    FtpClient* client = it->second;
+    client->storPreparing = false;
+    if (!ok)
+    {
+        echo(client->cmdBev, "550 File open failed.");
+        return;
+    }
+    
+    // 等待期间客户端在数据通道上开始了别的传输
+    if (client->hasPendingCmd || client->transferState != TransferIdle || client->storFile != NULL)
+    {
+        echo(client->cmdBev, "450 Requested file action not taken. Data connection busy.");
+        return;
+    }
+    
+    // 链接已经拆开，重新执行原命令，这次直接打开文件
+    client->restOffset = offset;
+    client->alloSize = allocSize;
+    ProcessFunc func = matchProcessFunc(cmd.op);
+    (this->*func)(client, cmd);
+    
+    // 等待期间先到的数据留在输入缓冲里，现在交给上传
+    if (client->pasvsBev != NULL)
+    {
+        if (!client->mem.paused)
+            bufferevent_enable(client->pasvsBev, EV_READ);
+        if (client->hasPendingCmd && evbuffer_get_length(bufferevent_get_input(client->pasvsBev)) > 0)
+            pasvReadCallback(client->pasvsBev, client);
+    }
+}
+
+void FtpServer::abortStor(FtpClient* client)
+{
+    // 上传中途断开，去重模式下残留的临时文件直接删除；原子上传保留临时文件，落盘后可以续传
+    client->storFile->flush();
+    m_cachePolicy->endWrite(client->storFile->fd(), client->transferOffset + client->storBytes, &client->storCache);
+    if (client->journal != NULL)
+    {
+        m_journal->suspend(client->journal, dup(client->storFile->fd()), client->transferOffset + client->storBytes);
+        client->journal = NULL;
+    }
+    client->storFile->close();
+    delete client->storFile;
+    client->storFile = NULL;
+    
+    if (client->storHash != NULL)
+    {
+        delete client->storHash;
+        client->storHash = NULL;
+        m_contentStore->discard(client->storTempFile);
+        if (client->quota != NULL)
+            m_quota->shrink(client->quota, client->storSize);
+    }
+
+    // 分段上传中断时已经写下去的部分仍然有效，客户端只需续传剩下的
+    if (client->upload != NULL)
+    {
+        m_uploads->detach(client->upload, client->transferOffset, client->transferOffset + client->storBytes);
+        client->upload = NULL;
+    }
+}
+
+void FtpServer::attachBuffers(FtpClient* client, bufferevent* bev, bool chargeInput)
+{
+    if (chargeInput)
+        evbuffer_add_cb(bufferevent_get_input(bev), FtpServer::bufferChargeCallback, client);
+    evbuffer_add_cb(bufferevent_get_output(bev), FtpServer::bufferChargeCallback, client);
+}
+
+void FtpServer::detachBuffers(FtpClient* client, bufferevent* bev)
+{
+    // 释放bufferevent时不会再有回调，队列里剩下的字节在这里退回
+    evbuffer* input = bufferevent_get_input(bev);
+    evbuffer* output = bufferevent_get_output(bev);
+    if (evbuffer_remove_cb(input, FtpServer::bufferChargeCallback, client) == 0)
+        m_memory->release(&client->mem, evbuffer_get_length(input));
+    evbuffer_remove_cb(output, FtpServer::bufferChargeCallback, client);
+    m_memory->release(&client->mem, evbuffer_get_length(output));
+    checkMemory(client);
+}
+
+/*static*/ void FtpServer::bufferChargeCallback(evbuffer* buffer, const evbuffer_cb_info* info, void* arg)
+{
+    FtpClient* client = (FtpClient*)arg;
+    FtpServer* serverPtr = client->serverPtr;
+
+    if (info->n_added > 0)
+        serverPtr->m_memory->charge(&client->mem, info->n_added);
+    if (info->n_deleted > 0)
+        serverPtr->m_memory->release(&client->mem, info->n_deleted);
+    serverPtr->checkMemory(client);
+}
+
+void FtpServer::checkMemory(FtpClient* client)
+{
+    // 会话超限：不再读命令和上传数据，下载也停止补充
+    if (!client->mem.paused && m_memory->sessionFull(&client->mem))
+    {
+        client->mem.paused = true;
+        m_memory->recordPause();
+        if (client->cmdBev != NULL)
+            bufferevent_disable(client->cmdBev, EV_READ);
+        if (client->pasvsBev != NULL)
+            bufferevent_disable(client->pasvsBev, EV_READ);
+    }
+    else if (client->mem.paused && m_memory->sessionRelieved(&client->mem))
+    {
+        client->mem.paused = false;
+        if (client->cmdBev != NULL)
+            bufferevent_enable(client->cmdBev, EV_READ);
+        if (client->pasvsBev != NULL)
+            bufferevent_enable(client->pasvsBev, EV_READ);
+        if (!m_stalled.empty())
+            event_active(m_memoryWakeup, EV_TIMEOUT, 0);
+    }
+
+    // 正处在别的会话的缓冲操作当中，推迟到下一轮事件循环再开始新的传输
+    if (!m_deferred.empty() && !m_memory->globalTight())
+        event_active(m_memoryWakeup, EV_TIMEOUT, 0);
+}
+
+/*static*/ void FtpServer::memoryWakeupCallback(evutil_socket_t fd, short event, void* arg)
+{
+    FtpServer* serverPtr = (FtpServer*)arg;
+    serverPtr->resumeTransfers();
+}
+
+void FtpServer::resumeTransfers()
+{
+    std::list<FtpClient*> stalled;
+    stalled.swap(m_stalled);
+    std::list<FtpClient*>::iterator it;
+    for (it = stalled.begin(); it != stalled.end(); it++)
+    {
+        FtpClient* client = *it;
+        if (client->transferState == TransferSending)
+            fillTransfer(client);
+        else if (client->transferState == TransferArchiving)
+            pumpArchive(client);
+    }
+
+    while (!m_deferred.empty() && !m_memory->globalTight())
+    {
+        FtpClient* client = m_deferred.front();
+        m_deferred.pop_front();
+
+        // 等待期间数据通道断开或换了命令的不再开始
+        if (client->transferState != TransferDeferred)
+            continue;
+        client->transferState = TransferIdle;
+        if (client->hasPendingCmd && client->pasvsBev != NULL)
+            startTransfer(client);
+    }
+}
+
+bool FtpServer::chargeQuota(FtpClient* client, size_t length)
+{
+    // 覆盖写已有的部分不增加用量，只有文件变长的部分才计入
+    uint64_t end = client->transferOffset + client->storBytes + length;
+    if (end <= client->storSize)
+        return true;
+
+    uint64_t growth = end - client->storSize;
+    if (!m_quota->canGrow(client->quota, growth))
+        return false;
+
+    m_quota->grow(client->quota, growth);
+    client->storSize = end;
+    return true;
+}
+
+void FtpServer::rejectStor(FtpClient* client)
+{
+    // 已经写下去的部分保留并计入用量
+    m_quota->recordRejected();
+    abortStor(client);
+    client->hasPendingCmd = false;
+    closeDataConnection(client);
+    echo(client->cmdBev, "552 Requested file action aborted. Exceeded storage allocation.");
+    traceDone(client, client->storBytes, "552");
+}
+
+/*static*/ void FtpServer::quotaTimerCallback(evutil_socket_t fd, short event, void* arg)
+{
+    FtpServer* serverPtr = (FtpServer*)arg;
+    if (!serverPtr->m_quota->save())
+    {
+        std::string msg = "cannot save quota state";
+        serverPtr->log(msg);
+    }
+}
+
+/*static*/ void FtpServer::manifestTimerCallback(evutil_socket_t fd, short event, void* arg)
+{
+    FtpServer* serverPtr = (FtpServer*)arg;
+    if (!serverPtr->m_hotManifest->save())
+    {
+        std::string msg = "cannot save hot manifest";
+        serverPtr->log(msg);
+    }
+}
+
+/*static*/ void FtpServer::reloadSignalCallback(evutil_socket_t fd, short event, void* arg)
+{
+    FtpServer* serverPtr = (FtpServer*)arg;
+    if (!serverPtr->m_userDb->reload(serverPtr->m_authPool, serverPtr->m_logger))
+    {
+        std::string msg = "user file reload skipped";
+        serverPtr->log(msg);
+    }
+}
+
 /*static*/ void FtpServer::cmdTimerCallback(evutil_socket_t fd, short event, void* arg)
 {
     FtpClient* client = (FtpClient*)arg;
     FtpServer* serverPtr = client->serverPtr;
     
+    // 升级过程中，进行中的传输结束后把会话交给新进程。SITE WATCH先结束，客户端到新进程上重新发起
+    if (serverPtr->m_draining && client->watch != NULL)
+        serverPtr->endWatch(client, "226 Watch ended; server restarting.");
+    if (serverPtr->m_draining && serverPtr->isIdle(client))
+    {
+        serverPtr->handOffSession(client);
+        return;
+    }
+    
+    // 等通知的会话不算空闲；长轮询最多等watch_timeout秒，客户端再重新发起
+    if (client->watch != NULL)
+    {
+        client->cmdTickCount = 0;
+        if (serverPtr->m_watchTimeout > 0 && ++client->watchTicks >= serverPtr->m_watchTimeout)
+            serverPtr->endWatch(client, "226 Watch timed out.");
+        return;
+    }
+    
     // 超时则主动关闭命令客户端
     client->cmdTickCount++;
     if (client->cmdTickCount >= serverPtr->m_cmdTimeout)
         serverPtr->removeClient(client);
 }
 
+void FtpServer::setTakeover(bool takeover)
+{
+    m_takeover = takeover;
+}
+
+bool FtpServer::startUpgradeListener()
+{
+    m_upgradeListenFd = UpgradeChannel::listen(m_upgradePath);
+    if (m_upgradeListenFd == -1)
+        return false;
+    
+    m_upgradeListenEvent = event_new(m_eventBase, m_upgradeListenFd, EV_READ|EV_PERSIST,
+                                     FtpServer::upgradeAcceptCallback, this);
+    event_add(m_upgradeListenEvent, NULL);
+    return true;
+}
+
+/*static*/ void FtpServer::upgradeAcceptCallback(evutil_socket_t fd, short event, void* arg)
+{
+    FtpServer* serverPtr = (FtpServer*)arg;
+    int sock = accept4(fd, NULL, NULL, SOCK_CLOEXEC);
+    if (sock == -1)
+        return;
+    
+    if (serverPtr->m_draining)
+    {
+        close(sock);
+        return;
+    }
+    
+    if (!UpgradeChannel::trustedPeer(sock))
+    {
+        std::string msg = "upgrade: rejected connection from another user";
+        serverPtr->log(msg);
+        close(sock);
+        return;
+    }
+    
+    serverPtr->beginHandoff(sock);
+}
+
+void FtpServer::beginHandoff(int sock)
+{
+    std::string msg = "upgrade: handing off listener and idle sessions";
+    log(msg);
+    
+    // 监听套接字交给新进程后，本进程不再accept；升级通道的路径由新进程重新绑定
+    if (!UpgradeChannel::sendMessage(sock, "LISTENER", evconnlistener_get_fd(m_cmdListener)))
+    {
+        close(sock);
+        return;
+    }
+    
+    evconnlistener_disable(m_cmdListener);
+    event_free(m_upgradeListenEvent);
+    m_upgradeListenEvent = NULL;
+    close(m_upgradeListenFd);
+    m_upgradeListenFd = -1;
+    
+    m_handoffFd = sock;
+    m_draining = true;
+    
+    // 先交出当前空闲的会话，其余的在传输结束后由命令通道定时器交出
+    std::vector<FtpClient*> idle;
+    std::map<evutil_socket_t, FtpClient*>::iterator it;
+    for (it = m_clients.begin(); it != m_clients.end(); it++)
+    {
+        if (isIdle(it->second))
+            idle.push_back(it->second);
+    }
+    for (size_t i = 0; i < idle.size(); i++)
+        handOffSession(idle[i]);
+    
+    checkDrained();
+}
+
+bool FtpServer::isIdle(FtpClient* client)
+{
+    // 没有传输时打开着的数据连接不算忙：MODE B在文件之间一直保持连接，交接时关掉，客户端重新PASV
+    return (!client->authPending && !client->hasPendingCmd &&
+            client->storFile == NULL && client->retrFile == NULL && !client->storPublishing && !client->storPreparing && client->watch == NULL &&
+            client->transferState == TransferIdle &&
+            evbuffer_get_length(bufferevent_get_input(client->cmdBev)) == 0 &&
+            evbuffer_get_length(bufferevent_get_output(client->cmdBev)) == 0);
+}
+
+void FtpServer::handOffSession(FtpClient* client)
+{
+    std::vector<std::string> fields;
+    fields.push_back("SESSION");
+    fields.push_back(client->user);
+    fields.push_back(client->login ? "1" : "0");
+    fields.push_back(client->rootPath);
+    fields.push_back(client->curRelativePath);
+    fields.push_back(client->type == TypeA ? "A" : "I");
+    fields.push_back(client->blockMode ? "B" : "S");
+    
+    // 数据连接不随会话交接，空闲的数据连接和未连上的PASV监听先关掉
+    closeDataConnection(client);
+    
+    // 交接失败时保留会话，由本进程继续服务
+    if (!UpgradeChannel::sendMessage(m_handoffFd, UpgradeChannel::join(fields), client->cmdSocket))
+        return;
+    
+    // 新进程已持有套接字的副本，这里关闭本进程的描述符不影响连接
+    removeClient(client);
+}
+
+void FtpServer::checkDrained()
+{
+    if (!m_draining || !m_clients.empty())
+        return;
+    
+    std::string msg = "upgrade: all sessions handed off or finished, exiting";
+    log(msg);
+    
+    UpgradeChannel::sendMessage(m_handoffFd, "END");
+    close(m_handoffFd);
+    m_handoffFd = -1;
+    m_draining = false;
+    event_base_loopexit(m_eventBase, NULL);
+}
+
+bool FtpServer::takeOver()
+{
+    m_takeoverFd = UpgradeChannel::connect(m_upgradePath);
+    if (m_takeoverFd == -1)
+        return false;
+    
+    std::string payload;
+    int fd = -1;
+    if (!UpgradeChannel::recvMessage(m_takeoverFd, &payload, &fd) || payload != "LISTENER" || fd == -1)
+    {
+        close(m_takeoverFd);
+        m_takeoverFd = -1;
+        return false;
+    }
+    
+    evutil_make_socket_nonblocking(fd);
+    m_cmdListener = evconnlistener_new(m_eventBase, FtpServer::listenCallback, this,
+                                       LEV_OPT_REUSEABLE|LEV_OPT_CLOSE_ON_FREE, -1, fd);
+    SocketTuning::applyListener(fd, m_controlProfile);
+    
+    evutil_make_socket_nonblocking(m_takeoverFd);
+    m_takeoverEvent = event_new(m_eventBase, m_takeoverFd, EV_READ|EV_PERSIST,
+                                FtpServer::takeoverReadCallback, this);
+    event_add(m_takeoverEvent, NULL);
+    return true;
+}
+
+/*static*/ void FtpServer::takeoverReadCallback(evutil_socket_t fd, short event, void* arg)
+{
+    FtpServer* serverPtr = (FtpServer*)arg;
+    
+    for (;;)
+    {
+        std::string payload;
+        int sessionFd = -1;
+        if (!UpgradeChannel::recvMessage(fd, &payload, &sessionFd))
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+                return;
+            payload = "END";
+        }
+        
+        // 旧进程没发END就退出了，按交接结束处理，否则可读的EOF会让持久事件一直触发
+        if (payload.empty())
+            payload = "END";
+        
+        std::vector<std::string> fields = UpgradeChannel::split(payload);
+        if (fields[0] == "SESSION" && sessionFd != -1)
+        {
+            serverPtr->adoptSession(sessionFd, fields);
+        }
+        else if (fields[0] == "END")
+        {
+            if (sessionFd != -1)
+                close(sessionFd);
+            
+            std::string msg = "upgrade: takeover complete";
+            serverPtr->log(msg);
+            
+            event_free(serverPtr->m_takeoverEvent);
+            serverPtr->m_takeoverEvent = NULL;
+            close(fd);
+            serverPtr->m_takeoverFd = -1;
+            return;
+        }
+        else if (sessionFd != -1)
+        {
+            close(sessionFd);
+        }
+    }
+}
+
+void FtpServer::adoptSession(int fd, const std::vector<std::string>& fields)
+{
+    if (fields.size() < 6)
+    {
+        close(fd);
+        return;
+    }
+    
+    sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    memset(&addr, 0, sizeof(addr));
+    getpeername(fd, (sockaddr*)&addr, &len);
+    evutil_make_socket_nonblocking(fd);
+    
+    FtpClient* client = createSession(fd, addr);
+    client->user = fields[1];
+    client->rootPath = fields[3];
+    client->curRelativePath = Vfs::normalize(fields[4]);
+    client->type = (fields[5] == "A") ? TypeA : TypeI;
+    client->blockMode = (fields.size() > 6 && fields[6] == "B");
+    if (fields[2] == "1")
+    {
+        client->login = true;
+        client->vfs = Vfs::create(client->rootPath);
+        client->vfs->changeDir(client->curRelativePath);
+        if (!client->vfs->hostPath("/").empty())
+            client->quota = m_quota->account(client->rootPath, m_walkPool);
+        m_admission->addUser(client->user);
+    }
+}
+
 void FtpServer::echo(bufferevent* bev, std::string response, bool immediately /*= false*/)
 {
     response += "\r\n";
@@ -829,12 +3343,13 @@ void FtpServer::echo(bufferevent* bev, std::string response, bool immediately /*
 std::string FtpServer::generateAbsoluteTarget(FtpClient* client, std::string fileOrDir)
 {
     if (fileOrDir.empty())
-        return client->rootPath + client->curRelativePath;
+        return client->curRelativePath;
     
+    // 逻辑路径，由client->vfs映射到实际存储；规范化后".."到根目录为止
     if (fileOrDir.at(0) == '/')
-        return client->rootPath + fileOrDir;
+        return Vfs::normalize(fileOrDir);
     
-    return client->rootPath + client->curRelativePath + "/" + fileOrDir;
+    return Vfs::normalize(client->curRelativePath + "/" + fileOrDir);
 }
 
 void FtpServer::log(std::string& msg)
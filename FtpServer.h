@@ -8,21 +8,41 @@
 
 #include <event2/event.h>
 #include <event2/bufferevent.h>
+#include <event2/buffer.h>
 #include <event2/listener.h>
 
 #include <string>
 #include <map>
 #include <list>
+#include <set>
+#include <vector>
 #include "LocalFile.h"
 #include "Logger.h"
+#include "Config.h"
+#include "ContentStore.h"
+#include "Sha256.h"
+#include "UserDatabase.h"
+#include "ThreadPool.h"
+#include "AdmissionControl.h"
+#include "SessionRecorder.h"
+#include "UpgradeChannel.h"
+#include "Vfs.h"
+#include "TreeWalker.h"
+#include "UploadTracker.h"
+#include "CachePolicy.h"
+#include "QuotaManager.h"
+#include "MemoryBudget.h"
+#include "TransferTrace.h"
+#include "TarStreamer.h"
+#include "SocketTuning.h"
+#include "UploadJournal.h"
+#include "HotManifest.h"
+#include "BlockMode.h"
+#include "DirWatcher.h"
+#include "BufferPool.h"
 
 class FtpServer;
-
-struct UserConfig
-{
-    std::string password;
-    std::string rootPath;
-};
+class StoreCommitTask;
 
 enum ClientOperation
 {
@@ -37,6 +57,7 @@ enum ClientOperation
     CDUP,
     PWD,
     PASV,
+    MODE,
     LIST,
     NLST,
     STOR,
@@ -47,8 +68,11 @@ enum ClientOperation
     DELE,
     RNFR,
     RNTO,
+    REST,
+    ALLO,
     ABOR,
     NOOP,
+    SITE,
     QUIT
 };
 
@@ -64,25 +88,89 @@ enum DataType
     TypeA
 };
 
+// 数据通道上下行传输的状态
+enum TransferState
+{
+    TransferIdle,
+    TransferSending,    // 输出缓冲低于低水位时从文件补充数据
+    TransferWalking,    // 递归列目录，输出缓冲低于低水位时继续派发扫描任务
+    TransferArchiving,  // 打包下载目录，输出缓冲低于低水位时继续生成
+    TransferFlushing,   // 数据已全部入队，等待输出缓冲发空后回复226
+    TransferDeferred    // 全局缓冲内存紧张，下载或列目录排队等待
+};
+
+// RETR <目录>.tar/.tar.gz/.tgz且没有同名文件时打包下载该目录
+enum ArchiveMode
+{
+    ArchiveNone,
+    ArchiveTar,
+    ArchiveTarGz
+};
+
+// 列目录的方式
+enum ListMode
+{
+    ListPlain,
+    ListNames,          // NLST
+    ListRecursive,      // LIST -R
+    ListTree            // SITE TREE
+};
+
 struct FtpClient
 {
     evutil_socket_t cmdSocket;
+    uint64_t sessionId;     // 套接字会被复用，异步任务回来时用它确认还是同一个会话
     sockaddr_in addr;
     std::string user;
     bool login;
+    bool authPending;       // 密码正在工作线程中校验
+    unsigned int authSeq;   // 每次USER/PASS递增，丢弃过期的校验结果
     std::string rootPath;   // 逻辑根目录的实际路径
     std::string curRelativePath;    // 逻辑路径
+    Vfs* vfs;               // 登录后按rootPath挂载的文件系统
     
     bufferevent* cmdBev;
     bufferevent* pasvsBev;
     evconnlistener* pasvListener;
     ClientCommand lastCmd;  // 上一个命令
     DataType type;
+    bool blockMode;         // MODE B：数据连接在传输之间保持打开
+    BlockReader blockReader;    // 块模式上传的块头解析状态
+    uint64_t nextMarker;    // 块模式下载下一个重启标记的文件偏移
 
     bool hasPendingCmd;
     ClientCommand pendingCmd;   // 上一个待处理的命令，一般是需要数据通道配合使用的命令，如LIST、RETR等
     std::string pendingAccessFile;  // 待处理命令关联的文件
-    LocalFile* storFile;    // 收到STOR文件上传命令后，在服务器端存储的文件
+    VfsFile* storFile;    // 收到STOR文件上传命令后，在服务器端存储的文件
+    VfsFile* retrFile;    // 正在下载的文件
+    uint64_t sentBytes;     // 本次下载/列目录已入队的字节数
+    uint64_t restOffset;    // REST设置的偏移，下一个STOR/RETR使用后清零
+    uint64_t alloSize;      // ALLO声明的文件长度，下一个STOR使用后清零
+    uint64_t transferOffset;    // 本次传输在文件中的起始偏移
+    UploadSession* upload;  // 参与的分段上传，没有时为NULL
+    CacheCursor retrCache;  // 下载文件的页缓存游标
+    CacheCursor storCache;  // 上传文件的页缓存游标
+    QuotaAccount* quota;    // 根目录的配额账户，不限额时为NULL
+    uint64_t storSize;      // 上传文件当前的长度，写过这个位置的部分才计入用量
+    MemoryCharge mem;       // 命令和数据通道缓冲占用的内存
+    TransferMarks trace;    // 当前传输经过各阶段的时间点
+    bool asciiCr;           // TYPE A换行转换跨块的'\r'状态
+    TransferState transferState;
+    std::string transferResponse;   // 输出缓冲发空后回复的内容
+    ListMode listMode;
+    std::string listPattern;    // LIST/NLST参数最后一级中的通配符，为空时不过滤
+    TreeWalker* walker;     // 正在进行的递归列目录
+    ArchiveMode archive;    // 待处理的RETR是否打包下载目录
+    TarStreamer* tar;       // 正在进行的打包下载
+    Sha256* storHash;       // 去重模式下边收边算的内容摘要，非去重模式为NULL
+    std::string storTempFile;   // 去重模式下上传先落到存储的临时文件
+    JournalEntry* journal;      // 原子上传在日志里的条目，其他上传为NULL
+    uint64_t checkpointAt;      // 上一个检查点的偏移
+    bool storPublishing;        // 上传已收完，等落盘和改名后才回复226
+    bool storPreparing;         // 上传前正在工作线程里拆开去重的硬链接，完成后重新执行命令
+    WatchSubscription* watch;   // SITE WATCH的订阅，没有时为NULL
+    int watchTicks;             // 本次SITE WATCH已经等了的秒数
+    uint64_t storBytes;
     
     event* cmdTimer;    // 命令通道超时
     short cmdTickCount;
@@ -90,41 +178,89 @@ struct FtpClient
     FtpServer* serverPtr;   // 方便在类静态函数中操作FtpServer类
 };
 
+// 事件优先级，数值小的先处理。libevent每轮循环只处理有活动事件的最高一级，
+// 命令通道有数据时先于所有数据通道的回调运行
+enum EventPriority
+{
+    PriorityControl,    // 命令通道和会话超时
+    PriorityDefault,    // 监听、工作线程的通知和其他定时器
+    PriorityData,       // PASV数据通道
+    PriorityCount
+};
+
 typedef void (FtpServer::*ProcessFunc)(FtpClient*, ClientCommand);
 
 class FtpServer
 {
+    friend class AuthTask;
+    friend class PublishRequest;
+    friend class LinkBreakTask;
+    friend class StoreCommitTask;
+    
 public:
-    FtpServer();
+    FtpServer(const Config& config);
     ~FtpServer();
 
     int start();
+    void setTakeover(bool takeover);
     
 protected:
+    void runLoop();
+
     void initUserConfigs();
     void clearUserConfigs();
     
     void initCmdMaps();
     ClientOperation matchCmdOp(std::string cmd);
     ProcessFunc matchProcessFunc(ClientOperation op);
-    UserConfig* findUserConfig(const std::string& user);
+    const UserConfig* findUserConfig(const std::string& user);
     
     static void listenCallback(evconnlistener* listener, evutil_socket_t fd,
                                sockaddr* address, int socklen, void* arg);
+    static void acceptErrorCallback(evconnlistener* listener, void* arg);
+    FtpClient* createSession(evutil_socket_t fd, const sockaddr_in& addr);
+    static void acceptResumeCallback(evutil_socket_t fd, short event, void* arg);
+    static void commitRetryCallback(evutil_socket_t fd, short event, void* arg);
     static void readCallback(bufferevent* bev, void* arg);
     static void eventCallback(bufferevent* bev, short event, void* arg);
     
     static void pasvListenCallback(evconnlistener* listener, evutil_socket_t fd,
                                    sockaddr* address, int socklen, void* arg);
     static void pasvReadCallback(bufferevent* bev, void* arg);
+    static void pasvWriteCallback(bufferevent* bev, void* arg);
     static void pasvEventCallback(bufferevent* bev, short event, void* arg);
     
     static void cmdTimerCallback(evutil_socket_t fd, short event, void* arg);
+    static void reloadSignalCallback(evutil_socket_t fd, short event, void* arg);
+    static void quotaTimerCallback(evutil_socket_t fd, short event, void* arg);
+    static void manifestTimerCallback(evutil_socket_t fd, short event, void* arg);
+
+    // 缓冲内存记账：evbuffer的每次增减计入会话和全局预算
+    void attachBuffers(FtpClient* client, bufferevent* bev, bool chargeInput);
+    void detachBuffers(FtpClient* client, bufferevent* bev);
+    static void bufferChargeCallback(evbuffer* buffer, const evbuffer_cb_info* info, void* arg);
+    void checkMemory(FtpClient* client);
+    static void memoryWakeupCallback(evutil_socket_t fd, short event, void* arg);
+    void resumeTransfers();
+    
+    // 平滑升级：旧进程把监听套接字和空闲会话交给新进程，自己处理完进行中的传输后退出
+    bool startUpgradeListener();
+    static void upgradeAcceptCallback(evutil_socket_t fd, short event, void* arg);
+    void beginHandoff(int sock);
+    bool isIdle(FtpClient* client);
+    void handOffSession(FtpClient* client);
+    void checkDrained();
+    bool takeOver();
+    static void takeoverReadCallback(evutil_socket_t fd, short event, void* arg);
+    void adoptSession(int fd, const std::vector<std::string>& fields);
 
     void processUnknown(FtpClient* client, ClientCommand cmd);
     void processAuth(FtpClient* client, ClientCommand cmd);
     void processUser(FtpClient* client, ClientCommand cmd);
     void processPass(FtpClient* client, ClientCommand cmd);
+    void finishPass(evutil_socket_t socket, uint64_t sessionId, unsigned int authSeq,
+                    bool ok, const std::string& rootPath, const std::string& cacheKey);
+    void loginSucceeded(FtpClient* client, const std::string& rootPath);
     void processSyst(FtpClient* client, ClientCommand cmd);
     void processFeat(FtpClient* client, ClientCommand cmd);
     
@@ -133,13 +269,30 @@ protected:
     void processPwd(FtpClient* client, ClientCommand cmd);
     void processType(FtpClient* client, ClientCommand cmd);
     void processPasv(FtpClient* client, ClientCommand cmd);
+    void processMode(FtpClient* client, ClientCommand cmd);
     void processList(FtpClient* client, ClientCommand cmd);
     void echoList(FtpClient* client, const std::string& dir);
+    void setListTarget(FtpClient* client, const std::string& arg);
+    void startTransfer(FtpClient* client);
     void processNlst(FtpClient* client, ClientCommand cmd);
     
     void processRetr(FtpClient* client, ClientCommand cmd);
     void echoFile(FtpClient* client, const std::string& filename);
+    void fillTransfer(FtpClient* client);
+    bool fillBlocks(FtpClient* client, evbuffer* output, size_t* count);
+    void echoArchive(FtpClient* client, const std::string& dir);
+    void pumpArchive(FtpClient* client);
+    void closeRetrFile(FtpClient* client);
+    void startFlushing(FtpClient* client, const std::string& response = "226 Transfer complete.");
+    static void walkDoneCallback(TreeWalker* walker, void* arg);
+    void finishTransfer(FtpClient* client, const std::string& response);
+    std::string completionReply(FtpClient* client, const std::string& response);
+    void closeDataConnection(FtpClient* client);
+    void setDataPriority(bufferevent* bev);
     void processStor(FtpClient* client, ClientCommand cmd);
+    bool beginAtomicStor(FtpClient* client, const std::string& target, const std::string& hostTarget, uint64_t offset);
+    void finishPublish(evutil_socket_t socket, uint64_t sessionId, bool ok, uint64_t bytes,
+                       QuotaAccount* quota, uint64_t release);
     void processAppe(FtpClient* client, ClientCommand cmd);
     
     void processMkd(FtpClient* client, ClientCommand cmd);
@@ -147,10 +300,35 @@ protected:
     void processDele(FtpClient* client, ClientCommand cmd);
     void processRnfr(FtpClient* client, ClientCommand cmd);
     void processRnto(FtpClient* client, ClientCommand cmd);
+    void processRest(FtpClient* client, ClientCommand cmd);
+    void processAllo(FtpClient* client, ClientCommand cmd);
     
     void processAbor(FtpClient* client, ClientCommand cmd);
     void processNoop(FtpClient* client, ClientCommand cmd);
     void processQuit(FtpClient* client, ClientCommand cmd);
+    
+    void processSite(FtpClient* client, ClientCommand cmd);
+    void processSiteStats(FtpClient* client, ClientCommand cmd);
+    void processSiteTree(FtpClient* client, ClientCommand cmd);
+    void processSiteQuota(FtpClient* client, ClientCommand cmd);
+    void processSiteMem(FtpClient* client, ClientCommand cmd);
+    void processSiteTrace(FtpClient* client, ClientCommand cmd);
+    void processSiteWatch(FtpClient* client, ClientCommand cmd);
+    static void watchCallback(const std::vector<std::string>& lines, bool overflow, bool removed, void* arg);
+    void endWatch(FtpClient* client, const std::string& response);
+    void traceDone(FtpClient* client, uint64_t bytes, const std::string& response);
+    
+    bool storeData(FtpClient* client, const char* data, size_t length);
+    void readBlocks(FtpClient* client);
+    void finishStor(FtpClient* client);
+    void abortStor(FtpClient* client);
+    bool deferLinkBreak(FtpClient* client, const ClientCommand& cmd, const std::string& target,
+                        uint64_t offset, uint64_t allocSize);
+    void finishLinkBreak(evutil_socket_t socket, uint64_t sessionId, bool ok, const ClientCommand& cmd,
+                         uint64_t offset, uint64_t allocSize);
+    void scheduleCommitRetry();
+    bool chargeQuota(FtpClient* client, size_t length);
+    void rejectStor(FtpClient* client);
 
     void echo(bufferevent* bev, std::string response, bool immediately = false);
     std::string generateAbsoluteTarget(FtpClient* client, std::string fileOrDir);
@@ -170,11 +348,81 @@ protected:
     uint16_t m_cmdPort;
     short m_cmdTimeout;
     evconnlistener* m_cmdListener;
-    std::map<std::string, UserConfig*> m_userConfigMap;
+    UserDatabase* m_userDb;
+    std::string m_usersFile;
+    event* m_reloadEvent;   // SIGHUP重新加载用户文件
+    ThreadPool* m_authPool; // 慢散列放到工作线程校验，避免登录风暴卡住事件循环
+    int m_authThreads;
+    int m_authQueue;
+    size_t m_authCacheSize;
+    std::set<std::string> m_authCache;  // 校验通过的结果缓存，键为用户、密码和散列的摘要
+    std::list<std::string> m_authCacheOrder;
+    uint64_t m_nextSessionId;
+    AdmissionControl* m_admission;
+    event* m_acceptResumeTimer;     // fd耗尽时暂停监听，退避后恢复
+    std::list<StoreCommitTask*> m_commitBacklog;    // 线程池排满时等待重新提交的去重提交
+    event* m_commitRetryTimer;
+    int m_acceptBackoffMs;
+    size_t m_transferChunkSize;     // 每次从文件补充的字节数
+    size_t m_transferLowWatermark;  // 输出缓冲低于该值时补充
+    std::vector<char> m_asciiBuffer;    // TYPE A下载转换前的暂存区，一个补充块大小
+    ThreadPool* m_walkPool;         // 递归列目录的扫描线程
+    int m_walkThreads;
+    int m_walkQueue;
+    int m_treeMaxDepth;
+    uint64_t m_treeMaxEntries;
+    size_t m_tarSendfileMin;        // 打包下载时不小于该长度的文件用sendfile发送
+    int m_tarGzipLevel;
+    SocketProfile m_controlProfile;     // 命令通道的套接字参数
+    SocketProfile m_dataProfile;        // 数据通道的套接字参数
+    SessionRecorder* m_recorder;    // 会话录制，未开启时为NULL
+    std::string m_upgradePath;      // 升级通道的Unix套接字路径，为空则不支持平滑升级
+    bool m_takeover;                // 启动时从旧进程接管，而不是自己绑定端口
+    int m_upgradeListenFd;
+    event* m_upgradeListenEvent;
+    int m_handoffFd;                // 旧进程：到新进程的连接
+    bool m_draining;                // 旧进程：已交出监听，等待剩余会话结束
+    int m_takeoverFd;               // 新进程：到旧进程的连接
+    event* m_takeoverEvent;
     std::map<evutil_socket_t, FtpClient*> m_clients;
     std::map<ClientOperation, ProcessFunc> m_processFuncMap;
     std::map<std::string, ClientOperation> m_strOpMap;
+    std::map<std::string, ProcessFunc> m_siteFuncMap;  // SITE子命令
     Logger* m_logger;
+    ContentStore* m_contentStore;   // 未开启去重时为NULL
+    UploadTracker* m_uploads;       // 进行中的分段上传
+    CachePolicy* m_cachePolicy;     // 传输的页缓存提示
+    QuotaManager* m_quota;
+    event* m_quotaTimer;            // 定期保存配额用量
+    int m_quotaSaveInterval;
+    MemoryBudget* m_memory;
+    event* m_memoryWakeup;          // 内存回落后在下一轮事件循环里恢复传输
+    std::list<FtpClient*> m_deferred;   // 等待全局内存的传输，按到达顺序
+    std::list<FtpClient*> m_stalled;    // 会话恢复后需要重新补充的下载
+    TransferTrace* m_trace;         // 传输生命周期跟踪
+    std::string m_traceFile;        // SITE TRACE DUMP写出的文件
+    std::set<std::string> m_siteAdmins; // 可以执行SITE STATS、MEM、TRACE的用户
+    UploadJournal* m_journal;       // 原子上传和断点续传日志，关闭原子上传时为NULL
+    uint64_t m_checkpointBytes;     // 上传每写这么多做一次检查点
+    HotManifest* m_hotManifest;     // 热点清单和启动预热，未配置时为NULL
+    event* m_manifestTimer;         // 定期保存热点清单
+    int m_manifestInterval;
+    DirWatcher* m_dirWatcher;       // SITE WATCH的目录通知，inotify不可用时为NULL
+    int m_watchTimeout;             // SITE WATCH最长等待的秒数，0为不限
+    uint64_t m_blockMarkerInterval; // 块模式下载每隔这么多字节发一个重启标记，0为不发
+    bool m_eventPriorities;         // 命令通道优先于数据通道调度
+    int m_loopMaxCallbacks;         // 每轮循环最多处理的数据回调，之后回头检查新事件，0为不限
+    int m_dataReadBudget;           // 数据通道每次回调最多读的字节数，0为libevent默认
+    int m_dataWriteBudget;          // 数据通道每次回调最多写的字节数
+    uint64_t m_directIoMin;         // 不小于这么大的二进制传输用O_DIRECT绕过页缓存，0为不用
+    bool m_lowLatency;              // 先空转轮询再阻塞的事件循环
+    int m_loopCpu;                  // 事件循环线程绑定的CPU，-1为不绑定
+    uint64_t m_spinMaxUsec;         // 空转窗口的上限
+    uint64_t m_spinUsec;            // 当前的空转窗口，随命中情况在上限的1/16到上限之间调整
+    uint64_t m_loopActivity;        // 命令通道读到数据的次数，空转时据此判断有没有等到命令
+    uint64_t m_spinHits;
+    uint64_t m_spinMisses;
+    uint64_t m_loopBlocks;
 };
 
 #endif // FTPSERVER_H
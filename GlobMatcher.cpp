@@ -0,0 +1,192 @@
+#include "GlobMatcher.h"
+#include <string.h>
+
+GlobMatcher::GlobMatcher(const std::string& pattern)
+{
+    std::string text = pattern;
+    m_dirsOnly = (!text.empty() && text[text.size() - 1] == '/');
+    if (m_dirsOnly)
+        text.erase(text.size() - 1);
+    m_dotOk = (!text.empty() && text[0] == '.');
+
+    m_segments.push_back(Segment());
+    for (size_t i = 0; i < text.size(); i++)
+    {
+        Token token;
+        token.kind = TokenChar;
+        token.c = (unsigned char)text[i];
+        token.cls = 0;
+        if (text[i] == '*')
+        {
+            m_segments.push_back(Segment());
+            continue;
+        }
+        else if (text[i] == '?')
+        {
+            token.kind = TokenAny;
+        }
+        else if (text[i] == '[')
+        {
+            // 没有配对的']'时'['按普通字符处理
+            size_t end = parseClass(text, i, &token);
+            if (end != std::string::npos)
+                i = end;
+        }
+        else if (text[i] == '\\' && i + 1 < text.size())
+        {
+            token.c = (unsigned char)text[++i];
+        }
+        m_segments.back().tokens.push_back(token);
+    }
+
+    m_minLength = 0;
+    for (size_t s = 0; s < m_segments.size(); s++)
+    {
+        Segment& segment = m_segments[s];
+        segment.literal = true;
+        for (size_t t = 0; t < segment.tokens.size(); t++)
+        {
+            if (segment.tokens[t].kind != TokenChar)
+                segment.literal = false;
+            segment.text += (char)segment.tokens[t].c;
+        }
+        m_minLength += segment.tokens.size();
+    }
+}
+
+size_t GlobMatcher::parseClass(const std::string& pattern, size_t pos, Token* token)
+{
+    CharClass cls;
+    memset(cls.bits, 0, sizeof(cls.bits));
+
+    size_t i = pos + 1;
+    bool negate = (i < pattern.size() && (pattern[i] == '!' || pattern[i] == '^'));
+    if (negate)
+        i++;
+
+    // 紧跟在'['或'[!'后的']'是普通字符
+    size_t first = i;
+    for (; i < pattern.size(); i++)
+    {
+        if (pattern[i] == ']' && i > first)
+            break;
+
+        unsigned char low = (unsigned char)pattern[i];
+        unsigned char high = low;
+        if (i + 2 < pattern.size() && pattern[i + 1] == '-' && pattern[i + 2] != ']')
+        {
+            high = (unsigned char)pattern[i + 2];
+            i += 2;
+        }
+        for (unsigned int c = low; c <= high; c++)
+            cls.bits[c >> 5] |= 1u << (c & 31);
+    }
+    if (i >= pattern.size())
+        return std::string::npos;
+
+    if (negate)
+    {
+        for (int w = 0; w < 8; w++)
+            cls.bits[w] = ~cls.bits[w];
+    }
+
+    token->kind = TokenClass;
+    token->cls = m_classes.size();
+    m_classes.push_back(cls);
+    return i;
+}
+
+bool GlobMatcher::matchAt(const Segment& segment, const char* p) const
+{
+    if (segment.literal)
+        return (memcmp(p, segment.text.data(), segment.text.size()) == 0);
+
+    for (size_t t = 0; t < segment.tokens.size(); t++)
+    {
+        const Token& token = segment.tokens[t];
+        unsigned char c = (unsigned char)p[t];
+        if (token.kind == TokenChar)
+        {
+            if (c != token.c)
+                return false;
+        }
+        else if (token.kind == TokenClass)
+        {
+            if (!(m_classes[token.cls].bits[c >> 5] & (1u << (c & 31))))
+                return false;
+        }
+    }
+
+    return true;
+}
+
+const char* GlobMatcher::find(const Segment& segment, const char* p, size_t length) const
+{
+    size_t size = segment.tokens.size();
+    if (size > length)
+        return NULL;
+    if (segment.literal)
+        return (const char*)memmem(p, length, segment.text.data(), size);
+
+    // 以普通字符开头时用memchr跳到候选位置，否则逐个位置试
+    const char* last = p + (length - size);
+    const Token& head = segment.tokens[0];
+    while (p <= last)
+    {
+        if (head.kind == TokenChar)
+        {
+            p = (const char*)memchr(p, head.c, last - p + 1);
+            if (p == NULL)
+                return NULL;
+        }
+        if (matchAt(segment, p))
+            return p;
+        p++;
+    }
+
+    return NULL;
+}
+
+bool GlobMatcher::match(const char* name, size_t length) const
+{
+    if (length < m_minLength)
+        return false;
+    if (length > 0 && name[0] == '.' && !m_dotOk)
+        return false;
+
+    const Segment& first = m_segments.front();
+    if (m_segments.size() == 1)
+        return (length == first.tokens.size() && matchAt(first, name));
+
+    // 头尾两段位置固定，各比较一次
+    const Segment& last = m_segments.back();
+    size_t begin = first.tokens.size();
+    size_t end = length - last.tokens.size();
+    if (!matchAt(first, name) || !matchAt(last, name + end))
+        return false;
+
+    // 中间的段取最靠前的匹配，给后面的段留下最多的空间
+    for (size_t s = 1; s + 1 < m_segments.size(); s++)
+    {
+        const Segment& segment = m_segments[s];
+        const char* hit = find(segment, name + begin, end - begin);
+        if (hit == NULL)
+            return false;
+        begin = (hit - name) + segment.tokens.size();
+    }
+
+    return true;
+}
+
+/*static*/ bool GlobMatcher::isPattern(const std::string& text)
+{
+    for (size_t i = 0; i < text.size(); i++)
+    {
+        if (text[i] == '\\')
+            i++;
+        else if (text[i] == '*' || text[i] == '?' || text[i] == '[')
+            return true;
+    }
+
+    return false;
+}
@@ -0,0 +1,62 @@
+#ifndef GLOBMATCHER_H
+#define GLOBMATCHER_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+// LIST/NLST参数里的通配符：*、?、[abc]/[a-z]/[!abc]，'\'转义下一个字符；以'/'结尾时只匹配目录。
+// 构造时按'*'把模式切成若干段，首段和末段只在名字的头尾比较一次，中间的段从左往右找
+// 最靠前的出现位置；全是普通字符的段用memcmp/memmem，不逐条目跑通用的回溯匹配。
+// 与shell一样，以'.'开头的名字只有模式也以'.'开头时才匹配
+class GlobMatcher
+{
+public:
+    GlobMatcher(const std::string& pattern);
+
+    bool match(const char* name, size_t length) const;
+    bool dirsOnly() const { return m_dirsOnly; }
+
+    static bool isPattern(const std::string& text);    // 含有未转义的*、?或[
+
+protected:
+    enum TokenKind
+    {
+        TokenChar,
+        TokenAny,
+        TokenClass
+    };
+
+    struct Token
+    {
+        TokenKind kind;
+        unsigned char c;    // TokenChar的字符
+        size_t cls;         // TokenClass在m_classes中的下标
+    };
+
+    // 两个'*'之间的一段，匹配的长度固定为tokens.size()
+    struct Segment
+    {
+        std::vector<Token> tokens;
+        bool literal;       // 全是普通字符，text即内容
+        std::string text;
+    };
+
+    struct CharClass
+    {
+        uint32_t bits[8];
+    };
+
+    size_t parseClass(const std::string& pattern, size_t pos, Token* token);
+    bool matchAt(const Segment& segment, const char* p) const;
+    const char* find(const Segment& segment, const char* p, size_t length) const;
+
+protected:
+    std::vector<Segment> m_segments;    // 只有一段时模式里没有'*'
+    std::vector<CharClass> m_classes;
+    size_t m_minLength;     // 各段长度之和
+    bool m_dotOk;
+    bool m_dirsOnly;
+};
+
+#endif // GLOBMATCHER_H
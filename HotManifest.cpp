@@ -0,0 +1,330 @@
+#include "HotManifest.h"
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <algorithm>
+
+static const int TICK_MS = 100;
+static const uint64_t ENTRY_COST = 256;     // 每个目录项按一个inode的大小计入额度
+static const size_t SLICE_ITEMS = 64;
+
+static uint64_t nowUsec()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// 一个时间片的预热，额度用完或条目做完就返回
+class WarmTask : public ThreadTask
+{
+public:
+    WarmTask(HotManifest* manifest, int64_t budget)
+        : m_manifest(manifest), m_budget(budget), m_fileMax(manifest->m_warmFileMax),
+          m_consumed(0), m_spent(0), m_files(0), m_dirs(0)
+    {
+    }
+
+    virtual void run()
+    {
+        for (size_t i = 0; i < m_items.size() && (int64_t)m_spent < m_budget; i++)
+        {
+            if (m_items[i].dir)
+                warmDir(m_items[i].path);
+            else
+                warmFile(m_items[i].path);
+            m_consumed++;
+        }
+    }
+
+    virtual void done()
+    {
+        m_manifest->sliceDone(this);
+    }
+
+protected:
+    void warmFile(const std::string& path)
+    {
+        // 不是文件属主时O_NOATIME会被拒绝，退回普通打开
+        int fd = open(path.c_str(), O_RDONLY|O_CLOEXEC|O_NOATIME);
+        if (fd < 0 && errno == EPERM)
+            fd = open(path.c_str(), O_RDONLY|O_CLOEXEC);
+        if (fd < 0)
+            return;
+
+        struct stat st;
+        if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode))
+        {
+            uint64_t length = std::min((uint64_t)st.st_size, m_fileMax);
+            readahead(fd, 0, length);
+            m_spent += length + ENTRY_COST;
+            m_files++;
+        }
+        close(fd);
+    }
+
+    void warmDir(const std::string& path)
+    {
+        int fd = open(path.c_str(), O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+        DIR* dir = (fd >= 0) ? fdopendir(fd) : NULL;
+        if (dir == NULL)
+        {
+            if (fd >= 0)
+                close(fd);
+            return;
+        }
+
+        // 只要LIST用到的属性
+        dirent* entry;
+        while ((entry = readdir(dir)) != NULL)
+        {
+            const char* name = entry->d_name;
+            if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+                continue;
+            struct statx stx;
+            statx(fd, name, AT_SYMLINK_NOFOLLOW, STATX_BASIC_STATS, &stx);
+            m_spent += ENTRY_COST;
+        }
+        closedir(dir);
+        m_dirs++;
+    }
+
+public:
+    HotManifest* m_manifest;
+    std::vector<HotManifest::Item> m_items;
+    int64_t m_budget;
+    uint64_t m_fileMax;
+    size_t m_consumed;
+    uint64_t m_spent;
+    uint64_t m_files;
+    uint64_t m_dirs;
+};
+
+HotManifest::HotManifest(const std::string& path, size_t size, uint64_t warmRate, uint64_t warmFileMax)
+{
+    m_path = path;
+    m_size = (size > 0) ? size : 1;
+    m_warmRate = warmRate;
+    m_warmFileMax = warmFileMax;
+    m_warmNext = 0;
+    m_tokens = 0;
+    m_sliceRunning = false;
+    m_pool = NULL;
+    m_tickTimer = NULL;
+    m_warmStart = 0;
+    m_warmedFiles = 0;
+    m_warmedDirs = 0;
+    m_warmedBytes = 0;
+    m_yielded = 0;
+    m_warmMs = 0;
+}
+
+HotManifest::~HotManifest()
+{
+    stopWarming();
+}
+
+bool HotManifest::load()
+{
+    FILE* fp = fopen(m_path.c_str(), "r");
+    if (fp == NULL)
+        return (errno == ENOENT);
+
+    // 上次的次数接着累计，热度跨重启保留
+    char line[PATH_MAX + 64];
+    while (fgets(line, sizeof(line), fp) != NULL)
+    {
+        size_t length = strlen(line);
+        if (length > 0 && line[length - 1] == '\n')
+            line[--length] = '\0';
+
+        char kind;
+        unsigned long long count;
+        int pos = 0;
+        if (sscanf(line, "%c %llu %n", &kind, &count, &pos) != 2 || pos == 0 || (kind != 'F' && kind != 'D'))
+            continue;
+
+        Item item;
+        item.dir = (kind == 'D');
+        item.path = line + pos;
+        (item.dir ? m_dirs : m_files)[item.path] = count;
+        m_warmList.push_back(item);
+    }
+    fclose(fp);
+    return true;
+}
+
+bool HotManifest::save()
+{
+    std::vector<std::pair<uint64_t, Item> > ranked;
+    std::map<std::string, uint64_t>::iterator it;
+    for (int dir = 0; dir < 2; dir++)
+    {
+        std::map<std::string, uint64_t>& counts = dir ? m_dirs : m_files;
+        for (it = counts.begin(); it != counts.end(); it++)
+        {
+            Item item;
+            item.dir = (dir != 0);
+            item.path = it->first;
+            ranked.push_back(std::make_pair(it->second, item));
+        }
+    }
+
+    // 次数从高到低，只取前m_size个
+    size_t count = std::min(ranked.size(), m_size);
+    std::vector<std::pair<uint64_t, size_t> > order;
+    for (size_t i = 0; i < ranked.size(); i++)
+        order.push_back(std::make_pair(~ranked[i].first, i));
+    std::partial_sort(order.begin(), order.begin() + count, order.end());
+
+    std::string temp = m_path + ".tmp";
+    FILE* fp = fopen(temp.c_str(), "w");
+    if (fp == NULL)
+        return false;
+    for (size_t i = 0; i < count; i++)
+    {
+        const std::pair<uint64_t, Item>& entry = ranked[order[i].second];
+        fprintf(fp, "%c %llu %s\n", entry.second.dir ? 'D' : 'F', (unsigned long long)entry.first,
+                entry.second.path.c_str());
+    }
+    bool ret = (fclose(fp) == 0);
+    if (!ret || rename(temp.c_str(), m_path.c_str()) != 0)
+    {
+        unlink(temp.c_str());
+        return false;
+    }
+
+    // 每保存一次次数减半（不减到0），近期的访问占主导
+    decay(false);
+    return true;
+}
+
+void HotManifest::touch(std::map<std::string, uint64_t>& counts, const std::string& hostPath)
+{
+    counts[hostPath]++;
+    if (m_files.size() + m_dirs.size() > m_size * 4)
+        decay(true);
+}
+
+void HotManifest::touchFile(const std::string& hostPath)
+{
+    touch(m_files, hostPath);
+}
+
+void HotManifest::touchDir(const std::string& hostPath)
+{
+    touch(m_dirs, hostPath);
+}
+
+void HotManifest::decay(bool prune)
+{
+    for (int dir = 0; dir < 2; dir++)
+    {
+        std::map<std::string, uint64_t>& counts = dir ? m_dirs : m_files;
+        std::map<std::string, uint64_t>::iterator it = counts.begin();
+        while (it != counts.end())
+        {
+            it->second = prune ? it->second / 2 : (it->second + 1) / 2;
+            if (it->second == 0)
+                counts.erase(it++);
+            else
+                it++;
+        }
+    }
+}
+
+void HotManifest::startWarming(event_base* base, ThreadPool* pool)
+{
+    if (m_warmList.empty() || m_warmRate == 0)
+        return;
+
+    m_pool = pool;
+    m_warmStart = nowUsec();
+    m_tickTimer = event_new(base, -1, EV_PERSIST, HotManifest::tickCallback, this);
+    timeval interval = { 0, TICK_MS * 1000 };
+    event_add(m_tickTimer, &interval);
+}
+
+void HotManifest::stopWarming()
+{
+    if (m_tickTimer != NULL)
+    {
+        event_free(m_tickTimer);
+        m_tickTimer = NULL;
+    }
+}
+
+/*static*/ void HotManifest::tickCallback(evutil_socket_t fd, short event, void* arg)
+{
+    ((HotManifest*)arg)->tick();
+}
+
+void HotManifest::tick()
+{
+    // 额度最多攒一片，空闲很久后也不会突然猛读
+    int64_t slice = (int64_t)(m_warmRate * TICK_MS / 1000);
+    m_tokens = std::min(m_tokens + slice, slice);
+    if (m_sliceRunning || m_tokens <= 0)
+        return;
+
+    if (m_pool->queueLength() > 0)
+    {
+        m_yielded++;
+        return;
+    }
+
+    WarmTask* task = new WarmTask(this, m_tokens);
+    size_t end = std::min(m_warmList.size(), m_warmNext + SLICE_ITEMS);
+    task->m_items.assign(m_warmList.begin() + m_warmNext, m_warmList.begin() + end);
+    if (!m_pool->submit(task))
+    {
+        delete task;
+        m_yielded++;
+        return;
+    }
+    m_sliceRunning = true;
+}
+
+void HotManifest::sliceDone(WarmTask* task)
+{
+    m_sliceRunning = false;
+    m_warmNext += task->m_consumed;
+    m_tokens -= (int64_t)task->m_spent;
+    m_warmedFiles += task->m_files;
+    m_warmedDirs += task->m_dirs;
+    m_warmedBytes += task->m_spent;
+
+    if (m_warmNext >= m_warmList.size())
+    {
+        m_warmMs = (nowUsec() - m_warmStart) / 1000;
+        m_warmList.clear();
+        stopWarming();
+    }
+}
+
+std::string HotManifest::formatStats()
+{
+    char buf[512];
+    sprintf(buf,
+            " warm.files %llu\r\n"
+            " warm.dirs %llu\r\n"
+            " warm.bytes %llu\r\n"
+            " warm.yielded %llu\r\n"
+            " warm.remaining %llu\r\n"
+            " warm.ms %llu\r\n"
+            " manifest.tracked %llu\r\n",
+            (unsigned long long)m_warmedFiles,
+            (unsigned long long)m_warmedDirs,
+            (unsigned long long)m_warmedBytes,
+            (unsigned long long)m_yielded,
+            (unsigned long long)(m_warmList.size() - std::min(m_warmNext, m_warmList.size())),
+            (unsigned long long)m_warmMs,
+            (unsigned long long)(m_files.size() + m_dirs.size()));
+    return buf;
+}
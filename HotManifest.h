@@ -0,0 +1,73 @@
+#ifndef HOTMANIFEST_H
+#define HOTMANIFEST_H
+
+#include <stdint.h>
+#include <string>
+#include <map>
+#include <vector>
+#include <event2/event.h>
+#include "ThreadPool.h"
+
+class WarmTask;
+
+// 热点清单：按RETR和LIST的次数统计最常访问的文件和目录，定期把排在前面的写到清单文件。
+// 启动时按清单在后台预热：文件用readahead读进页缓存（每个最多warmFileMax），目录读出所有
+// 条目并逐个statx，把目录项和inode缓存填上，LIST时不必再等磁盘。预热按令牌桶限速，每个时间片
+// 作为一个任务交给线程池，池里有排队的任务（正在进行的递归列目录）时让出这一片。
+// 监听在预热开始前就已就绪，不等它完成。只在事件循环线程中使用
+class HotManifest
+{
+    friend class WarmTask;
+
+public:
+    HotManifest(const std::string& path, size_t size, uint64_t warmRate, uint64_t warmFileMax);
+    ~HotManifest();
+
+    bool load();
+    bool save();
+    void startWarming(event_base* base, ThreadPool* pool);
+
+    void touchFile(const std::string& hostPath);
+    void touchDir(const std::string& hostPath);
+
+    std::string formatStats();
+
+protected:
+    struct Item
+    {
+        bool dir;
+        std::string path;
+    };
+
+    void touch(std::map<std::string, uint64_t>& counts, const std::string& hostPath);
+    void decay(bool prune);     // prune时只访问过一次的条目被丢弃，给新条目腾出位置
+    static void tickCallback(evutil_socket_t fd, short event, void* arg);
+    void tick();
+    void sliceDone(WarmTask* task);
+    void stopWarming();
+
+protected:
+    std::string m_path;
+    size_t m_size;              // 清单最多列出的条目数
+    uint64_t m_warmRate;        // 预热的字节/秒
+    uint64_t m_warmFileMax;     // 每个文件最多预读的长度
+    std::map<std::string, uint64_t> m_files;   // 本地路径 -> 访问次数
+    std::map<std::string, uint64_t> m_dirs;
+
+    std::vector<Item> m_warmList;   // 上次清单里的条目，按热度从高到低
+    size_t m_warmNext;
+    int64_t m_tokens;           // 可用的预热额度，一片超支时为负，后面的片补回来
+    bool m_sliceRunning;
+    ThreadPool* m_pool;
+    event* m_tickTimer;
+    uint64_t m_warmStart;       // 开始预热的时间，微秒
+
+    // 统计
+    uint64_t m_warmedFiles;
+    uint64_t m_warmedDirs;
+    uint64_t m_warmedBytes;
+    uint64_t m_yielded;         // 让给线上任务的时间片
+    uint64_t m_warmMs;          // 预热完成用的时间，未完成时为0
+};
+
+#endif // HOTMANIFEST_H
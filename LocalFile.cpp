@@ -1,67 +1,86 @@
 #include "LocalFile.h"
 #include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
 #include <sys/stat.h>
 #include <dirent.h>   
+#include <string.h>
 #include <time.h>
 #include <sys/time.h>
+#include "BufferPool.h"
+#include <algorithm>
 
 LocalFile::LocalFile()
 {
-    m_file = NULL;
+    m_fd = -1;
     m_openMode = Read;
-    m_isOpen = false;
+    m_offset = 0;
+    m_writeFailed = false;
+    m_stage = NULL;
+    m_staged = 0;
+    m_directMin = 0;
+    m_direct = false;
+    m_directUsed = false;
 }
 
 LocalFile::~LocalFile()
 {
+    close();
 }
 
 bool LocalFile::open(std::string filename, int mode)
+{
+    return attach(::open(filename.c_str(), openFlags(mode), 0644), filename, mode);
+}
+
+bool LocalFile::attach(int fd, const std::string& filename, int mode)
 {
     if (isOpen())
         close();
 
     m_filename = filename;
-    
-    std::string modeStr;
-    if (mode == Read)
-    {
-        modeStr = "r";
-    }
-    else if (mode == Write)
-    {
-        modeStr = "a";
-    }
-    else if (mode == Read|Write)
-    {
-        modeStr = "a+";
-    }
-    else if (mode == Write|Truncate)
-    {
-        modeStr = "w";
-    }
+    m_openMode = mode;
+    m_offset = 0;
+    m_writeFailed = false;
+    m_fd = fd;
+    return (m_fd >= 0);
+}
+
+/*static*/ int LocalFile::openFlags(int mode)
+{
+    // 写模式下文件不存在则创建；不带Truncate时保留原有内容，从seek的位置开始覆盖写
+    int flags = O_CLOEXEC;
+    if ((mode & Read) && (mode & Write))
+        flags |= O_RDWR|O_CREAT;
+    else if (mode & Write)
+        flags |= O_WRONLY|O_CREAT;
     else
-    {
-        modeStr = "r";
-    }
+        flags |= O_RDONLY;
     
-    m_file = fopen(filename.c_str(), modeStr.c_str());
-    m_isOpen = (m_file != NULL);
-    return m_isOpen;
+    if ((mode & Write) && (mode & Truncate))
+        flags |= O_TRUNC;
+    if ((mode & Write) && (mode & Append))
+        flags |= O_APPEND;
+    
+    return flags;
 }
 
 bool LocalFile::isOpen()
 {
-    return m_isOpen;
+    return (m_fd >= 0);
 }
 
-void LocalFile::close()
+bool LocalFile::close()
 {
-    if (isOpen())
-    {
-        fclose(m_file);
-        m_isOpen = false;
-    }
+    if (!isOpen())
+        return true;
+
+    flush();
+    BufferPool::release(m_stage);
+    m_stage = NULL;
+    int ret = ::close(m_fd);
+    m_fd = -1;
+    return (ret == 0 && !m_writeFailed);
 }
 
 std::string LocalFile::readAll()
@@ -77,21 +96,169 @@ std::string LocalFile::readAll()
 std::string LocalFile::read(unsigned int length)
 {
     char* buf = new char[length];
-    fread(buf, 1, length, m_file);
-    std::string content(buf, length);
+    size_t count = read(buf, length);
+    std::string content(buf, count);
     delete[] buf;
     
     return content;
 }
 
+size_t LocalFile::read(char* data, size_t length)
+{
+    size_t total = 0;
+    while (total < length)
+    {
+        ssize_t count = pread(m_fd, data + total, length - total, m_offset);
+        if (count < 0 && errno == EINTR)
+            continue;
+        if (count <= 0)
+            break;
+        
+        total += count;
+        m_offset += count;
+    }
+    
+    return total;
+}
+
 void LocalFile::write(std::string bytes)
 {
-    fwrite(bytes.c_str(), 1, bytes.size(), m_file);
+    write(bytes.c_str(), bytes.size());
+}
+
+void LocalFile::write(const char* data, size_t length)
+{
+    if (m_stage == NULL)
+    {
+        writeThrough(data, length);
+        return;
+    }
+
+    // 攒满一整个缓冲再写，一次系统调用代替几十次小块的写。中途落盘后开头不在页边界时
+    // 这一缓冲少攒一点，让它在页边界结束，之后的写入重新对齐
+    while (length > 0)
+    {
+        size_t size = BufferPool::bufferSize() - (size_t)(m_offset % 4096);
+        size_t count = std::min(length, size - m_staged);
+        memcpy(m_stage + m_staged, data, count);
+        m_staged += count;
+        data += count;
+        length -= count;
+        if (m_staged == size)
+            flush();
+    }
+}
+
+bool LocalFile::writeThrough(const char* data, size_t length)
+{
+    // 非追加模式用pwrite写到自己的位置，多个连接可以同时写同一个文件的不同区段
+    size_t total = 0;
+    while (total < length)
+    {
+        ssize_t count;
+        if (m_openMode & Append)
+            count = ::write(m_fd, data + total, length - total);
+        else
+            count = pwrite(m_fd, data + total, length - total, m_offset);
+        
+        if (count < 0 && errno == EINTR)
+            continue;
+        if (count <= 0)
+        {
+            m_writeFailed = true;
+            return false;
+        }
+        
+        total += count;
+        m_offset += count;
+    }
+    return true;
+}
+
+void LocalFile::flush()
+{
+    if (m_stage == NULL || m_staged == 0)
+        return;
+
+    // 写过m_directMin后从下一个对齐的整块起改用O_DIRECT；不满一页的尾巴先关掉O_DIRECT再写
+    bool aligned = (m_offset % 4096 == 0 && m_staged % 4096 == 0);
+    if (!m_direct && m_directMin > 0 && m_offset >= m_directMin && aligned && setDirectFlag(true))
+    {
+        if (!m_directUsed)
+            BufferPool::recordDirect(true);
+        m_directUsed = true;
+    }
+    else if (m_direct && !aligned)
+    {
+        setDirectFlag(false);
+    }
+
+    writeThrough(m_stage, m_staged);
+    m_staged = 0;
+}
+
+bool LocalFile::stageWrites(uint64_t directMin)
+{
+    if (!isOpen() || !BufferPool::enabled() || m_stage != NULL)
+        return false;
+
+    m_stage = BufferPool::acquire();
+    m_staged = 0;
+    m_directMin = (m_openMode & Append) ? 0 : directMin;
+    return (m_stage != NULL);
+}
+
+bool LocalFile::setDirect()
+{
+    if (!isOpen() || !setDirectFlag(true))
+        return false;
+
+    BufferPool::recordDirect(false);
+    return true;
+}
+
+bool LocalFile::setDirectFlag(bool on)
+{
+    // 文件系统不支持O_DIRECT时（如tmpfs）F_SETFL失败，继续走页缓存
+    int flags = fcntl(m_fd, F_GETFL);
+    if (flags < 0 || fcntl(m_fd, F_SETFL, on ? (flags | O_DIRECT) : (flags & ~O_DIRECT)) != 0)
+        return false;
+
+    m_direct = on;
+    return true;
+}
+
+int LocalFile::fd()
+{
+    return m_fd;
 }
 
-void LocalFile::write(char* data, unsigned int length)
+bool LocalFile::seek(uint64_t offset)
 {
-    fwrite(data, 1, length, m_file);
+    if (!isOpen() || (m_openMode & Append))
+        return false;
+    
+    flush();
+    m_offset = offset;
+    return true;
+}
+
+bool LocalFile::allocate(uint64_t size)
+{
+    // 一次分配好整个文件，分段并发写入时不会因为交错扩展而产生碎片
+    if (!isOpen())
+        return false;
+    
+    if (fallocate(m_fd, 0, 0, size) == 0)
+        return true;
+    
+    // 文件系统不支持fallocate时至少把长度设好
+    struct stat st;
+    if (fstat(m_fd, &st) != 0)
+        return false;
+    if ((uint64_t)st.st_size >= size)
+        return true;
+    return (ftruncate(m_fd, size) == 0);
 }
 
 /*static*/ std::string LocalFile::getUpDir(const std::string& dir)
@@ -112,26 +279,58 @@ void LocalFile::write(char* data, unsigned int length)
 
 /*static*/ std::string LocalFile::getDirList(const std::string& dir)
 {
-    DIR* d = opendir(dir.c_str());
+    int fd = ::open(dir.c_str(), O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+    if (fd < 0)
+        return "";
+    
+    return getDirList(fd);
+}
+
+// 过滤目录项：跳过"."和".."，按名字匹配；只要目录时先看d_type，
+// 文件系统不填d_type（DT_UNKNOWN）时才stat
+static bool acceptEntry(DIR* d, dirent* entry, const GlobMatcher* filter)
+{
+    const char* name = entry->d_name;
+    if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+        return false;
+    if (filter == NULL)
+        return true;
+    if (!filter->match(name, strlen(name)))
+        return false;
+    if (!filter->dirsOnly() || entry->d_type == DT_DIR)
+        return true;
+    if (entry->d_type != DT_UNKNOWN)
+        return false;
+
+    struct stat st;
+    return (fstatat(dirfd(d), name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode));
+}
+
+/*static*/ std::string LocalFile::getDirList(int dirFd, const GlobMatcher* filter)
+{
+    DIR* d = fdopendir(dirFd);
     if (d == NULL)
+    {
+        ::close(dirFd);
         return "";
+    }
     
+    // 相对目录描述符取属性，不再chdir改动整个进程的当前目录
     std::string listResult;
-    chdir(dir.c_str());
     char timeBuf[32];
-    char sizeBuf[16];
+    char sizeBuf[32];
     for (;;)
     {
         dirent* entry = readdir(d);
         if (entry == NULL)
             break;
+        
+        // 先按名字过滤，只有留下的条目才stat
+        if (!acceptEntry(d, entry, filter))
+            continue;
         struct stat st;
-        lstat(entry->d_name, &st);
-        std::string name(entry->d_name);
-        if (name == "." || name == "..")
-        {
+        if (fstatat(dirfd(d), entry->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0)
             continue;
-        }
         
         strftime(timeBuf, 32, "%Y-%m-%d %H:%M:%S", localtime(&st.st_mtime));
         listResult += timeBuf;
@@ -142,7 +341,7 @@ void LocalFile::write(char* data, unsigned int length)
         }
         else
         {
-            sprintf(sizeBuf, " %d ", st.st_size);
+            sprintf(sizeBuf, " %llu ", (unsigned long long)st.st_size);
             listResult += sizeBuf;
         }
         
@@ -150,6 +349,36 @@ void LocalFile::write(char* data, unsigned int length)
         listResult += "\r\n";
     }
     
+    closedir(d);
+    return listResult;
+}
+
+/*static*/ std::string LocalFile::getNameList(int dirFd, const GlobMatcher* filter)
+{
+    DIR* d = fdopendir(dirFd);
+    if (d == NULL)
+    {
+        ::close(dirFd);
+        return "";
+    }
+    
+    // 名字直接取自readdir，不stat，开销只与目录项数和匹配数有关
+    std::string listResult;
+    for (;;)
+    {
+        dirent* entry = readdir(d);
+        if (entry == NULL)
+            break;
+        if (!acceptEntry(d, entry, filter))
+            continue;
+        
+        listResult += entry->d_name;
+        if (filter != NULL && filter->dirsOnly())
+            listResult += "/";
+        listResult += "\r\n";
+    }
+    
+    closedir(d);
     return listResult;
 }
 
@@ -1,10 +1,13 @@
 #ifndef LOCALFILE_H
 #define LOCALFILE_H
 
+#include <stdint.h>
 #include <string>
 #include <stdio.h>
+#include "Vfs.h"
+#include "GlobMatcher.h"
 
-class LocalFile
+class LocalFile : public VfsFile
 {
 public:
     LocalFile();
@@ -14,31 +17,53 @@ public:
     {
         Read     = 0x1,
         Write    = 0x2,
-        Truncate = 0x4
+        Truncate = 0x4,
+        Append   = 0x8      // 每次写都追加到末尾，忽略seek
     };
     
     bool open(std::string filename, int mode);
+    bool attach(int fd, const std::string& filename, int mode);    // 接管已经按openFlags(mode)打开的描述符
     bool isOpen();
-    void close();
+    virtual bool close();
     
     std::string readAll();
     std::string read(unsigned int length);
+    virtual size_t read(char* data, size_t length);
     void write(std::string bytes);
-    void write(char* data, unsigned int length);
+    virtual void write(const char* data, size_t length);
+    virtual int fd();
+    virtual bool seek(uint64_t offset);
+    virtual bool allocate(uint64_t size);
+    virtual bool setDirect();
+    virtual bool stageWrites(uint64_t directMin);
+    virtual void flush();
     
     static std::string getUpDir(const std::string& dir);
+    static int openFlags(int mode);
     static std::string getDirList(const std::string& dir);
+    static std::string getDirList(int dirFd, const GlobMatcher* filter = NULL);    // 接管并关闭dirFd
+    static std::string getNameList(int dirFd, const GlobMatcher* filter = NULL);   // 只取名字，不stat
     static bool exist(const std::string& fileOrDir);
     static bool mkDir(const std::string& dir);
     static bool rmDir(const std::string& dir);
     static bool rmFile(const std::string& file);
     static bool rename(const std::string& oldPath, const std::string& newPath);
     
+protected:
+    bool writeThrough(const char* data, size_t length);
+    bool setDirectFlag(bool on);
+
 protected:
     std::string m_filename;
-    FILE* m_file;
-    OpenMode m_openMode;
-    bool m_isOpen;
+    int m_fd;
+    int m_openMode;
+    uint64_t m_offset;      // 下次pread/pwrite的位置
+    bool m_writeFailed;     // 写入出错时close()返回false
+    char* m_stage;          // 缓冲池里的写缓冲，不攒写入时为NULL；m_offset是它开头对应的位置
+    size_t m_staged;
+    uint64_t m_directMin;   // 写到这个偏移之后改用O_DIRECT，0为不用
+    bool m_direct;
+    bool m_directUsed;      // 只统计一次
     
 };
 
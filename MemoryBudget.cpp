@@ -0,0 +1,81 @@
+#include "MemoryBudget.h"
+#include <stdio.h>
+
+MemoryBudget::MemoryBudget(uint64_t globalLimit, uint64_t sessionLimit, unsigned deferPercent)
+{
+    m_globalLimit = globalLimit;
+    m_sessionLimit = sessionLimit;
+    if (deferPercent == 0 || deferPercent > 100)
+        deferPercent = 100;
+    m_deferAt = globalLimit / 100 * deferPercent;
+    m_used = 0;
+    m_peak = 0;
+    m_pauses = 0;
+    m_deferred = 0;
+}
+
+void MemoryBudget::init(MemoryCharge* charge)
+{
+    charge->bytes = 0;
+    charge->peak = 0;
+    charge->paused = false;
+}
+
+void MemoryBudget::charge(MemoryCharge* charge, size_t bytes)
+{
+    charge->bytes += bytes;
+    if (charge->bytes > charge->peak)
+        charge->peak = charge->bytes;
+    
+    m_used += bytes;
+    if (m_used > m_peak)
+        m_peak = m_used;
+}
+
+void MemoryBudget::release(MemoryCharge* charge, size_t bytes)
+{
+    // 释放得比记的多说明漏记了一次增加，归零而不是回绕
+    charge->bytes = (bytes > charge->bytes) ? 0 : charge->bytes - bytes;
+    m_used = (bytes > m_used) ? 0 : m_used - bytes;
+}
+
+bool MemoryBudget::sessionFull(const MemoryCharge* charge)
+{
+    return (m_sessionLimit > 0 && charge->bytes >= m_sessionLimit);
+}
+
+bool MemoryBudget::sessionRelieved(const MemoryCharge* charge)
+{
+    // 留出一半的余量再恢复，避免在上限附近反复暂停和恢复
+    return (m_sessionLimit == 0 || charge->bytes < m_sessionLimit / 2);
+}
+
+bool MemoryBudget::globalTight()
+{
+    return (m_globalLimit > 0 && m_used >= m_deferAt);
+}
+
+void MemoryBudget::recordPause()
+{
+    m_pauses++;
+}
+
+void MemoryBudget::recordDeferred()
+{
+    m_deferred++;
+}
+
+std::string MemoryBudget::formatStats()
+{
+    char buf[256];
+    sprintf(buf,
+            " memory.used %llu\r\n"
+            " memory.peak %llu\r\n"
+            " memory.session_pauses %llu\r\n"
+            " memory.deferred_transfers %llu\r\n",
+            (unsigned long long)m_used,
+            (unsigned long long)m_peak,
+            (unsigned long long)m_pauses,
+            (unsigned long long)m_deferred);
+    return buf;
+}
@@ -0,0 +1,49 @@
+#ifndef MEMORYBUDGET_H
+#define MEMORYBUDGET_H
+
+#include <stdint.h>
+#include <string>
+
+// 一个会话占用的缓冲内存：命令通道和数据通道的输入输出队列
+struct MemoryCharge
+{
+    uint64_t bytes;
+    uint64_t peak;
+    bool paused;        // 超过会话上限，已暂停读取命令和上传数据、停止补充下载缓冲
+};
+
+// 缓冲内存的记账。每个会话的占用同时计入全局预算：会话超过上限时暂停它的读取和补充，
+// 回落到一半以下再恢复；全局占用接近上限时新的下载和列目录排队等待
+class MemoryBudget
+{
+public:
+    MemoryBudget(uint64_t globalLimit, uint64_t sessionLimit, unsigned deferPercent);
+    
+    void init(MemoryCharge* charge);
+    void charge(MemoryCharge* charge, size_t bytes);
+    void release(MemoryCharge* charge, size_t bytes);
+    
+    bool sessionFull(const MemoryCharge* charge);       // 该暂停了
+    bool sessionRelieved(const MemoryCharge* charge);   // 可以恢复了
+    bool globalTight();     // 新的传输应当推迟
+    
+    uint64_t used() { return m_used; }
+    uint64_t globalLimit() { return m_globalLimit; }
+    
+    void recordPause();
+    void recordDeferred();
+    std::string formatStats();
+
+protected:
+    uint64_t m_globalLimit;     // 0表示不限
+    uint64_t m_sessionLimit;    // 0表示不限
+    uint64_t m_deferAt;         // 全局占用达到该值时推迟新的传输
+    uint64_t m_used;
+    
+    // 统计
+    uint64_t m_peak;
+    uint64_t m_pauses;
+    uint64_t m_deferred;
+};
+
+#endif // MEMORYBUDGET_H
@@ -0,0 +1,467 @@
+#include "MemoryVfs.h"
+#include "LocalFile.h"
+#include <stdio.h>
+#include <string.h>
+#include <new>
+
+std::map<std::string, MemoryTree*> MemoryTree::s_trees;
+size_t MemoryTree::s_defaultLimit = 256*1024*1024;
+
+MemoryNodeArena::MemoryNodeArena()
+{
+}
+
+MemoryNodeArena::~MemoryNodeArena()
+{
+    for (size_t i = 0; i < m_blocks.size(); i++)
+        delete[] m_blocks[i];
+}
+
+MemoryNode* MemoryNodeArena::allocate()
+{
+    if (m_freeList.empty())
+    {
+        char* block = new char[sizeof(MemoryNode) * BLOCK_NODES];
+        m_blocks.push_back(block);
+        for (int i = BLOCK_NODES - 1; i >= 0; i--)
+            m_freeList.push_back((MemoryNode*)(block + sizeof(MemoryNode) * i));
+    }
+    
+    MemoryNode* node = m_freeList.back();
+    m_freeList.pop_back();
+    return new (node) MemoryNode;
+}
+
+void MemoryNodeArena::release(MemoryNode* node)
+{
+    node->~MemoryNode();
+    m_freeList.push_back(node);
+}
+
+MemoryTree::MemoryTree(size_t limit)
+{
+    m_limit = limit;
+    m_used = 0;
+    m_root = createNode(true);
+}
+
+/*static*/ MemoryTree* MemoryTree::get(const std::string& name)
+{
+    std::map<std::string, MemoryTree*>::iterator it = s_trees.find(name);
+    if (it != s_trees.end())
+        return it->second;
+    
+    MemoryTree* tree = new MemoryTree(s_defaultLimit);
+    s_trees.insert(std::make_pair(name, tree));
+    return tree;
+}
+
+/*static*/ void MemoryTree::setDefaultLimit(size_t limit)
+{
+    s_defaultLimit = limit;
+}
+
+/*static*/ std::vector<std::string> MemoryTree::splitPath(const std::string& path)
+{
+    // 逐级解析，".."最多回到根目录
+    std::vector<std::string> parts;
+    size_t begin = 0;
+    while (begin <= path.size())
+    {
+        size_t end = path.find('/', begin);
+        if (end == std::string::npos)
+            end = path.size();
+        
+        std::string part = path.substr(begin, end - begin);
+        if (part == "..")
+        {
+            if (!parts.empty())
+                parts.pop_back();
+        }
+        else if (!part.empty() && part != ".")
+        {
+            parts.push_back(part);
+        }
+        
+        begin = end + 1;
+    }
+    
+    return parts;
+}
+
+/*static*/ std::string MemoryTree::normalize(const std::string& path)
+{
+    std::vector<std::string> parts = splitPath(path);
+    std::string result;
+    for (size_t i = 0; i < parts.size(); i++)
+        result += "/" + parts[i];
+    
+    return result.empty() ? "/" : result;
+}
+
+MemoryNode* MemoryTree::lookup(const std::string& path)
+{
+    std::vector<std::string> parts = splitPath(path);
+    MemoryNode* node = m_root;
+    for (size_t i = 0; i < parts.size(); i++)
+    {
+        if (!node->isDir)
+            return NULL;
+        
+        std::map<std::string, MemoryNode*>::iterator it = node->children.find(parts[i]);
+        if (it == node->children.end())
+            return NULL;
+        node = it->second;
+    }
+    
+    return node;
+}
+
+MemoryNode* MemoryTree::lookupParent(const std::string& path, std::string* name)
+{
+    std::vector<std::string> parts = splitPath(path);
+    if (parts.empty())
+        return NULL;    // 根目录没有父目录
+    
+    *name = parts.back();
+    std::string parent;
+    for (size_t i = 0; i + 1 < parts.size(); i++)
+        parent += "/" + parts[i];
+    
+    MemoryNode* node = lookup(parent);
+    return (node != NULL && node->isDir) ? node : NULL;
+}
+
+MemoryNode* MemoryTree::createNode(bool isDir)
+{
+    MemoryNode* node = m_arena.allocate();
+    node->isDir = isDir;
+    node->mtime = time(NULL);
+    node->blob = NULL;
+    return node;
+}
+
+void MemoryTree::destroyNode(MemoryNode* node)
+{
+    std::map<std::string, MemoryNode*>::iterator it;
+    for (it = node->children.begin(); it != node->children.end(); it++)
+        destroyNode(it->second);
+    
+    if (node->blob != NULL)
+        releaseBlob(node->blob);
+    m_arena.release(node);
+}
+
+MemoryBlob* MemoryTree::createBlob(const char* data, size_t size)
+{
+    if (m_used + size > m_limit)
+        return NULL;
+    
+    MemoryBlob* blob = new MemoryBlob;
+    blob->data = new char[size > 0 ? size : 1];
+    memcpy(blob->data, data, size);
+    blob->size = size;
+    blob->refCount = 1;
+    m_used += size;
+    return blob;
+}
+
+void MemoryTree::retainBlob(MemoryBlob* blob)
+{
+    blob->refCount++;
+}
+
+void MemoryTree::releaseBlob(MemoryBlob* blob)
+{
+    if (--blob->refCount > 0)
+        return;
+    
+    m_used -= blob->size;
+    delete[] blob->data;
+    delete blob;
+}
+
+size_t MemoryTree::used() const
+{
+    return m_used;
+}
+
+MemoryFile::MemoryFile(MemoryTree* tree, MemoryBlob* blob)
+{
+    m_tree = tree;
+    m_blob = blob;
+    m_tree->retainBlob(m_blob);
+    m_offset = 0;
+    m_writing = false;
+}
+
+MemoryFile::MemoryFile(MemoryTree* tree, const std::string& path, const std::string& initial, bool append)
+{
+    m_tree = tree;
+    m_blob = NULL;
+    m_writing = true;
+    m_path = path;
+    m_data = initial;
+    m_offset = append ? m_data.size() : 0;
+}
+
+MemoryFile::~MemoryFile()
+{
+    if (m_blob != NULL)
+        m_tree->releaseBlob(m_blob);
+}
+
+size_t MemoryFile::read(char* data, size_t length)
+{
+    if (m_blob == NULL || m_offset >= m_blob->size)
+        return 0;
+    
+    if (length > m_blob->size - m_offset)
+        length = m_blob->size - m_offset;
+    memcpy(data, m_blob->data + m_offset, length);
+    m_offset += length;
+    return length;
+}
+
+void MemoryFile::write(const char* data, size_t length)
+{
+    if (!m_writing)
+        return;
+    
+    if (m_offset > m_data.size())
+        m_data.resize(m_offset, '\0');
+    m_data.replace(m_offset, length, data, length);
+    m_offset += length;
+}
+
+bool MemoryFile::seek(uint64_t offset)
+{
+    if (!m_writing && (m_blob == NULL || offset > m_blob->size))
+        return false;
+    
+    m_offset = offset;
+    return true;
+}
+
+bool MemoryFile::close()
+{
+    if (!m_writing)
+        return true;
+    m_writing = false;
+    
+    // 内容整体换成新的blob，正在读旧内容的下载继续持有旧blob
+    std::string name;
+    MemoryNode* parent = m_tree->lookupParent(m_path, &name);
+    if (parent == NULL)
+        return false;
+    
+    MemoryNode* node = NULL;
+    std::map<std::string, MemoryNode*>::iterator it = parent->children.find(name);
+    if (it != parent->children.end())
+    {
+        node = it->second;
+        if (node->isDir)
+            return false;
+    }
+    
+    MemoryBlob* blob = m_tree->createBlob(m_data.data(), m_data.size());
+    std::string().swap(m_data);
+    if (blob == NULL)
+        return false;
+    
+    if (node == NULL)
+    {
+        node = m_tree->createNode(false);
+        parent->children.insert(std::make_pair(name, node));
+    }
+    
+    if (node->blob != NULL)
+        m_tree->releaseBlob(node->blob);
+    node->blob = blob;
+    node->mtime = time(NULL);
+    parent->mtime = node->mtime;
+    return true;
+}
+
+MemoryVfs::MemoryVfs(MemoryTree* tree)
+{
+    m_tree = tree;
+}
+
+VfsFile* MemoryVfs::open(const std::string& path, int mode)
+{
+    MemoryNode* node = m_tree->lookup(path);
+    if (mode == LocalFile::Read)
+    {
+        if (node == NULL || node->isDir)
+            return NULL;
+        return new MemoryFile(m_tree, node->blob);
+    }
+    
+    std::string name;
+    if (m_tree->lookupParent(path, &name) == NULL || (node != NULL && node->isDir))
+        return NULL;
+    
+    // 不带Truncate时保留现有内容，Append从末尾开始写，否则从seek的位置覆盖
+    std::string initial;
+    if (!(mode & LocalFile::Truncate) && node != NULL)
+        initial.assign(node->blob->data, node->blob->size);
+    
+    return new MemoryFile(m_tree, path, initial, (mode & LocalFile::Append) != 0);
+}
+
+std::string MemoryVfs::getDirList(const std::string& dir, const GlobMatcher* filter)
+{
+    MemoryNode* node = m_tree->lookup(dir);
+    if (node == NULL || !node->isDir)
+        return "";
+    
+    // 格式与LocalFile::getDirList一致
+    std::string listResult;
+    char timeBuf[32];
+    char sizeBuf[32];
+    std::map<std::string, MemoryNode*>::iterator it;
+    for (it = node->children.begin(); it != node->children.end(); it++)
+    {
+        MemoryNode* child = it->second;
+        if (filter != NULL && !acceptChild(it->first, child, filter))
+            continue;
+        
+        strftime(timeBuf, 32, "%Y-%m-%d %H:%M:%S", localtime(&child->mtime));
+        listResult += timeBuf;
+        
+        if (child->isDir)
+        {
+            listResult += " <DIR> ";
+        }
+        else
+        {
+            sprintf(sizeBuf, " %lu ", (unsigned long)child->blob->size);
+            listResult += sizeBuf;
+        }
+        
+        listResult += it->first;
+        listResult += "\r\n";
+    }
+    
+    return listResult;
+}
+
+std::string MemoryVfs::getNameList(const std::string& dir, const GlobMatcher* filter)
+{
+    MemoryNode* node = m_tree->lookup(dir);
+    if (node == NULL || !node->isDir)
+        return "";
+    
+    std::string listResult;
+    std::map<std::string, MemoryNode*>::iterator it;
+    for (it = node->children.begin(); it != node->children.end(); it++)
+    {
+        if (filter != NULL && !acceptChild(it->first, it->second, filter))
+            continue;
+        
+        listResult += it->first;
+        if (filter != NULL && filter->dirsOnly())
+            listResult += "/";
+        listResult += "\r\n";
+    }
+    
+    return listResult;
+}
+
+/*static*/ bool MemoryVfs::acceptChild(const std::string& name, MemoryNode* child, const GlobMatcher* filter)
+{
+    return (filter->match(name.data(), name.size()) && (!filter->dirsOnly() || child->isDir));
+}
+
+bool MemoryVfs::exist(const std::string& path)
+{
+    return (m_tree->lookup(path) != NULL);
+}
+
+bool MemoryVfs::mkDir(const std::string& dir)
+{
+    std::string name;
+    MemoryNode* parent = m_tree->lookupParent(dir, &name);
+    if (parent == NULL || parent->children.find(name) != parent->children.end())
+        return false;
+    
+    parent->children.insert(std::make_pair(name, m_tree->createNode(true)));
+    parent->mtime = time(NULL);
+    return true;
+}
+
+bool MemoryVfs::rmDir(const std::string& dir)
+{
+    std::string name;
+    MemoryNode* parent = m_tree->lookupParent(dir, &name);
+    if (parent == NULL)
+        return false;
+    
+    std::map<std::string, MemoryNode*>::iterator it = parent->children.find(name);
+    if (it == parent->children.end() || !it->second->isDir || !it->second->children.empty())
+        return false;
+    
+    m_tree->destroyNode(it->second);
+    parent->children.erase(it);
+    parent->mtime = time(NULL);
+    return true;
+}
+
+bool MemoryVfs::rmFile(const std::string& file)
+{
+    std::string name;
+    MemoryNode* parent = m_tree->lookupParent(file, &name);
+    if (parent == NULL)
+        return false;
+    
+    std::map<std::string, MemoryNode*>::iterator it = parent->children.find(name);
+    if (it == parent->children.end() || it->second->isDir)
+        return false;
+    
+    m_tree->destroyNode(it->second);
+    parent->children.erase(it);
+    parent->mtime = time(NULL);
+    return true;
+}
+
+bool MemoryVfs::rename(const std::string& oldPath, const std::string& newPath)
+{
+    std::string oldName, newName;
+    MemoryNode* oldParent = m_tree->lookupParent(oldPath, &oldName);
+    MemoryNode* newParent = m_tree->lookupParent(newPath, &newName);
+    if (oldParent == NULL || newParent == NULL)
+        return false;
+    
+    std::map<std::string, MemoryNode*>::iterator it = oldParent->children.find(oldName);
+    if (it == oldParent->children.end())
+        return false;
+    MemoryNode* node = it->second;
+    
+    // 目录不能移到自己的子目录下
+    if (node->isDir)
+    {
+        std::string prefix = MemoryTree::normalize(oldPath) + "/";
+        if (MemoryTree::normalize(newPath).compare(0, prefix.size(), prefix) == 0)
+            return false;
+    }
+    
+    std::map<std::string, MemoryNode*>::iterator target = newParent->children.find(newName);
+    if (target != newParent->children.end())
+    {
+        if (target->second == node)
+            return true;
+        if (target->second->isDir != node->isDir ||
+            (target->second->isDir && !target->second->children.empty()))
+        {
+            return false;
+        }
+        m_tree->destroyNode(target->second);
+        newParent->children.erase(target);
+    }
+    
+    oldParent->children.erase(it);
+    newParent->children.insert(std::make_pair(newName, node));
+    oldParent->mtime = newParent->mtime = time(NULL);
+    return true;
+}
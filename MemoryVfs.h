@@ -0,0 +1,118 @@
+#ifndef MEMORYVFS_H
+#define MEMORYVFS_H
+
+#include "Vfs.h"
+#include <time.h>
+#include <map>
+#include <vector>
+
+// 不可变的文件内容。读者持有引用，文件被覆盖或删除时正在进行的下载不受影响
+struct MemoryBlob
+{
+    char* data;
+    size_t size;
+    int refCount;
+};
+
+struct MemoryNode
+{
+    bool isDir;
+    time_t mtime;
+    MemoryBlob* blob;   // 目录为NULL
+    std::map<std::string, MemoryNode*> children;
+};
+
+// 目录树节点按块分配，删除的节点放回空闲链表复用
+class MemoryNodeArena
+{
+public:
+    MemoryNodeArena();
+    ~MemoryNodeArena();
+    
+    MemoryNode* allocate();
+    void release(MemoryNode* node);
+    
+protected:
+    static const int BLOCK_NODES = 256;
+    std::vector<char*> m_blocks;
+    std::vector<MemoryNode*> m_freeList;
+};
+
+// 一个具名的内存文件系统，同名挂载的所有会话共享。只在事件循环线程中访问
+class MemoryTree
+{
+public:
+    MemoryTree(size_t limit);
+    
+    MemoryNode* lookup(const std::string& path);
+    MemoryNode* lookupParent(const std::string& path, std::string* name);
+    
+    MemoryNode* createNode(bool isDir);
+    void destroyNode(MemoryNode* node);
+    
+    MemoryBlob* createBlob(const char* data, size_t size);
+    void retainBlob(MemoryBlob* blob);
+    void releaseBlob(MemoryBlob* blob);
+    
+    size_t used() const;
+    
+    static MemoryTree* get(const std::string& name);
+    static std::string normalize(const std::string& path);
+    static void setDefaultLimit(size_t limit);
+    
+protected:
+    static std::vector<std::string> splitPath(const std::string& path);
+    
+protected:
+    MemoryNodeArena m_arena;
+    MemoryNode* m_root;
+    size_t m_limit;     // 文件内容总字节数上限
+    size_t m_used;
+    
+    static std::map<std::string, MemoryTree*> s_trees;
+    static size_t s_defaultLimit;
+};
+
+class MemoryFile : public VfsFile
+{
+public:
+    MemoryFile(MemoryTree* tree, MemoryBlob* blob);     // 读
+    MemoryFile(MemoryTree* tree, const std::string& path, const std::string& initial, bool append);  // 写
+    virtual ~MemoryFile();
+    
+    virtual size_t read(char* data, size_t length);
+    virtual void write(const char* data, size_t length);
+    virtual bool close();
+    virtual bool seek(uint64_t offset);
+    
+protected:
+    MemoryTree* m_tree;
+    MemoryBlob* m_blob;
+    size_t m_offset;
+    bool m_writing;
+    std::string m_path;
+    std::string m_data;
+};
+
+class MemoryVfs : public Vfs
+{
+public:
+    MemoryVfs(MemoryTree* tree);
+    
+    virtual VfsFile* open(const std::string& path, int mode);
+    virtual std::string getDirList(const std::string& dir, const GlobMatcher* filter);
+    virtual std::string getNameList(const std::string& dir, const GlobMatcher* filter);
+    virtual bool exist(const std::string& path);
+    virtual bool mkDir(const std::string& dir);
+    virtual bool rmDir(const std::string& dir);
+    virtual bool rmFile(const std::string& file);
+    virtual bool rename(const std::string& oldPath, const std::string& newPath);
+    
+protected:
+    static bool acceptChild(const std::string& name, MemoryNode* child, const GlobMatcher* filter);
+
+protected:
+    MemoryTree* m_tree;
+};
+
+#endif // MEMORYVFS_H
@@ -0,0 +1,202 @@
+#include "PathResolver.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/syscall.h>
+#include <linux/openat2.h>
+
+/*static*/ size_t PathResolver::s_cacheSize = 16;
+/*static*/ unsigned PathResolver::s_generation = 0;
+/*static*/ bool PathResolver::s_noOpenat2 = false;
+/*static*/ uint64_t PathResolver::s_hits = 0;
+/*static*/ uint64_t PathResolver::s_misses = 0;
+/*static*/ uint64_t PathResolver::s_escapes = 0;
+
+PathResolver::PathResolver(const std::string& root)
+{
+    m_rootFd = ::open(root.c_str(), O_PATH|O_DIRECTORY|O_CLOEXEC);
+    m_cwd = "/";
+    m_generation = s_generation;
+}
+
+PathResolver::~PathResolver()
+{
+    flush();
+    if (m_rootFd >= 0)
+        ::close(m_rootFd);
+}
+
+bool PathResolver::isOpen()
+{
+    return (m_rootFd >= 0);
+}
+
+int PathResolver::dirFd(const std::string& dir)
+{
+    if (dir == "/")
+        return m_rootFd;
+    
+    // 别的会话删除或改名过目录，缓存的描述符可能已经对不上逻辑路径
+    if (m_generation != s_generation)
+    {
+        flush();
+        m_generation = s_generation;
+    }
+    
+    int fd = cached(dir);
+    if (fd >= 0)
+    {
+        s_hits++;
+        return fd;
+    }
+    s_misses++;
+    
+    // 从最近的已打开祖先目录开始，只解析剩下的几级
+    std::string base = dir;
+    int baseFd = -1;
+    while (baseFd < 0)
+    {
+        base.erase(base.find_last_of('/'));
+        baseFd = base.empty() ? m_rootFd : cached(base);
+    }
+    
+    fd = resolve(baseFd, dir.substr(base.size() + 1), O_PATH|O_DIRECTORY, 0);
+    if (fd < 0 && errno == EXDEV && baseFd != m_rootFd)
+        fd = resolve(m_rootFd, dir.substr(1), O_PATH|O_DIRECTORY, 0);
+    if (fd < 0)
+    {
+        if (errno == EXDEV)
+            s_escapes++;
+        return -1;
+    }
+    
+    insert(dir, fd);
+    return fd;
+}
+
+int PathResolver::open(const std::string& path, int flags, mode_t mode)
+{
+    if (path == "/")
+        return resolve(m_rootFd, ".", flags, mode);
+    
+    std::string name;
+    int parent = parentFd(path, name);
+    if (parent < 0)
+        return -1;
+    
+    // 最后一级是指向上层的符号链接时，相对父目录会被拒绝，再从根目录整体解析一次
+    int fd = resolve(parent, name, flags, mode);
+    if (fd < 0 && errno == EXDEV && parent != m_rootFd)
+        fd = resolve(m_rootFd, path.substr(1), flags, mode);
+    if (fd < 0 && errno == EXDEV)
+        s_escapes++;
+    
+    return fd;
+}
+
+int PathResolver::parentFd(const std::string& path, std::string& name)
+{
+    size_t slash = path.find_last_of('/');
+    if (path == "/" || slash == std::string::npos)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    
+    name = path.substr(slash + 1);
+    return dirFd(slash == 0 ? "/" : path.substr(0, slash));
+}
+
+bool PathResolver::changeDir(const std::string& dir)
+{
+    if (dirFd(dir) < 0)
+        return false;
+    
+    m_cwd = dir;
+    return true;
+}
+
+/*static*/ void PathResolver::invalidate()
+{
+    s_generation++;
+}
+
+/*static*/ void PathResolver::setCacheSize(size_t size)
+{
+    s_cacheSize = (size == 0) ? 1 : size;
+}
+
+int PathResolver::resolve(int baseFd, const std::string& path, int flags, mode_t mode)
+{
+    if (!s_noOpenat2)
+    {
+        open_how how;
+        memset(&how, 0, sizeof(how));
+        how.flags = flags | O_CLOEXEC;
+        how.mode = (flags & O_CREAT) ? mode : 0;
+        how.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS;
+        int fd = syscall(SYS_openat2, baseFd, path.c_str(), &how, sizeof(how));
+        if (fd >= 0 || errno != ENOSYS)
+            return fd;
+        
+        s_noOpenat2 = true;
+    }
+    
+    return openat(baseFd, path.c_str(), flags | O_CLOEXEC, mode);
+}
+
+int PathResolver::cached(const std::string& dir)
+{
+    std::map<std::string, std::pair<int, std::list<std::string>::iterator> >::iterator it = m_cache.find(dir);
+    if (it == m_cache.end())
+        return -1;
+    
+    m_order.splice(m_order.begin(), m_order, it->second.second);
+    return it->second.first;
+}
+
+void PathResolver::insert(const std::string& dir, int fd)
+{
+    m_order.push_front(dir);
+    m_cache[dir] = std::make_pair(fd, m_order.begin());
+    
+    // 淘汰最久没用的，当前目录除外
+    std::list<std::string>::iterator victim = m_order.end();
+    while (m_cache.size() > s_cacheSize && victim != m_order.begin())
+    {
+        victim--;
+        if (victim == m_order.begin())
+            break;
+        if (*victim == m_cwd)
+            continue;
+        
+        std::map<std::string, std::pair<int, std::list<std::string>::iterator> >::iterator it = m_cache.find(*victim);
+        ::close(it->second.first);
+        m_cache.erase(it);
+        victim = m_order.erase(victim);
+    }
+}
+
+void PathResolver::flush()
+{
+    std::map<std::string, std::pair<int, std::list<std::string>::iterator> >::iterator it;
+    for (it = m_cache.begin(); it != m_cache.end(); it++)
+        ::close(it->second.first);
+    m_cache.clear();
+    m_order.clear();
+}
+
+/*static*/ std::string PathResolver::formatStats()
+{
+    char buf[256];
+    sprintf(buf,
+            " path.cache_hits %llu\r\n"
+            " path.cache_misses %llu\r\n"
+            " path.escapes_blocked %llu\r\n",
+            (unsigned long long)s_hits,
+            (unsigned long long)s_misses,
+            (unsigned long long)s_escapes);
+    return buf;
+}
@@ -0,0 +1,65 @@
+#ifndef PATHRESOLVER_H
+#define PATHRESOLVER_H
+
+#include <stdint.h>
+#include <string>
+#include <list>
+#include <map>
+#include <sys/types.h>
+
+// 一个会话的路径解析器。持有根目录的O_PATH描述符，最近用过的目录（包括当前目录）
+// 的描述符放在一个小LRU里，之后的操作从离得最近的已打开目录开始解析，不必每次从头走完整路径。
+// 所有解析都经过openat2(RESOLVE_BENEATH)，".."或符号链接都无法越出根目录
+class PathResolver
+{
+public:
+    PathResolver(const std::string& root);
+    ~PathResolver();
+    
+    bool isOpen();
+    
+    // 目录的O_PATH描述符，归缓存所有，调用者不要关闭。失败返回-1并设置errno
+    int dirFd(const std::string& dir);
+    
+    // 打开文件或目录，flags同openat，返回的描述符由调用者关闭
+    int open(const std::string& path, int flags, mode_t mode);
+    
+    // 父目录的描述符和最后一级名字，供mkdirat/unlinkat/renameat这类不跟随最后一级的调用；
+    // path为"/"时返回-1
+    int parentFd(const std::string& path, std::string& name);
+    
+    // 切换当前目录，当前目录的描述符常驻缓存不被淘汰
+    bool changeDir(const std::string& dir);
+    
+    // 目录被删除或改名后调用，所有会话的缓存随之作废
+    static void invalidate();
+    
+    static void setCacheSize(size_t size);
+    static std::string formatStats();
+
+protected:
+    int resolve(int baseFd, const std::string& path, int flags, mode_t mode);
+    int cached(const std::string& dir);
+    void insert(const std::string& dir, int fd);
+    void flush();
+
+protected:
+    int m_rootFd;
+    std::string m_cwd;
+    
+    // LRU：链表头为最近使用
+    std::list<std::string> m_order;
+    std::map<std::string, std::pair<int, std::list<std::string>::iterator> > m_cache;
+    unsigned m_generation;
+    
+    static size_t s_cacheSize;
+    static unsigned s_generation;   // 任何会话删除或改名后递增
+    static bool s_noOpenat2;        // 内核不支持openat2时退回openat，只剩逻辑路径的规范化
+    
+    // 统计
+    static uint64_t s_hits;
+    static uint64_t s_misses;
+    static uint64_t s_escapes;
+};
+
+#endif // PATHRESOLVER_H
@@ -0,0 +1,134 @@
+#include "PosixVfs.h"
+#include "LocalFile.h"
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+PosixVfs::PosixVfs(const std::string& root)
+    : m_root(root), m_resolver(root)
+{
+}
+
+VfsFile* PosixVfs::open(const std::string& path, int mode)
+{
+    LocalFile* file = new LocalFile;
+    if (!file->attach(m_resolver.open(path, LocalFile::openFlags(mode), 0644), hostPath(path), mode))
+    {
+        delete file;
+        return NULL;
+    }
+    
+    return file;
+}
+
+std::string PosixVfs::getDirList(const std::string& dir, const GlobMatcher* filter)
+{
+    int fd = m_resolver.open(dir, O_RDONLY|O_DIRECTORY, 0);
+    if (fd < 0)
+        return "";
+    
+    return LocalFile::getDirList(fd, filter);
+}
+
+std::string PosixVfs::getNameList(const std::string& dir, const GlobMatcher* filter)
+{
+    int fd = m_resolver.open(dir, O_RDONLY|O_DIRECTORY, 0);
+    if (fd < 0)
+        return "";
+    
+    return LocalFile::getNameList(fd, filter);
+}
+
+bool PosixVfs::exist(const std::string& path)
+{
+    int fd = m_resolver.open(path, O_PATH, 0);
+    if (fd < 0)
+        return false;
+    
+    close(fd);
+    return true;
+}
+
+bool PosixVfs::mkDir(const std::string& dir)
+{
+    std::string name;
+    int parent = m_resolver.parentFd(dir, name);
+    return (parent >= 0 && mkdirat(parent, name.c_str(), S_IRWXU|S_IRWXG|S_IROTH|S_IXOTH) == 0);
+}
+
+bool PosixVfs::rmDir(const std::string& dir)
+{
+    std::string name;
+    int parent = m_resolver.parentFd(dir, name);
+    if (parent < 0 || unlinkat(parent, name.c_str(), AT_REMOVEDIR) != 0)
+        return false;
+    
+    PathResolver::invalidate();
+    return true;
+}
+
+bool PosixVfs::rmFile(const std::string& file)
+{
+    std::string name;
+    int parent = m_resolver.parentFd(file, name);
+    return (parent >= 0 && unlinkat(parent, name.c_str(), 0) == 0);
+}
+
+bool PosixVfs::rename(const std::string& oldPath, const std::string& newPath)
+{
+    // 取到新父目录的描述符可能淘汰旧父目录的缓存，所以旧父目录也要单独持有一份
+    std::string oldName;
+    int oldParent = m_resolver.parentFd(oldPath, oldName);
+    if (oldParent < 0)
+        return false;
+    oldParent = dup(oldParent);
+    if (oldParent < 0)
+        return false;
+    
+    std::string newName;
+    int newParent = m_resolver.parentFd(newPath, newName);
+    struct stat st;
+    bool isDir = (fstatat(oldParent, oldName.c_str(), &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode));
+    bool ret = (newParent >= 0 && renameat(oldParent, oldName.c_str(), newParent, newName.c_str()) == 0);
+    close(oldParent);
+    
+    // 目录改名后以它为前缀的缓存都失效了
+    if (ret && isDir)
+        PathResolver::invalidate();
+    return ret;
+}
+
+bool PosixVfs::changeDir(const std::string& dir)
+{
+    return m_resolver.changeDir(dir);
+}
+
+int PosixVfs::openDir(const std::string& dir)
+{
+    return m_resolver.open(dir, O_RDONLY|O_DIRECTORY, 0);
+}
+
+int PosixVfs::openParent(const std::string& path, std::string* name)
+{
+    // 缓存的是O_PATH描述符，不能fsync，重新打开一份
+    int parent = m_resolver.parentFd(path, *name);
+    return (parent >= 0) ? openat(parent, ".", O_RDONLY|O_DIRECTORY|O_CLOEXEC) : -1;
+}
+
+uint64_t PosixVfs::fileSize(const std::string& path)
+{
+    // 经解析器打开，不会顺着符号链接量到根目录外的文件
+    int fd = m_resolver.open(path, O_PATH, 0);
+    if (fd < 0)
+        return 0;
+    
+    struct stat st;
+    bool ok = (fstat(fd, &st) == 0 && S_ISREG(st.st_mode));
+    close(fd);
+    return ok ? st.st_size : 0;
+}
+
+std::string PosixVfs::hostPath(const std::string& path)
+{
+    return m_root + path;
+}
@@ -0,0 +1,33 @@
+#ifndef POSIXVFS_H
+#define POSIXVFS_H
+
+#include "Vfs.h"
+#include "PathResolver.h"
+
+// 本地文件系统后端。所有操作经PathResolver相对根目录和缓存的目录描述符进行，
+// 不会越出根目录；hostPath给出的拼接路径没有经过解析，只能当作键（日志、缓存提示），不能拿去打开文件
+class PosixVfs : public Vfs
+{
+public:
+    PosixVfs(const std::string& root);
+    
+    virtual VfsFile* open(const std::string& path, int mode);
+    virtual std::string getDirList(const std::string& dir, const GlobMatcher* filter);
+    virtual std::string getNameList(const std::string& dir, const GlobMatcher* filter);
+    virtual bool exist(const std::string& path);
+    virtual bool mkDir(const std::string& dir);
+    virtual bool rmDir(const std::string& dir);
+    virtual bool rmFile(const std::string& file);
+    virtual bool rename(const std::string& oldPath, const std::string& newPath);
+    virtual bool changeDir(const std::string& dir);
+    virtual int openDir(const std::string& dir);
+    virtual int openParent(const std::string& path, std::string* name);
+    virtual uint64_t fileSize(const std::string& path);
+    virtual std::string hostPath(const std::string& path);
+    
+protected:
+    std::string m_root;
+    PathResolver m_resolver;
+};
+
+#endif // POSIXVFS_H
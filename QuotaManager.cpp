@@ -0,0 +1,249 @@
+#include "QuotaManager.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+// 统计目录下所有普通文件的长度，不跟随符号链接
+static uint64_t sumTree(int dirFd)
+{
+    DIR* dir = fdopendir(dirFd);
+    if (dir == NULL)
+    {
+        close(dirFd);
+        return 0;
+    }
+    
+    uint64_t total = 0;
+    for (;;)
+    {
+        dirent* entry = readdir(dir);
+        if (entry == NULL)
+            break;
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+            continue;
+        
+        struct stat st;
+        if (fstatat(dirfd(dir), entry->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+            continue;
+        
+        if (S_ISREG(st.st_mode))
+        {
+            total += st.st_size;
+        }
+        else if (S_ISDIR(st.st_mode))
+        {
+            int subFd = openat(dirfd(dir), entry->d_name, O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC);
+            if (subFd >= 0)
+                total += sumTree(subFd);
+        }
+    }
+    
+    closedir(dir);
+    return total;
+}
+
+// 在工作线程中扫描一个根目录的初始用量
+class QuotaScanTask : public ThreadTask
+{
+public:
+    QuotaScanTask(QuotaManager* manager, QuotaAccount* account)
+        : m_manager(manager), m_account(account), m_root(account->root), m_ok(false), m_total(0)
+    {
+    }
+    
+    virtual void run()
+    {
+        int fd = open(m_root.c_str(), O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+        if (fd < 0)
+            return;
+        
+        m_total = sumTree(fd);
+        m_ok = true;
+    }
+    
+    virtual void done()
+    {
+        m_manager->scanDone(m_account, m_ok, m_total);
+    }
+
+protected:
+    QuotaManager* m_manager;
+    QuotaAccount* m_account;
+    std::string m_root;
+    bool m_ok;
+    uint64_t m_total;
+};
+
+QuotaManager::QuotaManager(uint64_t defaultLimit, const std::string& quotaFile, const std::string& stateFile)
+{
+    m_defaultLimit = defaultLimit;
+    m_quotaFile = quotaFile;
+    m_stateFile = stateFile;
+    m_dirty = false;
+    m_scans = 0;
+    m_rejected = 0;
+}
+
+QuotaManager::~QuotaManager()
+{
+    std::map<std::string, QuotaAccount*>::iterator it;
+    for (it = m_accounts.begin(); it != m_accounts.end(); it++)
+        delete it->second;
+}
+
+bool QuotaManager::load()
+{
+    if (!m_quotaFile.empty() && !m_limits.load(m_quotaFile))
+        return false;
+    
+    if (m_stateFile.empty())
+        return true;
+    
+    // 每行：用量 根目录
+    FILE* file = fopen(m_stateFile.c_str(), "r");
+    if (file == NULL)
+        return true;
+    
+    char line[4096];
+    while (fgets(line, sizeof(line), file) != NULL)
+    {
+        char* end = NULL;
+        unsigned long long used = strtoull(line, &end, 10);
+        if (end == line || *end != ' ')
+            continue;
+        
+        std::string root(end + 1);
+        while (!root.empty() && (root[root.size()-1] == '\n' || root[root.size()-1] == '\r'))
+            root.erase(root.size()-1);
+        if (!root.empty())
+            m_saved[root] = used;
+    }
+    
+    fclose(file);
+    return true;
+}
+
+bool QuotaManager::save()
+{
+    if (m_stateFile.empty() || !m_dirty)
+        return true;
+    
+    // 先写临时文件再改名，中途崩溃不会留下半个文件
+    std::string temp = m_stateFile + ".tmp";
+    FILE* file = fopen(temp.c_str(), "w");
+    if (file == NULL)
+        return false;
+    
+    std::map<std::string, QuotaAccount*>::iterator it;
+    for (it = m_accounts.begin(); it != m_accounts.end(); it++)
+    {
+        if (it->second->ready)
+            fprintf(file, "%lld %s\n", (long long)it->second->used, it->first.c_str());
+    }
+    
+    bool ok = (fflush(file) == 0 && fsync(fileno(file)) == 0);
+    ok = (fclose(file) == 0) && ok;
+    if (!ok || rename(temp.c_str(), m_stateFile.c_str()) != 0)
+    {
+        unlink(temp.c_str());
+        return false;
+    }
+    
+    m_dirty = false;
+    return true;
+}
+
+QuotaAccount* QuotaManager::account(const std::string& root, ThreadPool* pool)
+{
+    std::map<std::string, QuotaAccount*>::iterator it = m_accounts.find(root);
+    if (it != m_accounts.end())
+        return it->second;
+    
+    uint64_t limit = m_limits.getInt(root, m_defaultLimit);
+    if (limit == 0)
+        return NULL;
+    
+    QuotaAccount* account = new QuotaAccount;
+    account->root = root;
+    account->limit = limit;
+    account->used = 0;
+    account->ready = false;
+    m_accounts.insert(std::make_pair(root, account));
+    
+    std::map<std::string, uint64_t>::iterator saved = m_saved.find(root);
+    if (saved != m_saved.end())
+    {
+        account->used = saved->second;
+        account->ready = true;
+        return account;
+    }
+    
+    // 线程池排满时无法扫描，只能从0开始计数
+    QuotaScanTask* task = new QuotaScanTask(this, account);
+    if (!pool->submit(task))
+    {
+        delete task;
+        account->ready = true;
+    }
+    else
+    {
+        m_scans++;
+    }
+    
+    return account;
+}
+
+bool QuotaManager::canGrow(QuotaAccount* account, uint64_t bytes)
+{
+    if (!account->ready)
+        return true;
+    
+    return (account->used < 0 || (uint64_t)account->used + bytes <= account->limit);
+}
+
+void QuotaManager::grow(QuotaAccount* account, uint64_t bytes)
+{
+    account->used += bytes;
+    m_dirty = true;
+}
+
+void QuotaManager::shrink(QuotaAccount* account, uint64_t bytes)
+{
+    account->used -= bytes;
+    if (account->ready && account->used < 0)
+        account->used = 0;
+    m_dirty = true;
+}
+
+void QuotaManager::recordRejected()
+{
+    m_rejected++;
+}
+
+void QuotaManager::scanDone(QuotaAccount* account, bool ok, uint64_t total)
+{
+    // 扫描期间记下的增减与扫描结果合并，扫描与上传交错的部分可能有少量误差
+    if (ok)
+        account->used += total;
+    if (account->used < 0)
+        account->used = 0;
+    account->ready = true;
+    m_dirty = true;
+}
+
+std::string QuotaManager::formatStats()
+{
+    char buf[256];
+    sprintf(buf,
+            " quota.accounts %llu\r\n"
+            " quota.scans %llu\r\n"
+            " quota.rejected %llu\r\n",
+            (unsigned long long)m_accounts.size(),
+            (unsigned long long)m_scans,
+            (unsigned long long)m_rejected);
+    return buf;
+}
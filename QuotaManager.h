@@ -0,0 +1,59 @@
+#ifndef QUOTAMANAGER_H
+#define QUOTAMANAGER_H
+
+#include <stdint.h>
+#include <string>
+#include <map>
+#include "Config.h"
+#include "ThreadPool.h"
+
+// 一个用户根目录的空间用量。同一根目录的用户共用一个账户
+struct QuotaAccount
+{
+    std::string root;
+    uint64_t limit;
+    int64_t used;       // 扫描完成前只记录期间的增减，完成后加上扫描结果
+    bool ready;         // 初始用量已知（扫描完成或从状态文件恢复），此后才开始限制
+};
+
+// 按用户根目录的配额。用量保存在内存计数器里，上传、删除、改名时O(1)增减，
+// 第一次用到某个根目录时在工作线程中扫描一次得到初始值，并定期写入状态文件
+class QuotaManager
+{
+    friend class QuotaScanTask;
+
+public:
+    QuotaManager(uint64_t defaultLimit, const std::string& quotaFile, const std::string& stateFile);
+    ~QuotaManager();
+    
+    bool load();
+    bool save();
+    
+    // 返回根目录对应的账户，不限额时返回NULL。账户还没有初始用量时提交后台扫描
+    QuotaAccount* account(const std::string& root, ThreadPool* pool);
+    
+    bool canGrow(QuotaAccount* account, uint64_t bytes);
+    void grow(QuotaAccount* account, uint64_t bytes);
+    void shrink(QuotaAccount* account, uint64_t bytes);
+    void recordRejected();
+    
+    std::string formatStats();
+
+protected:
+    void scanDone(QuotaAccount* account, bool ok, uint64_t total);
+
+protected:
+    uint64_t m_defaultLimit;    // 0表示默认不限额
+    std::string m_quotaFile;    // 按根目录单独设置的配额，格式为 根目录 = 大小
+    std::string m_stateFile;    // 用量的持久化文件，为空则不保存
+    Config m_limits;
+    std::map<std::string, QuotaAccount*> m_accounts;
+    std::map<std::string, uint64_t> m_saved;    // 状态文件中读到的用量
+    bool m_dirty;
+    
+    // 统计
+    uint64_t m_scans;
+    uint64_t m_rejected;
+};
+
+#endif // QUOTAMANAGER_H
@@ -0,0 +1,114 @@
+#include "SessionRecorder.h"
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+static const char TRACE_MAGIC[8] = { 'F', 'T', 'P', 'T', 'R', 'A', 'C', 'E' };
+static const uint32_t TRACE_VERSION = 1;
+
+SessionRecorder::SessionRecorder(const std::string& filename, bool recordPasswords)
+{
+    m_filename = filename;
+    m_recordPasswords = recordPasswords;
+    m_file = NULL;
+    m_startUsec = 0;
+}
+
+SessionRecorder::~SessionRecorder()
+{
+    if (m_file != NULL)
+        fclose(m_file);
+}
+
+bool SessionRecorder::open()
+{
+    m_file = fopen(m_filename.c_str(), "wb");
+    if (m_file == NULL)
+        return false;
+    
+    setvbuf(m_file, NULL, _IOFBF, 64*1024);
+    fwrite(TRACE_MAGIC, 1, sizeof(TRACE_MAGIC), m_file);
+    fwrite(&TRACE_VERSION, 1, sizeof(TRACE_VERSION), m_file);
+    m_startUsec = 0;
+    m_startUsec = elapsedUsec();
+    return true;
+}
+
+uint64_t SessionRecorder::elapsedUsec()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000 - m_startUsec;
+}
+
+void SessionRecorder::write(uint64_t sessionId, TraceRecordType type, const char* payload, size_t length)
+{
+    if (m_file == NULL)
+        return;
+    
+    if (length > 0xffff)
+        length = 0xffff;
+    
+    TraceRecordHeader header;
+    header.timeUsec = elapsedUsec();
+    header.sessionId = (uint32_t)sessionId;
+    header.length = (uint16_t)length;
+    header.type = (uint8_t)type;
+    header.reserved = 0;
+    fwrite(&header, 1, sizeof(header), m_file);
+    if (length > 0)
+        fwrite(payload, 1, length, m_file);
+}
+
+void SessionRecorder::recordOpen(uint64_t sessionId)
+{
+    write(sessionId, TraceSessionOpen, NULL, 0);
+}
+
+void SessionRecorder::recordCommand(uint64_t sessionId, const std::string& line)
+{
+    std::string cmd = line;
+    while (!cmd.empty() && (cmd[cmd.size()-1] == '\n' || cmd[cmd.size()-1] == '\r'))
+        cmd.erase(cmd.size()-1);
+    
+    if (!m_recordPasswords && strncasecmp(cmd.c_str(), "PASS ", 5) == 0)
+        cmd = "PASS ***";
+    
+    write(sessionId, TraceCommand, cmd.c_str(), cmd.size());
+}
+
+void SessionRecorder::recordData(uint64_t sessionId, TraceRecordType type, uint64_t bytes)
+{
+    write(sessionId, type, (const char*)&bytes, sizeof(bytes));
+}
+
+void SessionRecorder::recordClose(uint64_t sessionId)
+{
+    write(sessionId, TraceSessionClose, NULL, 0);
+    fflush(m_file);
+}
+
+/*static*/ bool SessionRecorder::readFileHeader(FILE* file)
+{
+    char magic[sizeof(TRACE_MAGIC)];
+    uint32_t version;
+    if (fread(magic, 1, sizeof(magic), file) != sizeof(magic) ||
+        fread(&version, 1, sizeof(version), file) != sizeof(version))
+    {
+        return false;
+    }
+    
+    return (memcmp(magic, TRACE_MAGIC, sizeof(magic)) == 0 && version == TRACE_VERSION);
+}
+
+/*static*/ bool SessionRecorder::readRecord(FILE* file, TraceRecordHeader* header, std::string* payload)
+{
+    if (fread(header, 1, sizeof(*header), file) != sizeof(*header))
+        return false;
+    
+    payload->resize(header->length);
+    if (header->length > 0 && fread(&(*payload)[0], 1, header->length, file) != header->length)
+        return false;
+    
+    return true;
+}
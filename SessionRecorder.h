@@ -0,0 +1,57 @@
+#ifndef SESSIONRECORDER_H
+#define SESSIONRECORDER_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+
+// 会话录制的二进制格式：文件头"FTPTRACE"+版本号，之后是一串定长头+变长负载的记录。
+// 时间戳为相对录制开始的微秒数，数据通道只记录每次传输的字节数，不记录内容
+enum TraceRecordType
+{
+    TraceSessionOpen = 1,
+    TraceCommand = 2,       // 负载为命令行文本（不含CRLF）
+    TraceDataIn = 3,        // 负载为uint64_t，上传字节数
+    TraceDataOut = 4,       // 负载为uint64_t，下载/列目录字节数
+    TraceSessionClose = 5
+};
+
+#pragma pack(push, 1)
+struct TraceRecordHeader
+{
+    uint64_t timeUsec;
+    uint32_t sessionId;
+    uint16_t length;
+    uint8_t type;
+    uint8_t reserved;
+};
+#pragma pack(pop)
+
+class SessionRecorder
+{
+public:
+    SessionRecorder(const std::string& filename, bool recordPasswords);
+    ~SessionRecorder();
+    
+    bool open();
+    
+    void recordOpen(uint64_t sessionId);
+    void recordCommand(uint64_t sessionId, const std::string& line);
+    void recordData(uint64_t sessionId, TraceRecordType type, uint64_t bytes);
+    void recordClose(uint64_t sessionId);
+    
+    static bool readFileHeader(FILE* file);
+    static bool readRecord(FILE* file, TraceRecordHeader* header, std::string* payload);
+    
+protected:
+    void write(uint64_t sessionId, TraceRecordType type, const char* payload, size_t length);
+    uint64_t elapsedUsec();
+    
+protected:
+    std::string m_filename;
+    bool m_recordPasswords;     // 默认PASS的参数替换为***，回放时再指定密码
+    FILE* m_file;
+    uint64_t m_startUsec;
+};
+
+#endif // SESSIONRECORDER_H
@@ -0,0 +1,30 @@
+#ifndef SHA256_H
+#define SHA256_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+
+// 流式SHA-256，数据分块到达时边收边算，不需要二次读文件
+class Sha256
+{
+public:
+    Sha256();
+    
+    void reset();
+    void update(const char* data, size_t length);
+    std::string finalHex();     // 结束计算并返回64位十六进制摘要
+    
+    static std::string hex(const char* data, size_t length);
+    
+protected:
+    void transform(const uint8_t* block);
+    
+protected:
+    uint32_t m_state[8];
+    uint64_t m_totalLength;
+    uint8_t m_buffer[64];
+    size_t m_bufferLength;
+};
+
+#endif // SHA256_H
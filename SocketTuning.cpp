@@ -0,0 +1,110 @@
+#include "SocketTuning.h"
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#ifndef SO_PREFER_BUSY_POLL
+#define SO_PREFER_BUSY_POLL 69     // Linux 5.11，旧头文件里没有
+#endif
+
+uint64_t SocketTuning::s_failures = 0;
+uint64_t SocketTuning::s_autoSized = 0;
+uint64_t SocketTuning::s_lastAuto = 0;
+
+/*static*/ SocketProfile SocketTuning::load(const Config& config, const std::string& prefix, bool noDelay)
+{
+    SocketProfile profile;
+    profile.noDelay = config.getBool(prefix + "nodelay", noDelay);
+    profile.cork = config.getBool(prefix + "cork", false);
+    profile.sndBuf = (config.getString(prefix + "sndbuf") == "auto") ? -1 : config.getInt(prefix + "sndbuf", 0);
+    profile.rcvBuf = (config.getString(prefix + "rcvbuf") == "auto") ? -1 : config.getInt(prefix + "rcvbuf", 0);
+    profile.notSentLowat = config.getInt(prefix + "notsent_lowat", 0);
+    profile.congestion = config.getString(prefix + "congestion");
+    profile.linkRate = config.getInt(prefix + "link_rate", 125*1024*1024);
+    profile.bufMax = config.getInt(prefix + "buf_max", 32*1024*1024);
+    profile.busyPoll = config.getInt(prefix + "busy_poll", 0);
+    profile.preferBusyPoll = config.getBool(prefix + "prefer_busy_poll", false);
+    return profile;
+}
+
+/*static*/ void SocketTuning::setOption(int fd, int level, int name, int value)
+{
+    if (setsockopt(fd, level, name, &value, sizeof(value)) != 0)
+        s_failures++;
+}
+
+/*static*/ void SocketTuning::applyListener(int fd, const SocketProfile& profile)
+{
+    // 固定的缓冲大小在监听套接字上设置，SYN-ACK通告的窗口缩放据此确定
+    if (profile.sndBuf > 0)
+        setOption(fd, SOL_SOCKET, SO_SNDBUF, profile.sndBuf);
+    if (profile.rcvBuf > 0)
+        setOption(fd, SOL_SOCKET, SO_RCVBUF, profile.rcvBuf);
+    if (!profile.congestion.empty() &&
+        setsockopt(fd, IPPROTO_TCP, TCP_CONGESTION, profile.congestion.c_str(), profile.congestion.size()) != 0)
+        s_failures++;
+}
+
+/*static*/ int SocketTuning::autoSize(int fd, const SocketProfile& profile)
+{
+    // 握手测得的RTT乘以链路速率，留一倍余量；还没有RTT时交给内核自动调整
+    struct tcp_info info;
+    socklen_t length = sizeof(info);
+    if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &length) != 0 || info.tcpi_rtt == 0)
+        return 0;
+
+    uint64_t size = profile.linkRate * info.tcpi_rtt / 1000000 * 2;
+    if (size < 64*1024)
+        size = 64*1024;
+    if (size > (uint64_t)profile.bufMax)
+        size = profile.bufMax;
+
+    s_autoSized++;
+    s_lastAuto = size;
+    return (int)size;
+}
+
+/*static*/ void SocketTuning::applyAccepted(int fd, const SocketProfile& profile)
+{
+    if (profile.noDelay)
+        setOption(fd, IPPROTO_TCP, TCP_NODELAY, 1);
+    if (profile.notSentLowat > 0)
+        setOption(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, profile.notSentLowat);
+
+    // 超过net.core.busy_read的值需要CAP_NET_ADMIN，失败计入sock.failures
+    if (profile.busyPoll > 0)
+        setOption(fd, SOL_SOCKET, SO_BUSY_POLL, profile.busyPoll);
+    if (profile.preferBusyPoll)
+        setOption(fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, 1);
+
+    if (profile.sndBuf < 0 || profile.rcvBuf < 0)
+    {
+        int size = autoSize(fd, profile);
+        if (size > 0 && profile.sndBuf < 0)
+            setOption(fd, SOL_SOCKET, SO_SNDBUF, size);
+        if (size > 0 && profile.rcvBuf < 0)
+            setOption(fd, SOL_SOCKET, SO_RCVBUF, size);
+    }
+}
+
+/*static*/ void SocketTuning::setCork(int fd, const SocketProfile& profile, bool on)
+{
+    // 解除时内核立即发出凑不满一个段的尾巴
+    if (profile.cork)
+        setOption(fd, IPPROTO_TCP, TCP_CORK, on ? 1 : 0);
+}
+
+/*static*/ std::string SocketTuning::formatStats()
+{
+    char buf[128];
+    sprintf(buf,
+            " sock.failures %llu\r\n"
+            " sock.auto_sized %llu\r\n"
+            " sock.last_auto_buf %llu\r\n",
+            (unsigned long long)s_failures,
+            (unsigned long long)s_autoSized,
+            (unsigned long long)s_lastAuto);
+    return buf;
+}
@@ -0,0 +1,48 @@
+#ifndef SOCKETTUNING_H
+#define SOCKETTUNING_H
+
+#include <stdint.h>
+#include <string>
+#include "Config.h"
+
+// 一类连接（命令通道或数据通道）的套接字参数
+struct SocketProfile
+{
+    bool noDelay;           // TCP_NODELAY，关掉Nagle
+    bool cork;              // 传输期间TCP_CORK，头部和内容凑满一个段再发，结束时解除
+    int sndBuf;             // SO_SNDBUF：0为内核自动调整，-1为按带宽时延积估算
+    int rcvBuf;             // SO_RCVBUF：同上，设在监听套接字上以便握手时定下窗口缩放
+    int notSentLowat;       // TCP_NOTSENT_LOWAT，内核里未发出的数据不超过它，0为不设置
+    std::string congestion; // TCP_CONGESTION，空为系统默认
+    uint64_t linkRate;      // 估算缓冲用的链路速率，字节/秒
+    int bufMax;             // 估算出的缓冲上限
+    int busyPoll;           // SO_BUSY_POLL，读空时在驱动队列上忙等的微秒数，0为不设置
+    bool preferBusyPoll;    // SO_PREFER_BUSY_POLL，忙等期间推迟软中断收包
+};
+
+// 按配置调整命令通道和数据通道的套接字。监听套接字上设置的缓冲和拥塞控制算法由
+// accept出的连接继承；按时延积估算要等握手完成、TCP_INFO里有了RTT之后才能做
+class SocketTuning
+{
+public:
+    // 读取<prefix>nodelay、<prefix>sndbuf等配置项，sndbuf/rcvbuf可以写auto
+    static SocketProfile load(const Config& config, const std::string& prefix, bool noDelay);
+
+    static void applyListener(int fd, const SocketProfile& profile);
+    static void applyAccepted(int fd, const SocketProfile& profile);
+    static void setCork(int fd, const SocketProfile& profile, bool on);
+
+    static std::string formatStats();
+
+protected:
+    static void setOption(int fd, int level, int name, int value);
+    static int autoSize(int fd, const SocketProfile& profile);
+
+protected:
+    // 只在事件循环线程中修改
+    static uint64_t s_failures;     // setsockopt失败的次数，如配置了内核不支持的拥塞控制算法
+    static uint64_t s_autoSized;    // 按时延积估算过缓冲的连接数
+    static uint64_t s_lastAuto;     // 最近一次估算出的缓冲大小
+};
+
+#endif // SOCKETTUNING_H
@@ -0,0 +1,375 @@
+#include "TarStreamer.h"
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+
+static const size_t BLOCK = 512;
+static const size_t RECORD = 20 * BLOCK;    // GNU tar默认的记录长度，归档补齐到它的整数倍
+static const char s_zeros[BLOCK] = { 0 };
+
+uint64_t TarStreamer::s_archives = 0;
+uint64_t TarStreamer::s_files = 0;
+uint64_t TarStreamer::s_sendfileBytes = 0;
+uint64_t TarStreamer::s_copiedBytes = 0;
+
+// 数值字段：放得下size-1位八进制数时按八进制，否则用GNU的base-256编码（首字节0x80，其余大端）
+static void putNumber(char* field, size_t size, uint64_t value)
+{
+    if (value < ((uint64_t)1 << (3 * (size - 1))))
+    {
+        sprintf(field, "%0*llo", (int)(size - 1), (unsigned long long)value);
+        return;
+    }
+
+    for (size_t i = size - 1; i > 0; i--)
+    {
+        field[i] = (char)(value & 0xff);
+        value >>= 8;
+    }
+    field[0] = (char)0x80;
+}
+
+static void buildHeader(char* header, const std::string& name, const struct stat* st, char type, uint64_t size,
+                        const std::string& link)
+{
+    memset(header, 0, BLOCK);
+    memcpy(header, name.data(), std::min(name.size(), (size_t)100));
+    putNumber(header + 100, 8, (st != NULL) ? (st->st_mode & 07777) : 0644);
+    putNumber(header + 108, 8, (st != NULL) ? st->st_uid : 0);
+    putNumber(header + 116, 8, (st != NULL) ? st->st_gid : 0);
+    putNumber(header + 124, 12, size);
+    putNumber(header + 136, 12, (st != NULL && st->st_mtime > 0) ? st->st_mtime : 0);
+    header[156] = type;
+    memcpy(header + 157, link.data(), std::min(link.size(), (size_t)100));
+    memcpy(header + 257, "ustar  ", 8);     // GNU格式的magic和version
+
+    // 校验和按校验和字段为8个空格计算
+    memset(header + 148, ' ', 8);
+    unsigned int sum = 0;
+    for (size_t i = 0; i < BLOCK; i++)
+        sum += (unsigned char)header[i];
+    sprintf(header + 148, "%06o", sum);
+    header[155] = ' ';
+}
+
+TarStreamer::TarStreamer(int maxDepth, size_t chunkSize, size_t sendfileMin, int gzipLevel)
+{
+    m_maxDepth = maxDepth;
+    m_chunkSize = std::max(chunkSize, BLOCK);
+    m_sendfileMin = sendfileMin;
+    m_gzipLevel = gzipLevel;
+    m_output = NULL;
+    m_highWater = 0;
+    m_bodyFd = -1;
+    m_segment = NULL;
+    m_bodyOffset = 0;
+    m_bodySize = 0;
+    m_scratch.resize(m_chunkSize);
+    memset(&m_zstream, 0, sizeof(m_zstream));
+    m_done = false;
+    m_failed = false;
+    m_archiveBytes = 0;
+    m_bytes = 0;
+}
+
+TarStreamer::~TarStreamer()
+{
+    closeBody();
+    for (size_t i = 0; i < m_stack.size(); i++)
+        closedir(m_stack[i].dir);
+    if (m_zstream.state != NULL)
+        deflateEnd(&m_zstream);
+}
+
+bool TarStreamer::start(int rootFd, const std::string& topName, evbuffer* output, size_t highWater)
+{
+    m_output = output;
+    m_highWater = highWater;
+
+    // windowBits加16生成gzip格式
+    if (m_gzipLevel >= 0)
+    {
+        if (deflateInit2(&m_zstream, m_gzipLevel, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        {
+            close(rootFd);
+            return false;
+        }
+        m_compressed.resize(64 * 1024);
+    }
+
+    struct stat st;
+    DIR* dir = (fstat(rootFd, &st) == 0) ? fdopendir(rootFd) : NULL;
+    if (dir == NULL)
+    {
+        close(rootFd);
+        return false;
+    }
+
+    s_archives++;
+    writeHeader(topName + "/", st, '5', 0, "");
+    OpenDir top = { dir, topName + "/" };
+    m_stack.push_back(top);
+    return true;
+}
+
+bool TarStreamer::pump()
+{
+    while (!m_done && !m_failed && evbuffer_get_length(m_output) < m_highWater)
+    {
+        if (m_bodyFd >= 0)
+            sendBody();
+        else if (!nextEntry())
+            finish();
+    }
+
+    return (m_done || m_failed);
+}
+
+bool TarStreamer::nextEntry()
+{
+    while (!m_stack.empty())
+    {
+        // addEntry可能压入子目录，这里不保留对栈顶的引用
+        DIR* dir = m_stack.back().dir;
+        dirent* entry = readdir(dir);
+        if (entry == NULL)
+        {
+            closedir(dir);
+            m_stack.pop_back();
+            continue;
+        }
+
+        const char* name = entry->d_name;
+        if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+            continue;
+
+        addEntry(dirfd(dir), name, m_stack.back().prefix + name);
+        return true;
+    }
+
+    return false;
+}
+
+void TarStreamer::addEntry(int dirFd, const char* name, const std::string& path)
+{
+    struct stat st;
+    if (fstatat(dirFd, name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+        return;
+
+    if (S_ISDIR(st.st_mode))
+    {
+        // 超过深度的目录只记录本身，不再展开
+        writeHeader(path + "/", st, '5', 0, "");
+        if ((int)m_stack.size() >= m_maxDepth)
+            return;
+
+        int fd = openat(dirFd, name, O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC);
+        DIR* dir = (fd >= 0) ? fdopendir(fd) : NULL;
+        if (dir == NULL)
+        {
+            if (fd >= 0)
+                close(fd);
+            return;
+        }
+        OpenDir sub = { dir, path + "/" };
+        m_stack.push_back(sub);
+    }
+    else if (S_ISREG(st.st_mode))
+    {
+        // 以打开后的长度为准写头部
+        int fd = openat(dirFd, name, O_RDONLY|O_NOFOLLOW|O_CLOEXEC);
+        if (fd < 0)
+            return;
+        if (fstat(fd, &st) != 0)
+        {
+            close(fd);
+            return;
+        }
+
+        writeHeader(path, st, '0', st.st_size, "");
+        s_files++;
+        if (st.st_size == 0)
+        {
+            close(fd);
+            return;
+        }
+
+        m_bodyFd = fd;
+        m_bodyOffset = 0;
+        m_bodySize = st.st_size;
+        if (m_gzipLevel < 0 && m_bodySize >= m_sendfileMin)
+            m_segment = evbuffer_file_segment_new(fd, 0, st.st_size, EVBUF_FS_CLOSE_ON_FREE);
+    }
+    else if (S_ISLNK(st.st_mode))
+    {
+        char target[PATH_MAX];
+        ssize_t length = readlinkat(dirFd, name, target, sizeof(target));
+        if (length > 0)
+            writeHeader(path, st, '2', 0, std::string(target, length));
+    }
+    // 设备、FIFO和套接字不打包
+}
+
+void TarStreamer::writeHeader(const std::string& path, const struct stat& st, char type, uint64_t size,
+                              const std::string& link)
+{
+    if (path.size() > 100)
+        writeLongName('L', path);
+    if (link.size() > 100)
+        writeLongName('K', link);
+
+    char header[BLOCK];
+    buildHeader(header, path, &st, type, size, link);
+    emit(header, BLOCK);
+}
+
+void TarStreamer::writeLongName(char type, const std::string& name)
+{
+    // 名字连同结尾的'\0'作为一个条目的内容，紧接着的条目使用它
+    char header[BLOCK];
+    buildHeader(header, "././@LongLink", NULL, type, name.size() + 1, "");
+    emit(header, BLOCK);
+    emit(name.c_str(), name.size() + 1);
+    emit(s_zeros, (BLOCK - (name.size() + 1) % BLOCK) % BLOCK);
+}
+
+void TarStreamer::sendBody()
+{
+    size_t length = (size_t)std::min((uint64_t)m_chunkSize, m_bodySize - m_bodyOffset);
+    if (m_segment != NULL)
+    {
+        // 文件段按块挂到输出缓冲，缓冲长度照样受高水位约束
+        if (evbuffer_add_file_segment(m_output, m_segment, m_bodyOffset, length) != 0)
+        {
+            m_failed = true;
+            return;
+        }
+        m_archiveBytes += length;
+        m_bytes += length;
+        s_sendfileBytes += length;
+    }
+    else
+    {
+        // 打包过程中文件变短时补零，保证内容长度与头部一致
+        ssize_t got = pread(m_bodyFd, &m_scratch[0], length, m_bodyOffset);
+        if (got < 0)
+            got = 0;
+        if ((size_t)got < length)
+            memset(&m_scratch[got], 0, length - got);
+        emit(&m_scratch[0], length);
+        s_copiedBytes += length;
+    }
+
+    m_bodyOffset += length;
+    if (m_bodyOffset == m_bodySize)
+    {
+        emit(s_zeros, (BLOCK - m_bodySize % BLOCK) % BLOCK);
+        closeBody();
+    }
+}
+
+void TarStreamer::closeBody()
+{
+    // 文件段带EVBUF_FS_CLOSE_ON_FREE，最后一块发出后由libevent关闭描述符
+    if (m_segment != NULL)
+        evbuffer_file_segment_free(m_segment);
+    else if (m_bodyFd >= 0)
+        close(m_bodyFd);
+    m_segment = NULL;
+    m_bodyFd = -1;
+}
+
+void TarStreamer::finish()
+{
+    // 结尾两个全零块，再补齐到整记录
+    uint64_t end = m_archiveBytes + 2 * BLOCK;
+    end = (end + RECORD - 1) / RECORD * RECORD;
+    while (m_archiveBytes < end)
+        emit(s_zeros, BLOCK);
+
+    if (m_gzipLevel >= 0)
+        compress(NULL, 0, Z_FINISH);
+    m_done = true;
+}
+
+void TarStreamer::emit(const char* data, size_t length)
+{
+    if (length == 0)
+        return;
+
+    m_archiveBytes += length;
+    if (m_gzipLevel >= 0)
+    {
+        compress(data, length, Z_NO_FLUSH);
+    }
+    else
+    {
+        evbuffer_add(m_output, data, length);
+        m_bytes += length;
+    }
+}
+
+void TarStreamer::compress(const char* data, size_t length, int flush)
+{
+    m_zstream.next_in = (Bytef*)data;
+    m_zstream.avail_in = length;
+    for (;;)
+    {
+        m_zstream.next_out = (Bytef*)&m_compressed[0];
+        m_zstream.avail_out = m_compressed.size();
+        int ret = deflate(&m_zstream, flush);
+        if (ret == Z_STREAM_ERROR)
+        {
+            m_failed = true;
+            return;
+        }
+
+        size_t produced = m_compressed.size() - m_zstream.avail_out;
+        evbuffer_add(m_output, &m_compressed[0], produced);
+        m_bytes += produced;
+
+        // 输出区没写满说明输入已经消化完；结束时要一直取到Z_STREAM_END
+        if (flush == Z_FINISH ? (ret == Z_STREAM_END) : (m_zstream.avail_out != 0))
+            return;
+    }
+}
+
+/*static*/ bool TarStreamer::archiveName(const std::string& name, std::string* base, bool* gzip)
+{
+    static const struct
+    {
+        const char* suffix;
+        bool gzip;
+    } suffixes[] = { { ".tar", false }, { ".tar.gz", true }, { ".tgz", true } };
+
+    for (size_t i = 0; i < sizeof(suffixes) / sizeof(suffixes[0]); i++)
+    {
+        size_t length = strlen(suffixes[i].suffix);
+        if (name.size() > length && name.compare(name.size() - length, length, suffixes[i].suffix) == 0)
+        {
+            *base = name.substr(0, name.size() - length);
+            *gzip = suffixes[i].gzip;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/*static*/ std::string TarStreamer::formatStats()
+{
+    char buf[256];
+    sprintf(buf,
+            " tar.archives %llu\r\n"
+            " tar.files %llu\r\n"
+            " tar.sendfile_bytes %llu\r\n"
+            " tar.copied_bytes %llu\r\n",
+            (unsigned long long)s_archives,
+            (unsigned long long)s_files,
+            (unsigned long long)s_sendfileBytes,
+            (unsigned long long)s_copiedBytes);
+    return buf;
+}
@@ -0,0 +1,85 @@
+#ifndef TARSTREAMER_H
+#define TARSTREAMER_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include <event2/event.h>
+#include <event2/buffer.h>
+
+// 文件段（evbuffer_file_segment）和FtpServer用到的调度预算接口都是libevent 2.1才有的
+#if LIBEVENT_VERSION_NUMBER < 0x02010000
+#error "libevent 2.1 or later is required"
+#endif
+
+// 把目录树边遍历边打成tar（GNU格式，长名字用././@LongLink）写进数据通道的输出缓冲，
+// 不在磁盘上生成临时归档。头部在内存里拼好；不压缩时大文件的内容用evbuffer的文件段
+// 按块挂到输出缓冲，由libevent用sendfile发出，小文件直接读进缓冲，省得每个都占一个描述符。
+// 压缩时所有内容读出后经zlib生成gzip流。输出缓冲超过高水位即返回，写回调降下来后再pump
+class TarStreamer
+{
+public:
+    TarStreamer(int maxDepth, size_t chunkSize, size_t sendfileMin, int gzipLevel);    // gzipLevel<0时不压缩
+    ~TarStreamer();
+
+    bool start(int rootFd, const std::string& topName, evbuffer* output, size_t highWater);    // 接管rootFd
+    bool pump();        // 归档全部入队后返回true
+
+    bool failed() { return m_failed; }
+    uint64_t bytes() { return m_bytes; }    // 已入队的字节数（压缩时为压缩后）
+
+    // 是否为打包下载的名字：以.tar、.tar.gz或.tgz结尾，返回去掉后缀的部分
+    static bool archiveName(const std::string& name, std::string* base, bool* gzip);
+    static std::string formatStats();
+
+protected:
+    struct OpenDir
+    {
+        DIR* dir;
+        std::string prefix;     // 归档内的路径，以'/'结尾
+    };
+
+    bool nextEntry();
+    void addEntry(int dirFd, const char* name, const std::string& path);
+    void writeHeader(const std::string& path, const struct stat& st, char type, uint64_t size,
+                     const std::string& link);
+    void writeLongName(char type, const std::string& name);
+    void sendBody();
+    void finish();
+    void emit(const char* data, size_t length);
+    void compress(const char* data, size_t length, int flush);
+    void closeBody();
+
+protected:
+    int m_maxDepth;
+    size_t m_chunkSize;
+    size_t m_sendfileMin;
+    int m_gzipLevel;
+    evbuffer* m_output;
+    size_t m_highWater;
+
+    std::vector<OpenDir> m_stack;
+    int m_bodyFd;               // 正在输出内容的文件，没有时为-1
+    evbuffer_file_segment* m_segment;   // 走sendfile时的文件段
+    uint64_t m_bodyOffset;
+    uint64_t m_bodySize;
+    std::vector<char> m_scratch;
+    std::vector<char> m_compressed;
+
+    z_stream m_zstream;
+    bool m_done;
+    bool m_failed;
+    uint64_t m_archiveBytes;    // 未压缩的归档长度，用于补齐最后一个记录
+    uint64_t m_bytes;
+
+    // 所有归档的累计统计，只在事件循环线程中修改
+    static uint64_t s_archives;
+    static uint64_t s_files;
+    static uint64_t s_sendfileBytes;
+    static uint64_t s_copiedBytes;
+};
+
+#endif // TARSTREAMER_H
@@ -0,0 +1,160 @@
+#include "ThreadPool.h"
+#include <unistd.h>
+#include <fcntl.h>
+
+ThreadPool::ThreadPool(int threadCount, int maxQueue)
+{
+    m_threadCount = threadCount;
+    m_maxQueue = maxQueue;
+    m_stopping = false;
+    m_notifyPipe[0] = -1;
+    m_notifyPipe[1] = -1;
+    m_notifyEvent = NULL;
+    
+    pthread_mutex_init(&m_mutex, NULL);
+    pthread_cond_init(&m_cond, NULL);
+}
+
+ThreadPool::~ThreadPool()
+{
+    stop();
+    pthread_cond_destroy(&m_cond);
+    pthread_mutex_destroy(&m_mutex);
+}
+
+bool ThreadPool::start(event_base* base)
+{
+    if (pipe(m_notifyPipe) != 0)
+        return false;
+    
+    fcntl(m_notifyPipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(m_notifyPipe[1], F_SETFL, O_NONBLOCK);
+    m_notifyEvent = event_new(base, m_notifyPipe[0], EV_READ|EV_PERSIST, ThreadPool::notifyCallback, this);
+    event_add(m_notifyEvent, NULL);
+    
+    for (int i = 0; i < m_threadCount; i++)
+    {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, ThreadPool::workerMain, this) == 0)
+            m_threads.push_back(thread);
+    }
+    
+    return !m_threads.empty();
+}
+
+void ThreadPool::stop()
+{
+    pthread_mutex_lock(&m_mutex);
+    m_stopping = true;
+    pthread_cond_broadcast(&m_cond);
+    pthread_mutex_unlock(&m_mutex);
+    
+    for (size_t i = 0; i < m_threads.size(); i++)
+        pthread_join(m_threads[i], NULL);
+    m_threads.clear();
+    
+    // 未执行和未回调的任务直接丢弃
+    std::list<ThreadTask*>::iterator it;
+    for (it = m_pending.begin(); it != m_pending.end(); it++)
+        delete *it;
+    m_pending.clear();
+    for (it = m_finished.begin(); it != m_finished.end(); it++)
+        delete *it;
+    m_finished.clear();
+    
+    if (m_notifyEvent != NULL)
+    {
+        event_free(m_notifyEvent);
+        m_notifyEvent = NULL;
+    }
+    
+    for (int i = 0; i < 2; i++)
+    {
+        if (m_notifyPipe[i] != -1)
+        {
+            close(m_notifyPipe[i]);
+            m_notifyPipe[i] = -1;
+        }
+    }
+}
+
+bool ThreadPool::submit(ThreadTask* task)
+{
+    pthread_mutex_lock(&m_mutex);
+    if (m_stopping || (int)m_pending.size() >= m_maxQueue)
+    {
+        pthread_mutex_unlock(&m_mutex);
+        return false;
+    }
+    
+    m_pending.push_back(task);
+    pthread_cond_signal(&m_cond);
+    pthread_mutex_unlock(&m_mutex);
+    return true;
+}
+
+int ThreadPool::queueLength()
+{
+    pthread_mutex_lock(&m_mutex);
+    int length = m_pending.size();
+    pthread_mutex_unlock(&m_mutex);
+    return length;
+}
+
+/*static*/ void* ThreadPool::workerMain(void* arg)
+{
+    ThreadPool* pool = (ThreadPool*)arg;
+    
+    for (;;)
+    {
+        pthread_mutex_lock(&pool->m_mutex);
+        while (!pool->m_stopping && pool->m_pending.empty())
+            pthread_cond_wait(&pool->m_cond, &pool->m_mutex);
+        
+        if (pool->m_stopping)
+        {
+            pthread_mutex_unlock(&pool->m_mutex);
+            break;
+        }
+        
+        ThreadTask* task = pool->m_pending.front();
+        pool->m_pending.pop_front();
+        pthread_mutex_unlock(&pool->m_mutex);
+        
+        task->run();
+        
+        pthread_mutex_lock(&pool->m_mutex);
+        bool wasEmpty = pool->m_finished.empty();
+        pool->m_finished.push_back(task);
+        pthread_mutex_unlock(&pool->m_mutex);
+        
+        // 完成队列由空变非空时才需要唤醒事件循环
+        if (wasEmpty)
+        {
+            char c = 0;
+            write(pool->m_notifyPipe[1], &c, 1);
+        }
+    }
+    
+    return NULL;
+}
+
+/*static*/ void ThreadPool::notifyCallback(evutil_socket_t fd, short event, void* arg)
+{
+    ThreadPool* pool = (ThreadPool*)arg;
+    
+    char buf[64];
+    while (read(fd, buf, sizeof(buf)) > 0)
+        ;
+    
+    std::list<ThreadTask*> finished;
+    pthread_mutex_lock(&pool->m_mutex);
+    finished.swap(pool->m_finished);
+    pthread_mutex_unlock(&pool->m_mutex);
+    
+    for (std::list<ThreadTask*>::iterator it = finished.begin(); it != finished.end(); it++)
+    {
+        (*it)->done();
+        delete *it;
+    }
+}
@@ -0,0 +1,51 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <pthread.h>
+#include <event2/event.h>
+#include <list>
+#include <vector>
+
+// 放到工作线程执行的任务。run()在工作线程中调用，done()回到事件循环线程中调用，
+// 因此done()里可以安全地操作客户端和bufferevent
+class ThreadTask
+{
+public:
+    virtual ~ThreadTask() {}
+    virtual void run() = 0;
+    virtual void done() = 0;
+};
+
+// 固定线程数、队列有上限的线程池，完成的任务通过管道通知事件循环
+class ThreadPool
+{
+public:
+    ThreadPool(int threadCount, int maxQueue);
+    ~ThreadPool();
+    
+    bool start(event_base* base);
+    void stop();
+    
+    bool submit(ThreadTask* task);  // 队列已满时返回false，任务仍归调用者所有
+    int queueLength();
+    
+protected:
+    static void* workerMain(void* arg);
+    static void notifyCallback(evutil_socket_t fd, short event, void* arg);
+    
+protected:
+    int m_threadCount;
+    int m_maxQueue;
+    bool m_stopping;
+    std::vector<pthread_t> m_threads;
+    
+    pthread_mutex_t m_mutex;
+    pthread_cond_t m_cond;
+    std::list<ThreadTask*> m_pending;
+    std::list<ThreadTask*> m_finished;
+    
+    int m_notifyPipe[2];
+    event* m_notifyEvent;
+};
+
+#endif // THREADPOOL_H
@@ -0,0 +1,242 @@
+#include "TransferTrace.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+static uint64_t nowUsec()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+TransferTrace::TransferTrace(size_t ringSize)
+{
+    m_ring.resize(ringSize);
+    m_next = 0;
+    m_recorded = 0;
+    memset(m_histogram, 0, sizeof(m_histogram));
+    memset(m_max, 0, sizeof(m_max));
+}
+
+/*static*/ void TransferTrace::reset(TransferMarks* marks)
+{
+    marks->op = NULL;
+    memset(marks->at, 0, sizeof(marks->at));
+}
+
+/*static*/ void TransferTrace::begin(TransferMarks* marks, const char* op)
+{
+    // 同一个PASV上的时间点保留，命令之后的清掉
+    marks->op = op;
+    for (int i = MarkCommand; i < MarkCount; i++)
+        marks->at[i] = 0;
+    marks->at[MarkCommand] = nowUsec();
+}
+
+/*static*/ void TransferTrace::mark(TransferMarks* marks, TraceMark which)
+{
+    marks->at[which] = nowUsec();
+}
+
+/*static*/ void TransferTrace::markOnce(TransferMarks* marks, TraceMark which)
+{
+    if (marks->at[which] == 0)
+        marks->at[which] = nowUsec();
+}
+
+void TransferTrace::record(uint64_t sessionId, uint64_t bytes, const std::string& response, const TransferMarks* marks)
+{
+    if (m_ring.empty() || marks->op == NULL)
+        return;
+    
+    Record& record = m_ring[m_next];
+    record.sessionId = sessionId;
+    record.op = marks->op;
+    record.bytes = bytes;
+    record.code = atoi(response.c_str());
+    memcpy(record.at, marks->at, sizeof(record.at));
+    m_next = (m_next + 1) % m_ring.size();
+    m_recorded++;
+    
+    for (int phase = 0; phase < PhaseCount; phase++)
+    {
+        uint64_t start, end;
+        if (!phaseSpan(record, phase, &start, &end))
+            continue;
+        
+        uint64_t usec = end - start;
+        int bucket = 0;
+        for (uint64_t v = usec; v != 0; v >>= 1)
+            bucket++;
+        if (bucket >= BUCKETS)
+            bucket = BUCKETS - 1;
+        m_histogram[phase][bucket]++;
+        if (usec > m_max[phase])
+            m_max[phase] = usec;
+    }
+}
+
+/*static*/ bool TransferTrace::phaseSpan(const Record& record, int phase, uint64_t* start, uint64_t* end)
+{
+    const uint64_t* at = record.at;
+    switch (phase)
+    {
+    case PhasePasvSetup:
+        *start = at[MarkPasv];
+        *end = at[MarkPasvReady];
+        break;
+    case PhaseConnect:
+        *start = at[MarkPasvReady];
+        *end = at[MarkAccept];
+        break;
+    case PhaseOpen:
+        // 下载要等命令和数据连接都到齐才打开文件，从后到的那个算起
+        *start = at[MarkCommand];
+        if (at[MarkAccept] > *start && at[MarkAccept] <= at[MarkOpen])
+            *start = at[MarkAccept];
+        *end = at[MarkOpen];
+        break;
+    case PhaseFirstByte:
+        *start = at[MarkOpen];
+        *end = at[MarkFirstByte];
+        break;
+    case PhaseTransfer:
+        *start = at[MarkFirstByte];
+        *end = at[MarkLastByte];
+        break;
+    case PhaseDrain:
+        *start = at[MarkLastByte];
+        *end = at[MarkDone];
+        break;
+    case PhaseTtfb:
+        *start = at[MarkCommand];
+        *end = at[MarkFirstByte];
+        break;
+    default:
+        *start = at[MarkCommand];
+        *end = at[MarkDone];
+        break;
+    }
+    
+    return (*start != 0 && *end != 0 && *end >= *start);
+}
+
+/*static*/ const char* TransferTrace::phaseName(int phase)
+{
+    static const char* names[PhaseCount] =
+    {
+        "pasv_setup", "connect", "open", "first_byte", "transfer", "drain", "ttfb", "total"
+    };
+    return names[phase];
+}
+
+bool TransferTrace::dumpChrome(const std::string& path)
+{
+    FILE* file = fopen(path.c_str(), "w");
+    if (file == NULL)
+        return false;
+    
+    // 每个传输一个完整事件，其下按阶段再各一个；tid用会话号，同一会话的传输排在一行
+    fprintf(file, "{\"traceEvents\":[");
+    bool first = true;
+    size_t count = (m_recorded < m_ring.size()) ? (size_t)m_recorded : m_ring.size();
+    size_t index = (m_recorded < m_ring.size()) ? 0 : m_next;
+    int pid = getpid();
+    for (size_t i = 0; i < count; i++, index = (index + 1) % m_ring.size())
+    {
+        const Record& record = m_ring[index];
+        uint64_t begin = 0;
+        for (int mark = 0; mark < MarkCount && begin == 0; mark++)
+            begin = record.at[mark];
+        if (begin == 0 || record.at[MarkDone] < begin)
+            continue;
+        
+        fprintf(file, "%s\n{\"name\":\"%s\",\"cat\":\"transfer\",\"ph\":\"X\",\"ts\":%llu,\"dur\":%llu,"
+                "\"pid\":%d,\"tid\":%llu,\"args\":{\"bytes\":%llu,\"code\":%d}}",
+                first ? "" : ",", record.op, (unsigned long long)begin,
+                (unsigned long long)(record.at[MarkDone] - begin), pid,
+                (unsigned long long)record.sessionId, (unsigned long long)record.bytes, record.code);
+        first = false;
+        
+        // 直方图里的ttfb和total与各阶段重叠，不再单独画
+        for (int phase = 0; phase < PhaseTtfb; phase++)
+        {
+            uint64_t start, end;
+            if (!phaseSpan(record, phase, &start, &end))
+                continue;
+            
+            fprintf(file, ",\n{\"name\":\"%s\",\"cat\":\"phase\",\"ph\":\"X\",\"ts\":%llu,\"dur\":%llu,"
+                    "\"pid\":%d,\"tid\":%llu}",
+                    phaseName(phase), (unsigned long long)start, (unsigned long long)(end - start),
+                    pid, (unsigned long long)record.sessionId);
+        }
+    }
+    fprintf(file, "\n]}\n");
+    
+    return (fclose(file) == 0);
+}
+
+std::string TransferTrace::formatHistograms()
+{
+    // 每个阶段一行：次数、p50/p90/p99所在桶的上界和最大值
+    std::string result;
+    char buf[256];
+    for (int phase = 0; phase < PhaseCount; phase++)
+    {
+        uint64_t total = 0;
+        for (int i = 0; i < BUCKETS; i++)
+            total += m_histogram[phase][i];
+        if (total == 0)
+            continue;
+        
+        static const double points[] = { 0.50, 0.90, 0.99 };
+        uint64_t bounds[3];
+        for (int p = 0; p < 3; p++)
+        {
+            uint64_t want = (uint64_t)(total * points[p]);
+            if (want == 0)
+                want = 1;
+            
+            uint64_t seen = 0;
+            int bucket = 0;
+            for (; bucket < BUCKETS - 1; bucket++)
+            {
+                seen += m_histogram[phase][bucket];
+                if (seen >= want)
+                    break;
+            }
+            bounds[p] = (bucket == 0) ? 0 : ((uint64_t)1 << bucket) - 1;
+            if (bounds[p] > m_max[phase])
+                bounds[p] = m_max[phase];
+        }
+        
+        sprintf(buf, " %s count %llu p50 %lluus p90 %lluus p99 %lluus max %lluus\r\n",
+                phaseName(phase), (unsigned long long)total, (unsigned long long)bounds[0],
+                (unsigned long long)bounds[1], (unsigned long long)bounds[2], (unsigned long long)m_max[phase]);
+        result += buf;
+    }
+    
+    return result;
+}
+
+void TransferTrace::clear()
+{
+    m_next = 0;
+    m_recorded = 0;
+    memset(m_histogram, 0, sizeof(m_histogram));
+    memset(m_max, 0, sizeof(m_max));
+}
+
+std::string TransferTrace::formatStats()
+{
+    char buf[128];
+    sprintf(buf,
+            " trace.transfers %llu\r\n"
+            " trace.ring_size %llu\r\n",
+            (unsigned long long)m_recorded,
+            (unsigned long long)m_ring.size());
+    return buf;
+}
@@ -0,0 +1,85 @@
+#ifndef TRANSFERTRACE_H
+#define TRANSFERTRACE_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+// 一次传输生命周期中的时间点
+enum TraceMark
+{
+    MarkPasv,           // 收到PASV
+    MarkPasvReady,      // 数据端口的监听建好
+    MarkAccept,         // 客户端连上数据端口
+    MarkCommand,        // 收到RETR/STOR/LIST等命令
+    MarkOpen,           // 文件打开或目录读出
+    MarkFirstByte,      // 第一个字节入队（下载）或收到（上传）
+    MarkLastByte,       // 最后一个字节入队或收到
+    MarkDone,           // 回复226或出错
+    MarkCount
+};
+
+// 会话上正在进行的传输的时间点，单调时钟微秒，0表示还没经过
+struct TransferMarks
+{
+    const char* op;     // 收到命令后才有，为NULL时不记录
+    uint64_t at[MarkCount];
+};
+
+// 传输生命周期跟踪：结束的传输写入固定大小的环形缓冲，满了覆盖最旧的；
+// 各阶段耗时同时累计到按2的幂分桶的直方图。环形缓冲只由事件循环线程访问，不加锁
+class TransferTrace
+{
+public:
+    TransferTrace(size_t ringSize);
+    
+    static void reset(TransferMarks* marks);
+    static void begin(TransferMarks* marks, const char* op);
+    static void mark(TransferMarks* marks, TraceMark which);
+    static void markOnce(TransferMarks* marks, TraceMark which);
+    
+    // 传输结束时调用，response为回复给客户端的那一行
+    void record(uint64_t sessionId, uint64_t bytes, const std::string& response, const TransferMarks* marks);
+    
+    bool dumpChrome(const std::string& path);   // 按Chrome trace的JSON格式写出环形缓冲
+    std::string formatHistograms();
+    void clear();
+    std::string formatStats();
+
+protected:
+    enum Phase
+    {
+        PhasePasvSetup,     // 建立数据端口监听
+        PhaseConnect,       // 等客户端连上数据端口
+        PhaseOpen,          // 命令和连接都到齐后打开文件
+        PhaseFirstByte,     // 打开到第一个字节
+        PhaseTransfer,      // 第一个到最后一个字节
+        PhaseDrain,         // 最后一个字节到回复
+        PhaseTtfb,          // 命令到第一个字节
+        PhaseTotal,         // 命令到回复
+        PhaseCount
+    };
+    
+    struct Record
+    {
+        uint64_t sessionId;
+        const char* op;
+        uint64_t bytes;
+        int code;
+        uint64_t at[MarkCount];
+    };
+    
+    static bool phaseSpan(const Record& record, int phase, uint64_t* start, uint64_t* end);
+    static const char* phaseName(int phase);
+
+protected:
+    static const int BUCKETS = 40;  // 第i桶为[2^(i-1), 2^i)微秒
+    
+    std::vector<Record> m_ring;
+    size_t m_next;
+    uint64_t m_recorded;
+    uint64_t m_histogram[PhaseCount][BUCKETS];
+    uint64_t m_max[PhaseCount];
+};
+
+#endif // TRANSFERTRACE_H
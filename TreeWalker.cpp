@@ -0,0 +1,360 @@
+#include "TreeWalker.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/openat2.h>
+#include <vector>
+
+static const int WALK_BATCH = 1024;     // 每个任务大约处理的条目数，大目录分多批读
+static const int DENTS_BUF_SIZE = 32*1024;
+
+/*static*/ uint64_t TreeWalker::s_walks = 0;
+/*static*/ uint64_t TreeWalker::s_entries = 0;
+/*static*/ uint64_t TreeWalker::s_truncated = 0;
+
+static std::string joinPath(const std::string& dir, const std::string& name)
+{
+    if (name.empty())
+        return dir;
+    if (dir.empty() || dir[dir.size()-1] == '/')
+        return dir + name;
+    return dir + "/" + name;
+}
+
+// 打开遍历根目录下的子目录，路径中任何一级是符号链接都失败，扫描之后被换成链接也逃不出根目录。
+// 内核不支持openat2时只剩最后一级的O_NOFOLLOW
+static int openBeneath(int rootFd, const char* path)
+{
+    open_how how;
+    memset(&how, 0, sizeof(how));
+    how.flags = O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC;
+    how.resolve = RESOLVE_BENEATH|RESOLVE_NO_SYMLINKS;
+    int fd = syscall(SYS_openat2, rootFd, path, &how, sizeof(how));
+    if (fd >= 0 || errno != ENOSYS)
+        return fd;
+    
+    return openat(rootFd, path, O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC);
+}
+
+// 扫描一个目录的一批条目，run()在工作线程中只读写自己的成员
+class DirScanTask : public ThreadTask
+{
+public:
+    DirScanTask(TreeWalker* walker, const WalkDir& dir)
+        : m_walker(walker), m_dir(dir), m_rootFd(walker->m_rootFd),
+          m_format(walker->m_format), m_maxDepth(walker->m_maxDepth),
+          m_logicalDir(joinPath(walker->m_logicalRoot, dir.relPath)),
+          m_count(0), m_eof(false)
+    {
+    }
+    
+    virtual void run()
+    {
+        // 大目录分多批读，标题只在第一批加，空行只在最后一批加
+        if (m_dir.fd < 0)
+        {
+            const char* path = m_dir.relPath.empty() ? "." : m_dir.relPath.c_str();
+            m_dir.fd = openBeneath(m_rootFd, path);
+            if (m_dir.fd < 0)
+            {
+                m_eof = true;
+                return;
+            }
+            
+            if (m_format == TreeWalker::FormatList)
+                m_output += m_logicalDir + ":\r\n";
+        }
+        
+        char buf[DENTS_BUF_SIZE];
+        while (m_count < WALK_BATCH)
+        {
+            ssize_t length = getdents64(m_dir.fd, buf, sizeof(buf));
+            if (length <= 0)
+            {
+                m_eof = true;
+                break;
+            }
+            
+            for (ssize_t pos = 0; pos < length; )
+            {
+                struct dirent64* entry = (struct dirent64*)(buf + pos);
+                pos += entry->d_reclen;
+                if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+                    continue;
+                
+                // 条目可能在读目录和statx之间被删掉，跳过即可
+                struct statx stx;
+                if (statx(m_dir.fd, entry->d_name, AT_SYMLINK_NOFOLLOW|AT_STATX_DONT_SYNC,
+                          STATX_TYPE|STATX_SIZE|STATX_MTIME, &stx) != 0)
+                    continue;
+                
+                bool isDir = S_ISDIR(stx.stx_mode);
+                appendEntry(stx, isDir, (m_format == TreeWalker::FormatList) ?
+                            std::string(entry->d_name) : joinPath(m_logicalDir, entry->d_name));
+                m_count++;
+                
+                // 不跟随符号链接，避免环和逃出根目录
+                if (isDir && m_dir.depth < m_maxDepth)
+                {
+                    WalkDir sub;
+                    sub.relPath = joinPath(m_dir.relPath, entry->d_name);
+                    sub.depth = m_dir.depth + 1;
+                    sub.fd = -1;
+                    m_subDirs.push_back(sub);
+                }
+            }
+        }
+        
+        if (m_eof)
+        {
+            if (m_format == TreeWalker::FormatList)
+                m_output += "\r\n";
+            close(m_dir.fd);
+            m_dir.fd = -1;
+        }
+    }
+    
+    virtual void done()
+    {
+        m_walker->taskDone(this);
+    }
+
+protected:
+    void appendEntry(const struct statx& stx, bool isDir, const std::string& name)
+    {
+        char buf[64];
+        time_t mtime = stx.stx_mtime.tv_sec;
+        struct tm tmBuf;
+        localtime_r(&mtime, &tmBuf);
+        strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", &tmBuf);
+        m_output += buf;
+        
+        if (isDir)
+        {
+            m_output += " <DIR> ";
+        }
+        else
+        {
+            sprintf(buf, " %llu ", (unsigned long long)stx.stx_size);
+            m_output += buf;
+        }
+        
+        m_output += name;
+        m_output += "\r\n";
+    }
+
+public:
+    TreeWalker* m_walker;
+    WalkDir m_dir;
+    int m_rootFd;
+    TreeWalker::Format m_format;
+    int m_maxDepth;
+    std::string m_logicalDir;
+    
+    std::string m_output;
+    std::vector<WalkDir> m_subDirs;
+    int m_count;
+    bool m_eof;
+};
+
+TreeWalker::TreeWalker(ThreadPool* pool, int parallel, int maxDepth, uint64_t maxEntries)
+{
+    m_pool = pool;
+    m_parallel = (parallel < 1) ? 1 : parallel;
+    m_maxDepth = maxDepth;
+    m_maxEntries = maxEntries;
+    
+    m_rootFd = -1;
+    m_format = FormatList;
+    m_output = NULL;
+    m_highWater = 0;
+    m_callback = NULL;
+    m_arg = NULL;
+    
+    m_inFlight = 0;
+    m_hasActive = false;
+    m_cancelled = false;
+    m_truncated = false;
+    m_failed = false;
+    m_entries = 0;
+    m_bytes = 0;
+}
+
+TreeWalker::~TreeWalker()
+{
+    clearPending();
+    if (m_rootFd >= 0)
+        close(m_rootFd);
+}
+
+bool TreeWalker::start(int rootFd, const std::string& logicalRoot, Format format,
+                       evbuffer* output, size_t highWater, WalkDoneCallback callback, void* arg)
+{
+    m_rootFd = rootFd;
+    if (m_rootFd < 0)
+        return false;
+    
+    m_logicalRoot = logicalRoot;
+    m_format = format;
+    m_output = output;
+    m_highWater = highWater;
+    m_callback = callback;
+    m_arg = arg;
+    s_walks++;
+    
+    WalkDir root;
+    root.depth = 0;
+    root.fd = -1;
+    m_pending.push_back(root);
+    return true;
+}
+
+void TreeWalker::pump()
+{
+    bool busy = false;
+    while (!m_pending.empty() && m_inFlight < m_parallel &&
+           evbuffer_get_length(m_output) < m_highWater)
+    {
+        // 有目录只输出了一部分时只派发它的后续批次，其他目录等它读完
+        if (m_hasActive && m_pending.front().relPath != m_activePath)
+            break;
+        
+        DirScanTask* task = new DirScanTask(this, m_pending.front());
+        if (!m_pool->submit(task))
+        {
+            delete task;
+            busy = true;
+            break;
+        }
+        
+        m_pending.pop_front();
+        m_inFlight++;
+    }
+    
+    if (m_inFlight > 0)
+        return;
+    
+    // 线程池排满且本次遍历没有任务在跑，不会再有人来推进，只能放弃
+    if (busy)
+    {
+        m_failed = true;
+        clearPending();
+    }
+    
+    if (m_pending.empty())
+        m_callback(this, m_arg);
+}
+
+void TreeWalker::cancel()
+{
+    m_cancelled = true;
+    clearPending();
+    if (m_inFlight == 0)
+        delete this;
+}
+
+void TreeWalker::taskDone(DirScanTask* task)
+{
+    m_inFlight--;
+    
+    if (m_cancelled || m_truncated)
+    {
+        if (task->m_dir.fd >= 0)
+            close(task->m_dir.fd);
+        
+        if (m_cancelled)
+        {
+            if (m_inFlight == 0)
+                delete this;
+            return;
+        }
+    }
+    else
+    {
+        m_entries += task->m_count;
+        s_entries += task->m_count;
+        for (size_t i = 0; i < task->m_subDirs.size(); i++)
+            m_pending.push_back(task->m_subDirs[i]);
+        
+        // 同一个目录的各批输出要连在一起。正在输出别的目录时先存着，
+        // 最多是并行派发出去的那几个任务的结果
+        HeldOutput held;
+        held.output.swap(task->m_output);
+        held.dir = task->m_dir;
+        if (m_hasActive && task->m_dir.relPath != m_activePath)
+        {
+            m_held.push_back(held);
+        }
+        else
+        {
+            m_hasActive = false;
+            m_held.push_front(held);
+            releaseHeld();
+        }
+        
+        if (m_entries >= m_maxEntries)
+        {
+            m_truncated = true;
+            s_truncated++;
+            clearPending();
+        }
+    }
+    
+    pump();
+}
+
+void TreeWalker::releaseHeld()
+{
+    while (!m_hasActive && !m_held.empty())
+    {
+        HeldOutput& held = m_held.front();
+        evbuffer_add(m_output, held.output.data(), held.output.size());
+        m_bytes += held.output.size();
+        
+        // 没读完的目录成为当前目录，后续批次排到最前面，尽快释放它占着的描述符
+        if (held.dir.fd >= 0)
+        {
+            m_hasActive = true;
+            m_activePath = held.dir.relPath;
+            m_pending.push_front(held.dir);
+        }
+        m_held.pop_front();
+    }
+}
+
+void TreeWalker::clearPending()
+{
+    for (std::deque<WalkDir>::iterator it = m_pending.begin(); it != m_pending.end(); it++)
+    {
+        if (it->fd >= 0)
+            close(it->fd);
+    }
+    m_pending.clear();
+    
+    for (std::deque<HeldOutput>::iterator it = m_held.begin(); it != m_held.end(); it++)
+    {
+        if (it->dir.fd >= 0)
+            close(it->dir.fd);
+    }
+    m_held.clear();
+    m_hasActive = false;
+}
+
+/*static*/ std::string TreeWalker::formatStats()
+{
+    char buf[256];
+    sprintf(buf,
+            " tree.walks %llu\r\n"
+            " tree.entries %llu\r\n"
+            " tree.truncated %llu\r\n",
+            (unsigned long long)s_walks,
+            (unsigned long long)s_entries,
+            (unsigned long long)s_truncated);
+    return buf;
+}
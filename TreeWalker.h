@@ -0,0 +1,95 @@
+#ifndef TREEWALKER_H
+#define TREEWALKER_H
+
+#include <stdint.h>
+#include <string>
+#include <deque>
+#include <event2/buffer.h>
+#include "ThreadPool.h"
+
+class TreeWalker;
+class DirScanTask;
+typedef void (*WalkDoneCallback)(TreeWalker* walker, void* arg);
+
+// 待扫描的目录。fd>=0表示上一批没读完，接着读
+struct WalkDir
+{
+    std::string relPath;    // 相对遍历根目录，根目录为空串
+    int depth;
+    int fd;
+};
+
+// 暂时不能输出的一批结果，dir.fd>=0表示目录还没读完
+struct HeldOutput
+{
+    std::string output;
+    WalkDir dir;
+};
+
+// 递归列目录（LIST -R / SITE TREE）。每个目录的扫描是线程池里的一个任务，
+// 用openat/getdents64/statx一次读一批；结果回到事件循环后追加到数据通道的输出缓冲，
+// 输出缓冲超过高水位就暂停派发，等写回调把它降下来再继续，内存占用有上限
+class TreeWalker
+{
+    friend class DirScanTask;
+
+public:
+    enum Format
+    {
+        FormatList,     // 按目录分段，与LIST的行格式相同
+        FormatTree      // 每行一个条目，带完整逻辑路径
+    };
+    
+    TreeWalker(ThreadPool* pool, int parallel, int maxDepth, uint64_t maxEntries);
+    ~TreeWalker();      // 只能在结束回调里或cancel()之前释放
+    
+    // rootFd为遍历根目录的描述符（Vfs::openDir打开，已在用户根目录之内），之后归TreeWalker所有
+    bool start(int rootFd, const std::string& logicalRoot, Format format,
+               evbuffer* output, size_t highWater, WalkDoneCallback callback, void* arg);
+    void pump();    // 输出缓冲降下来后调用；遍历结束时回调，回调里可以delete
+    void cancel();  // 数据通道已关闭，剩余任务回来后自行释放，调用后不能再使用
+    
+    bool truncated() { return m_truncated; }
+    bool failed() { return m_failed; }
+    uint64_t entries() { return m_entries; }
+    uint64_t bytes() { return m_bytes; }
+    
+    static std::string formatStats();
+
+protected:
+    void taskDone(DirScanTask* task);
+    void releaseHeld();
+    void clearPending();
+
+protected:
+    ThreadPool* m_pool;
+    int m_parallel;         // 同一次遍历最多同时在线程池中的任务数
+    int m_maxDepth;
+    uint64_t m_maxEntries;
+    
+    int m_rootFd;
+    std::string m_logicalRoot;
+    Format m_format;
+    evbuffer* m_output;
+    size_t m_highWater;
+    WalkDoneCallback m_callback;
+    void* m_arg;
+    
+    std::deque<WalkDir> m_pending;
+    std::deque<HeldOutput> m_held;
+    bool m_hasActive;           // m_activePath只输出了一部分
+    std::string m_activePath;
+    int m_inFlight;
+    bool m_cancelled;
+    bool m_truncated;
+    bool m_failed;
+    uint64_t m_entries;
+    uint64_t m_bytes;
+    
+    // 所有遍历的累计统计，只在事件循环线程中修改
+    static uint64_t s_walks;
+    static uint64_t s_entries;
+    static uint64_t s_truncated;
+};
+
+#endif // TREEWALKER_H
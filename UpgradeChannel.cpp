@@ -0,0 +1,187 @@
+#include "UpgradeChannel.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+static bool fillAddress(const std::string& path, sockaddr_un* addr)
+{
+    if (path.size() >= sizeof(addr->sun_path))
+        return false;
+    
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    strcpy(addr->sun_path, path.c_str());
+    return true;
+}
+
+/*static*/ int UpgradeChannel::listen(const std::string& path)
+{
+    sockaddr_un addr;
+    if (!fillAddress(path, &addr))
+        return -1;
+    
+    int sock = socket(AF_UNIX, SOCK_SEQPACKET|SOCK_CLOEXEC|SOCK_NONBLOCK, 0);
+    if (sock == -1)
+        return -1;
+    
+    // 连上来的进程会拿到监听套接字和已登录的会话，只允许本用户连接
+    unlink(path.c_str());
+    if (bind(sock, (sockaddr*)&addr, sizeof(addr)) != 0 || chmod(path.c_str(), 0600) != 0 ||
+        ::listen(sock, 1) != 0)
+    {
+        close(sock);
+        return -1;
+    }
+    
+    return sock;
+}
+
+/*static*/ bool UpgradeChannel::trustedPeer(int sock)
+{
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    if (getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &len) != 0)
+        return false;
+    
+    return cred.uid == geteuid();
+}
+
+/*static*/ int UpgradeChannel::connect(const std::string& path)
+{
+    sockaddr_un addr;
+    if (!fillAddress(path, &addr))
+        return -1;
+    
+    int sock = socket(AF_UNIX, SOCK_SEQPACKET|SOCK_CLOEXEC, 0);
+    if (sock == -1)
+        return -1;
+    
+    if (::connect(sock, (sockaddr*)&addr, sizeof(addr)) != 0)
+    {
+        close(sock);
+        return -1;
+    }
+    
+    return sock;
+}
+
+/*static*/ bool UpgradeChannel::sendMessage(int sock, const std::string& payload, int fd /*= -1*/)
+{
+    iovec iov;
+    iov.iov_base = (void*)payload.data();
+    iov.iov_len = payload.size();
+    
+    msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    
+    char control[CMSG_SPACE(sizeof(int))];
+    if (fd != -1)
+    {
+        memset(control, 0, sizeof(control));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    }
+    
+    // 升级通道上的消息很小，阻塞发送即可
+    int flags = fcntl(sock, F_GETFL);
+    fcntl(sock, F_SETFL, flags & ~O_NONBLOCK);
+    ssize_t ret = sendmsg(sock, &msg, MSG_NOSIGNAL);
+    fcntl(sock, F_SETFL, flags);
+    
+    return (ret == (ssize_t)payload.size());
+}
+
+/*static*/ bool UpgradeChannel::recvMessage(int sock, std::string* payload, int* fd)
+{
+    char buf[8192];
+    iovec iov;
+    iov.iov_base = buf;
+    iov.iov_len = sizeof(buf);
+    
+    char control[CMSG_SPACE(sizeof(int))];
+    msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    
+    *fd = -1;
+    ssize_t count = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+    if (count < 0)
+        return false;
+    
+
+    for (cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg))
+    {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+            memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+    }
+    
+    payload->assign(buf, count);
+    return true;
+}
+
+/*static*/ std::string UpgradeChannel::join(const std::vector<std::string>& fields)
+{
+    std::string payload;
+    for (size_t i = 0; i < fields.size(); i++)
+    {
+        if (i > 0)
+            payload += '\t';
+        
+        const std::string& field = fields[i];
+        for (size_t j = 0; j < field.size(); j++)
+        {
+            char c = field[j];
+            if (c == '\t' || c == '\n' || c == '%')
+            {
+                char hex[4];
+                sprintf(hex, "%%%02X", (unsigned char)c);
+                payload += hex;
+            }
+            else
+            {
+                payload += c;
+            }
+        }
+    }
+    
+    return payload;
+}
+
+/*static*/ std::vector<std::string> UpgradeChannel::split(const std::string& payload)
+{
+    std::vector<std::string> fields(1);
+    for (size_t i = 0; i < payload.size(); i++)
+    {
+        char c = payload[i];
+        if (c == '\t')
+        {
+            fields.push_back("");
+        }
+        else if (c == '%' && i + 2 < payload.size())
+        {
+            fields.back() += (char)strtol(payload.substr(i+1, 2).c_str(), NULL, 16);
+            i += 2;
+        }
+        else
+        {
+            fields.back() += c;
+        }
+    }
+    
+    return fields;
+}
@@ -0,0 +1,26 @@
+#ifndef UPGRADECHANNEL_H
+#define UPGRADECHANNEL_H
+
+#include <string>
+#include <vector>
+
+// 平滑升级时新旧进程之间的通道：AF_UNIX SOCK_SEQPACKET，保留消息边界，
+// 每条消息可以通过SCM_RIGHTS携带一个文件描述符
+class UpgradeChannel
+{
+public:
+    static int listen(const std::string& path);
+    static int connect(const std::string& path);
+    // 对端进程的有效用户与本进程相同
+    static bool trustedPeer(int sock);
+    
+    static bool sendMessage(int sock, const std::string& payload, int fd = -1);
+    // 出错时返回false并保留errno；对端关闭时返回true，payload为空
+    static bool recvMessage(int sock, std::string* payload, int* fd);
+    
+    // 字段之间用'\t'分隔，字段内的'\t'、'\n'、'%'转义为%XX
+    static std::string join(const std::vector<std::string>& fields);
+    static std::vector<std::string> split(const std::string& payload);
+};
+
+#endif // UPGRADECHANNEL_H
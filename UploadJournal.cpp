@@ -0,0 +1,614 @@
+#include "UploadJournal.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <set>
+#include <vector>
+
+static const uint64_t COMPACT_BYTES = 1024 * 1024;    // 日志超过这个长度时重写
+
+// 把只剩有效条目的日志写到临时文件、落盘后改名替换，返回以追加方式重新打开的描述符，失败返回-1
+static int writeJournal(const std::string& path, const std::string& content, bool sync)
+{
+    std::string temp = path + ".tmp";
+    int fd = ::open(temp.c_str(), O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0644);
+    if (fd < 0)
+        return -1;
+    bool ret = (write(fd, content.data(), content.size()) == (ssize_t)content.size());
+    if (ret && sync)
+        ret = (fdatasync(fd) == 0);
+    close(fd);
+    if (!ret || rename(temp.c_str(), path.c_str()) != 0)
+    {
+        unlink(temp.c_str());
+        return -1;
+    }
+
+    // 改名要等目录落盘才算数，否则崩溃后看到的还是旧日志，之后追加的记录全丢
+    if (sync)
+    {
+        size_t slash = path.find_last_of('/');
+        std::string dir = (slash == std::string::npos) ? "." : (slash == 0 ? "/" : path.substr(0, slash));
+        int dirFd = ::open(dir.c_str(), O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+        if (dirFd >= 0)
+        {
+            fsync(dirFd);
+            close(dirFd);
+        }
+    }
+
+    return ::open(path.c_str(), O_WRONLY|O_APPEND|O_CLOEXEC);
+}
+
+// 一批落盘请求，在工作线程里按“数据、改名、目录、日志”的顺序处理
+class GroupCommitTask : public ThreadTask
+{
+public:
+    GroupCommitTask(UploadJournal* journal)
+        : m_journal(journal), m_journalFd(journal->m_fd), m_sync(journal->m_sync),
+          m_syncfsMin(journal->m_syncfsMin), m_syncfsCalls(0), m_written(0), m_journalOk(true),
+          m_compact(false), m_newFd(-1)
+    {
+    }
+
+    virtual ~GroupCommitTask()
+    {
+        if (m_newFd >= 0)
+            close(m_newFd);
+
+        // 线程池停止时没执行的批次直接丢弃
+        for (size_t i = 0; i < m_requests.size(); i++)
+        {
+            closeFds(m_requests[i]);
+            delete m_requests[i];
+        }
+    }
+
+    virtual void run()
+    {
+        // 重写日志的批次不带请求，只把m_records里的快照换成新日志
+        if (m_compact)
+        {
+            m_newFd = writeJournal(m_path, m_records, m_sync);
+            m_journalOk = (m_newFd >= 0);
+            m_written = m_records.size();
+            return;
+        }
+
+        syncData();
+
+        // 数据落盘之后才改名，目标位置上不会出现内容不全的文件
+        std::set<std::pair<dev_t, ino_t> > dirs;
+        for (size_t i = 0; i < m_requests.size(); i++)
+        {
+            SyncRequest* request = m_requests[i];
+            if (request->dirFd < 0 || !request->ok)
+                continue;
+
+            request->ok = (renameat(request->dirFd, request->from.c_str(),
+                                    request->dirFd, request->to.c_str()) == 0);
+            struct stat st;
+            if (request->ok && m_sync && fstat(request->dirFd, &st) == 0 &&
+                dirs.insert(std::make_pair(st.st_dev, st.st_ino)).second)
+                fsync(request->dirFd);
+        }
+
+        // 检查点在数据落盘后才记下，发布在改名后才记下
+        char line[64];
+        for (size_t i = 0; i < m_requests.size(); i++)
+        {
+            SyncRequest* request = m_requests[i];
+            if (!request->ok)
+                continue;
+            if (request->dirFd >= 0)
+                sprintf(line, "E %llu\n", (unsigned long long)request->entryId);
+            else
+                sprintf(line, "D %llu %llu %ld\n", (unsigned long long)request->entryId,
+                        (unsigned long long)request->offset, (long)time(NULL));
+            m_records += line;
+        }
+        for (size_t i = 0; i < m_requests.size(); i++)
+            closeFds(m_requests[i]);
+
+        if (m_journalFd >= 0 && !m_records.empty())
+        {
+            m_journalOk = (write(m_journalFd, m_records.data(), m_records.size()) == (ssize_t)m_records.size());
+            if (m_journalOk && m_sync)
+                m_journalOk = (fdatasync(m_journalFd) == 0);
+            m_written = m_records.size();
+        }
+    }
+
+    virtual void done()
+    {
+        m_journal->batchDone(this);
+    }
+
+protected:
+    void syncData()
+    {
+        size_t files = 0;
+        for (size_t i = 0; i < m_requests.size(); i++)
+        {
+            m_requests[i]->ok = true;
+            if (m_requests[i]->fd >= 0)
+                files++;
+        }
+        if (!m_sync)
+            return;
+
+        // 文件多时每个文件系统调一次syncfs，顺带刷掉的其他脏页也会写下去，
+        // 但比逐个fdatasync少了多次等待日志提交
+        if (files >= m_syncfsMin)
+        {
+            std::set<dev_t> devices;
+            std::set<dev_t> failed;
+            for (size_t i = 0; i < m_requests.size(); i++)
+            {
+                struct stat st;
+                int fd = m_requests[i]->fd;
+                if (fd < 0 || fstat(fd, &st) != 0 || !devices.insert(st.st_dev).second)
+                    continue;
+                m_syncfsCalls++;
+                if (syncfs(fd) != 0)
+                    failed.insert(st.st_dev);
+            }
+            for (size_t i = 0; i < m_requests.size(); i++)
+            {
+                struct stat st;
+                int fd = m_requests[i]->fd;
+                if (fd >= 0)
+                    m_requests[i]->ok = (fstat(fd, &st) == 0 && failed.count(st.st_dev) == 0);
+            }
+            return;
+        }
+
+        for (size_t i = 0; i < m_requests.size(); i++)
+        {
+            if (m_requests[i]->fd >= 0)
+                m_requests[i]->ok = (fdatasync(m_requests[i]->fd) == 0);
+        }
+    }
+
+    static void closeFds(SyncRequest* request)
+    {
+        if (request->fd >= 0)
+            close(request->fd);
+        if (request->dirFd >= 0)
+            close(request->dirFd);
+        request->fd = -1;
+        request->dirFd = -1;
+    }
+
+public:
+    UploadJournal* m_journal;
+    std::vector<SyncRequest*> m_requests;
+    std::string m_records;
+    int m_journalFd;
+    bool m_sync;
+    size_t m_syncfsMin;
+    uint64_t m_syncfsCalls;
+    uint64_t m_written;
+    bool m_journalOk;
+    bool m_compact;
+    std::string m_path;
+    int m_newFd;
+};
+
+UploadJournal::UploadJournal(const std::string& path, bool sync, int resumeTtl, size_t syncfsMin)
+{
+    m_path = path;
+    m_sync = sync;
+    m_resumeTtl = resumeTtl;
+    m_syncfsMin = (syncfsMin > 0) ? syncfsMin : 1;
+    m_fd = -1;
+    m_journalBytes = 0;
+    m_nextId = 1;
+    m_pool = NULL;
+    m_inFlight = false;
+    m_batches = 0;
+    m_synced = 0;
+    m_largestBatch = 0;
+    m_syncfsCalls = 0;
+    m_failures = 0;
+    m_resumed = 0;
+    m_expired = 0;
+}
+
+UploadJournal::~UploadJournal()
+{
+    delete m_pool;
+
+    std::list<SyncRequest*>::iterator pit;
+    for (pit = m_pending.begin(); pit != m_pending.end(); pit++)
+    {
+        if ((*pit)->fd >= 0)
+            close((*pit)->fd);
+        if ((*pit)->dirFd >= 0)
+            close((*pit)->dirFd);
+        delete *pit;
+    }
+
+    std::map<uint64_t, JournalEntry*>::iterator it;
+    for (it = m_byId.begin(); it != m_byId.end(); it++)
+        delete it->second;
+
+    if (m_fd >= 0)
+        close(m_fd);
+}
+
+bool UploadJournal::open(event_base* base)
+{
+    // 同一时间只有一批在执行，后来的请求在m_pending里攒着
+    m_pool = new ThreadPool(1, 4);
+    if (!m_pool->start(base))
+        return false;
+
+    if (m_path.empty())
+        return true;
+    if (!replay())
+        return false;
+    expire();
+    return rewrite();
+}
+
+/*static*/ std::string UploadJournal::tempName(const std::string& name)
+{
+    return "." + name + ".upload";
+}
+
+/*static*/ bool UploadJournal::isTempName(const std::string& name)
+{
+    static const std::string suffix = ".upload";
+    return (name.size() > suffix.size() + 1 && name[0] == '.' &&
+            name.compare(name.size() - suffix.size(), suffix.size(), suffix) == 0);
+}
+
+std::string UploadJournal::hostTemp(const std::string& target)
+{
+    size_t slash = target.find_last_of('/');
+    return target.substr(0, slash + 1) + tempName(target.substr(slash + 1));
+}
+
+bool UploadJournal::replay()
+{
+    FILE* fp = fopen(m_path.c_str(), "r");
+    if (fp == NULL)
+        return (errno == ENOENT);
+
+    char line[PATH_MAX + 128];
+    while (fgets(line, sizeof(line), fp) != NULL)
+    {
+        size_t length = strlen(line);
+        if (length > 0 && line[length - 1] == '\n')
+            line[--length] = '\0';
+
+        unsigned long long id = 0, offset = 0;
+        long stamp = 0;
+        int pos = 0;
+        if (line[0] == 'B' && sscanf(line, "B %llu %ld %llu %n", &id, &stamp, &offset, &pos) == 3 && pos > 0)
+        {
+            // 同一条目的B再次出现表示从offset重新开始
+            JournalEntry* entry = m_byId.count(id) ? m_byId[id] : new JournalEntry;
+            if (m_byId.count(id))
+                m_entries.erase(entry->target);
+            entry->id = id;
+            entry->target = line + pos;
+            entry->durable = offset;
+            entry->updated = stamp;
+            entry->active = false;
+            entry->syncing = false;
+            m_entries[entry->target] = entry;
+            m_byId[id] = entry;
+        }
+        else if (line[0] == 'D' && sscanf(line, "D %llu %llu %ld", &id, &offset, &stamp) == 3 && m_byId.count(id))
+        {
+            JournalEntry* entry = m_byId[id];
+            if (offset > entry->durable)
+                entry->durable = offset;
+            entry->updated = stamp;
+        }
+        else if (line[0] == 'E' && sscanf(line, "E %llu", &id) == 1 && m_byId.count(id))
+        {
+            remove(m_byId[id]);
+        }
+        if (id >= m_nextId)
+            m_nextId = id + 1;
+    }
+    fclose(fp);
+
+    // 崩溃前写下的、没来得及落盘的尾巴不可信，截到已落盘的长度
+    std::map<uint64_t, JournalEntry*>::iterator it = m_byId.begin();
+    while (it != m_byId.end())
+    {
+        JournalEntry* entry = it->second;
+        it++;
+
+        struct stat st;
+        std::string temp = hostTemp(entry->target);
+        if (stat(temp.c_str(), &st) != 0)
+        {
+            remove(entry);
+            continue;
+        }
+        if ((uint64_t)st.st_size < entry->durable)
+            entry->durable = st.st_size;
+        else if ((uint64_t)st.st_size > entry->durable)
+            truncate(temp.c_str(), entry->durable);
+    }
+
+    return true;
+}
+
+std::string UploadJournal::snapshot()
+{
+    // 当前条目的状态已经包含了所有未写入的记录
+    std::string content;
+    char line[PATH_MAX + 128];
+    std::map<uint64_t, JournalEntry*>::iterator it;
+    for (it = m_byId.begin(); it != m_byId.end(); it++)
+    {
+        JournalEntry* entry = it->second;
+        snprintf(line, sizeof(line), "B %llu %ld %llu %s\n", (unsigned long long)entry->id, (long)entry->updated,
+                 (unsigned long long)entry->durable, entry->target.c_str());
+        content += line;
+    }
+    return content;
+}
+
+bool UploadJournal::rewrite()
+{
+    if (m_path.empty())
+        return true;
+
+    std::string content = snapshot();
+    int fd = writeJournal(m_path, content, m_sync);
+    if (fd < 0)
+        return false;
+
+    if (m_fd >= 0)
+        close(m_fd);
+    m_fd = fd;
+    m_journalBytes = content.size();
+    m_records.clear();
+    return true;
+}
+
+void UploadJournal::compact()
+{
+    // 没有批次在途，条目状态就是日志的全部内容；之后的记录和请求等新日志换上后再写
+    GroupCommitTask* task = new GroupCommitTask(this);
+    task->m_compact = true;
+    task->m_path = m_path;
+    task->m_records = snapshot();
+    m_records.clear();
+    m_inFlight = true;
+
+    if (!m_pool->submit(task))
+    {
+        task->run();
+        task->done();
+        delete task;
+    }
+}
+
+void UploadJournal::expire()
+{
+    time_t now = time(NULL);
+    std::map<uint64_t, JournalEntry*>::iterator it = m_byId.begin();
+    while (it != m_byId.end())
+    {
+        JournalEntry* entry = it->second;
+        it++;
+        if (!entry->active && !entry->syncing && entry->updated + m_resumeTtl < now)
+        {
+            m_expired++;
+            discard(entry);
+        }
+    }
+}
+
+void UploadJournal::remove(JournalEntry* entry)
+{
+    m_entries.erase(entry->target);
+    m_byId.erase(entry->id);
+    delete entry;
+}
+
+JournalEntry* UploadJournal::find(const std::string& target)
+{
+    std::map<std::string, JournalEntry*>::iterator it = m_entries.find(target);
+    return (it != m_entries.end()) ? it->second : NULL;
+}
+
+JournalEntry* UploadJournal::begin(const std::string& target, uint64_t offset)
+{
+    JournalEntry* entry = find(target);
+    bool shrunk = false;
+    if (entry == NULL)
+    {
+        entry = new JournalEntry;
+        entry->id = m_nextId++;
+        entry->target = target;
+        m_entries[target] = entry;
+        m_byId[entry->id] = entry;
+    }
+    else
+    {
+        if (offset > 0)
+            m_resumed++;
+        shrunk = (offset < entry->durable);
+    }
+
+    entry->durable = offset;
+    entry->updated = time(NULL);
+    entry->active = true;
+    entry->syncing = false;
+
+    char line[PATH_MAX + 128];
+    snprintf(line, sizeof(line), "B %llu %ld %llu %s\n", (unsigned long long)entry->id, (long)entry->updated,
+             (unsigned long long)offset, target.c_str());
+    m_records += line;
+
+    // 从更早的位置重来时，旧的D记录会让重放保留已经被覆盖的内容，要尽快把B记下；
+    // 其他情况B随下一批写入即可，来不及写下时只是留下一个没人续传的临时文件
+    if (shrunk && !m_inFlight)
+        launch();
+    return entry;
+}
+
+void UploadJournal::checkpoint(JournalEntry* entry, int fd, uint64_t offset)
+{
+    SyncRequest* request = new SyncRequest;
+    request->fd = fd;
+    request->entryId = entry->id;
+    request->offset = offset;
+    entry->syncing = true;
+    submit(request);
+}
+
+void UploadJournal::suspend(JournalEntry* entry, int fd, uint64_t offset)
+{
+    entry->active = false;
+    entry->updated = time(NULL);
+    checkpoint(entry, fd, offset);
+}
+
+void UploadJournal::publish(JournalEntry* entry, const std::string& name, SyncRequest* request)
+{
+    request->entryId = entry->id;
+    request->from = tempName(name);
+    request->to = name;
+    submit(request);
+}
+
+void UploadJournal::discard(JournalEntry* entry)
+{
+    unlink(hostTemp(entry->target).c_str());
+    char line[64];
+    sprintf(line, "E %llu\n", (unsigned long long)entry->id);
+    m_records += line;
+    remove(entry);
+}
+
+void UploadJournal::submit(SyncRequest* request)
+{
+    m_pending.push_back(request);
+    if (!m_inFlight)
+        launch();
+}
+
+void UploadJournal::launch()
+{
+    if (m_pending.empty() && (m_records.empty() || m_fd < 0))
+        return;
+
+    GroupCommitTask* task = new GroupCommitTask(this);
+    task->m_requests.assign(m_pending.begin(), m_pending.end());
+    task->m_records.swap(m_records);
+    m_pending.clear();
+    m_inFlight = true;
+
+    // 只有一批在途，队列不会满；万一失败就在当前线程做完
+    if (!m_pool->submit(task))
+    {
+        task->run();
+        task->done();
+        delete task;
+    }
+}
+
+void UploadJournal::batchDone(GroupCommitTask* task)
+{
+    m_inFlight = false;
+    if (task->m_compact)
+    {
+        // 失败时接着往旧日志追加，下一批结束后再试
+        if (task->m_journalOk)
+        {
+            close(m_fd);
+            m_fd = task->m_newFd;
+            task->m_newFd = -1;
+            m_journalBytes = task->m_written;
+        }
+        else
+        {
+            m_failures++;
+        }
+        launch();
+        return;
+    }
+
+    m_batches++;
+    m_syncfsCalls += task->m_syncfsCalls;
+    m_journalBytes += task->m_written;
+    if (!task->m_journalOk)
+        m_failures++;
+
+    size_t files = task->m_requests.size();
+    for (size_t i = 0; i < files; i++)
+    {
+        SyncRequest* request = task->m_requests[i];
+        std::map<uint64_t, JournalEntry*>::iterator it = m_byId.find(request->entryId);
+        JournalEntry* entry = (it != m_byId.end()) ? it->second : NULL;
+        if (!request->ok)
+            m_failures++;
+
+        if (!request->to.empty())
+        {
+            // 发布失败时临时文件不再可信，连同条目一起删掉
+            if (entry != NULL && request->ok)
+                remove(entry);
+            else if (entry != NULL)
+                discard(entry);
+        }
+        else if (entry != NULL)
+        {
+            entry->syncing = false;
+            if (request->ok && request->offset > entry->durable)
+                entry->durable = request->offset;
+            entry->updated = time(NULL);
+        }
+
+        request->done();
+        delete request;
+    }
+    task->m_requests.clear();
+    m_synced += files;
+    if (files > m_largestBatch)
+        m_largestBatch = files;
+
+    expire();
+    if (m_journalBytes > COMPACT_BYTES && m_fd >= 0)
+        compact();
+    else
+        launch();
+}
+
+std::string UploadJournal::formatStats()
+{
+    char buf[512];
+    sprintf(buf,
+            " journal.batches %llu\r\n"
+            " journal.synced_files %llu\r\n"
+            " journal.largest_batch %llu\r\n"
+            " journal.syncfs_calls %llu\r\n"
+            " journal.failures %llu\r\n"
+            " journal.resumable %llu\r\n"
+            " journal.resumed %llu\r\n"
+            " journal.expired %llu\r\n",
+            (unsigned long long)m_batches,
+            (unsigned long long)m_synced,
+            (unsigned long long)m_largestBatch,
+            (unsigned long long)m_syncfsCalls,
+            (unsigned long long)m_failures,
+            (unsigned long long)m_entries.size(),
+            (unsigned long long)m_resumed,
+            (unsigned long long)m_expired);
+    return buf;
+}
@@ -0,0 +1,110 @@
+#ifndef UPLOADJOURNAL_H
+#define UPLOADJOURNAL_H
+
+#include <stdint.h>
+#include <time.h>
+#include <string>
+#include <map>
+#include <list>
+#include "ThreadPool.h"
+
+// 一个还没发布的上传。内容写在目标同目录下的隐藏临时文件里，durable之前的部分已经落盘
+struct JournalEntry
+{
+    uint64_t id;
+    std::string target;     // 目标文件的本地路径
+    uint64_t durable;
+    time_t updated;
+    bool active;            // 有会话正在写，或正在发布
+    bool syncing;           // 有检查点正在落盘
+};
+
+// 交给组提交的一次落盘。fd和dirFd由日志接管并关闭；dirFd>=0表示文件落盘后在该目录里
+// 把from改名为to发布。处理完在事件循环线程中调用done()，然后delete
+class SyncRequest
+{
+public:
+    SyncRequest() : fd(-1), dirFd(-1), entryId(0), offset(0), ok(false) {}
+    virtual ~SyncRequest() {}
+    virtual void done() {}
+
+    int fd;
+    int dirFd;
+    std::string from;
+    std::string to;
+    uint64_t entryId;
+    uint64_t offset;    // 落盘后记为durable的长度
+    bool ok;
+};
+
+class GroupCommitTask;
+
+// 上传的原子发布和断点日志。上传先写到".<名字>.upload"，收完后fdatasync、改名、fsync目录，
+// 目标位置上只会出现完整的文件。同时在途的落盘请求攒成一批交给一个工作线程：批量较大时
+// 每个文件系统只调一次syncfs，改名后同一目录只fsync一次，日志记录整批写入后只落盘一次。
+// 日志是追加写的文本，每行一条：
+//   B <id> <时间> <偏移> <目标路径>   开始上传（或从偏移处续传）
+//   D <id> <偏移> <时间>              偏移之前的内容已落盘
+//   E <id>                            已发布或已放弃
+// 启动时重放日志，把临时文件截到已落盘的长度，删掉过期的，再整体重写成只剩有效条目。
+// 只在事件循环线程中使用
+class UploadJournal
+{
+    friend class GroupCommitTask;
+
+public:
+    UploadJournal(const std::string& path, bool sync, int resumeTtl, size_t syncfsMin);    // path为空时不记日志
+    ~UploadJournal();
+
+    bool open(event_base* base);
+
+    static std::string tempName(const std::string& name);
+    static bool isTempName(const std::string& name);
+
+    JournalEntry* find(const std::string& target);
+    JournalEntry* begin(const std::string& target, uint64_t offset);    // 新建，或接着已有的条目从offset续传
+    void checkpoint(JournalEntry* entry, int fd, uint64_t offset);
+    void suspend(JournalEntry* entry, int fd, uint64_t offset);     // 会话断开，落盘后留待续传
+    void publish(JournalEntry* entry, const std::string& name, SyncRequest* request);
+    void discard(JournalEntry* entry);      // 删除临时文件和条目
+
+    std::string formatStats();
+
+protected:
+    bool replay();
+    std::string snapshot();
+    bool rewrite();         // 启动时在当前线程重写
+    void compact();         // 运行中交给工作线程重写，完成后在batchDone里换上新日志
+    void expire();
+    void remove(JournalEntry* entry);
+    std::string hostTemp(const std::string& target);
+    void submit(SyncRequest* request);
+    void launch();
+    void batchDone(GroupCommitTask* task);
+
+protected:
+    std::string m_path;
+    bool m_sync;                // 为false时不调fsync，只保留改名发布
+    int m_resumeTtl;            // 断开的上传保留多少秒
+    size_t m_syncfsMin;         // 一批至少这么多个文件时改用syncfs
+    int m_fd;
+    uint64_t m_journalBytes;    // 日志当前长度，超过有效条目很多时重写
+    uint64_t m_nextId;
+    std::map<std::string, JournalEntry*> m_entries;    // 目标路径 -> 条目
+    std::map<uint64_t, JournalEntry*> m_byId;
+    ThreadPool* m_pool;
+    std::list<SyncRequest*> m_pending;  // 等下一批的请求
+    std::string m_records;      // 不需要等数据落盘的日志记录（B/E），随下一批写入
+    bool m_inFlight;
+
+    // 统计
+    uint64_t m_batches;
+    uint64_t m_synced;
+    uint64_t m_largestBatch;
+    uint64_t m_syncfsCalls;
+    uint64_t m_failures;
+    uint64_t m_resumed;
+    uint64_t m_expired;
+};
+
+#endif // UPLOADJOURNAL_H
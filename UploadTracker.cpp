@@ -0,0 +1,112 @@
+#include "UploadTracker.h"
+#include <stdio.h>
+
+UploadTracker::UploadTracker()
+{
+    m_segments = 0;
+    m_completed = 0;
+}
+
+UploadTracker::~UploadTracker()
+{
+    std::map<std::string, UploadSession*>::iterator it;
+    for (it = m_sessions.begin(); it != m_sessions.end(); it++)
+        delete it->second;
+}
+
+UploadSession* UploadTracker::attach(const std::string& path, uint64_t size, bool* created)
+{
+    *created = false;
+    UploadSession* session = NULL;
+    std::map<std::string, UploadSession*>::iterator it = m_sessions.find(path);
+    if (it != m_sessions.end())
+    {
+        session = it->second;
+        if (session->size != size)
+        {
+            if (session->writers > 0)
+                return NULL;
+            
+            // 没人在写的旧会话长度对不上，说明客户端换了文件重新开始
+            m_sessions.erase(it);
+            delete session;
+            session = NULL;
+        }
+    }
+    
+    if (session == NULL)
+    {
+        session = new UploadSession;
+        session->path = path;
+        session->size = size;
+        session->received = 0;
+        session->writers = 0;
+        m_sessions.insert(std::make_pair(path, session));
+        *created = true;
+    }
+    
+    session->writers++;
+    return session;
+}
+
+bool UploadTracker::detach(UploadSession* session, uint64_t begin, uint64_t end)
+{
+    m_segments++;
+    session->writers--;
+    if (end > begin)
+        addRange(session, begin, end);
+    
+    std::map<uint64_t, uint64_t>::iterator first = session->ranges.begin();
+    bool complete = (first != session->ranges.end() && first->first == 0 && first->second >= session->size);
+    
+    // 没收齐且没人在写的会话保留下来，客户端可以稍后续传缺的区段
+    if (complete && session->writers == 0)
+    {
+        m_completed++;
+        m_sessions.erase(session->path);
+        delete session;
+    }
+    
+    return complete;
+}
+
+/*static*/ void UploadTracker::addRange(UploadSession* session, uint64_t begin, uint64_t end)
+{
+    std::map<uint64_t, uint64_t>& ranges = session->ranges;
+    
+    // 与前一个区段重叠或相接时从它的起点开始合并
+    std::map<uint64_t, uint64_t>::iterator it = ranges.upper_bound(begin);
+    if (it != ranges.begin())
+    {
+        std::map<uint64_t, uint64_t>::iterator prev = it;
+        prev--;
+        if (prev->second >= begin)
+            it = prev;
+    }
+    
+    while (it != ranges.end() && it->first <= end)
+    {
+        if (it->first < begin)
+            begin = it->first;
+        if (it->second > end)
+            end = it->second;
+        session->received -= it->second - it->first;
+        ranges.erase(it++);
+    }
+    
+    ranges.insert(std::make_pair(begin, end));
+    session->received += end - begin;
+}
+
+std::string UploadTracker::formatStats()
+{
+    char buf[256];
+    sprintf(buf,
+            " upload.segments %llu\r\n"
+            " upload.completed %llu\r\n"
+            " upload.sessions %llu\r\n",
+            (unsigned long long)m_segments,
+            (unsigned long long)m_completed,
+            (unsigned long long)m_sessions.size());
+    return buf;
+}
@@ -0,0 +1,44 @@
+#ifndef UPLOADTRACKER_H
+#define UPLOADTRACKER_H
+
+#include <stdint.h>
+#include <string>
+#include <map>
+
+// 同一个文件的分段上传。多个数据连接各自REST到自己的偏移后STOR，
+// 收完的区段合并记录在ranges里，覆盖了整个文件即为完成
+struct UploadSession
+{
+    std::string path;
+    uint64_t size;      // ALLO声明的文件总长度
+    std::map<uint64_t, uint64_t> ranges;    // 已写入的区段，起点 -> 终点（不含），互不相邻
+    uint64_t received;
+    int writers;        // 正在往这个文件写的连接数
+};
+
+// 按本地路径管理进行中的分段上传，只在事件循环线程中使用
+class UploadTracker
+{
+public:
+    UploadTracker();
+    ~UploadTracker();
+    
+    // 找到或新建路径对应的会话，新建时*created为true。已有会话的长度不同且仍有人在写时返回NULL
+    UploadSession* attach(const std::string& path, uint64_t size, bool* created);
+    // 一个连接写完[begin, end)后调用，全部收齐时返回true并释放会话
+    bool detach(UploadSession* session, uint64_t begin, uint64_t end);
+    
+    std::string formatStats();
+
+protected:
+    static void addRange(UploadSession* session, uint64_t begin, uint64_t end);
+
+protected:
+    std::map<std::string, UploadSession*> m_sessions;
+    
+    // 统计
+    uint64_t m_segments;
+    uint64_t m_completed;
+};
+
+#endif // UPLOADTRACKER_H
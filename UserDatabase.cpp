@@ -0,0 +1,194 @@
+#include "UserDatabase.h"
+#include "ThreadPool.h"
+#include "Logger.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <crypt.h>
+
+// 后台重新加载用户文件的任务
+class UserReloadTask : public ThreadTask
+{
+public:
+    UserReloadTask(UserDatabase* db, const std::string& filename, Logger* logger)
+        : m_db(db), m_filename(filename), m_logger(logger), m_table(NULL)
+    {
+    }
+    
+    ~UserReloadTask()
+    {
+        delete m_table;
+    }
+    
+    virtual void run()
+    {
+        m_table = UserDatabase::parse(m_filename);
+    }
+    
+    virtual void done()
+    {
+        if (m_table == NULL)
+        {
+            m_logger->log("reload user file " + m_filename + " failed, keep the old one");
+            return;
+        }
+        
+        char count[32];
+        sprintf(count, "%d", (int)m_table->size());
+        m_logger->log("reload user file " + m_filename + ": " + count + " users");
+        m_db->swap(m_table);
+        m_table = NULL;
+    }
+    
+protected:
+    UserDatabase* m_db;
+    std::string m_filename;
+    Logger* m_logger;
+    UserTable* m_table;
+};
+
+UserDatabase::UserDatabase()
+{
+    m_table = new UserTable;
+}
+
+UserDatabase::~UserDatabase()
+{
+    delete m_table;
+}
+
+bool UserDatabase::load(const std::string& filename)
+{
+    UserTable* table = parse(filename);
+    if (table == NULL)
+        return false;
+    
+    m_filename = filename;
+    swap(table);
+    return true;
+}
+
+bool UserDatabase::reload(ThreadPool* pool, Logger* logger)
+{
+    if (m_filename.empty())
+        return false;
+    
+    UserReloadTask* task = new UserReloadTask(this, m_filename, logger);
+    if (!pool->submit(task))
+    {
+        delete task;
+        return false;
+    }
+    
+    return true;
+}
+
+void UserDatabase::swap(UserTable* table)
+{
+    UserTable* old = m_table;
+    m_table = table;
+    delete old;
+}
+
+void UserDatabase::addUser(const std::string& user, const UserConfig& cfg)
+{
+    (*m_table)[user] = cfg;
+}
+
+const UserConfig* UserDatabase::find(const std::string& user) const
+{
+    UserTable::const_iterator it = m_table->find(user);
+    if (it == m_table->end())
+        return NULL;
+    
+    return &it->second;
+}
+
+size_t UserDatabase::size() const
+{
+    return m_table->size();
+}
+
+const std::string& UserDatabase::filename() const
+{
+    return m_filename;
+}
+
+/*static*/ UserTable* UserDatabase::parse(const std::string& filename)
+{
+    // 每行一个用户：user:hash:rootPath，'#'开头为注释。rootPath可以是"mem:<名字>"，只按前两个冒号切分
+    FILE* file = fopen(filename.c_str(), "r");
+    if (file == NULL)
+        return NULL;
+    
+    UserTable* table = new UserTable;
+    char line[1024];
+    while (fgets(line, sizeof(line), file) != NULL)
+    {
+        std::string str(line);
+        while (!str.empty() && (str[str.size()-1] == '\n' || str[str.size()-1] == '\r'))
+            str.erase(str.size()-1);
+        if (str.empty() || str[0] == '#')
+            continue;
+        
+        size_t first = str.find(':');
+        size_t last = (first == std::string::npos) ? first : str.find(':', first+1);
+        if (last == std::string::npos)
+            continue;
+        
+        UserConfig cfg;
+        cfg.password = str.substr(first+1, last-first-1);
+        cfg.rootPath = str.substr(last+1);
+        (*table)[str.substr(0, first)] = cfg;
+    }
+    
+    fclose(file);
+    return table;
+}
+
+/*static*/ bool UserDatabase::verifyPassword(const std::string& password, const std::string& hash)
+{
+    std::string computed;
+    if (!hash.empty() && hash[0] == '$')
+    {
+        // crypt_data较大，放堆上；crypt_r可重入，工作线程可以并发调用
+        crypt_data* data = (crypt_data*)calloc(1, sizeof(crypt_data));
+        const char* result = crypt_r(password.c_str(), hash.c_str(), data);
+        if (result != NULL && result[0] != '*')
+            computed = result;
+        free(data);
+        
+        if (computed.empty())
+            return false;
+    }
+    else
+    {
+        computed = password;
+    }
+    
+    // 定长比较，避免按比较耗时猜测
+    if (computed.size() != hash.size())
+        return false;
+    
+    unsigned char diff = 0;
+    for (size_t i = 0; i < hash.size(); i++)
+        diff |= computed[i] ^ hash[i];
+    
+    return (diff == 0);
+}
+
+/*static*/ std::string UserDatabase::hashPassword(const std::string& password)
+{
+    crypt_data* data = (crypt_data*)calloc(1, sizeof(crypt_data));
+    std::string hash;
+    const char* salt = crypt_gensalt_rn("$2b$", 10, NULL, 0, data->setting, sizeof(data->setting));
+    if (salt != NULL)
+    {
+        const char* result = crypt_r(password.c_str(), salt, data);
+        if (result != NULL && result[0] != '*')
+            hash = result;
+    }
+    free(data);
+    
+    return hash;
+}
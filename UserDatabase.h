@@ -0,0 +1,45 @@
+#ifndef USERDATABASE_H
+#define USERDATABASE_H
+
+#include <string>
+#include <unordered_map>
+
+class ThreadPool;
+class Logger;
+
+struct UserConfig
+{
+    std::string password;   // crypt(3)格式的散列（$2b$、$y$等），不以'$'开头的按明文比较
+    std::string rootPath;   // 本地目录，或"mem:<名字>"挂载同名的内存文件系统
+};
+
+typedef std::unordered_map<std::string, UserConfig> UserTable;
+
+// 用户库。表加载后不再修改，重新加载时整体换成新表（RCU方式）：
+// 查找只在事件循环线程中进行，换表也在事件循环线程中完成，所以查找不需要加锁，
+// 旧表在换表的回调结束后即可释放
+class UserDatabase
+{
+public:
+    UserDatabase();
+    ~UserDatabase();
+    
+    bool load(const std::string& filename);
+    bool reload(ThreadPool* pool, Logger* logger);  // 在工作线程中解析文件，完成后回到事件循环换表并记日志
+    void swap(UserTable* table);
+    
+    void addUser(const std::string& user, const UserConfig& cfg);
+    const UserConfig* find(const std::string& user) const;
+    size_t size() const;
+    const std::string& filename() const;
+    
+    static UserTable* parse(const std::string& filename);
+    static bool verifyPassword(const std::string& password, const std::string& hash);
+    static std::string hashPassword(const std::string& password);
+    
+protected:
+    std::string m_filename;
+    UserTable* m_table;
+};
+
+#endif // USERDATABASE_H
@@ -0,0 +1,37 @@
+#include "Vfs.h"
+#include "PosixVfs.h"
+#include "MemoryVfs.h"
+
+/*static*/ Vfs* Vfs::create(const std::string& rootPath)
+{
+    if (rootPath.compare(0, 4, "mem:") == 0)
+        return new MemoryVfs(MemoryTree::get(rootPath.substr(4)));
+    
+    return new PosixVfs(rootPath);
+}
+
+/*static*/ std::string Vfs::normalize(const std::string& path)
+{
+    std::string result;
+    size_t start = 0;
+    while (start <= path.size())
+    {
+        size_t end = path.find('/', start);
+        if (end == std::string::npos)
+            end = path.size();
+        
+        std::string part = path.substr(start, end - start);
+        if (part == "..")
+        {
+            size_t slash = result.find_last_of('/');
+            result.erase(slash == std::string::npos ? 0 : slash);
+        }
+        else if (!part.empty() && part != ".")
+        {
+            result += "/" + part;
+        }
+        start = end + 1;
+    }
+    
+    return result.empty() ? "/" : result;
+}
@@ -0,0 +1,57 @@
+#ifndef VFS_H
+#define VFS_H
+
+#include <stdint.h>
+#include <string>
+
+class GlobMatcher;
+
+// 打开的文件，由Vfs::open创建，用完后close再delete
+class VfsFile
+{
+public:
+    virtual ~VfsFile() {}
+    
+    virtual size_t read(char* data, size_t length) = 0;
+    virtual void write(const char* data, size_t length) = 0;
+    virtual bool close() = 0;   // 写入的文件在close时落地，失败返回false
+    virtual int fd() { return -1; }     // 本地文件返回描述符，其他后端为-1
+    virtual bool seek(uint64_t offset) { return false; }    // 设置下次读写的位置（REST）
+    virtual bool allocate(uint64_t size) { return false; }  // 预分配空间（ALLO），不支持时返回false
+    virtual bool setDirect() { return false; }  // 之后的读绕过页缓存（O_DIRECT），偏移和长度须按页对齐
+    virtual bool stageWrites(uint64_t directMin) { return false; }  // 写入先攒进池里的缓冲，见LocalFile
+    virtual void flush() {}     // 攒着的写入写下去，取fd去落盘之前调用
+};
+
+// 虚拟文件系统。每个登录会话按用户的rootPath创建一个实例，
+// 所有路径都是以'/'开头、相对用户根目录的逻辑路径
+class Vfs
+{
+public:
+    virtual ~Vfs() {}
+    
+    virtual VfsFile* open(const std::string& path, int mode) = 0;   // mode取值同LocalFile::OpenMode
+    virtual std::string getDirList(const std::string& dir, const GlobMatcher* filter) = 0;    // filter为NULL时不过滤
+    virtual std::string getNameList(const std::string& dir, const GlobMatcher* filter) = 0;   // NLST，每行只有名字
+    virtual bool exist(const std::string& path) = 0;
+    virtual bool mkDir(const std::string& dir) = 0;
+    virtual bool rmDir(const std::string& dir) = 0;
+    virtual bool rmFile(const std::string& file) = 0;
+    virtual bool rename(const std::string& oldPath, const std::string& newPath) = 0;
+    virtual bool changeDir(const std::string& dir) { return exist(dir); }   // CWD，后端可借此保留当前目录的句柄
+    virtual int openDir(const std::string& dir) { return -1; }  // 本地后端返回目录的描述符，由调用者关闭；其他后端为-1
+    virtual int openParent(const std::string& path, std::string* name) { return -1; }    // 同上，返回父目录，name为最后一级
+    virtual uint64_t fileSize(const std::string& path) { return 0; }   // 本地普通文件的长度，其余情况为0，供配额计算
+    
+    // 逻辑路径在本地文件系统上的实际路径；不在本地磁盘上的后端返回空串，
+    // 依赖真实文件的功能（如上传去重）据此跳过。路径里的符号链接没有检查，访问文件要用上面的描述符
+    virtual std::string hostPath(const std::string& path) { return ""; }
+    
+    // rootPath为"mem:<名字>"时挂载同名的内存文件系统，否则为本地目录
+    static Vfs* create(const std::string& rootPath);
+    
+    // 规范化逻辑路径：合并多余的'/'，去掉"."，".."回到上一级但不会越过根目录
+    static std::string normalize(const std::string& path);
+};
+
+#endif // VFS_H
@@ -1,11 +1,73 @@
 #include <iostream>
+#include <unistd.h>
 #include "FtpServer.h"
 
-int main()
+static void usage(const char* prog)
 {
-    FtpServer server;
+    printf("Usage: %s [-c config] [-g] [-p] [-u]\n", prog);
+    printf("  -c config  load settings from config file\n");
+    printf("  -g         collect unreferenced blobs in the dedup store and exit (server must be stopped)\n");
+    printf("  -p         read a password from stdin and print its hash for the users file\n");
+    printf("  -u         take over the listener and idle sessions from the running server (upgrade_socket)\n");
+}
+
+int main(int argc, char* argv[])
+{
+    Config config;
+    bool collectGarbage = false;
+    bool hashPassword = false;
+    bool takeover = false;
+    
+    int opt;
+    while ((opt = getopt(argc, argv, "c:gpuh")) != -1)
+    {
+        switch (opt)
+        {
+        case 'c':
+            if (!config.load(optarg))
+            {
+                fprintf(stderr, "cannot load config file %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'g':
+            collectGarbage = true;
+            break;
+        case 'p':
+            hashPassword = true;
+            break;
+        case 'u':
+            takeover = true;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    
+    if (collectGarbage)
+    {
+        ContentStore store(config.getString("dedup_store", "/var/lib/ftp_server/store"));
+        uint64_t freedBytes = 0;
+        int removed = store.collectGarbage(&freedBytes);
+        printf("removed %d blobs, freed %llu bytes\n", removed, (unsigned long long)freedBytes);
+        return 0;
+    }
+    
+    if (hashPassword)
+    {
+        std::string password;
+        std::getline(std::cin, password);
+        std::string hash = UserDatabase::hashPassword(password);
+        if (hash.empty())
+            return 1;
+        printf("%s\n", hash.c_str());
+        return 0;
+    }
+    
+    FtpServer server(config);
+    server.setTakeover(takeover);
     server.start();
     
     return 0;
 }
-
@@ -0,0 +1,518 @@
+// ftp_replay：把ftp_server录制的会话轨迹（capture_file）按原始时间间隔回放到服务器，
+// 统计命令延迟与吞吐，并可与之前保存的基线报告对比。-n模式不需要轨迹，
+// 只在命令通道上一问一答地发NOOP，测往返延迟
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include "SessionRecorder.h"
+
+struct TraceEvent
+{
+    uint64_t timeUsec;
+    int type;
+    std::string command;
+    uint64_t bytes;
+};
+
+struct TraceSession
+{
+    uint32_t id;
+    uint64_t startUsec;
+    std::vector<TraceEvent> events;
+};
+
+struct ReplayOptions
+{
+    std::string host;
+    int port;
+    double speed;       // 1为原速，2为两倍速，0为不等待
+    int scale;          // 每个录制会话同时回放的份数
+    std::string user;
+    std::string password;
+    int pingRounds;     // 大于0时不回放轨迹，每个会话发这么多次NOOP
+};
+
+struct ReplayJob
+{
+    const TraceSession* session;
+    const ReplayOptions* options;
+    uint64_t baseUsec;
+};
+
+static pthread_mutex_t g_statsMutex = PTHREAD_MUTEX_INITIALIZER;
+static std::map<std::string, std::vector<uint64_t> > g_latencies;
+static uint64_t g_bytes = 0;
+static uint64_t g_errors = 0;
+
+static uint64_t nowUsec()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void sleepUntil(uint64_t usec)
+{
+    struct timespec ts;
+    ts.tv_sec = usec / 1000000;
+    ts.tv_nsec = (usec % 1000000) * 1000;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) != 0)
+        ;
+}
+
+static int connectTo(const std::string& host, int port)
+{
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, host.c_str(), &addr.sin_addr) != 1)
+        return -1;
+    
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd == -1)
+        return -1;
+    
+    if (connect(fd, (sockaddr*)&addr, sizeof(addr)) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+    
+    int on = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    return fd;
+}
+
+// 读一个完整应答（含多行应答），返回最后一行
+static bool readReply(int fd, std::string& buffer, std::string* reply)
+{
+    for (;;)
+    {
+        size_t eol;
+        while ((eol = buffer.find("\r\n")) != std::string::npos)
+        {
+            std::string line = buffer.substr(0, eol);
+            buffer.erase(0, eol + 2);
+            if (line.size() >= 4 && isdigit(line[0]) && isdigit(line[1]) && isdigit(line[2]) && line[3] == ' ')
+            {
+                *reply = line;
+                return true;
+            }
+        }
+        
+        char buf[4096];
+        ssize_t count = recv(fd, buf, sizeof(buf), 0);
+        if (count <= 0)
+            return false;
+        buffer.append(buf, count);
+    }
+}
+
+static int parsePasvPort(const std::string& reply)
+{
+    size_t open = reply.find('(');
+    if (open == std::string::npos)
+        return -1;
+    
+    int h1, h2, h3, h4, p1, p2;
+    if (sscanf(reply.c_str() + open, "(%d,%d,%d,%d,%d,%d)", &h1, &h2, &h3, &h4, &p1, &p2) != 6)
+        return -1;
+    
+    return p1 * 256 + p2;
+}
+
+static void recordLatency(const std::string& verb, uint64_t usec, uint64_t bytes, bool error)
+{
+    pthread_mutex_lock(&g_statsMutex);
+    g_latencies[verb].push_back(usec);
+    g_latencies["ALL"].push_back(usec);
+    g_bytes += bytes;
+    if (error)
+        g_errors++;
+    pthread_mutex_unlock(&g_statsMutex);
+}
+
+static uint64_t uploadSize(const TraceSession* session, size_t commandIndex)
+{
+    // 上传的字节数记录在该命令之后的第一条DataIn中
+    for (size_t i = commandIndex + 1; i < session->events.size(); i++)
+    {
+        if (session->events[i].type == TraceDataIn)
+            return session->events[i].bytes;
+        if (session->events[i].type == TraceCommand)
+            break;
+    }
+    
+    return 0;
+}
+
+static void* replaySession(void* arg)
+{
+    ReplayJob* job = (ReplayJob*)arg;
+    const TraceSession* session = job->session;
+    const ReplayOptions* options = job->options;
+    
+    double speed = options->speed;
+    uint64_t startUsec = job->baseUsec + (speed > 0 ? (uint64_t)(session->startUsec / speed) : 0);
+    sleepUntil(startUsec);
+    
+    int ctrl = connectTo(options->host, options->port);
+    std::string buffer;
+    std::string reply;
+    if (ctrl == -1 || !readReply(ctrl, buffer, &reply))
+    {
+        recordLatency("CONNECT", 0, 0, true);
+        if (ctrl != -1)
+            close(ctrl);
+        delete job;
+        return NULL;
+    }
+    
+    int data = -1;
+    std::vector<char> zeros(64*1024, 0);
+    std::vector<char> sink(64*1024);
+    for (size_t i = 0; i < session->events.size(); i++)
+    {
+        const TraceEvent& ev = session->events[i];
+        if (ev.type != TraceCommand)
+            continue;
+        
+        if (speed > 0)
+            sleepUntil(startUsec + (uint64_t)((ev.timeUsec - session->startUsec) / speed));
+        
+        std::string line = ev.command;
+        std::string verb = line.substr(0, line.find(' '));
+        std::transform(verb.begin(), verb.end(), verb.begin(), ::toupper);
+        if (verb == "USER" && !options->user.empty())
+            line = "USER " + options->user;
+        else if (verb == "PASS" && (!options->password.empty() || line == "PASS ***"))
+            line = "PASS " + options->password;
+        
+        uint64_t t0 = nowUsec();
+        uint64_t bytes = 0;
+        line += "\r\n";
+        if (send(ctrl, line.c_str(), line.size(), MSG_NOSIGNAL) != (ssize_t)line.size() ||
+            !readReply(ctrl, buffer, &reply))
+        {
+            recordLatency(verb, nowUsec() - t0, 0, true);
+            break;
+        }
+        
+        if (verb == "PASV" && reply.compare(0, 3, "227") == 0)
+        {
+            if (data != -1)
+                close(data);
+            // 忽略应答中的IP（可能是外网地址），回放统一连到-H指定的主机
+            data = connectTo(options->host, parsePasvPort(reply));
+        }
+        else if ((verb == "RETR" || verb == "LIST" || verb == "NLST") && reply[0] == '1' && data != -1)
+        {
+            for (;;)
+            {
+                ssize_t count = recv(data, &sink[0], sink.size(), 0);
+                if (count <= 0)
+                    break;
+                bytes += count;
+            }
+            close(data);
+            data = -1;
+            readReply(ctrl, buffer, &reply);
+        }
+        else if ((verb == "STOR" || verb == "APPE") && reply[0] == '1' && data != -1)
+        {
+            uint64_t remain = uploadSize(session, i);
+            while (remain > 0)
+            {
+                size_t chunk = std::min<uint64_t>(remain, zeros.size());
+                ssize_t count = send(data, &zeros[0], chunk, MSG_NOSIGNAL);
+                if (count <= 0)
+                    break;
+                remain -= count;
+                bytes += count;
+            }
+            close(data);
+            data = -1;
+            readReply(ctrl, buffer, &reply);
+        }
+        
+        recordLatency(verb, nowUsec() - t0, bytes, reply[0] == '4' || reply[0] == '5');
+        if (verb == "QUIT")
+            break;
+    }
+    
+    if (data != -1)
+        close(data);
+    close(ctrl);
+    delete job;
+    return NULL;
+}
+
+static bool sendCommand(int fd, std::string& buffer, const std::string& command, std::string* reply)
+{
+    std::string line = command + "\r\n";
+    return (send(fd, line.c_str(), line.size(), MSG_NOSIGNAL) == (ssize_t)line.size() &&
+            readReply(fd, buffer, reply));
+}
+
+static void* pingSession(void* arg)
+{
+    ReplayJob* job = (ReplayJob*)arg;
+    const ReplayOptions* options = job->options;
+    sleepUntil(job->baseUsec);
+
+    int ctrl = connectTo(options->host, options->port);
+    std::string buffer;
+    std::string reply;
+    if (ctrl == -1 || !readReply(ctrl, buffer, &reply))
+    {
+        recordLatency("CONNECT", 0, 0, true);
+        if (ctrl != -1)
+            close(ctrl);
+        delete job;
+        return NULL;
+    }
+
+    // NOOP不要求登录，给了用户名时照常登录，测的是登录后会话的延迟
+    if (!options->user.empty() &&
+        (!sendCommand(ctrl, buffer, "USER " + options->user, &reply) ||
+         !sendCommand(ctrl, buffer, "PASS " + options->password, &reply)))
+    {
+        recordLatency("PASS", 0, 0, true);
+        close(ctrl);
+        delete job;
+        return NULL;
+    }
+
+    for (int i = 0; i < options->pingRounds; i++)
+    {
+        uint64_t t0 = nowUsec();
+        bool ok = sendCommand(ctrl, buffer, "NOOP", &reply);
+        recordLatency("NOOP", nowUsec() - t0, 0, !ok || reply[0] != '2');
+        if (!ok)
+            break;
+    }
+
+    sendCommand(ctrl, buffer, "QUIT", &reply);
+    close(ctrl);
+    delete job;
+    return NULL;
+}
+
+static bool loadTrace(const std::string& filename, std::vector<TraceSession>* sessions)
+{
+    FILE* file = fopen(filename.c_str(), "rb");
+    if (file == NULL || !SessionRecorder::readFileHeader(file))
+    {
+        if (file != NULL)
+            fclose(file);
+        return false;
+    }
+    
+    std::map<uint32_t, size_t> index;
+    TraceRecordHeader header;
+    std::string payload;
+    while (SessionRecorder::readRecord(file, &header, &payload))
+    {
+        std::map<uint32_t, size_t>::iterator it = index.find(header.sessionId);
+        if (it == index.end())
+        {
+            TraceSession session;
+            session.id = header.sessionId;
+            session.startUsec = header.timeUsec;
+            sessions->push_back(session);
+            it = index.insert(std::make_pair(header.sessionId, sessions->size() - 1)).first;
+        }
+        
+        TraceEvent ev;
+        ev.timeUsec = header.timeUsec;
+        ev.type = header.type;
+        ev.bytes = 0;
+        if (header.type == TraceCommand)
+            ev.command = payload;
+        else if ((header.type == TraceDataIn || header.type == TraceDataOut) && payload.size() == sizeof(uint64_t))
+            memcpy(&ev.bytes, payload.data(), sizeof(uint64_t));
+        
+        (*sessions)[it->second].events.push_back(ev);
+        if (header.type == TraceSessionClose)
+            index.erase(it);    // 会话号可能被后续会话复用
+    }
+    
+    fclose(file);
+    return true;
+}
+
+static uint64_t percentile(std::vector<uint64_t>& values, double p)
+{
+    if (values.empty())
+        return 0;
+    
+    size_t pos = (size_t)(p * (values.size() - 1));
+    std::nth_element(values.begin(), values.begin() + pos, values.end());
+    return values[pos];
+}
+
+static std::map<std::string, double> buildReport(int sessions, uint64_t wallUsec)
+{
+    std::map<std::string, double> report;
+    report["replay.sessions"] = sessions;
+    report["replay.errors"] = g_errors;
+    report["replay.wall_sec"] = wallUsec / 1e6;
+    report["replay.bytes"] = g_bytes;
+    report["replay.throughput_mbps"] = (wallUsec == 0) ? 0 : (g_bytes * 8.0 / wallUsec);
+    
+    std::map<std::string, std::vector<uint64_t> >::iterator it;
+    for (it = g_latencies.begin(); it != g_latencies.end(); it++)
+    {
+        std::string prefix = "latency." + it->first;
+        report[prefix + ".count"] = it->second.size();
+        report[prefix + ".p50_us"] = percentile(it->second, 0.50);
+        report[prefix + ".p99_us"] = percentile(it->second, 0.99);
+        report[prefix + ".max_us"] = percentile(it->second, 1.0);
+    }
+    
+    return report;
+}
+
+static std::map<std::string, double> loadReport(const std::string& filename)
+{
+    std::map<std::string, double> report;
+    FILE* file = fopen(filename.c_str(), "r");
+    if (file == NULL)
+        return report;
+    
+    char key[256];
+    double value;
+    while (fscanf(file, "%255s %lf", key, &value) == 2)
+        report[key] = value;
+    
+    fclose(file);
+    return report;
+}
+
+static void usage(const char* prog)
+{
+    printf("Usage: %s -t trace [-H host] [-P port] [-s speed] [-x scale] [-u user] [-p password]\n"
+           "          [-o report] [-b baseline]\n"
+           "       %s -n rounds [-H host] [-P port] [-x sessions] [-u user] [-p password]\n"
+           "          [-o report] [-b baseline]\n", prog, prog);
+    printf("  -s speed     1 replays at recorded pace, 2 twice as fast, 0 without delays\n");
+    printf("  -x scale     number of concurrent copies of each recorded session\n");
+    printf("  -o report    save the report for use as a later baseline\n");
+    printf("  -b baseline  compare the report against a saved baseline\n");
+    printf("  -n rounds    NOOP ping-pong on each session instead of replaying a trace\n");
+}
+
+int main(int argc, char* argv[])
+{
+    ReplayOptions options;
+    options.host = "127.0.0.1";
+    options.port = 5021;
+    options.speed = 1.0;
+    options.scale = 1;
+    options.pingRounds = 0;
+    std::string traceFile, reportFile, baselineFile;
+    
+    int opt;
+    while ((opt = getopt(argc, argv, "t:H:P:s:x:u:p:o:b:n:h")) != -1)
+    {
+        switch (opt)
+        {
+        case 't': traceFile = optarg; break;
+        case 'H': options.host = optarg; break;
+        case 'P': options.port = atoi(optarg); break;
+        case 's': options.speed = atof(optarg); break;
+        case 'x': options.scale = std::max(1, atoi(optarg)); break;
+        case 'u': options.user = optarg; break;
+        case 'p': options.password = optarg; break;
+        case 'o': reportFile = optarg; break;
+        case 'b': baselineFile = optarg; break;
+        case 'n': options.pingRounds = atoi(optarg); break;
+        default: usage(argv[0]); return 1;
+        }
+    }
+    
+    std::vector<TraceSession> sessions;
+    if (options.pingRounds <= 0 && (traceFile.empty() || !loadTrace(traceFile, &sessions)))
+    {
+        usage(argv[0]);
+        return 1;
+    }
+    
+    uint64_t baseUsec = nowUsec() + 10000;
+    std::vector<pthread_t> threads;
+    for (int copy = 0; options.pingRounds > 0 && copy < options.scale; copy++)
+    {
+        ReplayJob* job = new ReplayJob;
+        job->session = NULL;
+        job->options = &options;
+        job->baseUsec = baseUsec;
+
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, pingSession, job) == 0)
+            threads.push_back(thread);
+        else
+            delete job;
+    }
+    for (size_t i = 0; i < sessions.size(); i++)
+    {
+        for (int copy = 0; copy < options.scale; copy++)
+        {
+            ReplayJob* job = new ReplayJob;
+            job->session = &sessions[i];
+            job->options = &options;
+            job->baseUsec = baseUsec;
+            
+            pthread_t thread;
+            if (pthread_create(&thread, NULL, replaySession, job) == 0)
+                threads.push_back(thread);
+            else
+                delete job;
+        }
+    }
+    
+    for (size_t i = 0; i < threads.size(); i++)
+        pthread_join(threads[i], NULL);
+    
+    std::map<std::string, double> report = buildReport(threads.size(), nowUsec() - baseUsec);
+    std::map<std::string, double> baseline;
+    if (!baselineFile.empty())
+        baseline = loadReport(baselineFile);
+    
+    FILE* out = reportFile.empty() ? NULL : fopen(reportFile.c_str(), "w");
+    std::map<std::string, double>::iterator it;
+    for (it = report.begin(); it != report.end(); it++)
+    {
+        if (out != NULL)
+            fprintf(out, "%s %.3f\n", it->first.c_str(), it->second);
+        
+        std::map<std::string, double>::iterator base = baseline.find(it->first);
+        if (base == baseline.end())
+        {
+            printf("%-36s %14.3f\n", it->first.c_str(), it->second);
+        }
+        else
+        {
+            double delta = (base->second == 0) ? 0 : (it->second - base->second) * 100.0 / base->second;
+            printf("%-36s %14.3f  baseline %14.3f  %+7.1f%%\n",
+                   it->first.c_str(), it->second, base->second, delta);
+        }
+    }
+    
+    if (out != NULL)
+        fclose(out);
+    
+    return 0;
+}